@@ -0,0 +1,254 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef RAKAU_DETAIL_EWALD_HPP
+#define RAKAU_DETAIL_EWALD_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <xsimd/xsimd.hpp>
+
+#include <rakau/detail/simd.hpp>
+
+namespace rakau
+{
+
+inline namespace detail
+{
+
+// The Ewald corrections for a periodic cubic box. In a periodic box of unit size, the force per unit of mass
+// exerted by a particle of unit mass at the origin (together with all its periodic images) on a particle
+// at x is (Hernquist, Bouchet & Suto, 1991)
+//
+// E(x) = sum_n (x - n) / |x - n|**3 * (erfc(alpha |x - n|) + 2 alpha |x - n| / sqrt(pi) exp(-alpha**2 |x - n|**2))
+//        + 2 sum_{h != 0} h / |h|**2 exp(-pi**2 |h|**2 / alpha**2) sin(2 pi h.x),
+//
+// where n and h run over the integer lattice, and the corresponding potential (with a uniform neutralising
+// background) is
+//
+// psi(x) = sum_n erfc(alpha |x - n|) / |x - n| + 1 / pi sum_{h != 0} exp(-pi**2 |h|**2 / alpha**2) / |h|**2
+//          cos(2 pi h.x) - pi / alpha**2.
+//
+// The corrections are the differences between these quantities and the Newtonian force/potential of the
+// nearest image, that is, E(x) - x / |x|**3 and psi(x) - 1 / |x|. They are smooth within the [-1/2, 1/2]**3
+// cell (the value in the origin being the interaction of a particle with its own periodic images), and they
+// are tabulated on a regular grid covering the [0, 1/2]**3 octant, the other octants being recovered by symmetry.
+// In a box of size L, the corrections scale as 1 / L**2 (force) and 1 / L (potential).
+
+// The splitting parameter between the real-space and the reciprocal-space sums.
+inline constexpr double ewald_alpha = 2;
+
+// Number of intervals per dimension in the lookup table.
+inline constexpr std::size_t ewald_table_n = 64;
+
+// Exact Ewald corrections at x, for a box of unit size. The return value contains the 3 components
+// of the force correction and the potential correction.
+inline std::array<double, 4> ewald_corr_exact(const std::array<double, 3> &x)
+{
+    constexpr double pi = 3.141592653589793238462643383279502884;
+    const double sqrt_pi = std::sqrt(pi), alpha = ewald_alpha, alpha2 = alpha * alpha;
+    std::array<double, 4> retval{};
+    // The real-space sum. The images farther than r_max contribute less than erfc(alpha * r_max) / r_max,
+    // and they are skipped (for x in the [-1/2, 1/2]**3 cell, these include all the images with |n_i| > n_max).
+    constexpr int n_max = 3;
+    constexpr double r_max = 2.6;
+    for (int n0 = -n_max; n0 <= n_max; ++n0) {
+        for (int n1 = -n_max; n1 <= n_max; ++n1) {
+            for (int n2 = -n_max; n2 <= n_max; ++n2) {
+                const std::array<double, 3> d{x[0] - n0, x[1] - n1, x[2] - n2};
+                const auto r2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2], r = std::sqrt(r2);
+                if (r > r_max) {
+                    continue;
+                }
+                if (n0 == 0 && n1 == 0 && n2 == 0) {
+                    // The nearest image: subtract the Newtonian terms.
+                    if (r == 0.) {
+                        // NOTE: the limit of -erf(alpha r) / r for r -> 0. The force correction vanishes.
+                        retval[3] -= 2 * alpha / sqrt_pi;
+                    } else {
+                        const auto f = (-std::erf(alpha * r) + 2 * alpha * r / sqrt_pi * std::exp(-alpha2 * r2))
+                                       / (r2 * r);
+                        for (std::size_t j = 0; j < 3u; ++j) {
+                            retval[j] += d[j] * f;
+                        }
+                        retval[3] -= std::erf(alpha * r) / r;
+                    }
+                } else {
+                    const auto ec = std::erfc(alpha * r),
+                               f = (ec + 2 * alpha * r / sqrt_pi * std::exp(-alpha2 * r2)) / (r2 * r);
+                    for (std::size_t j = 0; j < 3u; ++j) {
+                        retval[j] += d[j] * f;
+                    }
+                    retval[3] += ec / r;
+                }
+            }
+        }
+    }
+    // The reciprocal-space sum. The terms with |h|**2 > 10 are below exp(-10 pi**2 / alpha**2). The terms in h
+    // and -h are equal, thus only the half-space with the first nonzero component of h positive is summed.
+    constexpr int h_max = 3;
+    constexpr int h2_max = 10;
+    for (int h0 = 0; h0 <= h_max; ++h0) {
+        for (int h1 = h0 ? -h_max : 0; h1 <= h_max; ++h1) {
+            for (int h2 = (h0 || h1) ? -h_max : 1; h2 <= h_max; ++h2) {
+                const auto hh = h0 * h0 + h1 * h1 + h2 * h2;
+                if (hh > h2_max) {
+                    continue;
+                }
+                const auto c = 2 * std::exp(-pi * pi * hh / alpha2) / hh,
+                           ph = 2 * pi * (h0 * x[0] + h1 * x[1] + h2 * x[2]), s = 2 * c * std::sin(ph);
+                retval[0] += s * h0;
+                retval[1] += s * h1;
+                retval[2] += s * h2;
+                retval[3] += c / pi * std::cos(ph);
+            }
+        }
+    }
+    retval[3] -= pi / alpha2;
+    return retval;
+}
+
+// The lookup table of the Ewald corrections, for a box of unit size. The element at index
+// (i * (ewald_table_n + 1) + j) * (ewald_table_n + 1) + k contains the corrections at the point
+// (i, j, k) / (2 * ewald_table_n). The table is computed on first use.
+inline const std::vector<std::array<double, 4>> &ewald_table()
+{
+    static const auto table = []() {
+        constexpr auto n1 = ewald_table_n + 1u;
+        std::vector<std::array<double, 4>> retval(n1 * n1 * n1);
+        tbb::parallel_for(tbb::blocked_range(std::size_t(0), n1), [&retval](const auto &range) {
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                for (std::size_t j = 0; j < n1; ++j) {
+                    for (std::size_t k = 0; k < n1; ++k) {
+                        retval[(i * n1 + j) * n1 + k]
+                            = ewald_corr_exact({static_cast<double>(i) / (2. * ewald_table_n),
+                                                static_cast<double>(j) / (2. * ewald_table_n),
+                                                static_cast<double>(k) / (2. * ewald_table_n)});
+                    }
+                }
+            }
+        });
+        return retval;
+    }();
+    return table;
+}
+
+// Compute via trilinear interpolation in the lookup table the Ewald corrections at x (the 3 components of
+// the force correction and the potential correction), for a box of size box_size. The components of x must be
+// in the [-box_size/2, box_size/2] range (i.e., x is the nearest image). table is the return value of
+// ewald_table(), inv_box_size the inverse of box_size.
+template <typename F>
+inline std::array<F, 4> ewald_corr(const std::vector<std::array<double, 4>> &table, const F *x, F inv_box_size)
+{
+    constexpr auto n1 = ewald_table_n + 1u;
+    std::array<std::size_t, 3> idx;
+    std::array<double, 3> w;
+    for (std::size_t j = 0; j < 3u; ++j) {
+        const auto t = std::min(std::abs(static_cast<double>(x[j] * inv_box_size)), .5) * (2. * ewald_table_n);
+        idx[j] = std::min(static_cast<std::size_t>(t), ewald_table_n - 1u);
+        w[j] = t - static_cast<double>(idx[j]);
+    }
+    std::array<double, 4> res{};
+    for (std::size_t c = 0; c < 8u; ++c) {
+        const auto d0 = c >> 2, d1 = (c >> 1) & 1u, d2 = c & 1u;
+        const auto wc = (d0 ? w[0] : 1. - w[0]) * (d1 ? w[1] : 1. - w[1]) * (d2 ? w[2] : 1. - w[2]);
+        const auto &v = table[((idx[0] + d0) * n1 + idx[1] + d1) * n1 + idx[2] + d2];
+        for (std::size_t j = 0; j < 4u; ++j) {
+            res[j] += wc * v[j];
+        }
+    }
+    // Restore the signs of the force components (which are odd functions of the corresponding
+    // coordinate, and even functions of the others), and rescale to the box size.
+    const auto inv_box_size2 = static_cast<double>(inv_box_size) * static_cast<double>(inv_box_size);
+    std::array<F, 4> retval;
+    for (std::size_t j = 0; j < 3u; ++j) {
+        retval[j] = static_cast<F>((x[j] < F(0) ? -res[j] : res[j]) * inv_box_size2);
+    }
+    retval[3] = static_cast<F>(res[3] * static_cast<double>(inv_box_size));
+    return retval;
+}
+
+// The lookup table of the Ewald corrections converted to the floating-point type F, with one vector
+// per correction (i.e., in structure-of-arrays layout), for the vectorised interpolation in ewald_corr_simd().
+template <typename F>
+inline const std::array<std::vector<F>, 4> &ewald_table_soa()
+{
+    static const auto table = []() {
+        const auto &t = ewald_table();
+        std::array<std::vector<F>, 4> retval;
+        for (std::size_t j = 0; j < 4u; ++j) {
+            retval[j].resize(t.size());
+            for (decltype(t.size()) i = 0; i < t.size(); ++i) {
+                retval[j][i] = static_cast<F>(t[i][j]);
+            }
+        }
+        return retval;
+    }();
+    return table;
+}
+
+// Vectorised version of ewald_corr(): x contains the coordinates of a batch of points, and table is the
+// return value of ewald_table_soa(). The interpolation is carried out in the precision of the batch type B,
+// and the values at the corners of the cells of the table are loaded via gathers (see simd_gather()).
+template <typename B, typename F>
+inline std::array<B, 4> ewald_corr_simd(const std::array<std::vector<F>, 4> &table, const std::array<B, 3> &x,
+                                        F inv_box_size)
+{
+    constexpr auto N = xsimd::simd_batch_traits<B>::size;
+    constexpr auto n1 = ewald_table_n + 1u;
+    const B inv_bs(inv_box_size), half(F(.5)), scale(F(2 * ewald_table_n)), max_idx(F(ewald_table_n - 1u)),
+        n1_vec(static_cast<F>(n1)), one(F(1));
+    // Compute the indices of the cells and the weights. The index of the first corner of the
+    // cell in the table is computed in floating point, where it is exactly representable.
+    std::array<B, 3> w;
+    B base(F(0));
+    for (std::size_t j = 0; j < 3u; ++j) {
+        const auto t = xsimd::min(xsimd::abs(x[j]) * inv_bs, half) * scale, i = xsimd::min(xsimd::floor(t), max_idx);
+        w[j] = t - i;
+        base = xsimd_fma(base, n1_vec, i);
+    }
+    alignas(XSIMD_DEFAULT_ALIGNMENT) F base_f[N];
+    base.store_aligned(base_f);
+    std::int32_t idx[N];
+    for (std::size_t i = 0; i < N; ++i) {
+        idx[i] = static_cast<std::int32_t>(base_f[i]);
+    }
+    std::array<B, 4> res;
+    res.fill(B(F(0)));
+    for (std::size_t c = 0; c < 8u; ++c) {
+        const auto d0 = c >> 2, d1 = (c >> 1) & 1u, d2 = c & 1u;
+        const auto wc = (d0 ? w[0] : one - w[0]) * (d1 ? w[1] : one - w[1]) * (d2 ? w[2] : one - w[2]);
+        // NOTE: the offset of the corner with respect to the first corner
+        // of the cell is the same for all the lanes.
+        const auto off = (d0 * n1 + d1) * n1 + d2;
+        for (std::size_t j = 0; j < 4u; ++j) {
+            res[j] = xsimd_fma(wc, simd_gather<B>(table[j].data() + off, idx), res[j]);
+        }
+    }
+    // Restore the signs of the force components and rescale to the box size (see ewald_corr()).
+    const auto inv_bs2 = inv_bs * inv_bs;
+    for (std::size_t j = 0; j < 3u; ++j) {
+        res[j] = xsimd::select(x[j] < B(F(0)), -res[j], res[j]) * inv_bs2;
+    }
+    res[3] *= inv_bs;
+    return res;
+}
+
+} // namespace detail
+
+} // namespace rakau
+
+#endif
@@ -0,0 +1,260 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef RAKAU_DETAIL_PM_HPP
+#define RAKAU_DETAIL_PM_HPP
+
+#include <array>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include <rakau/detail/tree_fwd.hpp>
+
+namespace rakau
+{
+
+inline namespace detail
+{
+
+// The particle-mesh (PM) solver for the long-range part of the interaction in the TreePM mode. The
+// interaction is split as 1 / r = erfc(r / (2 rs)) / r + erf(r / (2 rs)) / r, where rs is the splitting
+// scale. The short-range term is computed by the tree, and it is neglected beyond a cutoff radius. The
+// long-range term is computed on a periodic mesh via Fourier methods (Bagla, 2002; Springel, 2005):
+//
+// - the masses are assigned to the mesh with the cloud-in-cell (CIC) scheme,
+// - the potential is computed in Fourier space as phi_k = -4 pi rho_k exp(-k**2 rs**2) / k**2, deconvolving
+//   the CIC window twice (for the assignment and for the interpolation),
+// - the accelerations are computed via spectral differentiation, a_k = -i k phi_k,
+// - the accelerations/potentials are interpolated at the positions of the particles with the CIC scheme.
+//
+// The splitting scale is pm_asmth mesh cells, and the cutoff radius pm_rcut splitting scales.
+inline constexpr double pm_asmth = 1.25;
+inline constexpr double pm_rcut = 4.5;
+
+// In-place radix-2 complex FFT of the n values starting at data (n must be a power of 2). w must point
+// to the n / 2 twiddle factors exp(-+2 pi i k / n) (the sign determining the direction of the transform).
+// The inverse transform is not normalised.
+inline void pm_fft_1d(std::complex<double> *data, std::size_t n, const std::complex<double> *w)
+{
+    // The bit-reversal permutation.
+    for (std::size_t i = 1, j = 0; i < n; ++i) {
+        auto bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(data[i], data[j]);
+        }
+    }
+    // The butterflies.
+    for (std::size_t len = 2; len <= n; len <<= 1) {
+        const auto half = len / 2u, w_stride = n / len;
+        for (std::size_t i = 0; i < n; i += len) {
+            for (std::size_t k = 0; k < half; ++k) {
+                const auto u = data[i + k], v = data[i + k + half] * w[k * w_stride];
+                data[i + k] = u + v;
+                data[i + k + half] = u - v;
+            }
+        }
+    }
+}
+
+// In-place 3-dimensional FFT of the values in grid, which is a mesh with n points per dimension
+// stored in row-major order. If inverse is true, the (not normalised) inverse transform is computed.
+inline void pm_fft_3d(std::vector<std::complex<double>> &grid, std::size_t n, bool inverse)
+{
+    constexpr double pi = 3.141592653589793238462643383279502884;
+    std::vector<std::complex<double>> w(n / 2u);
+    for (std::size_t k = 0; k < n / 2u; ++k) {
+        w[k] = std::polar(1., (inverse ? 2. : -2.) * pi * static_cast<double>(k) / static_cast<double>(n));
+    }
+    // Transform along each dimension. The lines along the current dimension are identified
+    // by the indices of the other two dimensions, and they are copied into a contiguous buffer.
+    for (std::size_t d = 0; d < 3u; ++d) {
+        const auto stride = d == 0u ? n * n : (d == 1u ? n : std::size_t(1));
+        tbb::parallel_for(tbb::blocked_range(std::size_t(0), n * n), [&grid, &w, n, d, stride](const auto &range) {
+            std::vector<std::complex<double>> line(n);
+            for (auto l = range.begin(); l != range.end(); ++l) {
+                const auto a = l / n, b = l % n;
+                // The offset of the first point of the line.
+                const auto off = d == 0u ? a * n + b : (d == 1u ? a * n * n + b : (a * n + b) * n);
+                for (std::size_t i = 0; i < n; ++i) {
+                    line[i] = grid[off + i * stride];
+                }
+                pm_fft_1d(line.data(), n, w.data());
+                for (std::size_t i = 0; i < n; ++i) {
+                    grid[off + i * stride] = line[i];
+                }
+            }
+        });
+    }
+}
+
+// Compute via the PM method the long-range accelerations/potentials of the n_parts particles whose
+// coordinates/masses are pointed to by p_ptrs, in a periodic cubic box of size box_size centred in the origin.
+// n_grid is the number of mesh cells per dimension (a power of 2), rs the splitting scale. The results
+// are written into res_ptrs (with the same layout as in the tree traversal). Q indicates which quantities
+// will be computed (accs, potentials, or both).
+//
+// The potentials include the constant terms which make the TreePM potentials consistent with the Ewald
+// summation (see ewald.hpp): the long-range interaction of each particle with itself, 1 / (sqrt(pi) rs),
+// is removed, and the mean of the short-range interaction over the box, 4 pi rs**2 / box_size**3, which
+// is not compensated by the neutralising background in the short-range term, is subtracted.
+template <unsigned Q, typename F>
+inline void pm_acc_pot(std::size_t n_grid, F box_size, F rs, const std::array<const F *, 4> &p_ptrs,
+                       std::size_t n_parts, const std::array<F *, tree_nvecs_res<Q, 3>> &res_ptrs)
+{
+    constexpr double pi = 3.141592653589793238462643383279502884;
+    const auto n = n_grid, n3 = n * n * n;
+    const auto L = static_cast<double>(box_size), h = L / static_cast<double>(n), inv_h = 1. / h,
+               rs2 = static_cast<double>(rs) * static_cast<double>(rs);
+    // Helper to compute the CIC indices and weights of the particle at index i.
+    auto cic = [&p_ptrs, n, L, inv_h](std::size_t i, std::array<std::array<std::size_t, 2>, 3> &idx,
+                                      std::array<std::array<double, 2>, 3> &wt) {
+        for (std::size_t j = 0; j < 3u; ++j) {
+            // NOTE: the centres of the cells are at -L / 2 + (k + 1 / 2) h.
+            const auto u = (static_cast<double>(p_ptrs[j][i]) + L / 2.) * inv_h - .5, fl = std::floor(u);
+            const auto f = u - fl;
+            // NOTE: the particles are in the box, thus fl is in the [-1, n) range.
+            const auto k0 = fl < 0. ? n - 1u : static_cast<std::size_t>(fl) % n;
+            idx[j] = {k0, (k0 + 1u) % n};
+            wt[j] = {1. - f, f};
+        }
+    };
+
+    // Mass assignment.
+    // NOTE: the particles are bucketed according to the first mesh plane (along the first dimension) of their
+    // CIC stencil: the particles in the bucket k update only the planes k and k + 1 (modulo n). The buckets are
+    // processed in parallel in two phases, first the even ones and then the odd ones, so that in each phase
+    // distinct buckets update distinct planes (n being even). Within a bucket, the particles are processed
+    // in index order, hence the result does not depend on the number of threads.
+    std::vector<std::size_t> p_plane(n_parts);
+    tbb::parallel_for(tbb::blocked_range(std::size_t(0), n_parts), [&cic, &p_plane](const auto &range) {
+        std::array<std::array<std::size_t, 2>, 3> idx;
+        std::array<std::array<double, 2>, 3> wt;
+        for (auto i = range.begin(); i != range.end(); ++i) {
+            cic(i, idx, wt);
+            p_plane[i] = idx[0][0];
+        }
+    });
+    // Sort the particle indices by bucket (counting sort), and compute the total mass.
+    std::vector<std::size_t> b_offsets(n + 1u), b_parts(n_parts);
+    double tot_mass = 0;
+    for (std::size_t i = 0; i < n_parts; ++i) {
+        ++b_offsets[p_plane[i] + 1u];
+        tot_mass += static_cast<double>(p_ptrs[3][i]);
+    }
+    for (std::size_t k = 0; k < n; ++k) {
+        b_offsets[k + 1u] += b_offsets[k];
+    }
+    {
+        auto b_cur(b_offsets);
+        for (std::size_t i = 0; i < n_parts; ++i) {
+            b_parts[b_cur[p_plane[i]]++] = i;
+        }
+    }
+    std::vector<std::complex<double>> rho_k(n3);
+    for (std::size_t phase = 0; phase < 2u; ++phase) {
+        tbb::parallel_for(tbb::blocked_range(std::size_t(0), n / 2u), [&cic, &p_ptrs, &b_offsets, &b_parts, &rho_k,
+                                                                       n, inv_h, phase](const auto &range) {
+            std::array<std::array<std::size_t, 2>, 3> idx;
+            std::array<std::array<double, 2>, 3> wt;
+            for (auto b = range.begin(); b != range.end(); ++b) {
+                const auto k = 2u * b + phase;
+                for (auto bi = b_offsets[k]; bi < b_offsets[k + 1u]; ++bi) {
+                    const auto i = b_parts[bi];
+                    cic(i, idx, wt);
+                    const auto m = static_cast<double>(p_ptrs[3][i]);
+                    for (std::size_t c = 0; c < 8u; ++c) {
+                        const auto d0 = c >> 2, d1 = (c >> 1) & 1u, d2 = c & 1u;
+                        rho_k[(idx[0][d0] * n + idx[1][d1]) * n + idx[2][d2]]
+                            += m * inv_h * inv_h * inv_h * wt[0][d0] * wt[1][d1] * wt[2][d2];
+                    }
+                }
+            }
+        });
+    }
+    pm_fft_3d(rho_k, n, false);
+
+    // Multiply by the Green function, including the normalisation of the inverse transform.
+    // The wavenumbers along each dimension.
+    std::vector<double> kv(n), win(n);
+    for (std::size_t k = 0; k < n; ++k) {
+        kv[k] = 2. * pi / L * (k <= n / 2u ? static_cast<double>(k) : static_cast<double>(k) - static_cast<double>(n));
+        // The Fourier transform of the CIC window along one dimension.
+        const auto x = kv[k] * h / 2.;
+        win[k] = k ? (std::sin(x) / x) * (std::sin(x) / x) : 1.;
+    }
+    tbb::parallel_for(tbb::blocked_range(std::size_t(0), n3), [&rho_k, &kv, &win, n, n3, rs2](const auto &range) {
+        for (auto l = range.begin(); l != range.end(); ++l) {
+            const auto i0 = l / (n * n), i1 = (l / n) % n, i2 = l % n;
+            const auto k2 = kv[i0] * kv[i0] + kv[i1] * kv[i1] + kv[i2] * kv[i2];
+            if (k2 == 0.) {
+                // NOTE: the mean density is compensated by the neutralising background.
+                rho_k[l] = 0;
+                continue;
+            }
+            const auto w = win[i0] * win[i1] * win[i2];
+            rho_k[l] *= -4. * pi * std::exp(-k2 * rs2) / (k2 * w * w * static_cast<double>(n3));
+        }
+    });
+
+    // Compute the mesh of each output quantity, and interpolate it at the positions of the particles.
+    constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : 3u);
+    std::vector<std::complex<double>> mesh(n3);
+    for (std::size_t q = 0; q < tree_nvecs_res<Q, 3>; ++q) {
+        const auto is_pot = (Q == 1u || Q == 2u) && q == pot_idx;
+        tbb::parallel_for(tbb::blocked_range(std::size_t(0), n3),
+                          [&rho_k, &mesh, &kv, n, q, is_pot](const auto &range) {
+                              for (auto l = range.begin(); l != range.end(); ++l) {
+                                  if (is_pot) {
+                                      mesh[l] = rho_k[l];
+                                  } else {
+                                      const auto i = q == 0u ? l / (n * n) : (q == 1u ? (l / n) % n : l % n);
+                                      // NOTE: the Nyquist component of the derivative is set to zero.
+                                      const auto k = i == n / 2u ? 0. : kv[i];
+                                      mesh[l] = std::complex<double>(0., -k) * rho_k[l];
+                                  }
+                              }
+                          });
+        pm_fft_3d(mesh, n, true);
+        tbb::parallel_for(tbb::blocked_range(std::size_t(0), n_parts),
+                          [&cic, &mesh, &res_ptrs, &p_ptrs, n, q, is_pot, tot_mass, rs2, L](const auto &range) {
+                              std::array<std::array<std::size_t, 2>, 3> idx;
+                              std::array<std::array<double, 2>, 3> wt;
+                              for (auto i = range.begin(); i != range.end(); ++i) {
+                                  cic(i, idx, wt);
+                                  double val = 0;
+                                  for (std::size_t c = 0; c < 8u; ++c) {
+                                      const auto d0 = c >> 2, d1 = (c >> 1) & 1u, d2 = c & 1u;
+                                      val += wt[0][d0] * wt[1][d1] * wt[2][d2]
+                                             * mesh[(idx[0][d0] * n + idx[1][d1]) * n + idx[2][d2]].real();
+                                  }
+                                  if (is_pot) {
+                                      const auto m = static_cast<double>(p_ptrs[3][i]);
+                                      val = m * val + m * m / std::sqrt(pi * rs2)
+                                            + m * tot_mass * 4. * pi * rs2 / (L * L * L);
+                                  }
+                                  res_ptrs[q][i] = static_cast<F>(val);
+                              }
+                          });
+    }
+}
+
+} // namespace detail
+
+} // namespace rakau
+
+#endif
@@ -9,7 +9,12 @@
 #ifndef RAKAU_DETAIL_SIMD_HPP
 #define RAKAU_DETAIL_SIMD_HPP
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
 #include <type_traits>
 
 #include <xsimd/xsimd.hpp>
@@ -101,6 +106,23 @@ inline xsimd::batch<float, 16> inv_sqrt_3(xsimd::batch<float, 16> x)
     return tmp * tmp * tmp;
 }
 
+inline xsimd::batch<double, 8> inv_sqrt(xsimd::batch<double, 8> x)
+{
+#if defined(RAKAU_WITH_SIMD_COUNTERS)
+    ++simd_rsqrt_counter_tl;
+#endif
+    // NOTE: each Newton iteration roughly doubles the number of correct bits,
+    // two iterations are needed to go from 14 bits to double precision.
+    const xsimd::batch<double, 8> y0(_mm512_rsqrt14_pd(x));
+    return inv_sqrt_newton_iter(inv_sqrt_newton_iter(y0, x), x);
+}
+
+inline xsimd::batch<double, 8> inv_sqrt_3(xsimd::batch<double, 8> x)
+{
+    const auto tmp = inv_sqrt(x);
+    return tmp * tmp * tmp;
+}
+
 #endif
 
 #if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX_VERSION
@@ -119,13 +141,191 @@ inline xsimd::batch<float, 8> inv_sqrt_3(xsimd::batch<float, 8> x)
     return tmp * tmp * tmp;
 }
 
+inline xsimd::batch<double, 4> inv_sqrt(xsimd::batch<double, 4> x)
+{
+    using batch_type = xsimd::batch<double, 4>;
+    // NOTE: there is no rsqrt intrinsic for doubles in AVX, thus we compute the initial
+    // estimate in single precision. This works only if x is within the range of the normal
+    // floats, otherwise we fall back to the standard computation.
+    const batch_type flt_min(static_cast<double>(std::numeric_limits<float>::min())),
+        flt_max(static_cast<double>(std::numeric_limits<float>::max()));
+    if (xsimd::any((x < flt_min) | (x > flt_max))) {
+        return batch_type(1.) / xsimd_sqrt(x);
+    }
+#if defined(RAKAU_WITH_SIMD_COUNTERS)
+    ++simd_rsqrt_counter_tl;
+#endif
+    // NOTE: three Newton iterations are needed to go from the 12 bits of
+    // the single-precision estimate to double precision.
+    const batch_type y0(_mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(x))));
+    return inv_sqrt_newton_iter(inv_sqrt_newton_iter(inv_sqrt_newton_iter(y0, x), x), x);
+}
+
+inline xsimd::batch<double, 4> inv_sqrt_3(xsimd::batch<double, 4> x)
+{
+    const auto tmp = inv_sqrt(x);
+    return tmp * tmp * tmp;
+}
+
+#endif
+
+// Rotate the lanes of a batch by one position, that is, the lane i of the return
+// value is the lane (i + 1) % N of x. The generic implementation goes through memory.
+template <typename F, std::size_t N>
+inline xsimd::batch<F, N> simd_rotate(xsimd::batch<F, N> x)
+{
+    alignas(XSIMD_DEFAULT_ALIGNMENT) F tmp[2u * N];
+    x.store_aligned(tmp);
+    x.store_unaligned(tmp + N);
+    xsimd::batch<F, N> retval;
+    retval.load_unaligned(tmp + 1);
+    return retval;
+}
+
+#if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX512_VERSION
+
+inline xsimd::batch<float, 16> simd_rotate(xsimd::batch<float, 16> x)
+{
+    const auto xi = _mm512_castps_si512(x);
+    return xsimd::batch<float, 16>(_mm512_castsi512_ps(_mm512_alignr_epi32(xi, xi, 1)));
+}
+
+inline xsimd::batch<double, 8> simd_rotate(xsimd::batch<double, 8> x)
+{
+    const auto xi = _mm512_castpd_si512(x);
+    return xsimd::batch<double, 8>(_mm512_castsi512_pd(_mm512_alignr_epi64(xi, xi, 1)));
+}
+
+#endif
+
+#if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX2_VERSION
+
+inline xsimd::batch<float, 8> simd_rotate(xsimd::batch<float, 8> x)
+{
+    return xsimd::batch<float, 8>(_mm256_permutevar8x32_ps(x, _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0)));
+}
+
+inline xsimd::batch<double, 4> simd_rotate(xsimd::batch<double, 4> x)
+{
+    return xsimd::batch<double, 4>(_mm256_permute4x64_pd(x, _MM_SHUFFLE(0, 3, 2, 1)));
+}
+
+#endif
+
+#if XSIMD_X86_INSTR_SET >= XSIMD_X86_SSE2_VERSION
+
+inline xsimd::batch<float, 4> simd_rotate(xsimd::batch<float, 4> x)
+{
+    return xsimd::batch<float, 4>(_mm_shuffle_ps(x, x, _MM_SHUFFLE(0, 3, 2, 1)));
+}
+
+inline xsimd::batch<double, 2> simd_rotate(xsimd::batch<double, 2> x)
+{
+    return xsimd::batch<double, 2>(_mm_shuffle_pd(x, x, 1));
+}
+
 #endif
 
+// Load the first n elements (n < N) of a batch starting at ptr, taking the other lanes from fill.
+// The elements past ptr + n are not accessed. The generic implementation goes through memory.
+template <typename F, std::size_t N>
+inline xsimd::batch<F, N> simd_load_tail(const F *ptr, std::size_t n, xsimd::batch<F, N> fill)
+{
+    assert(n < N);
+    alignas(XSIMD_DEFAULT_ALIGNMENT) F tmp[N];
+    fill.store_aligned(tmp);
+    std::copy(ptr, ptr + n, tmp);
+    xsimd::batch<F, N> retval;
+    retval.load_aligned(tmp);
+    return retval;
+}
+
+// Store the first n lanes (n < N) of x starting at ptr. The elements past ptr + n are not accessed.
+template <typename F, std::size_t N>
+inline void simd_store_tail(F *ptr, std::size_t n, xsimd::batch<F, N> x)
+{
+    assert(n < N);
+    alignas(XSIMD_DEFAULT_ALIGNMENT) F tmp[N];
+    x.store_aligned(tmp);
+    std::copy(tmp, tmp + n, ptr);
+}
+
+#if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX512_VERSION
+
+// NOTE: in AVX512, the masked loads/stores do not access the memory
+// locations of the masked-out lanes (and they do not generate faults).
+inline xsimd::batch<float, 16> simd_load_tail(const float *ptr, std::size_t n, xsimd::batch<float, 16> fill)
+{
+    assert(n < 16u);
+    return xsimd::batch<float, 16>(_mm512_mask_loadu_ps(fill, static_cast<__mmask16>((1u << n) - 1u), ptr));
+}
+
+inline void simd_store_tail(float *ptr, std::size_t n, xsimd::batch<float, 16> x)
+{
+    assert(n < 16u);
+    _mm512_mask_storeu_ps(ptr, static_cast<__mmask16>((1u << n) - 1u), x);
+}
+
+inline xsimd::batch<double, 8> simd_load_tail(const double *ptr, std::size_t n, xsimd::batch<double, 8> fill)
+{
+    assert(n < 8u);
+    return xsimd::batch<double, 8>(_mm512_mask_loadu_pd(fill, static_cast<__mmask8>((1u << n) - 1u), ptr));
+}
+
+inline void simd_store_tail(double *ptr, std::size_t n, xsimd::batch<double, 8> x)
+{
+    assert(n < 8u);
+    _mm512_mask_storeu_pd(ptr, static_cast<__mmask8>((1u << n) - 1u), x);
+}
+
+#endif
+
+// Load a batch of type B gathering its lanes from ptr, at the offsets contained in idx (which must
+// point to B::size offsets). On AVX2/AVX512 the gather intrinsics are used, otherwise the batch
+// is assembled in memory.
+template <typename B, typename F>
+inline B simd_gather(const F *ptr, const std::int32_t *idx)
+{
+    static_assert(std::is_same_v<typename xsimd::simd_batch_traits<B>::value_type, F>);
+    // NOTE: use the masked variants of the intrinsics with a full mask and a zero source, as the unmasked
+    // ones are implemented on top of the undefined intrinsics in GCC, and they trigger
+    // maybe-uninitialized warnings.
+#if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX512_VERSION
+    if constexpr (std::is_same_v<B, xsimd::batch<float, 16>>) {
+        return B(_mm512_mask_i32gather_ps(_mm512_setzero_ps(), __mmask16(0xFFFF), _mm512_loadu_si512(idx), ptr, 4));
+    }
+    if constexpr (std::is_same_v<B, xsimd::batch<double, 8>>) {
+        return B(_mm512_mask_i32gather_pd(_mm512_setzero_pd(), __mmask8(0xFF),
+                                          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx)), ptr, 8));
+    }
+#endif
+#if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX2_VERSION
+    if constexpr (std::is_same_v<B, xsimd::batch<float, 8>>) {
+        return B(_mm256_mask_i32gather_ps(_mm256_setzero_ps(), ptr,
+                                          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx)),
+                                          _mm256_castsi256_ps(_mm256_set1_epi32(-1)), 4));
+    }
+    if constexpr (std::is_same_v<B, xsimd::batch<double, 4>>) {
+        return B(_mm256_mask_i32gather_pd(_mm256_setzero_pd(), ptr,
+                                          _mm_loadu_si128(reinterpret_cast<const __m128i *>(idx)),
+                                          _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8));
+    }
+#endif
+    constexpr auto N = xsimd::simd_batch_traits<B>::size;
+    alignas(XSIMD_DEFAULT_ALIGNMENT) F tmp[N];
+    for (std::size_t i = 0; i < N; ++i) {
+        tmp[i] = ptr[idx[i]];
+    }
+    B retval;
+    retval.load_aligned(tmp);
+    return retval;
+}
+
 // Small variable template helper to establish if a fast implementation
 // of the inverse sqrt for an xsimd batch of type B is available.
 // Currently, this is true for:
-// - AVX 8-floats batches,
-// - AVX512 16-floats batches.
+// - AVX 8-floats and 4-doubles batches,
+// - AVX512 16-floats and 8-doubles batches.
 // NOTE: there are intrinsics in SSE for rsqrt as well, but they don't seem to
 // improve performance for our use case. I could not understand why exactly that's
 // the case.
@@ -133,9 +333,13 @@ template <typename B>
 inline constexpr bool has_fast_inv_sqrt =
 #if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX_VERSION
     (std::is_same_v<typename xsimd::simd_batch_traits<B>::value_type, float> && xsimd::simd_batch_traits<B>::size == 8u)
+    || (std::is_same_v<typename xsimd::simd_batch_traits<B>::value_type,
+                       double> && xsimd::simd_batch_traits<B>::size == 4u)
 #if XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX512_VERSION
     || (std::is_same_v<typename xsimd::simd_batch_traits<B>::value_type,
                        float> && xsimd::simd_batch_traits<B>::size == 16u)
+    || (std::is_same_v<typename xsimd::simd_batch_traits<B>::value_type,
+                       double> && xsimd::simd_batch_traits<B>::size == 8u)
 #endif
 #else
     false
@@ -0,0 +1,57 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef RAKAU_DETAIL_SIMD_DISPATCH_FWD_HPP
+#define RAKAU_DETAIL_SIMD_DISPATCH_FWD_HPP
+
+#include <cstddef>
+#include <vector>
+
+namespace rakau
+{
+inline namespace detail
+{
+
+// The instruction sets for which the simd kernels are compiled in the rakau library.
+// NOTE: the types involved in the entry points of the kernels (see below) are explicitly marked with the
+// default visibility, otherwise the entry points would be hidden in the user's code compiled with
+// -fvisibility=hidden.
+enum class __attribute__((visibility("default"))) simd_isa { sse2, avx2, avx512 };
+
+// The name of an instruction set.
+inline constexpr const char *simd_isa_name(simd_isa isa)
+{
+    switch (isa) {
+        case simd_isa::sse2:
+            return "sse2";
+        case simd_isa::avx2:
+            return "avx2";
+        default:
+            return "avx512";
+    }
+}
+
+// The best instruction set supported by the cpu in use. If the RAKAU_SIMD_ISA environment variable
+// is set to the name of an instruction set, the instruction sets above it will not be selected.
+simd_isa simd_dispatch_isa() __attribute__((visibility("default")));
+
+// Entry point into the computation of the accelerations/potentials for the instruction set Isa. This
+// is implemented as a friend of the tree class, and it is explicitly instantiated in the rakau library
+// for the trees supported by the dispatch (see tree::acc_pot_isa()). The tree, the array of output
+// iterators (pointers, possibly permuted if Ordered is true) and the options are passed in as void
+// pointers, so that the symbols do not depend on the visibility of the types in the user's code.
+template <simd_isa Isa>
+struct __attribute__((visibility("default"))) tree_simd_access {
+    template <unsigned Q, std::size_t NDim, typename F, typename UInt, bool Ordered>
+    static void acc_pot(const void *, const void *, F, F, F, const std::vector<double> &, const void *);
+};
+
+} // namespace detail
+} // namespace rakau
+
+#endif
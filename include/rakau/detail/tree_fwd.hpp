@@ -67,13 +67,21 @@ struct tree_node_t {
     // NOTE: these will be 32/64bit uints in most cases. Because there's 2 of these,
     // they will typically not result in padding.
     UInt code, level;
-    // Node properties (COM coordinates + mass) and square of the node dimension.
+    // Node properties (COM coordinates + mass), dimension of the node and offset of the COM.
+    // The dimension is the largest side of the tight bounding box of the particles in the node
+    // (which is never larger than the geometrical dimension of the node), the offset is the distance
+    // between the COM and the centre of the bounding box. eps is the largest softening length of the
+    // particles in the node, if per-particle softening lengths are in use (zero otherwise).
     // NOTE: these will be single/double precision ieee FPs in most cases. Assuming
     // we have no padding at this point, any extra padding necessary can be placed
     // here.
-    F props[NDim + 1u], dim2;
+    F props[NDim + 1u], dim, com_off, eps;
 };
 
+// Helper granting the test suite access to the private members of the tree class.
+// NOTE: this is declared here, but it is defined only in the tests.
+struct tree_test_access;
+
 // Critical node.
 template <typename F, typename UInt>
 using tree_cnode_t = std::tuple<UInt, tree_size_t<F>, tree_size_t<F>>;
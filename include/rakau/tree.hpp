@@ -27,8 +27,10 @@
 #include <iostream>
 #include <iterator>
 #include <limits>
+#include <mutex>
 #include <numeric>
 #include <optional>
+#include <shared_mutex>
 #include <stdexcept>
 #include <string>
 #include <tuple>
@@ -55,11 +57,16 @@
 #include <rakau/detail/cuda_fwd.hpp>
 #endif
 #include <rakau/detail/di_aligned_allocator.hpp>
+#include <rakau/detail/ewald.hpp>
+#include <rakau/detail/pm.hpp>
 #if defined(RAKAU_WITH_ROCM)
 #include <rakau/detail/rocm_fwd.hpp>
 #endif
 #include <rakau/detail/igor.hpp>
 #include <rakau/detail/simd.hpp>
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+#include <rakau/detail/simd_dispatch_fwd.hpp>
+#endif
 #include <rakau/detail/simple_timer.hpp>
 #include <rakau/detail/tree_fwd.hpp>
 
@@ -140,6 +147,27 @@ inline long double fma_wrap(long double x, long double y, long double z)
 #endif
 }
 
+// Generic FMA and square root wrappers, usable both with scalars and with SIMD batches.
+template <typename T>
+inline T gen_fma(T x, T y, T z)
+{
+    if constexpr (std::is_floating_point_v<T>) {
+        return fma_wrap(x, y, z);
+    } else {
+        return xsimd_fma(x, y, z);
+    }
+}
+
+template <typename T>
+inline T gen_sqrt(T x)
+{
+    if constexpr (std::is_floating_point_v<T>) {
+        return std::sqrt(x);
+    } else {
+        return xsimd_sqrt(x);
+    }
+}
+
 // Some handy aliases for std::iterator_traits.
 template <typename It>
 using it_value_type = typename std::iterator_traits<It>::value_type;
@@ -480,18 +508,65 @@ namespace kwargs
 IGOR_MAKE_NAMED_ARGUMENT(box_size);
 IGOR_MAKE_NAMED_ARGUMENT(max_leaf_n);
 IGOR_MAKE_NAMED_ARGUMENT(ncrit);
+IGOR_MAKE_NAMED_ARGUMENT(periodic);
+IGOR_MAKE_NAMED_ARGUMENT(pm_grid);
+IGOR_MAKE_NAMED_ARGUMENT(eps_parts);
 
 // kwargs for acc/pot computation.
 IGOR_MAKE_NAMED_ARGUMENT(G);
 IGOR_MAKE_NAMED_ARGUMENT(eps);
 IGOR_MAKE_NAMED_ARGUMENT(split);
+IGOR_MAKE_NAMED_ARGUMENT(dual_tree);
+IGOR_MAKE_NAMED_ARGUMENT(old_accs);
+IGOR_MAKE_NAMED_ARGUMENT(ilist_cache);
+IGOR_MAKE_NAMED_ARGUMENT(batch_leaves);
+IGOR_MAKE_NAMED_ARGUMENT(mutual);
+IGOR_MAKE_NAMED_ARGUMENT(mixed_precision);
+IGOR_MAKE_NAMED_ARGUMENT(calibrate);
+IGOR_MAKE_NAMED_ARGUMENT(acc_errs);
 
 } // namespace kwargs
 
+// Target relative error for the computation of the accelerations/potentials. It can be passed to the
+// acc/pot functions of the tree in place of the opening angle (see tree::acc_pot_err()).
+struct rel_error {
+    double value;
+};
+
+// The softening kernels. With the Plummer kernel, the interactions are computed at the softened distance
+// sqrt(r**2 + eps**2), thus the softening affects the interactions at any separation. The other kernels have
+// compact support: the softening length eps is the radius of the support, and the interactions are exactly
+// Newtonian for r >= eps. The compact kernels are the cubic spline kernel of Monaghan & Lattanzio (1985),
+// in the form used in GADGET (Springel, 2001), and the Wendland C2 kernel (Wendland, 1995).
+enum class softening_kernel { plummer, spline, wendland_c2 };
+
+// The name of a softening kernel.
+inline constexpr const char *softening_kernel_name(softening_kernel sk)
+{
+    switch (sk) {
+        case softening_kernel::plummer:
+            return "plummer";
+        case softening_kernel::spline:
+            return "spline";
+        default:
+            return "wendland_c2";
+    }
+}
+
+// The alignment of the vectors of floating-point values.
+// NOTE: with the SIMD dispatch, the kernels compiled for all the instruction sets operate on
+// the same trees, hence the alignment cannot depend on the instruction set in use (64 is
+// the alignment mandated by AVX-512).
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+inline constexpr std::size_t f_vector_alignment = 64;
+#else
+inline constexpr std::size_t f_vector_alignment = XSIMD_DEFAULT_ALIGNMENT;
+#endif
+
 // Vector type for storing floating-point values. The allocator does default-init,
 // rather than value-init, and it enforces the SIMD-mandated alignment value.
 template <typename F>
-using f_vector = std::vector<F, di_aligned_allocator<F, XSIMD_DEFAULT_ALIGNMENT>>;
+using f_vector = std::vector<F, di_aligned_allocator<F, f_vector_alignment>>;
 
 // NOTE: possible improvements:
 // - it is still not yet clear to me what the NUMA picture is here. During tree traversal, the results
@@ -515,12 +590,15 @@ using f_vector = std::vector<F, di_aligned_allocator<F, XSIMD_DEFAULT_ALIGNMENT>
 //   which are not very similar to each other (which, in turn, means that during tree traversal the BH check
 //   will fail often). It's probably best to start experimenting with such size as a free parameter, check the
 //   performance with various values and then try to understand if there's any heuristic we can deduce from that.
-// - quadrupole moments.
 // - radix sort.
 // - would be interesting to see if we can do the permutations in-place efficiently. If that worked, it would probably
 //   help simplifying things on the GPU side. See for instance:
 //   https://stackoverflow.com/questions/7365814/in-place-array-reordering
-template <std::size_t NDim, typename F, typename UInt = std::size_t>
+// MPOrder is the order of the multipole expansion of the nodes used in the computation of the
+// accelerations/potentials: 1 is the monopole (the dipole vanishes when expanding around the COM),
+// 2 adds the quadrupole, 3 the octupole. SK is the softening kernel (see softening_kernel).
+template <std::size_t NDim, typename F, typename UInt = std::size_t, unsigned MPOrder = 1,
+          softening_kernel SK = softening_kernel::plummer>
 class tree
 {
     // Need at least 1 dimension.
@@ -534,10 +612,28 @@ class tree
     // UInt must be an unsigned integral.
     static_assert(std::is_integral_v<UInt> && std::is_unsigned_v<UInt>,
                   "The type UInt must be a C++ unsigned integral type.");
+    // Only monopole, quadrupole and octupole expansions are supported.
+    static_assert(MPOrder >= 1u && MPOrder <= 3u, "The multipole order must be 1, 2 or 3.");
     // cbits shortcut.
     static constexpr auto cbits = cbits_v<UInt, NDim>;
     // simd_enabled shortcut.
     static constexpr bool simd_enabled = simd_enabled_v<F>;
+    // Shortcut to detect compact-support softening kernels.
+    static constexpr bool compact_sk = SK != softening_kernel::plummer;
+
+    // Test-only access to the private members (see tree_test_access).
+    friend struct detail::tree_test_access;
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+    // Access for the kernels compiled for the instruction sets of the SIMD dispatch.
+    template <simd_isa>
+    friend struct detail::tree_simd_access;
+    // The trees whose kernels are compiled in the rakau library for all the instruction sets
+    // (the kernels of the other trees are compiled for the instruction set of the user's code).
+    static constexpr bool simd_dispatch_enabled
+        = (NDim == 2u || NDim == 3u) && MPOrder == 1u && SK == softening_kernel::plummer
+          && (std::is_same_v<F, float> || std::is_same_v<F, double>)
+          && (std::is_same_v<UInt, std::uint32_t> || std::is_same_v<UInt, std::uint64_t>);
+#endif
 
 public:
     using size_type = tree_size_t<F>;
@@ -546,6 +642,11 @@ private:
     // Consistency check: the size type which was forward-defined
     // is the same as the actual size type.
     static_assert(std::is_same_v<size_type, typename f_vector<F>::size_type>);
+    // The floating-point type in which the mixed-precision mode adds up the terms of the compensated sums
+    // of the accelerations/potentials (see acc_pot_cnode()), and in which the dual-tree traversal
+    // accumulates the interactions between the nodes.
+    using acc_fp_type = std::conditional_t<(std::numeric_limits<F>::digits < std::numeric_limits<double>::digits),
+                                           double, F>;
     // The node type.
     using node_type = tree_node_t<NDim, F, UInt>;
     // The tree type.
@@ -554,12 +655,43 @@ private:
     using cnode_type = tree_cnode_t<F, UInt>;
     // List of critical nodes.
     using cnode_list_type = std::vector<cnode_type, di_aligned_allocator<cnode_type>>;
-    // Small helper to get the square of the dimension of a node at the tree level node_level.
-    F get_sqr_node_dim(UInt node_level) const
-    {
-        const auto tmp = get_node_dim(node_level, m_box_size);
-        return tmp * tmp;
-    }
+    // Layout of the storage for the higher-order multipole moments of a node. The quadrupole
+    // and octupole tensors are symmetric, and only their independent components are stored.
+    // Each tensor is followed by its trace (a scalar for the quadrupole, a vector
+    // for the octupole).
+    static constexpr std::size_t mp_q_size = NDim * (NDim + 1u) / 2u;
+    static constexpr std::size_t mp_q_tr_off = mp_q_size;
+    static constexpr std::size_t mp_o_off = mp_q_tr_off + 1u;
+    static constexpr std::size_t mp_o_size = NDim * (NDim + 1u) * (NDim + 2u) / 6u;
+    static constexpr std::size_t mp_o_tr_off = mp_o_off + mp_o_size;
+    static constexpr std::size_t mp_size = MPOrder == 1u ? 0u : (MPOrder == 2u ? mp_o_off : mp_o_tr_off + NDim);
+    // Tables mapping the indices of the full quadrupole/octupole tensors (in row-major
+    // order) to the position of the corresponding components in the storage.
+    static constexpr auto mp_q_idx = []() {
+        std::array<std::size_t, NDim * NDim> retval{};
+        std::size_t n = 0;
+        for (std::size_t j1 = 0; j1 < NDim; ++j1) {
+            for (std::size_t j2 = j1; j2 < NDim; ++j2, ++n) {
+                retval[j1 * NDim + j2] = retval[j2 * NDim + j1] = n;
+            }
+        }
+        return retval;
+    }();
+    static constexpr auto mp_o_idx = []() {
+        std::array<std::size_t, NDim * NDim * NDim> retval{};
+        std::size_t n = mp_o_off;
+        for (std::size_t j1 = 0; j1 < NDim; ++j1) {
+            for (std::size_t j2 = j1; j2 < NDim; ++j2) {
+                for (std::size_t j3 = j2; j3 < NDim; ++j3, ++n) {
+                    // Assign all the permutations of (j1, j2, j3).
+                    retval[(j1 * NDim + j2) * NDim + j3] = retval[(j1 * NDim + j3) * NDim + j2]
+                        = retval[(j2 * NDim + j1) * NDim + j3] = retval[(j2 * NDim + j3) * NDim + j1]
+                        = retval[(j3 * NDim + j1) * NDim + j2] = retval[(j3 * NDim + j2) * NDim + j1] = n;
+                }
+            }
+        }
+        return retval;
+    }();
     // A small functor to right shift an input UInt by a fixed amount.
     // Used in the tree construction functions.
     struct code_shifter {
@@ -641,7 +773,11 @@ private:
                                        ParentLevel + 1u,
                                        // NOTE: make sure the node props are initialised to zero.
                                        {},
-                                       get_sqr_node_dim(ParentLevel + 1u)};
+                                       // NOTE: the dimension, the COM offset and the softening
+                                       // length will be set in compute_node_properties().
+                                       get_node_dim(ParentLevel + 1u, m_box_size),
+                                       0,
+                                       0};
                     // Compute its properties.
                     compute_node_properties(new_node);
                     // Add the node to the tree.
@@ -734,7 +870,9 @@ private:
                                            cur_code,
                                            ParentLevel + 1u,
                                            {},
-                                           get_sqr_node_dim(ParentLevel + 1u)};
+                                           get_node_dim(ParentLevel + 1u, m_box_size),
+                                           0,
+                                           0};
                         compute_node_properties(new_node);
                         new_tree.push_back(std::move(new_node));
                         const auto u_npart
@@ -797,6 +935,10 @@ private:
         // Make sure we always have an empty tree when invoking this method.
         assert(m_tree.empty());
         assert(m_crit_nodes.empty());
+        assert(m_crit_idx.empty());
+        // Bump the generation of the tree structure, so that the cached
+        // interaction lists referring to the old structure are not replayed.
+        ++m_tree_gen;
         // Exit early if there are no particles.
         if (!m_codes.size()) {
             return;
@@ -832,7 +974,11 @@ private:
                                    // NOTE: make sure mass and COM coords are initialised in a known state (i.e.,
                                    // zero for C++ floating-point).
                                    {},
-                                   root_sqr_node_dim});
+                                   // NOTE: the dimension, the COM offset and the softening
+                                   // length will be set in compute_node_properties().
+                                   m_box_size,
+                                   0,
+                                   0});
 
         // Compute the root node's properties. Do it concurrently with other computations.
         tbb::task_group tg;
@@ -961,9 +1107,10 @@ private:
         // Verify the node levels.
         assert(std::all_of(m_tree.begin(), m_tree.end(),
                            [](const auto &n) { return n.level == tree_level<NDim>(n.code); }));
-        // Verify the node dim2.
-        assert(std::all_of(m_tree.begin(), m_tree.end(),
-                           [this](const auto &n) { return n.dim2 == get_sqr_node_dim(n.level); }));
+        // Verify the node dimensions and COM offsets.
+        assert(std::all_of(m_tree.begin(), m_tree.end(), [](const auto &n) {
+            return std::isfinite(n.dim) && n.dim >= F(0) && std::isfinite(n.com_off) && n.com_off >= F(0);
+        }));
 
         // NOTE: a couple of final checks to make sure we can use size_type to represent both the tree
         // size and the size of the list of critical nodes.
@@ -975,6 +1122,60 @@ private:
             throw std::overflow_error("The size of the critical nodes list (" + std::to_string(m_crit_nodes.size())
                                       + ") is too large, and it results in an overflow condition");
         }
+
+        // Locate the critical nodes in the tree structure. The traversal of the tree
+        // for a target critical node will identify its ancestors via its index.
+        m_crit_idx.resize(boost::numeric_cast<decltype(m_crit_idx.size())>(m_crit_nodes.size()));
+        tbb::parallel_for(
+            tbb::blocked_range(decltype(m_crit_nodes.size())(0), m_crit_nodes.size()), [this](const auto &range) {
+                // NOTE: the critical nodes are sorted according to the nodal code, like the tree,
+                // thus we can start each search from the node found in the previous one.
+                auto it = m_tree.begin();
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    it = std::lower_bound(it, m_tree.end(), get<0>(m_crit_nodes[i]),
+                                          [](const auto &n, UInt code) { return node_compare<NDim>(n.code, code); });
+                    assert(it != m_tree.end() && it->code == get<0>(m_crit_nodes[i]));
+                    m_crit_idx[i] = static_cast<size_type>(it - m_tree.begin());
+                }
+            });
+
+        // Check that the padding coordinate used in the self interactions can be computed.
+        if constexpr (simd_enabled) {
+            static_cast<void>(tgt_pad_coord());
+        }
+
+        // Compute the higher-order multipole moments, if needed.
+        if constexpr (MPOrder > 1u) {
+            compute_node_multipoles();
+        }
+
+        // Compute the data for the Ewald corrections, if needed.
+        if (use_ewald()) {
+            compute_node_ewald_tr();
+        }
+    }
+    // Compute the coordinate that will be used for the masked-out lanes of the last, partial batch of a target
+    // node in the vectorised self interactions kernel (see tree_self_interactions_simd()).
+    F tgt_pad_coord() const
+    {
+        // NOTE: in the self interactions kernel, the masked-out lanes are treated as padding particles
+        // with zero mass, so that the extra accelerations/potentials due to them are zero. Their positions
+        // must not overlap with any real particle, in order to avoid singularities, hence they must be
+        // outside the box. The padding particles are not involved in the opening criterion checks (in the
+        // other kernels, the masked-out lanes are filled with a copy of a real particle, see tgt_load()),
+        // thus their position does not depend on the opening angle.
+        //
+        // We put the padding particles at coordinates (M, M, ...), with M = 2 * b_size. The upper right
+        // corner of the box, with coordinates (b_size/2, b_size/2, ...), is the closest point of the box
+        // to the padding particles, at a distance of 3/2 * sqrt(NDim) * b_size. In periodic mode, the
+        // minimum image convention brings the padding particles back into the box, and the kernel
+        // masks their contributions explicitly.
+        const auto pad_coord = m_box_size * F(2);
+        if (!std::isfinite(pad_coord)) {
+            throw std::overflow_error("The calculation of the SIMD padding coordinate produced the non-finite value "
+                                      + std::to_string(pad_coord));
+        }
+        return pad_coord;
     }
     void compute_node_properties(node_type &node)
     {
@@ -1007,6 +1208,129 @@ private:
         }
         // Store the total mass.
         node.props[NDim] = tot_mass;
+        // Compute the tight bounding box of the particles, and use it to determine
+        // the node dimension and the offset of the COM from the centre of the box.
+        F dim(0), off2(0);
+        for (std::size_t j = 0; j < NDim; ++j) {
+            const auto [min_it, max_it]
+                = std::minmax_element(m_parts[j].data() + begin, m_parts[j].data() + end);
+            dim = std::max(dim, *max_it - *min_it);
+            const auto diff = node.props[j] - (*min_it + *max_it) / F(2);
+            off2 = fma_wrap(diff, diff, off2);
+        }
+        node.dim = dim;
+        node.com_off = std::sqrt(off2);
+        // The largest softening length.
+        node.eps = m_eps.empty() ? F(0) : *std::max_element(m_eps.data() + begin, m_eps.data() + end);
+    }
+    // Compute the traces of the quadrupole moments of all the nodes with respect to their COMs (that is,
+    // the sums of m * |x - COM|**2 over the particles of the nodes), which are needed by the Ewald
+    // corrections in periodic mode (see tree_acc_pot_ewald()).
+    void compute_node_ewald_tr()
+    {
+        simple_timer st("Ewald data computation");
+        m_ewald_tr.resize(static_cast<decltype(m_ewald_tr.size())>(m_tree.size()));
+        if constexpr (MPOrder > 1u) {
+            // The traces are already available in the multipole moments.
+            tbb::parallel_for(tbb::blocked_range(size_type(0), static_cast<size_type>(m_tree.size())),
+                              [this](const auto &range) {
+                                  for (auto i = range.begin(); i != range.end(); ++i) {
+                                      m_ewald_tr[i] = m_multipoles[i * mp_size + mp_q_tr_off];
+                                  }
+                              });
+        } else if (!m_tree.empty()) {
+            compute_node_ewald_tr_impl(0);
+        }
+    }
+    // Compute recursively the trace of the node at index idx (and of all its descendants) for
+    // compute_node_ewald_tr(). The traces of the internal nodes are computed from the traces of the
+    // children via the parallel axis theorem, so that each particle is visited only once.
+    // NOTE: we re-use the machinery of the dual-tree traversal for the iteration over the children.
+    void compute_node_ewald_tr_impl(size_type idx)
+    {
+        const auto &node = m_tree[idx];
+        F tr(0);
+        if (node.n_children) {
+            dt_for_each_child(idx, dt_par(idx), [this](size_type c) { compute_node_ewald_tr_impl(c); });
+            const auto end = static_cast<size_type>(idx + node.n_children + 1u);
+            for (auto c = static_cast<size_type>(idx + 1u); c < end;
+                 c = static_cast<size_type>(c + m_tree[c].n_children + 1u)) {
+                const auto &cprops = m_tree[c].props;
+                F d2(0);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    const auto dx = cprops[j] - node.props[j];
+                    d2 = fma_wrap(dx, dx, d2);
+                }
+                tr += fma_wrap(cprops[NDim], d2, m_ewald_tr[c]);
+            }
+        } else {
+            for (auto k = node.begin; k != node.end; ++k) {
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    const auto dx = m_parts[j][k] - node.props[j];
+                    tr = fma_wrap(m_parts[NDim][k] * dx, dx, tr);
+                }
+            }
+        }
+        m_ewald_tr[idx] = tr;
+    }
+    // Compute the higher-order multipole moments of all the nodes, using the COMs
+    // computed in compute_node_properties() as expansion centres.
+    void compute_node_multipoles()
+    {
+        static_assert(MPOrder > 1u);
+        simple_timer st("multipole moments computation");
+        // NOTE: make sure we can compute the total size of the storage.
+        if (m_tree.size() > std::numeric_limits<size_type>::max() / mp_size) {
+            throw std::overflow_error("The size of the tree (" + std::to_string(m_tree.size())
+                                      + ") is too large, and it results in an overflow condition when computing "
+                                        "the size of the multipole moments storage");
+        }
+        m_multipoles.resize(static_cast<decltype(m_multipoles.size())>(m_tree.size() * mp_size));
+        tbb::parallel_for(tbb::blocked_range(size_type(0), static_cast<size_type>(m_tree.size())),
+                          [this](const auto &range) {
+                              std::array<F, NDim> dx;
+                              for (auto i = range.begin(); i != range.end(); ++i) {
+                                  const auto &node = m_tree[i];
+                                  const auto mp = m_multipoles.data() + i * mp_size;
+                                  std::fill(mp, mp + mp_size, F(0));
+                                  for (auto k = node.begin; k != node.end; ++k) {
+                                      const auto m = m_parts[NDim][k];
+                                      for (std::size_t j = 0; j < NDim; ++j) {
+                                          dx[j] = m_parts[j][k] - node.props[j];
+                                      }
+                                      // The quadrupole moments.
+                                      for (std::size_t j1 = 0; j1 < NDim; ++j1) {
+                                          for (std::size_t j2 = j1; j2 < NDim; ++j2) {
+                                              auto &q = mp[mp_q_idx[j1 * NDim + j2]];
+                                              q = fma_wrap(m * dx[j1], dx[j2], q);
+                                          }
+                                      }
+                                      // The octupole moments.
+                                      if constexpr (MPOrder > 2u) {
+                                          for (std::size_t j1 = 0; j1 < NDim; ++j1) {
+                                              for (std::size_t j2 = j1; j2 < NDim; ++j2) {
+                                                  for (std::size_t j3 = j2; j3 < NDim; ++j3) {
+                                                      auto &o = mp[mp_o_idx[(j1 * NDim + j2) * NDim + j3]];
+                                                      o = fma_wrap(m * dx[j1] * dx[j2], dx[j3], o);
+                                                  }
+                                              }
+                                          }
+                                      }
+                                  }
+                                  // The traces.
+                                  for (std::size_t j = 0; j < NDim; ++j) {
+                                      mp[mp_q_tr_off] += mp[mp_q_idx[j * NDim + j]];
+                                  }
+                                  if constexpr (MPOrder > 2u) {
+                                      for (std::size_t j1 = 0; j1 < NDim; ++j1) {
+                                          for (std::size_t j2 = 0; j2 < NDim; ++j2) {
+                                              mp[mp_o_tr_off + j1]
+                                                  += mp[mp_o_idx[(j1 * NDim + j2) * NDim + j2]];
+                                          }
+                                      }
+                                  }
+                              }
+                          });
     }
     // Discretize the coordinates of the particle at index idx. The result will
     // be written into retval.
@@ -1045,6 +1369,190 @@ private:
             }
         }
     }
+    // In periodic mode, bring the coordinates of the particles into the [-box_size/2, box_size/2) range
+    // by adding integral multiples of the box size. Otherwise, this function does nothing.
+    // NOTE: non-finite coordinates are left untouched, they will be reported later by disc_coords().
+    void periodic_wrap()
+    {
+        if (!m_periodic) {
+            return;
+        }
+        for (std::size_t j = 0; j < NDim; ++j) {
+            tbb::parallel_for(tbb::blocked_range(size_type(0), nparts()), [this, j](const auto &range) {
+                const auto box_size = m_box_size, half_box_size = box_size / F(2);
+                const auto c_ptr = m_parts[j].data();
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    auto x = c_ptr[i];
+                    if (rakau_unlikely(!std::isfinite(x))) {
+                        continue;
+                    }
+                    x -= box_size * std::floor(x / box_size + F(.5));
+                    // NOTE: because of round-off errors, the result might end up on the upper
+                    // boundary of the box (or marginally outside its lower boundary), in which
+                    // case we replace it with its periodic image on the lower boundary.
+                    if (x / box_size + F(.5) >= F(1) || x < -half_box_size) {
+                        x = -half_box_size;
+                    }
+                    c_ptr[i] = x;
+                }
+            });
+        }
+    }
+    // Apply the minimum image convention to the coordinate difference d (either a scalar
+    // or a simd batch), that is, bring d into the [-box_size/2, box_size/2] range by adding
+    // an integral multiple of the box size. To be used only in periodic mode.
+    // NOTE: in the vectorised self interactions kernel, this is applied also to the coordinates of the
+    // padding particles of the last tile, which are thus folded back into the box and may overlap with
+    // a real particle. Their contributions are selected out in the kernel (see tree_self_interactions_simd()).
+    template <typename T>
+    T min_image(const T &d) const
+    {
+        assert(m_periodic);
+        if constexpr (std::is_same_v<T, F>) {
+            return d - m_box_size * std::nearbyint(d / m_box_size);
+        } else {
+            const T box_size(m_box_size);
+            return d - box_size * xsimd::nearbyint(d / box_size);
+        }
+    }
+    // Flag to signal that the interactions with the periodic images are computed via the Ewald corrections.
+    // This is the case in periodic mode, unless the TreePM mode is active (the PM solver accounts for the
+    // periodic images in the long-range part of the interactions).
+    bool use_ewald() const
+    {
+        return m_periodic && !m_pm_grid;
+    }
+    // The splitting scale of the TreePM mode (see pm.hpp).
+    F pm_rs() const
+    {
+        assert(m_pm_grid);
+        return static_cast<F>(pm_asmth) * m_box_size / static_cast<F>(m_pm_grid);
+    }
+    // The inverse of twice the splitting scale of the TreePM mode (zero if the TreePM mode is disabled).
+    F pm_inv_2rs() const
+    {
+        return m_pm_grid ? F(1) / (F(2) * pm_rs()) : F(0);
+    }
+    // The short-range factors of the TreePM mode at the square distance(s) dist2 (either a scalar or a simd
+    // batch). The Newtonian accelerations and potentials are multiplied by, respectively, erfc(x) + 2 x / sqrt(pi)
+    // exp(-x**2) and erfc(x), where x = r / (2 rs) and rs is the splitting scale (see pm.hpp). inv_2rs is the
+    // value returned by pm_inv_2rs().
+    // NOTE: the factors are evaluated at the softened distance.
+    template <typename T>
+    static std::array<T, 2> pm_sr_factors(const T &dist2, const T &inv_2rs)
+    {
+        if constexpr (std::is_same_v<T, F>) {
+            const auto x = std::sqrt(dist2) * inv_2rs, ec = std::erfc(x);
+            return {fma_wrap(F(1.1283791670955125739) * x, std::exp(-x * x), ec), ec};
+        } else {
+            const auto x = xsimd_sqrt(dist2) * inv_2rs, ec = xsimd::erfc(x);
+            return {xsimd_fma(T(F(1.1283791670955125739)) * x, xsimd::exp(-x * x), ec), ec};
+        }
+    }
+    // The square of the softening length for the interaction between particles with softening lengths e1
+    // and e2 (either scalars or simd batches), when per-particle softening lengths are in use. The larger
+    // of the two lengths is used, so that the interaction is symmetric.
+    template <typename T>
+    static T pair_eps2(const T &e1, const T &e2)
+    {
+        if constexpr (std::is_same_v<T, F>) {
+            const auto e = std::max(e1, e2);
+            return e * e;
+        } else {
+            const auto e = xsimd::max(e1, e2);
+            return e * e;
+        }
+    }
+    // The polynomials of the compact-support softening kernels at q = r / h (either a scalar or a simd batch),
+    // where h is the radius of the support and 0 <= q < 1. Within the support, the accelerations and the potentials
+    // are computed from the Newtonian ones replacing 1 / r**3 with the first polynomial divided by h**3,
+    // and 1 / r with the second polynomial divided by h. Both polynomials are 1 for q = 1.
+    template <typename T>
+    static std::array<T, 2> sk_polys(const T &q)
+    {
+        const auto q2 = q * q;
+        if constexpr (SK == softening_kernel::spline) {
+            // The inner (q < 1/2) and the outer branches of the spline.
+            auto inner = [&q, &q2]() -> std::array<T, 2> {
+                return {T(F(32) / 3) + q2 * (T(F(32)) * q - T(F(192) / 5)),
+                        T(F(14) / 5) + q2 * (T(F(-16) / 3) + q2 * (T(F(48) / 5) - T(F(32) / 5) * q))};
+            };
+            auto outer = [&q, &q2]() -> std::array<T, 2> {
+                const auto inv_q = T(F(1)) / q;
+                return {T(F(64) / 3) + q * (T(F(-48)) + q * (T(F(192) / 5) - T(F(32) / 3) * q))
+                            - T(F(1) / 15) * inv_q * inv_q * inv_q,
+                        T(F(16) / 5) - T(F(1) / 15) * inv_q
+                            + q2 * (T(F(-32) / 3) + q * (T(F(16)) + q * (T(F(-48) / 5) + T(F(32) / 15) * q)))};
+            };
+            if constexpr (std::is_same_v<T, F>) {
+                return q < F(.5) ? inner() : outer();
+            } else {
+                // NOTE: the outer branch is not finite for q = 0, but it is discarded by the selection.
+                const auto mask = q < T(F(.5));
+                const auto in = inner(), out = outer();
+                return {xsimd::select(mask, in[0], out[0]), xsimd::select(mask, in[1], out[1])};
+            }
+        } else {
+            static_assert(SK == softening_kernel::wendland_c2);
+            return {T(F(14)) + q2 * (T(F(-84)) + q * (T(F(140)) + q * (T(F(-90)) + T(F(21)) * q))),
+                    T(F(3)) + q2 * (T(F(-7)) + q2 * (T(F(21)) + q * (T(F(-28)) + q * (T(F(15)) - T(F(3)) * q))))};
+        }
+    }
+    // The distance factors of the interactions at the square distance(s) dist2 (either a scalar or a simd batch).
+    // The return value contains the values by which the masses are divided in the computation of, respectively,
+    // the accelerations (dist**3) and the potentials (dist). In the simd case, the values are those of simd_dist3()
+    // and simd_dist() (i.e., the inverse values if the fast inverse sqrt is available), and only the factors
+    // needed for Q are computed. With the Plummer kernel, dist2 must include the square of the softening length.
+    // With the compact-support kernels, dist2 is the Newtonian square distance and h2 the square of the radius of
+    // the support: the kernel polynomials are evaluated only if dist2 < h2 (for at least one lane, in the simd case).
+    template <unsigned Q, typename T>
+    static std::array<T, 2> soft_dists(const T &dist2, [[maybe_unused]] const T &h2)
+    {
+        std::array<T, 2> retval;
+        if constexpr (std::is_same_v<T, F>) {
+            if constexpr (compact_sk) {
+                if (dist2 < h2) {
+                    const auto h = std::sqrt(h2);
+                    const auto p = sk_polys(std::sqrt(dist2) / h);
+                    return {h2 * h / p[0], h / p[1]};
+                }
+            }
+            const auto dist = std::sqrt(dist2);
+            retval = {dist2 * dist, dist};
+        } else {
+            if constexpr (Q == 0u || Q == 2u) {
+                retval[0] = simd_dist3(dist2);
+            }
+            if constexpr (Q == 1u || Q == 2u) {
+                retval[1] = simd_dist(dist2);
+            }
+            if constexpr (compact_sk) {
+                const auto mask = dist2 < h2;
+                if (xsimd::any(mask)) {
+                    // NOTE: the lanes outside the support may produce non-finite values
+                    // here (e.g., if h2 is zero), but they are discarded by the selection.
+                    const auto h = xsimd_sqrt(h2);
+                    const auto p = sk_polys(xsimd_sqrt(dist2) / h);
+                    if constexpr (Q == 0u || Q == 2u) {
+                        if constexpr (use_fast_inv_sqrt<T>) {
+                            const auto inv_h = T(F(1)) / h;
+                            retval[0] = xsimd::select(mask, p[0] * inv_h * inv_h * inv_h, retval[0]);
+                        } else {
+                            retval[0] = xsimd::select(mask, h2 * h / p[0], retval[0]);
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        if constexpr (use_fast_inv_sqrt<T>) {
+                            retval[1] = xsimd::select(mask, p[1] / h, retval[1]);
+                        } else {
+                            retval[1] = xsimd::select(mask, h / p[1], retval[1]);
+                        }
+                    }
+                }
+            }
+        }
+        return retval;
+    }
     // Small helper to determine m_inv_perm based on the indirect sorting vector m_perm.
     // This is used when (re)building the tree.
     void perm_to_inv_perm()
@@ -1065,13 +1573,17 @@ private:
     // Indirect code sort. The input range, which must point to values of type size_type,
     // will be sorted so that, after sorting, [m_codes[*begin], m_codes[*(begin + 1)], ... ]
     // yields the values in m_codes in ascending order. This is used when (re)building the tree.
+    // NOTE: tbb::parallel_sort() is not stable, and the relative order of equal codes would
+    // depend on the partitioning of the sort among the threads. The ties are thus broken by
+    // index, so that the internal order of the particles (and, with it, the order of the
+    // summations) is the same regardless of the number of threads.
     template <typename It>
     void indirect_code_sort(It begin, It end) const
     {
         static_assert(std::is_same_v<size_type, it_value_type<It>>);
         simple_timer st("indirect code sorting");
         tbb::parallel_sort(begin, end, [codes_ptr = m_codes.data()](const size_type &idx1, const size_type &idx2) {
-            return codes_ptr[idx1] < codes_ptr[idx2];
+            return codes_ptr[idx1] < codes_ptr[idx2] || (codes_ptr[idx1] == codes_ptr[idx2] && idx1 < idx2);
         });
     }
     // Determine the box size from an input sequence of iterators representing the coordinates and
@@ -1128,9 +1640,12 @@ private:
     // case we will be moving particle data into the tree). In the latter case, N is expected to be zero.
     // NOTE: if PData is an array of iterators, the iterator type needs to be a random access iterator,
     // as we need to index into it for parallel iteration.
-    template <typename PData>
+    // EpsIt is either std::nullptr_t (no per-particle softening lengths) or a random access iterator
+    // to the softening lengths of the particles.
+    template <typename PData, typename EpsIt>
     void construct_impl(const F &box_size, bool box_size_deduced, PData &&p_data, [[maybe_unused]] const size_type &N,
-                        const size_type &max_leaf_n, const size_type &ncrit)
+                        const size_type &max_leaf_n, const size_type &ncrit, bool periodic,
+                        const size_type &pm_grid, [[maybe_unused]] const EpsIt &eps_parts)
     {
         simple_timer st("overall tree construction");
 
@@ -1142,6 +1657,8 @@ private:
         m_box_size_deduced = box_size_deduced;
         m_max_leaf_n = max_leaf_n;
         m_ncrit = ncrit;
+        m_periodic = periodic;
+        m_pm_grid = pm_grid;
 
         // Param consistency checks: if size is deduced, box_size must be zero.
         assert(!m_box_size_deduced || m_box_size == F(0));
@@ -1162,6 +1679,36 @@ private:
             throw std::invalid_argument("The critical number of particles for the vectorised computation of the "
                                         "potentials/accelerations must be nonzero");
         }
+        // Check the periodic boundary conditions.
+        if (m_periodic) {
+            if constexpr (NDim != 3u) {
+                throw std::invalid_argument("Periodic boundary conditions are supported only in 3D, but the tree has "
+                                            + std::to_string(NDim) + " dimensions");
+            }
+            if (m_box_size_deduced || m_box_size == F(0)) {
+                throw std::invalid_argument(
+                    "A nonzero box size must be specified explicitly when using periodic boundary conditions");
+            }
+            // NOTE: compute the lookup table of the Ewald corrections here (if needed), rather
+            // than in the middle of the first computation of the accelerations/potentials.
+            ewald_table();
+        }
+        // Check the TreePM mode.
+        if (m_pm_grid) {
+            if (!m_periodic) {
+                throw std::invalid_argument("The TreePM mode requires periodic boundary conditions");
+            }
+            if (m_pm_grid < 16u || (m_pm_grid & (m_pm_grid - 1u))) {
+                throw std::invalid_argument("The number of cells per dimension of the PM mesh must be a power of 2 "
+                                            "not smaller than 16, but it is "
+                                            + std::to_string(m_pm_grid) + " instead");
+            }
+            if constexpr (MPOrder > 1u) {
+                throw std::invalid_argument("The TreePM mode is supported only for a multipole order of 1, but the "
+                                            "multipole order of the tree is "
+                                            + std::to_string(MPOrder));
+            }
+        }
 
         if constexpr (move_data) {
             // We can move in the input data.
@@ -1224,12 +1771,43 @@ private:
                               tbb::simple_partitioner());
         }
 
+        // Copy in the per-particle softening lengths, if provided.
+        if constexpr (!std::is_same_v<EpsIt, std::nullptr_t>) {
+            it_diff_check<EpsIt>(nparts());
+            m_eps.resize(boost::numeric_cast<decltype(m_eps.size())>(nparts()));
+            // NOTE: the copy returns the smallest index of an invalid softening length
+            // (or nparts(), if all the values are valid), so that the error reported
+            // below does not depend on how the range is split among the threads.
+            const auto bad_idx = tbb::parallel_reduce(
+                tbb::blocked_range(size_type(0), nparts(), boost::numeric_cast<size_type>(data_chunking)), nparts(),
+                [this, &eps_parts](const auto &range, size_type cur_bad) {
+                    for (auto i = range.begin(); i != range.end(); ++i) {
+                        const F eps(eps_parts[static_cast<it_diff_type<EpsIt>>(i)]);
+                        if (rakau_unlikely(!std::isfinite(eps) || eps < F(0))) {
+                            return std::min(cur_bad, i);
+                        }
+                        m_eps[i] = eps;
+                    }
+                    return cur_bad;
+                },
+                [](const size_type &a, const size_type &b) { return std::min(a, b); }, tbb::simple_partitioner());
+            if (bad_idx != nparts()) {
+                throw std::invalid_argument("The softening length of the particle at index " + std::to_string(bad_idx)
+                                            + " must be finite and non-negative, but it is "
+                                            + std::to_string(F(eps_parts[static_cast<it_diff_type<EpsIt>>(bad_idx)]))
+                                            + " instead");
+            }
+        }
+
         // Deduce the box size, if needed.
         if (m_box_size_deduced) {
             // NOTE: this function works ok if nparts() == 0.
             m_box_size = determine_box_size(p_its_u(), nparts());
         }
 
+        // Bring the particles into the box, if needed.
+        periodic_wrap();
+
         {
             // Do the Morton encoding.
             simple_timer st_m("morton encoding");
@@ -1262,6 +1840,9 @@ private:
             for (std::size_t j = 0; j < NDim + 1u; ++j) {
                 tg.run([this, j]() { apply_isort(m_parts[j], m_perm); });
             }
+            if (!m_eps.empty()) {
+                tg.run([this]() { apply_isort(m_eps, m_perm); });
+            }
             // Establish the inverse permutation vector.
             tg.run([this]() { perm_to_inv_perm(); });
             // Copy over m_perm to m_last_perm.
@@ -1315,7 +1896,9 @@ private:
 
 public:
     // Default constructor.
-    tree() : m_box_size(0), m_box_size_deduced(false), m_max_leaf_n(default_max_leaf_n), m_ncrit(default_ncrit)
+    tree()
+        : m_box_size(0), m_box_size_deduced(false), m_max_leaf_n(default_max_leaf_n), m_ncrit(default_ncrit),
+          m_periodic(false), m_pm_grid(0)
     {
         rocm_init_state();
     }
@@ -1348,7 +1931,24 @@ private:
             ncrit = boost::numeric_cast<size_type>(p(kwargs::ncrit));
         }
 
-        return std::tuple{box_size, box_size_deduced, max_leaf_n, ncrit};
+        // Handle the periodic boundary conditions.
+        bool periodic = false;
+        if constexpr (p.has(kwargs::periodic)) {
+            periodic = p(kwargs::periodic);
+        }
+
+        // Handle the size of the mesh of the TreePM mode.
+        size_type pm_grid = 0;
+        if constexpr (p.has(kwargs::pm_grid)) {
+            pm_grid = boost::numeric_cast<size_type>(p(kwargs::pm_grid));
+        }
+
+        // Handle the per-particle softening lengths (represented as std::nullptr_t if not provided).
+        if constexpr (p.has(kwargs::eps_parts)) {
+            return std::tuple{box_size, box_size_deduced, max_leaf_n, ncrit, periodic, pm_grid, p(kwargs::eps_parts)};
+        } else {
+            return std::tuple{box_size, box_size_deduced, max_leaf_n, ncrit, periodic, pm_grid, nullptr};
+        }
     }
 
 public:
@@ -1357,10 +1957,11 @@ public:
     explicit tree(const std::array<It, NDim + 1u> &cm_it, const size_type &N, KwArgs &&... args)
     {
         // Parse the named arguments.
-        const auto [box_size, box_size_deduced, max_leaf_n, ncrit] = parse_ctor_kwargs(std::forward<KwArgs>(args)...);
+        const auto [box_size, box_size_deduced, max_leaf_n, ncrit, periodic, pm_grid, eps_parts]
+            = parse_ctor_kwargs(std::forward<KwArgs>(args)...);
 
         // Do the actual construction.
-        construct_impl(box_size, box_size_deduced, cm_it, N, max_leaf_n, ncrit);
+        construct_impl(box_size, box_size_deduced, cm_it, N, max_leaf_n, ncrit, periodic, pm_grid, eps_parts);
 
         // NOTE: perhaps we can fold this into construct_impl() eventually.
         rocm_init_state();
@@ -1425,29 +2026,44 @@ public:
     explicit tree(std::array<f_vector<F>, NDim + 1u> &&coords, KwArgs &&... args)
     {
         // Parse the named arguments.
-        const auto [box_size, box_size_deduced, max_leaf_n, ncrit] = parse_ctor_kwargs(std::forward<KwArgs>(args)...);
+        const auto [box_size, box_size_deduced, max_leaf_n, ncrit, periodic, pm_grid, eps_parts]
+            = parse_ctor_kwargs(std::forward<KwArgs>(args)...);
 
         // Do the actual construction.
-        construct_impl(box_size, box_size_deduced, std::move(coords), 0, max_leaf_n, ncrit);
+        construct_impl(box_size, box_size_deduced, std::move(coords), 0, max_leaf_n, ncrit, periodic, pm_grid,
+                       eps_parts);
 
         // NOTE: perhaps we can fold this into construct_impl() eventually.
         rocm_init_state();
     }
     tree(const tree &other)
         : m_box_size(other.m_box_size), m_box_size_deduced(other.m_box_size_deduced), m_max_leaf_n(other.m_max_leaf_n),
-          m_ncrit(other.m_ncrit), m_parts(other.m_parts), m_codes(other.m_codes), m_perm(other.m_perm),
-          m_last_perm(other.m_last_perm), m_inv_perm(other.m_inv_perm), m_tree(other.m_tree),
-          m_crit_nodes(other.m_crit_nodes)
+          m_ncrit(other.m_ncrit), m_periodic(other.m_periodic), m_pm_grid(other.m_pm_grid), m_parts(other.m_parts),
+          m_eps(other.m_eps), m_codes(other.m_codes), m_perm(other.m_perm), m_last_perm(other.m_last_perm),
+          m_inv_perm(other.m_inv_perm), m_tree(other.m_tree), m_crit_nodes(other.m_crit_nodes),
+          m_crit_idx(other.m_crit_idx), m_multipoles(other.m_multipoles), m_ewald_tr(other.m_ewald_tr),
+          m_tree_gen(other.m_tree_gen), m_ilist(other.ilist_copy())
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+          ,
+          m_simd_isa(other.m_simd_isa)
+#endif
     {
         // We made deep copies from other, setup the views.
         rocm_init_state();
     }
     tree(tree &&other) noexcept
         : m_box_size(other.m_box_size), m_box_size_deduced(other.m_box_size_deduced), m_max_leaf_n(other.m_max_leaf_n),
-          m_ncrit(other.m_ncrit), m_parts(std::move(other.m_parts)), m_codes(std::move(other.m_codes)),
+          m_ncrit(other.m_ncrit), m_periodic(other.m_periodic), m_pm_grid(other.m_pm_grid),
+          m_parts(std::move(other.m_parts)), m_eps(std::move(other.m_eps)), m_codes(std::move(other.m_codes)),
           m_perm(std::move(other.m_perm)), m_last_perm(std::move(other.m_last_perm)),
           m_inv_perm(std::move(other.m_inv_perm)), m_tree(std::move(other.m_tree)),
-          m_crit_nodes(std::move(other.m_crit_nodes))
+          m_crit_nodes(std::move(other.m_crit_nodes)), m_crit_idx(std::move(other.m_crit_idx)),
+          m_multipoles(std::move(other.m_multipoles)), m_ewald_tr(std::move(other.m_ewald_tr)),
+          m_tree_gen(other.m_tree_gen), m_ilist(std::move(other.m_ilist))
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+          ,
+          m_simd_isa(other.m_simd_isa)
+#endif
     {
         // Make sure other is left in a known state, otherwise we might
         // have in principle assertions failures in the destructor of other
@@ -1475,13 +2091,24 @@ public:
                 m_box_size_deduced = other.m_box_size_deduced;
                 m_max_leaf_n = other.m_max_leaf_n;
                 m_ncrit = other.m_ncrit;
+                m_periodic = other.m_periodic;
+                m_pm_grid = other.m_pm_grid;
                 m_parts = other.m_parts;
+                m_eps = other.m_eps;
                 m_codes = other.m_codes;
                 m_perm = other.m_perm;
                 m_last_perm = other.m_last_perm;
                 m_inv_perm = other.m_inv_perm;
                 m_tree = other.m_tree;
                 m_crit_nodes = other.m_crit_nodes;
+                m_crit_idx = other.m_crit_idx;
+                m_multipoles = other.m_multipoles;
+                m_ewald_tr = other.m_ewald_tr;
+                m_tree_gen = other.m_tree_gen;
+                m_ilist = other.ilist_copy();
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+                m_simd_isa = other.m_simd_isa;
+#endif
 
                 // Re-init the views.
                 rocm_init_state();
@@ -1508,13 +2135,24 @@ public:
             m_box_size_deduced = other.m_box_size_deduced;
             m_max_leaf_n = other.m_max_leaf_n;
             m_ncrit = other.m_ncrit;
+            m_periodic = other.m_periodic;
+            m_pm_grid = other.m_pm_grid;
             m_parts = std::move(other.m_parts);
+            m_eps = std::move(other.m_eps);
             m_codes = std::move(other.m_codes);
             m_perm = std::move(other.m_perm);
             m_last_perm = std::move(other.m_last_perm);
             m_inv_perm = std::move(other.m_inv_perm);
             m_tree = std::move(other.m_tree);
             m_crit_nodes = std::move(other.m_crit_nodes);
+            m_crit_idx = std::move(other.m_crit_idx);
+            m_multipoles = std::move(other.m_multipoles);
+            m_ewald_tr = std::move(other.m_ewald_tr);
+            m_tree_gen = other.m_tree_gen;
+            m_ilist = std::move(other.m_ilist);
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+            m_simd_isa = other.m_simd_isa;
+#endif
             // Make sure other is left in an empty state, otherwise we might
             // have in principle assertion failures in the destructor of other
             // in debug mode.
@@ -1541,6 +2179,8 @@ public:
         }
         // Same number of particles and codes.
         assert(m_parts[0].size() == m_codes.size());
+        // The per-particle softening lengths, if present, are one per particle.
+        assert(m_eps.empty() || m_eps.size() == m_parts[0].size());
         // Codes are sorted.
         assert(std::is_sorted(m_codes.begin(), m_codes.end()));
         // The size of m_perm, m_last_perm and m_inv_perm is the number of particles.
@@ -1587,15 +2227,22 @@ public:
         m_box_size_deduced = false;
         m_max_leaf_n = default_max_leaf_n;
         m_ncrit = default_ncrit;
+        m_periodic = false;
+        m_pm_grid = 0;
         for (auto &p : m_parts) {
             p.clear();
         }
+        m_eps.clear();
         m_codes.clear();
         m_perm.clear();
         m_last_perm.clear();
         m_inv_perm.clear();
         m_tree.clear();
         m_crit_nodes.clear();
+        m_crit_idx.clear();
+        m_multipoles.clear();
+        m_ewald_tr.clear();
+        m_ilist.clear();
 
         // Re-init the views with the new (empty) data.
         rocm_init_state();
@@ -1607,6 +2254,10 @@ public:
         static_assert(unsigned(std::numeric_limits<UInt>::digits) <= std::numeric_limits<std::size_t>::max());
         const auto n_nodes = m_tree.size();
         os << "Box size                 : " << m_box_size << (m_box_size_deduced ? " (deduced)" : "") << '\n';
+        os << "Periodic                 : " << (m_periodic ? "yes" : "no") << '\n';
+        os << "PM mesh size             : " << m_pm_grid << (m_pm_grid ? "" : " (TreePM disabled)") << '\n';
+        os << "Softening kernel         : " << softening_kernel_name(SK) << '\n';
+        os << "Per-particle softening   : " << (m_eps.empty() ? "no" : "yes") << '\n';
         os << "Total number of particles: " << m_codes.size() << '\n';
         os << "Total number of nodes    : " << n_nodes << "\n\n";
         if (!n_nodes) {
@@ -1694,11 +2345,129 @@ private:
         static thread_local std::array<f_vector<F>, nvecs_res<Q>> tmp_res;
         return tmp_res;
     }
-    // Temporary vectors to store the data of a target node during traversal.
-    static auto &tgt_tmp_data()
+    // Compensation terms of the accelerations/potentials of a critical node in the mixed-precision mode
+    // (see res_ptrs_type).
+    template <unsigned Q>
+    static auto &acc_pot_tmp_cmp()
+    {
+        static thread_local std::array<f_vector<F>, nvecs_res<Q>> tmp_cmp;
+        return tmp_cmp;
+    }
+    // Pointers to the buffers in which the accelerations/potentials on the particles of a target node are
+    // accumulated. If Mixed is true (i.e., in the mixed-precision mode, see acc_pot_cnode()), cmp points to the
+    // compensation terms of the sums: each sum is then kept as the unevaluated sum of two values in F, and the
+    // contribution of each source node is added to it with an error-free transformation (see res_store()).
+    // Otherwise, cmp is unused.
+    // NOTE: the kernels are templated over the type of the pointers, so that the plain mode
+    // does not pay for the checks of the mixed-precision mode.
+    template <unsigned Q, bool Mixed>
+    struct res_ptrs_type : std::array<F *, nvecs_res<Q>> {
+        static constexpr bool mixed = Mixed;
+        std::array<F *, nvecs_res<Q>> cmp;
+    };
+    // Load the accumulated value j of the target particles starting at index i, to which the kernels add the
+    // contribution of a source node before storing it back via res_store(). B is either F or a SIMD batch type,
+    // in which case n is the number of elements from i to the end of the target node (see tgt_load()).
+    // NOTE: in the mixed-precision mode this returns zero, so that the kernels compute only the contribution
+    // of the source node, which is then added to the compensated sum by res_store().
+    template <typename B, typename R>
+    static B res_load(const R &res_ptrs, std::size_t j, size_type i, size_type n)
+    {
+        if constexpr (R::mixed) {
+            ignore(res_ptrs, j, i, n);
+            return B(F(0));
+        } else if constexpr (std::is_same_v<B, F>) {
+            ignore(n);
+            return res_ptrs[j][i];
+        } else {
+            return tgt_load<B>(res_ptrs[j] + i, n);
+        }
+    }
+    // Store the accumulated value j of the target particles starting at index i (see res_load()). In the
+    // mixed-precision mode, x is added to the compensated sum via the TwoSum algorithm (Knuth): the rounding
+    // error of the sum in F is computed exactly and accumulated into the compensation term. The error of the
+    // result is then of the order of eps_F**2 times the sum of the absolute values of the contributions
+    // (eps_F being the machine epsilon of F), plus the error of the final conversion in acc_pot_cnode().
+    template <typename B, typename R>
+    static void res_store(const R &res_ptrs, std::size_t j, size_type i, size_type n, const B &x)
+    {
+        auto load = [n](const F *ptr) {
+            if constexpr (std::is_same_v<B, F>) {
+                return *ptr;
+            } else {
+                return tgt_load<B>(ptr, n);
+            }
+        };
+        auto store = [n](F *ptr, const B &y) {
+            if constexpr (std::is_same_v<B, F>) {
+                *ptr = y;
+            } else {
+                tgt_store(ptr, n, y);
+            }
+        };
+        if constexpr (R::mixed) {
+            const auto a = load(res_ptrs[j] + i);
+            const auto s = a + x;
+            const auto x_virt = s - a;
+            const auto err = (a - (s - x_virt)) + (x - x_virt);
+            store(res_ptrs[j] + i, s);
+            store(res_ptrs.cmp[j] + i, load(res_ptrs.cmp[j] + i) + err);
+        } else {
+            store(res_ptrs[j] + i, x);
+        }
+    }
+    // Add the value x, computed in acc_fp_type, to the accumulated value j of the target particle at index i.
+    template <typename R>
+    static void res_add_acc(const R &res_ptrs, std::size_t j, size_type i, acc_fp_type x)
+    {
+        if constexpr (R::mixed) {
+            // NOTE: x is split into two values in F, which are added to the two terms of the compensated sum.
+            const auto hi = static_cast<F>(x);
+            res_store(res_ptrs, j, i, 1, hi);
+            res_ptrs.cmp[j][i] += static_cast<F>(x - hi);
+        } else {
+            res_ptrs[j][i] = static_cast<F>(acc_fp_type(res_ptrs[j][i]) + x);
+        }
+    }
+    // Temporary vector to accumulate the bounds of the truncation errors
+    // of the accelerations of the particles of a critical node.
+    static auto &acc_pot_tmp_err()
+    {
+        static thread_local std::vector<F> tmp_err;
+        return tmp_err;
+    }
+    // Temporary vector to store the data for the relative opening criterion
+    // of a target node during traversal.
+    static auto &tgt_tmp_rel_data()
+    {
+        static thread_local f_vector<F> tmp_rel;
+        return tmp_rel;
+    }
+    // Batch of source particles for the evaluation of the opened leaves. Instead of running the leaf kernel
+    // for each opened leaf (which, with typical leaf sizes, results in very short inner loops), the particles
+    // of the opened leaves are appended to the batch, and the interactions are computed once the batch is full.
+    // ptrs are pointers to the coordinates/masses in the batch (with room for leaf_batch_max particles), eps
+    // a pointer to their softening lengths (null if per-particle softening lengths are not in use), size
+    // the number of particles currently in the batch. The storage is aligned and, when SIMD is enabled, it is
+    // padded to a multiple of the SIMD batch size before the evaluation, so that the source particles can be read
+    // with full-width aligned loads (see tree_acc_pot_batch_simd()).
+    // NOTE: the padding is added only at the end of the batch, rather than after each leaf, as
+    // the leaves don't need to start at an aligned position in the batch.
+    struct leaf_batch_type {
+        std::array<F *, NDim + 1u> ptrs;
+        F *eps;
+        size_type size;
+    };
+    // NOTE: this is large enough to make the inner loop of the kernel long, while keeping the source
+    // particles and a target node of typical size in the L1 cache.
+    static constexpr size_type leaf_batch_max = 512;
+    // Temporary vectors to accumulate the particles of the source leaves opened
+    // during the traversal of a target node (see leaf_batch_type). The last vector
+    // is used for the softening lengths.
+    static auto &leaf_batch_data()
     {
-        static thread_local std::array<f_vector<F>, NDim + 1u> tmp_tgt;
-        return tmp_tgt;
+        static thread_local std::array<f_vector<F>, NDim + 2u> tmp_lb;
+        return tmp_lb;
     }
     // Compute the element-wise accelerations on the batch of particles at xvec1, yvec1, zvec1 by the
     // particles at xvec2, yvec2, zvec2 with masses mvec2, and add the result into res_x_vec, res_y_vec,
@@ -1764,237 +2533,698 @@ private:
         // NOTE: need a negated FMA for the potential.
         res_pot_vec = xsimd_fnma(mvec1, m2_dist, res_pot_vec);
     }
-    // Function to compute the self-interactions within a target node. eps2 is the square of the softening length,
-    // tgt_size is the number of particles in the target node, p_ptrs pointers to the target particles'
-    // coordinates/masses, res_ptrs pointers to the output arrays. Q indicates which quantities will be computed
-    // (accs, potentials, or both).
-    template <unsigned Q>
-    void tree_self_interactions(F eps2, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
-                                const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+    // Compute the contributions of the higher-order multipole moments mp of a source node to the accelerations
+    // and/or to the potential (per unit of mass) at the positions r, relative to the COM of the source node.
+    // inv_dist is 1/R and inv_dist2 1/R**2, where R is the softened distance from the COM. The results are
+    // accumulated into acc and pot. B can be either a scalar or a SIMD batch type.
+    template <unsigned Q, typename B>
+    static void mp_acc_pot(const F *mp, const std::array<B, NDim> &r, B inv_dist, B inv_dist2,
+                           std::array<B, NDim> &acc, B &pot)
     {
-        if constexpr (simd_enabled && NDim == 3u) {
-            // xsimd batch type.
-            using batch_type = xsimd::simd_type<F>;
-            // Size of batch_type.
-            constexpr auto batch_size = batch_type::size;
-            // Shortcuts to the node coordinates/masses.
-            const auto [x_ptr, y_ptr, z_ptr, m_ptr] = p_ptrs;
-            // Softening length, vector version.
-            const batch_type eps2_vec(eps2);
-            if constexpr (Q == 0u) {
-                // Q == 0, accelerations only.
-                //
-                // Shortcuts to the result vectors.
-                const auto [res_x, res_y, res_z] = res_ptrs;
-                for (size_type i1 = 0; i1 < tgt_size; i1 += batch_size) {
-                    // Load the first batch of particles.
-                    const auto xvec1 = xsimd::load_aligned(x_ptr + i1), yvec1 = xsimd::load_aligned(y_ptr + i1),
-                               zvec1 = xsimd::load_aligned(z_ptr + i1), mvec1 = xsimd::load_aligned(m_ptr + i1);
-                    // Init the accumulators for the accelerations on the first batch of particles.
-                    batch_type res_x_vec1(F(0)), res_y_vec1(F(0)), res_z_vec1(F(0));
-                    // Now we iterate over the node particles starting 1 position past i1 (to avoid self interactions).
-                    // This is the classical n body inner loop.
-                    for (size_type i2 = i1 + 1u; i2 < tgt_size; ++i2) {
-                        // Load the second batch of particles.
-                        const auto xvec2 = xsimd::load_unaligned(x_ptr + i2), yvec2 = xsimd::load_unaligned(y_ptr + i2),
-                                   zvec2 = xsimd::load_unaligned(z_ptr + i2), mvec2 = xsimd::load_unaligned(m_ptr + i2);
-                        // NOTE: now we are going to do a slight repetition of batch_batch_3d_accs(), with the goal
-                        // of avoiding doing extra needless computations.
-                        // Compute the relative positions of 2 wrt 1, and the distance square.
-                        const auto diff_x = xvec2 - xvec1, diff_y = yvec2 - yvec1, diff_z = zvec2 - zvec1,
-                                   dist2 = diff_x * diff_x + diff_y * diff_y + xsimd_fma(diff_z, diff_z, eps2_vec);
-                        // Compute m1/dist3 and m2/dist3.
-                        batch_type m1_dist3, m2_dist3;
-                        if constexpr (use_fast_inv_sqrt<batch_type>) {
-                            const auto tmp = inv_sqrt_3(dist2);
-                            m1_dist3 = mvec1 * tmp;
-                            m2_dist3 = mvec2 * tmp;
-                        } else {
-                            // NOTE: here it might be beneficial to compute 1/sqrt()
-                            // and get rid of a division, paying instead a couple of extra
-                            // multiplications. To be benchmarked.
-                            const auto dist = xsimd_sqrt(dist2);
-                            const auto dist3 = dist * dist2;
-                            m1_dist3 = mvec1 / dist3;
-                            m2_dist3 = mvec2 / dist3;
-                        }
-                        // Add to the accumulators for 1 the accelerations due to the batch 2.
-                        res_x_vec1 = xsimd_fma(diff_x, m2_dist3, res_x_vec1);
-                        res_y_vec1 = xsimd_fma(diff_y, m2_dist3, res_y_vec1);
-                        res_z_vec1 = xsimd_fma(diff_z, m2_dist3, res_z_vec1);
-                        // Add *directly into the result buffer* the acceleration on 2 due to 1.
-                        xsimd_fnma(diff_x, m1_dist3, xsimd::load_unaligned(res_x + i2)).store_unaligned(res_x + i2);
-                        xsimd_fnma(diff_y, m1_dist3, xsimd::load_unaligned(res_y + i2)).store_unaligned(res_y + i2);
-                        xsimd_fnma(diff_z, m1_dist3, xsimd::load_unaligned(res_z + i2)).store_unaligned(res_z + i2);
-                    }
-                    // Add the accumulated acceleration on 1 to the values already in the result buffer.
-                    (xsimd::load_aligned(res_x + i1) + res_x_vec1).store_aligned(res_x + i1);
-                    (xsimd::load_aligned(res_y + i1) + res_y_vec1).store_aligned(res_y + i1);
-                    (xsimd::load_aligned(res_z + i1) + res_z_vec1).store_aligned(res_z + i1);
-                }
-            } else if constexpr (Q == 1u) {
-                // Q == 1, potentials only.
-                //
-                // Shortcut to the result vector.
-                const auto res = res_ptrs[0];
-                for (size_type i1 = 0; i1 < tgt_size; i1 += batch_size) {
-                    // Load the first batch of particles.
-                    const auto xvec1 = xsimd::load_aligned(x_ptr + i1), yvec1 = xsimd::load_aligned(y_ptr + i1),
-                               zvec1 = xsimd::load_aligned(z_ptr + i1), mvec1 = xsimd::load_aligned(m_ptr + i1);
-                    // Init the accumulator for the potential on the first batch of particles.
-                    batch_type res_vec(F(0));
-                    // Now we iterate over the node particles starting 1 position past i1 (to avoid self interactions).
-                    // This is the classical n body inner loop.
-                    for (size_type i2 = i1 + 1u; i2 < tgt_size; ++i2) {
-                        // Load the second batch of particles.
-                        const auto xvec2 = xsimd::load_unaligned(x_ptr + i2), yvec2 = xsimd::load_unaligned(y_ptr + i2),
-                                   zvec2 = xsimd::load_unaligned(z_ptr + i2), mvec2 = xsimd::load_unaligned(m_ptr + i2);
-                        // NOTE: now we are going to do a slight repetition of batch_batch_3d_pots(), with the goal
-                        // of avoiding doing extra needless computations.
-                        // Compute the relative positions of 2 wrt 1, and the distance square.
-                        const auto diff_x = xvec2 - xvec1, diff_y = yvec2 - yvec1, diff_z = zvec2 - zvec1,
-                                   dist2 = diff_x * diff_x + diff_y * diff_y + xsimd_fma(diff_z, diff_z, eps2_vec);
-                        // Compute m1/dist.
-                        batch_type m1_dist;
-                        if constexpr (use_fast_inv_sqrt<batch_type>) {
-                            m1_dist = mvec1 * inv_sqrt(dist2);
-                        } else {
-                            m1_dist = mvec1 / xsimd_sqrt(dist2);
-                        }
-                        // Compute the mutual (negated) potential between 1 and 2.
-                        const auto mut_pot = m1_dist * mvec2;
-                        // Subtract it from the acccumulator for 1.
-                        res_vec -= mut_pot;
-                        // Subtract *directly from the result buffer* the mutual negated potential for 2.
-                        (xsimd::load_unaligned(res + i2) - mut_pot).store_unaligned(res + i2);
-                    }
-                    // Add the accumulated potentials on 1 from the values already in the result buffer.
-                    // NOTE: we are doing an add here because we already built res_vec with repeated
-                    // subtractions, thus generating a negative value.
-                    (xsimd::load_aligned(res + i1) + res_vec).store_aligned(res + i1);
-                }
-            } else {
-                // Q == 2, accelerations and potentials.
-                //
-                // Shortcuts to the result vectors.
-                const auto [res_x, res_y, res_z, res_pot] = res_ptrs;
-                for (size_type i1 = 0; i1 < tgt_size; i1 += batch_size) {
-                    // Load the first batch of particles.
-                    const auto xvec1 = xsimd::load_aligned(x_ptr + i1), yvec1 = xsimd::load_aligned(y_ptr + i1),
-                               zvec1 = xsimd::load_aligned(z_ptr + i1), mvec1 = xsimd::load_aligned(m_ptr + i1);
-                    // Init the accumulators for the accelerations/potentials on the first batch of particles.
-                    batch_type res_x_vec1(F(0)), res_y_vec1(F(0)), res_z_vec1(F(0)), res_pot_vec(F(0));
-                    // Now we iterate over the node particles starting 1 position past i1 (to avoid self interactions).
-                    // This is the classical n body inner loop.
-                    for (size_type i2 = i1 + 1u; i2 < tgt_size; ++i2) {
-                        // Load the second batch of particles.
-                        const auto xvec2 = xsimd::load_unaligned(x_ptr + i2), yvec2 = xsimd::load_unaligned(y_ptr + i2),
-                                   zvec2 = xsimd::load_unaligned(z_ptr + i2), mvec2 = xsimd::load_unaligned(m_ptr + i2);
-                        // NOTE: now we are going to do a slight repetition of batch_batch_3d_accs_pots(), with the goal
-                        // of avoiding doing extra needless computations.
-                        // Compute the relative positions of 2 wrt 1, and the distance square.
-                        const auto diff_x = xvec2 - xvec1, diff_y = yvec2 - yvec1, diff_z = zvec2 - zvec1,
-                                   dist2 = diff_x * diff_x + diff_y * diff_y + xsimd_fma(diff_z, diff_z, eps2_vec);
-                        // Compute m1/dist, m1/dist3 and m2/dist3.
-                        batch_type m1_dist, m1_dist3, m2_dist3;
-                        if constexpr (use_fast_inv_sqrt<batch_type>) {
-                            const auto tmp = inv_sqrt(dist2);
-                            m1_dist = mvec1 * tmp;
-                            const auto tmp3 = tmp * tmp * tmp;
-                            m1_dist3 = mvec1 * tmp3;
-                            m2_dist3 = mvec2 * tmp3;
-                        } else {
-                            // NOTE: as hinted above in the Q == 0 case, perhaps we can avoid
-                            // some of these divisions.
-                            const auto dist = xsimd_sqrt(dist2);
-                            m1_dist = mvec1 / dist;
-                            const auto dist3 = dist * dist2;
-                            m1_dist3 = mvec1 / dist3;
-                            m2_dist3 = mvec2 / dist3;
-                        }
-                        // Compute the mutual (negated) potential between 1 and 2.
-                        const auto mut_pot = m1_dist * mvec2;
-                        // Add to the accumulators for 1 the accelerations due to the batch 2,
-                        // and subtract the mutual negated potential from the acccumulator for 1.
-                        res_x_vec1 = xsimd_fma(diff_x, m2_dist3, res_x_vec1);
-                        res_y_vec1 = xsimd_fma(diff_y, m2_dist3, res_y_vec1);
-                        res_z_vec1 = xsimd_fma(diff_z, m2_dist3, res_z_vec1);
-                        res_pot_vec -= mut_pot;
-                        // Add *directly into the result buffer* the acceleration on 2 due to 1,
-                        // and subtract the negated potential.
-                        xsimd_fnma(diff_x, m1_dist3, xsimd::load_unaligned(res_x + i2)).store_unaligned(res_x + i2);
-                        xsimd_fnma(diff_y, m1_dist3, xsimd::load_unaligned(res_y + i2)).store_unaligned(res_y + i2);
-                        xsimd_fnma(diff_z, m1_dist3, xsimd::load_unaligned(res_z + i2)).store_unaligned(res_z + i2);
-                        (xsimd::load_unaligned(res_pot + i2) - mut_pot).store_unaligned(res_pot + i2);
-                    }
-                    // Add the accumulated accelerations/potentials on 1 to the values already in the result buffer.
-                    (xsimd::load_aligned(res_x + i1) + res_x_vec1).store_aligned(res_x + i1);
-                    (xsimd::load_aligned(res_y + i1) + res_y_vec1).store_aligned(res_y + i1);
-                    (xsimd::load_aligned(res_z + i1) + res_z_vec1).store_aligned(res_z + i1);
-                    // NOTE: the accumulated potential is added because it was constructed as a negative quantity.
-                    (xsimd::load_aligned(res_pot + i1) + res_pot_vec).store_aligned(res_pot + i1);
+        static_assert(MPOrder > 1u);
+        const B inv_dist3 = inv_dist * inv_dist2, inv_dist5 = inv_dist3 * inv_dist2, inv_dist7 = inv_dist5 * inv_dist2;
+        // Quadrupole: compute S r and r S r, S being the quadrupole tensor.
+        std::array<B, NDim> sr;
+        B rsr(F(0));
+        for (std::size_t j1 = 0; j1 < NDim; ++j1) {
+            sr[j1] = B(F(0));
+            for (std::size_t j2 = 0; j2 < NDim; ++j2) {
+                sr[j1] = gen_fma(B(mp[mp_q_idx[j1 * NDim + j2]]), r[j2], sr[j1]);
+            }
+            rsr = gen_fma(r[j1], sr[j1], rsr);
+        }
+        const B tr_s(mp[mp_q_tr_off]);
+        if constexpr (Q == 0u || Q == 2u) {
+            // a = 3 S r / R**5 + (3/2 tr(S) / R**5 - 15/2 r S r / R**7) r.
+            const B c_sr = B(F(3)) * inv_dist5,
+                    c_r = B(F(3) / F(2)) * tr_s * inv_dist5 - B(F(15) / F(2)) * rsr * inv_dist7;
+            for (std::size_t j = 0; j < NDim; ++j) {
+                acc[j] = gen_fma(c_sr, sr[j], gen_fma(c_r, r[j], acc[j]));
+            }
+        }
+        if constexpr (Q == 1u || Q == 2u) {
+            // phi = tr(S) / (2 R**3) - 3 r S r / (2 R**5).
+            pot = pot + B(F(1) / F(2)) * tr_s * inv_dist3 - B(F(3) / F(2)) * rsr * inv_dist5;
+        }
+        if constexpr (MPOrder > 2u) {
+            // Octupole: compute O r r, O r r r and T r, O being the octupole
+            // tensor and T its trace vector.
+            std::array<B, NDim> orr;
+            B orrr(F(0)), tr(F(0));
+            for (std::size_t j1 = 0; j1 < NDim; ++j1) {
+                orr[j1] = B(F(0));
+                for (std::size_t j2 = 0; j2 < NDim; ++j2) {
+                    B tmp(F(0));
+                    for (std::size_t j3 = 0; j3 < NDim; ++j3) {
+                        tmp = gen_fma(B(mp[mp_o_idx[(j1 * NDim + j2) * NDim + j3]]), r[j3], tmp);
+                    }
+                    orr[j1] = gen_fma(tmp, r[j2], orr[j1]);
                 }
+                orrr = gen_fma(orr[j1], r[j1], orrr);
+                tr = gen_fma(B(mp[mp_o_tr_off + j1]), r[j1], tr);
             }
-        } else {
-            // Pointer to the masses.
-            const auto m_ptr = p_ptrs[NDim];
-            // Temporary vectors to be used in the loops below.
-            std::array<F, NDim> diffs, pos1;
-            for (size_type i1 = 0; i1 < tgt_size; ++i1) {
-                // Load the coords of the current particle.
+            const B inv_dist9 = inv_dist7 * inv_dist2;
+            if constexpr (Q == 0u || Q == 2u) {
+                // a = 15/2 O r r / R**7 - 3/2 T / R**5 + (15/2 T r / R**7 - 35/2 O r r r / R**9) r.
+                const B c_orr = B(F(15) / F(2)) * inv_dist7, c_t = B(F(3) / F(2)) * inv_dist5,
+                        c_r = B(F(15) / F(2)) * tr * inv_dist7 - B(F(35) / F(2)) * orrr * inv_dist9;
                 for (std::size_t j = 0; j < NDim; ++j) {
-                    pos1[j] = p_ptrs[j][i1];
+                    acc[j] = gen_fma(c_orr, orr[j], gen_fma(c_r, r[j], acc[j] - c_t * B(mp[mp_o_tr_off + j])));
                 }
-                // Load the mass of the current particle.
-                const auto m1 = m_ptr[i1];
-                // The acceleration/potential vector for the current particle
-                // (inited to zero).
-                std::array<F, nvecs_res<Q>> a1{};
-                for (size_type i2 = i1 + 1u; i2 < tgt_size; ++i2) {
-                    // Determine dist2, dist and dist3.
-                    F dist2(eps2);
-                    for (std::size_t j = 0; j < NDim; ++j) {
-                        diffs[j] = p_ptrs[j][i2] - pos1[j];
-                        dist2 = fma_wrap(diffs[j], diffs[j], dist2);
-                    }
-                    const auto dist = std::sqrt(dist2), m2 = m_ptr[i2];
-                    if constexpr (Q == 0u || Q == 2u) {
-                        // Q == 0 or 2: accelerations are requested.
-                        const auto dist3 = dist2 * dist, m2_dist3 = m2 / dist3, m1_dist3 = m1 / dist3;
-                        // Accumulate the accelerations, both in the local
-                        // accumulator for the current particle and in the global
-                        // acc vector for the opposite acceleration.
-                        for (std::size_t j = 0; j < NDim; ++j) {
-                            a1[j] = fma_wrap(m2_dist3, diffs[j], a1[j]);
-                            // NOTE: this is a fused negated multiply-add.
-                            res_ptrs[j][i2] = fma_wrap(m1_dist3, -diffs[j], res_ptrs[j][i2]);
-                        }
-                    }
-                    if constexpr (Q == 1u || Q == 2u) {
-                        // Q == 1 or 2: potentials are requested.
-                        // Establish the index of the potential in the result array:
-                        // 0 if only the potentials are requested, NDim otherwise.
-                        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
-                        // Compute the negated mutual potential.
-                        const auto mut_pot = m1 / dist * m2;
+            }
+            if constexpr (Q == 1u || Q == 2u) {
+                // phi = 3 T r / (2 R**5) - 5 O r r r / (2 R**7).
+                pot = pot + B(F(3) / F(2)) * tr * inv_dist5 - B(F(5) / F(2)) * orrr * inv_dist7;
+            }
+        }
+    }
+    // Load a batch of target data (coordinates, masses, temporary data or results) starting at ptr. n is the number
+    // of elements from ptr to the end of the target node. The target data is read in place and it is not padded:
+    // when n is less than the batch size, only the first n elements are loaded (via masked loads in AVX512, see
+    // simd_load_tail()), and the other lanes are set to fill (or, if fill is not provided, to the first element,
+    // so that they do not alter the outcome of the opening criterion checks).
+    template <typename B>
+    static B tgt_load(const F *ptr, size_type n)
+    {
+        return n < B::size ? simd_load_tail(ptr, n, B(*ptr)) : B(ptr, xsimd::unaligned_mode{});
+    }
+    template <typename B>
+    static B tgt_load(const F *ptr, size_type n, F fill)
+    {
+        return n < B::size ? simd_load_tail(ptr, n, B(fill)) : B(ptr, xsimd::unaligned_mode{});
+    }
+    // Store the batch x of target data starting at ptr. n is the number of elements from ptr to the end of the
+    // target node: if n is less than the batch size, only the first n lanes are stored.
+    template <typename B>
+    static void tgt_store(F *ptr, size_type n, const B &x)
+    {
+        if (n < B::size) {
+            simd_store_tail(ptr, n, x);
+        } else {
+            x.store_unaligned(ptr);
+        }
+    }
+    // Dimension-generic SIMD implementations of the tree traversal kernels. They are currently used in 2D,
+    // while the 3D versions are written out explicitly in the kernels themselves (with the exception of
+    // the self interactions kernel, which is used in any dimension). The arguments are the same as in the
+    // corresponding kernels.
+    //
+    // Computation of 1/dist**3 (or dist**3, if the fast inverse sqrt is not available), 1/dist (or dist)
+    // from the batch of squared distances dist2.
+    template <typename B>
+    static B simd_dist3(B dist2)
+    {
+        if constexpr (use_fast_inv_sqrt<B>) {
+            return inv_sqrt_3(dist2);
+        } else {
+            return xsimd_sqrt(dist2) * dist2;
+        }
+    }
+    template <typename B>
+    static B simd_dist(B dist2)
+    {
+        if constexpr (use_fast_inv_sqrt<B>) {
+            return inv_sqrt(dist2);
+        } else {
+            return xsimd_sqrt(dist2);
+        }
+    }
+    // Compute m / dist**n, given the value x returned by simd_dist3() or simd_dist().
+    template <typename B>
+    static B simd_m_div(B m, B x)
+    {
+        if constexpr (use_fast_inv_sqrt<B>) {
+            return m * x;
+        } else {
+            return m / x;
+        }
+    }
+    // Self interactions via a tiled kernel. The target particles are split in tiles of batch_size particles. The
+    // interactions between two different tiles are computed keeping both tiles in registers and rotating the lanes
+    // of the second one (together with its accumulators) batch_size times, so that each lane of the first tile meets
+    // each lane of the second one. Each pair of particles is thus evaluated once, with a symmetric update, and the
+    // results of the second tile are loaded/stored once per tile (rather than once per particle of the first tile).
+    // The first tile is re-used for all the tiles following it. Within a tile, the lanes are rotated against
+    // themselves batch_size - 1 times, updating only the first operand.
+    //
+    // NOTE: the masked-out lanes of the last tile are filled with padding particles, which have zero mass and
+    // are far away from the real particles (see tgt_pad_coord()). The interactions between the padding particles
+    // may produce non-finite values, but these end up only in the results of the padding particles, as the
+    // accumulators are rotated together with the particles, and they are never stored. The softening lengths
+    // (if tgt_eps is not null) are rotated together with the particles as well. In periodic mode, the minimum
+    // image convention folds the padding particles back into the box, where they may overlap with a real
+    // particle: in this case, the contributions of the zero-mass particles of the second operand are explicitly
+    // selected out when the last tile is involved.
+    template <unsigned Q, typename R>
+    void tree_self_interactions_simd(F eps2, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                                     const F *tgt_eps, const R &res_ptrs) const
+    {
+        using batch_type = xsimd::simd_type<F>;
+        constexpr auto batch_size = batch_type::size;
+        // Establish the index of the potential in the result array:
+        // 0 if only the potentials are requested, NDim otherwise.
+        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+        const batch_type eps2_vec(eps2), pm_inv_2rs_vec(pm_inv_2rs());
+        const auto m_ptr = p_ptrs[NDim];
+        // The coordinate of the masked-out lanes (if any).
+        const auto pad_coord = (tgt_size % batch_size) ? tgt_pad_coord() : F(0);
+        std::array<batch_type, NDim> pos1, pos2, diffs;
+        std::array<batch_type, nvecs_res<Q>> res1, res2;
+        // The softening lengths of the batches 1 and 2, if per-particle softening lengths are in use.
+        batch_type eps_vec1(F(0)), eps_vec2(F(0));
+        // Interactions between the lanes of the batches 1 and 2. The contributions on 1 are added to res1 and,
+        // if Sym is true, the contributions on 2 to res2.
+        // If masked is true, the contributions of the zero-mass particles of 2 on 1 are set to zero.
+        auto interact = [this, eps2_vec, pm_inv_2rs_vec, tgt_eps, &eps_vec1, &eps_vec2, &pos1, &pos2, &diffs, &res1,
+                         &res2](const batch_type &mvec1, const batch_type &mvec2, auto sym, bool masked) {
+            constexpr bool Sym = decltype(sym)::value;
+            // NOTE: with the compact-support kernels, the softening
+            // length is not added to the square distance.
+            const auto h2 = tgt_eps ? pair_eps2(eps_vec1, eps_vec2) : eps2_vec;
+            auto dist2 = compact_sk ? batch_type(F(0)) : h2;
+            for (std::size_t j = 0; j < NDim; ++j) {
+                diffs[j] = pos2[j] - pos1[j];
+                if (m_periodic) {
+                    diffs[j] = min_image(diffs[j]);
+                }
+                dist2 = xsimd_fma(diffs[j], diffs[j], dist2);
+            }
+            const auto sd = soft_dists<Q>(dist2, h2);
+            // The short-range factors in the TreePM mode.
+            [[maybe_unused]] std::array<batch_type, 2> pm_f;
+            if (m_pm_grid) {
+                pm_f = pm_sr_factors(dist2, pm_inv_2rs_vec);
+            }
+            if constexpr (Q == 0u || Q == 2u) {
+                const auto dist3 = sd[0];
+                auto m2_dist3 = simd_m_div(mvec2, dist3);
+                if (m_pm_grid) {
+                    m2_dist3 *= pm_f[0];
+                }
+                if (masked) {
+                    m2_dist3 = xsimd::select(mvec2 == batch_type(F(0)), batch_type(F(0)), m2_dist3);
+                }
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    res1[j] = xsimd_fma(diffs[j], m2_dist3, res1[j]);
+                }
+                if constexpr (Sym) {
+                    auto m1_dist3 = simd_m_div(mvec1, dist3);
+                    if (m_pm_grid) {
+                        m1_dist3 *= pm_f[0];
+                    }
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        res2[j] = xsimd_fnma(diffs[j], m1_dist3, res2[j]);
+                    }
+                }
+            }
+            if constexpr (Q == 1u || Q == 2u) {
+                // Subtract the mutual (negated) potential between 1 and 2.
+                auto mut_pot = simd_m_div(mvec1, sd[1]) * mvec2;
+                if (m_pm_grid) {
+                    mut_pot *= pm_f[1];
+                }
+                if (masked) {
+                    mut_pot = xsimd::select(mvec2 == batch_type(F(0)), batch_type(F(0)), mut_pot);
+                }
+                res1[pot_idx] -= mut_pot;
+                if constexpr (Sym) {
+                    res2[pot_idx] -= mut_pot;
+                }
+            }
+        };
+        for (size_type i1 = 0; i1 < tgt_size; i1 += batch_size) {
+            const auto n1 = static_cast<size_type>(tgt_size - i1);
+            // NOTE: only the last tile may contain padding particles.
+            const auto masked1 = m_periodic && n1 < batch_size;
+            // Load the first tile.
+            for (std::size_t j = 0; j < NDim; ++j) {
+                pos1[j] = tgt_load<batch_type>(p_ptrs[j] + i1, n1, pad_coord);
+            }
+            const auto mvec1 = tgt_load<batch_type>(m_ptr + i1, n1, F(0));
+            if (tgt_eps) {
+                eps_vec1 = tgt_load<batch_type>(tgt_eps + i1, n1, F(0));
+            }
+            res1.fill(batch_type(F(0)));
+            // The interactions within the first tile.
+            pos2 = pos1;
+            auto mvec2 = mvec1;
+            eps_vec2 = eps_vec1;
+            for (std::size_t r = 1; r < batch_size; ++r) {
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pos2[j] = simd_rotate(pos2[j]);
+                }
+                mvec2 = simd_rotate(mvec2);
+                if (tgt_eps) {
+                    eps_vec2 = simd_rotate(eps_vec2);
+                }
+                interact(mvec1, mvec2, std::false_type{}, masked1);
+            }
+            // The interactions with the following tiles.
+            for (size_type i2 = i1 + batch_size; i2 < tgt_size; i2 += batch_size) {
+                const auto n2 = static_cast<size_type>(tgt_size - i2);
+                const auto masked2 = m_periodic && n2 < batch_size;
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pos2[j] = tgt_load<batch_type>(p_ptrs[j] + i2, n2, pad_coord);
+                }
+                mvec2 = tgt_load<batch_type>(m_ptr + i2, n2, F(0));
+                if (tgt_eps) {
+                    eps_vec2 = tgt_load<batch_type>(tgt_eps + i2, n2, F(0));
+                }
+                res2.fill(batch_type(F(0)));
+                for (std::size_t r = 0; r < batch_size; ++r) {
+                    interact(mvec1, mvec2, std::true_type{}, masked2);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        pos2[j] = simd_rotate(pos2[j]);
+                    }
+                    mvec2 = simd_rotate(mvec2);
+                    if (tgt_eps) {
+                        eps_vec2 = simd_rotate(eps_vec2);
+                    }
+                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                        res2[j] = simd_rotate(res2[j]);
+                    }
+                }
+                // NOTE: after batch_size rotations, the lanes of res2 are back
+                // in the order of the particles of the second tile.
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res_store(res_ptrs, j, i2, n2, res_load<batch_type>(res_ptrs, j, i2, n2) + res2[j]);
+                }
+            }
+            // Add the accumulated values on the first tile to the values already in the result buffer.
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                res_store(res_ptrs, j, i1, n1, res_load<batch_type>(res_ptrs, j, i1, n1) + res1[j]);
+            }
+        }
+    }
+    template <unsigned Q, typename R>
+    void tree_acc_pot_src_simd(F eps2, const std::array<const F *, NDim + 1u> &src_ptrs, const F *src_eps,
+                               size_type src_size, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                               const F *tgt_eps, const R &res_ptrs) const
+    {
+        assert((src_eps == nullptr) == (tgt_eps == nullptr));
+        using batch_type = xsimd::simd_type<F>;
+        constexpr auto batch_size = batch_type::size;
+        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+        const batch_type eps2_vec(eps2), pm_inv_2rs_vec(pm_inv_2rs());
+        std::array<batch_type, NDim> pos1, diffs;
+        std::array<batch_type, nvecs_res<Q>> res;
+        for (size_type i = 0; i < tgt_size; i += batch_size) {
+            const auto n = static_cast<size_type>(tgt_size - i);
+            // Load the current batch of target data and the accumulated accelerations/potentials.
+            for (std::size_t j = 0; j < NDim; ++j) {
+                pos1[j] = tgt_load<batch_type>(p_ptrs[j] + i, n);
+            }
+            const auto mvec1 = tgt_load<batch_type>(p_ptrs[NDim] + i, n);
+            const auto eps_vec1 = tgt_eps ? tgt_load<batch_type>(tgt_eps + i, n) : batch_type(F(0));
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                res[j] = res_load<batch_type>(res_ptrs, j, i, n);
+            }
+            for (size_type k = 0; k < src_size; ++k) {
+                // Compute the interaction with the source particle.
+                const auto h2 = tgt_eps ? pair_eps2(eps_vec1, batch_type(src_eps[k])) : eps2_vec;
+                auto dist2 = compact_sk ? batch_type(F(0)) : h2;
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    diffs[j] = batch_type(src_ptrs[j][k]) - pos1[j];
+                    if (m_periodic) {
+                        diffs[j] = min_image(diffs[j]);
+                    }
+                    dist2 = xsimd_fma(diffs[j], diffs[j], dist2);
+                }
+                const auto sd = soft_dists<Q>(dist2, h2);
+                const batch_type mvec2(src_ptrs[NDim][k]);
+                // The short-range factors in the TreePM mode.
+                [[maybe_unused]] std::array<batch_type, 2> pm_f;
+                if (m_pm_grid) {
+                    pm_f = pm_sr_factors(dist2, pm_inv_2rs_vec);
+                }
+                if constexpr (Q == 0u || Q == 2u) {
+                    auto m2_dist3 = simd_m_div(mvec2, sd[0]);
+                    if (m_pm_grid) {
+                        m2_dist3 *= pm_f[0];
+                    }
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        res[j] = xsimd_fma(diffs[j], m2_dist3, res[j]);
+                    }
+                }
+                if constexpr (Q == 1u || Q == 2u) {
+                    auto m2_dist = simd_m_div(mvec2, sd[1]);
+                    if (m_pm_grid) {
+                        m2_dist *= pm_f[1];
+                    }
+                    res[pot_idx] = xsimd_fnma(mvec1, m2_dist, res[pot_idx]);
+                }
+            }
+            // Store the updated accelerations/potentials.
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                res_store(res_ptrs, j, i, n, res[j]);
+            }
+        }
+    }
+    // Compute the accelerations/potentials on a target node by the src_size source particles of a leaf batch
+    // (see leaf_batch_type). Differently from tree_acc_pot_src(), the target particles are processed one at a time,
+    // and the source particles are loaded in SIMD batches. Thus, the source data must be aligned, and src_size
+    // must be a multiple of the batch size (the batch is padded with zero-mass particles in
+    // tree_acc_pot_flush_leaves()). This ensures that all the loads in the inner loop are aligned and full-width.
+    template <unsigned Q, typename R>
+    void tree_acc_pot_batch_simd(F eps2, const std::array<const F *, NDim + 1u> &src_ptrs, const F *src_eps,
+                                 size_type src_size, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                                 const F *tgt_eps, const R &res_ptrs) const
+    {
+        assert((src_eps == nullptr) == (tgt_eps == nullptr));
+        using batch_type = xsimd::simd_type<F>;
+        constexpr auto batch_size = batch_type::size;
+        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+        assert(src_size % batch_size == 0u);
+        const batch_type eps2_vec(eps2), pm_inv_2rs_vec(pm_inv_2rs());
+        std::array<batch_type, NDim> pos1, diffs;
+        std::array<batch_type, nvecs_res<Q>> res;
+        for (size_type i = 0; i < tgt_size; ++i) {
+            // Splat the coordinates and the softening length of the target particle.
+            for (std::size_t j = 0; j < NDim; ++j) {
+                pos1[j] = batch_type(p_ptrs[j][i]);
+            }
+            const batch_type eps_vec1(tgt_eps ? tgt_eps[i] : F(0));
+            // Accumulate the interactions with all the source particles.
+            // NOTE: for the potentials, we accumulate m2 / dist (the multiplication
+            // by the target mass is done at the end).
+            res.fill(batch_type(F(0)));
+            for (size_type k = 0; k < src_size; k += batch_size) {
+                const auto h2 = tgt_eps ? pair_eps2(eps_vec1, xsimd::load_aligned(src_eps + k)) : eps2_vec;
+                auto dist2 = compact_sk ? batch_type(F(0)) : h2;
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    diffs[j] = xsimd::load_aligned(src_ptrs[j] + k) - pos1[j];
+                    if (m_periodic) {
+                        diffs[j] = min_image(diffs[j]);
+                    }
+                    dist2 = xsimd_fma(diffs[j], diffs[j], dist2);
+                }
+                const auto sd = soft_dists<Q>(dist2, h2);
+                const auto mvec2 = xsimd::load_aligned(src_ptrs[NDim] + k);
+                // The short-range factors in the TreePM mode.
+                [[maybe_unused]] std::array<batch_type, 2> pm_f;
+                if (m_pm_grid) {
+                    pm_f = pm_sr_factors(dist2, pm_inv_2rs_vec);
+                }
+                if constexpr (Q == 0u || Q == 2u) {
+                    auto m2_dist3 = simd_m_div(mvec2, sd[0]);
+                    if (m_pm_grid) {
+                        m2_dist3 *= pm_f[0];
+                    }
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        res[j] = xsimd_fma(diffs[j], m2_dist3, res[j]);
+                    }
+                }
+                if constexpr (Q == 1u || Q == 2u) {
+                    auto m2_dist = simd_m_div(mvec2, sd[1]);
+                    if (m_pm_grid) {
+                        m2_dist *= pm_f[1];
+                    }
+                    res[pot_idx] += m2_dist;
+                }
+            }
+            // Reduce the accumulators and add them to the results.
+            if constexpr (Q == 0u || Q == 2u) {
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    res_store(res_ptrs, j, i, 1, res_load<F>(res_ptrs, j, i, 1) + xsimd::hadd(res[j]));
+                }
+            }
+            if constexpr (Q == 1u || Q == 2u) {
+                res_store(res_ptrs, pot_idx, i, 1,
+                          fma_wrap(-p_ptrs[NDim][i], xsimd::hadd(res[pot_idx]), res_load<F>(res_ptrs, pot_idx, i, 1)));
+            }
+        }
+    }
+    template <unsigned Q, typename R>
+    void tree_acc_pot_bh_com_simd(size_type src_idx, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                                  const std::array<F *, nvecs_tmp<Q>> &tmp_ptrs, const R &res_ptrs) const
+    {
+        using batch_type = xsimd::simd_type<F>;
+        constexpr auto batch_size = batch_type::size;
+        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+        // Establish the index of the dist values in the temp data:
+        // 0 if only the potentials are requested, NDim + 1 otherwise.
+        constexpr auto dist_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim + 1u);
+        const batch_type m_src_vec(m_tree[src_idx].props[NDim]);
+        for (size_type i = 0; i < tgt_size; i += batch_size) {
+            const auto n = static_cast<size_type>(tgt_size - i);
+            if constexpr (Q == 0u || Q == 2u) {
+                const auto m_src_dist3_vec = simd_m_div(m_src_vec, tgt_load<batch_type>(tmp_ptrs[NDim] + i, n));
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    res_store(res_ptrs, j, i, n,
+                              xsimd_fma(tgt_load<batch_type>(tmp_ptrs[j] + i, n), m_src_dist3_vec,
+                                        res_load<batch_type>(res_ptrs, j, i, n)));
+                }
+            }
+            if constexpr (Q == 1u || Q == 2u) {
+                const auto m_src_dist_vec = simd_m_div(m_src_vec, tgt_load<batch_type>(tmp_ptrs[dist_idx] + i, n));
+                res_store(res_ptrs, pot_idx, i, n,
+                          xsimd_fnma(tgt_load<batch_type>(p_ptrs[NDim] + i, n), m_src_dist_vec,
+                                     res_load<batch_type>(res_ptrs, pot_idx, i, n)));
+            }
+        }
+    }
+    // NOTE: this returns false if at least one target particle fails the opening criterion (as established by
+    // the mac_fail functor, see tree_acc_pot_bh_check()).
+    template <unsigned Q, typename MACFail>
+    bool tree_acc_pot_bh_check_simd(const F *props, F eps2, size_type tgt_size,
+                                    const std::array<const F *, NDim + 1u> &p_ptrs,
+                                    const std::array<F *, nvecs_tmp<Q>> &tmp_ptrs, const MACFail &mac_fail) const
+    {
+        using batch_type = xsimd::simd_type<F>;
+        constexpr auto batch_size = batch_type::size;
+        constexpr auto dist_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim + 1u);
+        const batch_type eps2_vec(eps2);
+        std::array<batch_type, NDim> com_vec, diffs;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            com_vec[j] = batch_type(props[j]);
+        }
+        for (size_type i = 0; i < tgt_size; i += batch_size) {
+            const auto n = static_cast<size_type>(tgt_size - i);
+            batch_type dist2(F(0));
+            for (std::size_t j = 0; j < NDim; ++j) {
+                diffs[j] = com_vec[j] - tgt_load<batch_type>(p_ptrs[j] + i, n);
+                if (m_periodic) {
+                    diffs[j] = min_image(diffs[j]);
+                }
+                dist2 = xsimd_fma(diffs[j], diffs[j], dist2);
+            }
+            if (mac_fail(dist2, i)) {
+                return false;
+            }
+            // Add the softening length, and store the data for tree_acc_pot_bh_com().
+            dist2 += eps2_vec;
+            if constexpr (Q == 0u || Q == 2u) {
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    tgt_store(tmp_ptrs[j] + i, n, diffs[j]);
+                }
+            }
+            if constexpr (Q == 0u) {
+                tgt_store(tmp_ptrs[NDim] + i, n, simd_dist3(dist2));
+            } else {
+                const auto d = simd_dist(dist2);
+                tgt_store(tmp_ptrs[dist_idx] + i, n, d);
+                if constexpr (Q == 2u) {
+                    if constexpr (use_fast_inv_sqrt<batch_type>) {
+                        tgt_store(tmp_ptrs[NDim] + i, n, d * d * d);
+                    } else {
+                        tgt_store(tmp_ptrs[NDim] + i, n, d * dist2);
+                    }
+                }
+            }
+        }
+        return true;
+    }
+    // Function to compute the self-interactions within a target node. eps2 is the square of the softening length,
+    // tgt_size is the number of particles in the target node, p_ptrs pointers to the target particles'
+    // coordinates/masses, tgt_eps a pointer to their softening lengths (null if per-particle softening lengths
+    // are not in use, in which case eps2 is used for all the pairs), res_ptrs pointers to the output arrays.
+    // Q indicates which quantities will be computed (accs, potentials, or both).
+    template <unsigned Q, typename R>
+    void tree_self_interactions(F eps2, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                                const F *tgt_eps, const R &res_ptrs) const
+    {
+        if constexpr (simd_enabled) {
+            tree_self_interactions_simd<Q>(eps2, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+        } else {
+            // Pointer to the masses.
+            const auto m_ptr = p_ptrs[NDim];
+            const auto pm_inv_2rs_s = pm_inv_2rs();
+            // Temporary vectors to be used in the loops below.
+            std::array<F, NDim> diffs, pos1;
+            for (size_type i1 = 0; i1 < tgt_size; ++i1) {
+                // Load the coords of the current particle.
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pos1[j] = p_ptrs[j][i1];
+                }
+                // Load the mass of the current particle.
+                const auto m1 = m_ptr[i1];
+                // The acceleration/potential vector for the current particle
+                // (inited to zero).
+                std::array<F, nvecs_res<Q>> a1{};
+                for (size_type i2 = i1 + 1u; i2 < tgt_size; ++i2) {
+                    // Determine dist2, dist and dist3.
+                    const auto h2 = tgt_eps ? pair_eps2(tgt_eps[i1], tgt_eps[i2]) : eps2;
+                    F dist2(compact_sk ? F(0) : h2);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = p_ptrs[j][i2] - pos1[j];
+                        if (m_periodic) {
+                            diffs[j] = min_image(diffs[j]);
+                        }
+                        dist2 = fma_wrap(diffs[j], diffs[j], dist2);
+                    }
+                    const auto [dist3, dist] = soft_dists<Q>(dist2, h2);
+                    const auto m2 = m_ptr[i2];
+                    // The short-range factors in the TreePM mode.
+                    std::array<F, 2> pm_f{F(1), F(1)};
+                    if (m_pm_grid) {
+                        pm_f = pm_sr_factors(dist2, pm_inv_2rs_s);
+                    }
+                    if constexpr (Q == 0u || Q == 2u) {
+                        // Q == 0 or 2: accelerations are requested.
+                        const auto m2_dist3 = m2 / dist3 * pm_f[0], m1_dist3 = m1 / dist3 * pm_f[0];
+                        // Accumulate the accelerations, both in the local
+                        // accumulator for the current particle and in the global
+                        // acc vector for the opposite acceleration.
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            a1[j] = fma_wrap(m2_dist3, diffs[j], a1[j]);
+                            // NOTE: this is a fused negated multiply-add.
+                            res_store(res_ptrs, j, i2, 1,
+                                      fma_wrap(m1_dist3, -diffs[j], res_load<F>(res_ptrs, j, i2, 1)));
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        // Q == 1 or 2: potentials are requested.
+                        // Establish the index of the potential in the result array:
+                        // 0 if only the potentials are requested, NDim otherwise.
+                        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                        // Compute the negated mutual potential.
+                        const auto mut_pot = m1 / dist * m2 * pm_f[1];
                         // Subtract mut_pot from the accumulator for the current particle and from
                         // the total potential of particle i2.
                         a1[pot_idx] -= mut_pot;
-                        res_ptrs[pot_idx][i2] -= mut_pot;
+                        res_store(res_ptrs, pot_idx, i2, 1, res_load<F>(res_ptrs, pot_idx, i2, 1) - mut_pot);
                     }
                 }
                 // Update the acceleration/potential on the first particle
                 // in the temporary storage.
                 if constexpr (Q == 0u || Q == 2u) {
                     for (std::size_t j = 0; j < NDim; ++j) {
-                        res_ptrs[j][i1] += a1[j];
+                        res_store(res_ptrs, j, i1, 1, res_load<F>(res_ptrs, j, i1, 1) + a1[j]);
                     }
                 }
                 if constexpr (Q == 1u || Q == 2u) {
                     constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
                     // NOTE: addition, because the value in a1[pot_idx] was already built
                     // as a negative quantity.
-                    res_ptrs[pot_idx][i1] += a1[pot_idx];
+                    res_store(res_ptrs, pot_idx, i1, 1, res_load<F>(res_ptrs, pot_idx, i1, 1) + a1[pot_idx]);
+                }
+            }
+        }
+    }
+    // Compute the mutual interactions between two disjoint sets of particles, accumulating equal and opposite
+    // contributions into the results of both sets. eps2 is the square of the softening length, size1 and size2
+    // the number of particles in the two sets, p1_ptrs and p2_ptrs pointers to their coordinates/masses, eps1_ptr
+    // and eps2_ptr pointers to their softening lengths (null if per-particle softening lengths are not in use,
+    // in which case eps2 is used for all the pairs), res1_ptrs and res2_ptrs pointers to their output arrays.
+    // Q indicates which quantities will be computed (accs, potentials, or both).
+    //
+    // NOTE: the particles of the first set are processed one at a time, the particles of the second one (if simd
+    // is enabled) in SIMD batches read and written in place via tgt_load()/tgt_store(). The masked-out lanes of
+    // the last batch are filled with zero-mass padding particles far away from the real particles (see
+    // tgt_pad_coord()), whose contributions thus vanish. The minimum image convention is not applied, as the
+    // mutual mode is not available with periodic boundary conditions (see acc_pot_impl()).
+    template <unsigned Q>
+    void tree_mutual_interactions(F eps2, size_type size1, const std::array<const F *, NDim + 1u> &p1_ptrs,
+                                  const F *eps1_ptr, const std::array<F *, nvecs_res<Q>> &res1_ptrs, size_type size2,
+                                  const std::array<const F *, NDim + 1u> &p2_ptrs, const F *eps2_ptr,
+                                  const std::array<F *, nvecs_res<Q>> &res2_ptrs) const
+    {
+        assert(!m_periodic);
+        assert((eps1_ptr == nullptr) == (eps2_ptr == nullptr));
+        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+        if constexpr (simd_enabled) {
+            using batch_type = xsimd::simd_type<F>;
+            constexpr auto batch_size = batch_type::size;
+            const batch_type eps2_vec(eps2);
+            // The coordinate of the masked-out lanes (if any).
+            const auto pad_coord = (size2 % batch_size) ? tgt_pad_coord() : F(0);
+            std::array<batch_type, NDim> pos1, diffs;
+            std::array<batch_type, nvecs_res<Q>> a1;
+            for (size_type i1 = 0; i1 < size1; ++i1) {
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pos1[j] = batch_type(p1_ptrs[j][i1]);
+                }
+                const batch_type mvec1(p1_ptrs[NDim][i1]), eps_vec1(eps1_ptr ? eps1_ptr[i1] : F(0));
+                // The accumulators for the current particle.
+                a1.fill(batch_type(F(0)));
+                for (size_type i2 = 0; i2 < size2; i2 += batch_size) {
+                    const auto n2 = static_cast<size_type>(size2 - i2);
+                    // NOTE: with the compact-support kernels, the softening
+                    // length is not added to the square distance.
+                    const auto h2
+                        = eps1_ptr ? pair_eps2(eps_vec1, tgt_load<batch_type>(eps2_ptr + i2, n2, F(0))) : eps2_vec;
+                    auto dist2 = compact_sk ? batch_type(F(0)) : h2;
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = tgt_load<batch_type>(p2_ptrs[j] + i2, n2, pad_coord) - pos1[j];
+                        dist2 = xsimd_fma(diffs[j], diffs[j], dist2);
+                    }
+                    const auto mvec2 = tgt_load<batch_type>(p2_ptrs[NDim] + i2, n2, F(0));
+                    const auto sd = soft_dists<Q>(dist2, h2);
+                    if constexpr (Q == 0u || Q == 2u) {
+                        const auto m1_dist3 = simd_m_div(mvec1, sd[0]), m2_dist3 = simd_m_div(mvec2, sd[0]);
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            a1[j] = xsimd_fma(diffs[j], m2_dist3, a1[j]);
+                            tgt_store(res2_ptrs[j] + i2, n2,
+                                      xsimd_fnma(diffs[j], m1_dist3, tgt_load<batch_type>(res2_ptrs[j] + i2, n2)));
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        // The negated mutual potential.
+                        const auto mut_pot = simd_m_div(mvec1, sd[1]) * mvec2;
+                        a1[pot_idx] -= mut_pot;
+                        tgt_store(res2_ptrs[pot_idx] + i2, n2,
+                                  tgt_load<batch_type>(res2_ptrs[pot_idx] + i2, n2) - mut_pot);
+                    }
+                }
+                // NOTE: the potential in a1 was built as a negative quantity, hence the addition.
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res1_ptrs[j][i1] += xsimd::hadd(a1[j]);
+                }
+            }
+        } else {
+            std::array<F, NDim> diffs, pos1;
+            for (size_type i1 = 0; i1 < size1; ++i1) {
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    pos1[j] = p1_ptrs[j][i1];
+                }
+                const auto m1 = p1_ptrs[NDim][i1];
+                // The accumulator for the current particle.
+                std::array<F, nvecs_res<Q>> a1{};
+                for (size_type i2 = 0; i2 < size2; ++i2) {
+                    const auto h2 = eps1_ptr ? pair_eps2(eps1_ptr[i1], eps2_ptr[i2]) : eps2;
+                    F dist2(compact_sk ? F(0) : h2);
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        diffs[j] = p2_ptrs[j][i2] - pos1[j];
+                        dist2 = fma_wrap(diffs[j], diffs[j], dist2);
+                    }
+                    const auto [dist3, dist] = soft_dists<Q>(dist2, h2);
+                    const auto m2 = p2_ptrs[NDim][i2];
+                    if constexpr (Q == 0u || Q == 2u) {
+                        const auto m2_dist3 = m2 / dist3, m1_dist3 = m1 / dist3;
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            a1[j] = fma_wrap(m2_dist3, diffs[j], a1[j]);
+                            res2_ptrs[j][i2] = fma_wrap(m1_dist3, -diffs[j], res2_ptrs[j][i2]);
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        const auto mut_pot = m1 / dist * m2;
+                        a1[pot_idx] -= mut_pot;
+                        res2_ptrs[pot_idx][i2] -= mut_pot;
+                    }
+                }
+                // NOTE: the potential in a1 was built as a negative quantity, hence the addition.
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res1_ptrs[j][i1] += a1[j];
                 }
             }
         }
@@ -2002,45 +3232,138 @@ private:
     // Function to compute the accelerations/potentials on a target node by all the particles of a leaf source node.
     // eps2 is the square of the softening length, src_idx is the index, in the tree structure, of the leaf node,
     // tgt_size the number of particles in the target node, p_ptrs pointers to the target particles' coordinates/masses,
+    // tgt_eps a pointer to their softening lengths (null if per-particle softening lengths are not in use),
     // res_ptrs pointers to the output arrays. Q indicates which quantities will be computed (accs, potentials, or
     // both).
-    template <unsigned Q>
+    template <unsigned Q, typename R>
     void tree_acc_pot_leaf(F eps2, size_type src_idx, size_type tgt_size,
-                           const std::array<const F *, NDim + 1u> &p_ptrs,
-                           const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+                           const std::array<const F *, NDim + 1u> &p_ptrs, const F *tgt_eps, const R &res_ptrs) const
     {
         // Get a reference to the source node.
         const auto &src_node = m_tree[src_idx];
-        // Establish the range of the source node.
-        const auto src_begin = src_node.begin, src_end = src_node.end;
+        tree_acc_pot_range<Q>(eps2, src_node.begin, src_node.end, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+    }
+    // Compute the accelerations/potentials on a target node by the leaf source node at index src_idx, which failed
+    // the opening criterion. If lb is not null, the particles of the leaf are appended to the batch lb instead, and
+    // the interactions are computed when the batch is full or when it is flushed via tree_acc_pot_flush_leaves().
+    // The other arguments are the same as in tree_acc_pot_leaf().
+    template <unsigned Q, typename R>
+    void tree_acc_pot_open_leaf(F eps2, size_type src_idx, leaf_batch_type *lb, size_type tgt_size,
+                                const std::array<const F *, NDim + 1u> &p_ptrs, const F *tgt_eps,
+                                const R &res_ptrs) const
+    {
+        if (!lb) {
+            tree_acc_pot_leaf<Q>(eps2, src_idx, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+            return;
+        }
+        const auto &src_node = m_tree[src_idx];
+        const auto src_size = static_cast<size_type>(src_node.end - src_node.begin);
+        assert(lb->size <= leaf_batch_max);
+        if (src_size > leaf_batch_max - lb->size) {
+            // Not enough room in the batch, flush it.
+            tree_acc_pot_flush_leaves<Q>(eps2, *lb, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+            if (src_size > leaf_batch_max) {
+                // NOTE: this can happen with large values of max_leaf_n, or for the leaves
+                // at the maximum tree depth (which cannot be split further).
+                tree_acc_pot_leaf<Q>(eps2, src_idx, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+                return;
+            }
+        }
+        for (std::size_t j = 0; j < NDim + 1u; ++j) {
+            std::copy(m_parts[j].data() + src_node.begin, m_parts[j].data() + src_node.end, lb->ptrs[j] + lb->size);
+        }
+        if (lb->eps) {
+            std::copy(m_eps.data() + src_node.begin, m_eps.data() + src_node.end, lb->eps + lb->size);
+        }
+        lb->size += src_size;
+    }
+    // Compute the accelerations/potentials on a target node by the source particles accumulated in the batch lb,
+    // and empty the batch. The other arguments are the same as in tree_acc_pot_leaf().
+    template <unsigned Q, typename R>
+    void tree_acc_pot_flush_leaves(F eps2, leaf_batch_type &lb, size_type tgt_size,
+                                   const std::array<const F *, NDim + 1u> &p_ptrs, const F *tgt_eps,
+                                   const R &res_ptrs) const
+    {
+        if (lb.size) {
+            std::array<const F *, NDim + 1u> src_ptrs;
+            std::copy(lb.ptrs.begin(), lb.ptrs.end(), src_ptrs.begin());
+            if constexpr (simd_enabled) {
+                constexpr auto batch_size = static_cast<size_type>(xsimd::simd_type<F>::size);
+                static_assert(leaf_batch_max % batch_size == 0u);
+                // Pad the batch to a multiple of the SIMD batch size. The padding particles
+                // have zero mass, and they are placed at the position of the last particle in the
+                // batch, with the same softening length (so that they don't introduce singularities
+                // which are not already there).
+                const auto padded_size = static_cast<size_type>((lb.size + batch_size - 1u) / batch_size * batch_size);
+                assert(padded_size <= leaf_batch_max);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    std::fill(lb.ptrs[j] + lb.size, lb.ptrs[j] + padded_size, lb.ptrs[j][lb.size - 1u]);
+                }
+                std::fill(lb.ptrs[NDim] + lb.size, lb.ptrs[NDim] + padded_size, F(0));
+                if (lb.eps) {
+                    std::fill(lb.eps + lb.size, lb.eps + padded_size, lb.eps[lb.size - 1u]);
+                }
+                tree_acc_pot_batch_simd<Q>(eps2, src_ptrs, lb.eps, padded_size, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+            } else {
+                tree_acc_pot_src<Q>(eps2, src_ptrs, lb.eps, lb.size, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+            }
+            lb.size = 0;
+        }
+    }
+    // Function to compute the accelerations/potentials on a target node by all the particles in the
+    // [src_begin, src_end) range (in internal order). The other arguments are the same as in tree_acc_pot_leaf().
+    template <unsigned Q, typename R>
+    void tree_acc_pot_range(F eps2, size_type src_begin, size_type src_end, size_type tgt_size,
+                            const std::array<const F *, NDim + 1u> &p_ptrs, const F *tgt_eps, const R &res_ptrs) const
+    {
+        std::array<const F *, NDim + 1u> src_ptrs;
+        for (std::size_t j = 0; j < NDim + 1u; ++j) {
+            src_ptrs[j] = m_parts[j].data() + src_begin;
+        }
+        tree_acc_pot_src<Q>(eps2, src_ptrs, m_eps.empty() ? nullptr : m_eps.data() + src_begin,
+                            static_cast<size_type>(src_end - src_begin), tgt_size, p_ptrs, tgt_eps, res_ptrs);
+    }
+    // Function to compute the accelerations/potentials on a target node by src_size source particles,
+    // whose coordinates/masses are pointed to by src_ptrs, and whose softening lengths are pointed to by
+    // src_eps (null if per-particle softening lengths are not in use). The other arguments are the same as in
+    // tree_acc_pot_leaf().
+    template <unsigned Q, typename R>
+    void tree_acc_pot_src(F eps2, const std::array<const F *, NDim + 1u> &src_ptrs, const F *src_eps,
+                          size_type src_size, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                          const F *tgt_eps, const R &res_ptrs) const
+    {
+        assert((src_eps == nullptr) == (tgt_eps == nullptr));
         if constexpr (simd_enabled && NDim == 3u) {
+            if (compact_sk || m_periodic || tgt_eps) {
+                // NOTE: in periodic mode, use the dimension-generic kernel, which applies the minimum
+                // image convention to the coordinate differences (and the short-range factors in the
+                // TreePM mode). The same goes for the compact-support softening kernels and for
+                // the per-particle softening lengths.
+                tree_acc_pot_src_simd<Q>(eps2, src_ptrs, src_eps, src_size, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+                return;
+            }
             // The SIMD-accelerated version.
             using batch_type = xsimd::simd_type<F>;
             constexpr auto batch_size = batch_type::size;
-            // The number of particles in the source node.
-            const auto src_size = static_cast<size_type>(src_end - src_begin);
             // Vector version of eps2.
             const batch_type eps2_vec(eps2);
             // Pointers to the target node data.
             const auto [x_ptr1, y_ptr1, z_ptr1, m_ptr1] = p_ptrs;
-            // Pointers to the source node data.
-            const auto x_ptr2 = m_parts[0].data() + src_begin, y_ptr2 = m_parts[1].data() + src_begin,
-                       z_ptr2 = m_parts[2].data() + src_begin, m_ptr2 = m_parts[3].data() + src_begin;
+            // Pointers to the source data.
+            const auto [x_ptr2, y_ptr2, z_ptr2, m_ptr2] = src_ptrs;
             if constexpr (Q == 0u) {
                 // Q == 0, accelerations only.
-                //
-                // Pointers to the result data.
-                const auto [res_x, res_y, res_z] = res_ptrs;
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
+                    const auto n = static_cast<size_type>(tgt_size - i);
                     // Load the current batch of target data.
-                    const auto xvec1 = batch_type(x_ptr1 + i, xsimd::aligned_mode{}),
-                               yvec1 = batch_type(y_ptr1 + i, xsimd::aligned_mode{}),
-                               zvec1 = batch_type(z_ptr1 + i, xsimd::aligned_mode{});
+                    const auto xvec1 = tgt_load<batch_type>(x_ptr1 + i, n),
+                               yvec1 = tgt_load<batch_type>(y_ptr1 + i, n),
+                               zvec1 = tgt_load<batch_type>(z_ptr1 + i, n);
                     // Init the batches for computing the accelerations, loading the
                     // accumulated acceleration for the current batch.
-                    auto res_x_vec = batch_type(res_x + i, xsimd::aligned_mode{}),
-                         res_y_vec = batch_type(res_y + i, xsimd::aligned_mode{}),
-                         res_z_vec = batch_type(res_z + i, xsimd::aligned_mode{});
+                    auto res_x_vec = res_load<batch_type>(res_ptrs, 0, i, n),
+                         res_y_vec = res_load<batch_type>(res_ptrs, 1, i, n),
+                         res_z_vec = res_load<batch_type>(res_ptrs, 2, i, n);
                     for (size_type j = 0; j < src_size; ++j) {
                         // Compute the interaction with the source particle.
                         batch_batch_3d_accs(res_x_vec, res_y_vec, res_z_vec, xvec1, yvec1, zvec1, batch_type(x_ptr2[j]),
@@ -2048,24 +3371,22 @@ private:
                                             eps2_vec);
                     }
                     // Store the updated accelerations in the temporary vectors.
-                    res_x_vec.store_aligned(res_x + i);
-                    res_y_vec.store_aligned(res_y + i);
-                    res_z_vec.store_aligned(res_z + i);
+                    res_store(res_ptrs, 0, i, n, res_x_vec);
+                    res_store(res_ptrs, 1, i, n, res_y_vec);
+                    res_store(res_ptrs, 2, i, n, res_z_vec);
                 }
             } else if constexpr (Q == 1u) {
                 // Q == 1, potentials only.
-                //
-                // Pointer to the result data.
-                const auto res = res_ptrs[0];
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
+                    const auto n = static_cast<size_type>(tgt_size - i);
                     // Load the current batch of target data.
-                    const auto xvec1 = batch_type(x_ptr1 + i, xsimd::aligned_mode{}),
-                               yvec1 = batch_type(y_ptr1 + i, xsimd::aligned_mode{}),
-                               zvec1 = batch_type(z_ptr1 + i, xsimd::aligned_mode{}),
-                               mvec1 = batch_type(m_ptr1 + i, xsimd::aligned_mode{});
+                    const auto xvec1 = tgt_load<batch_type>(x_ptr1 + i, n),
+                               yvec1 = tgt_load<batch_type>(y_ptr1 + i, n),
+                               zvec1 = tgt_load<batch_type>(z_ptr1 + i, n),
+                               mvec1 = tgt_load<batch_type>(m_ptr1 + i, n);
                     // Init the batch for computing the potentials, loading the
                     // accumulated potentials for the current batch.
-                    auto res_vec = batch_type(res + i, xsimd::aligned_mode{});
+                    auto res_vec = res_load<batch_type>(res_ptrs, 0, i, n);
                     for (size_type j = 0; j < src_size; ++j) {
                         // Compute the interaction with the source particle,
                         // and subtract the obtained potentials from the current
@@ -2077,25 +3398,23 @@ private:
                                                        batch_type(m_ptr2[j]), eps2_vec);
                     }
                     // Store the updated potentials in the temporary vector.
-                    res_vec.store_aligned(res + i);
+                    res_store(res_ptrs, 0, i, n, res_vec);
                 }
             } else {
                 // Q == 2, accelerations and potentials.
-                //
-                // Pointers to the result data.
-                const auto [res_x, res_y, res_z, res_pot] = res_ptrs;
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
+                    const auto n = static_cast<size_type>(tgt_size - i);
                     // Load the current batch of target data.
-                    const auto xvec1 = batch_type(x_ptr1 + i, xsimd::aligned_mode{}),
-                               yvec1 = batch_type(y_ptr1 + i, xsimd::aligned_mode{}),
-                               zvec1 = batch_type(z_ptr1 + i, xsimd::aligned_mode{}),
-                               mvec1 = batch_type(m_ptr1 + i, xsimd::aligned_mode{});
+                    const auto xvec1 = tgt_load<batch_type>(x_ptr1 + i, n),
+                               yvec1 = tgt_load<batch_type>(y_ptr1 + i, n),
+                               zvec1 = tgt_load<batch_type>(z_ptr1 + i, n),
+                               mvec1 = tgt_load<batch_type>(m_ptr1 + i, n);
                     // Init the batches for computing the accelerations and the potentials, loading the
                     // accumulated values for the current batch.
-                    auto res_x_vec = batch_type(res_x + i, xsimd::aligned_mode{}),
-                         res_y_vec = batch_type(res_y + i, xsimd::aligned_mode{}),
-                         res_z_vec = batch_type(res_z + i, xsimd::aligned_mode{}),
-                         res_pot_vec = batch_type(res_pot + i, xsimd::aligned_mode{});
+                    auto res_x_vec = res_load<batch_type>(res_ptrs, 0, i, n),
+                         res_y_vec = res_load<batch_type>(res_ptrs, 1, i, n),
+                         res_z_vec = res_load<batch_type>(res_ptrs, 2, i, n),
+                         res_pot_vec = res_load<batch_type>(res_ptrs, 3, i, n);
                     for (size_type j = 0; j < src_size; ++j) {
                         // Compute the interaction with the source particle.
                         batch_batch_3d_accs_pots(res_x_vec, res_y_vec, res_z_vec, res_pot_vec, xvec1, yvec1, zvec1,
@@ -2103,15 +3422,18 @@ private:
                                                  batch_type(z_ptr2[j]), batch_type(m_ptr2[j]), eps2_vec);
                     }
                     // Store the updated accelerations/potentials in the temporary vectors.
-                    res_x_vec.store_aligned(res_x + i);
-                    res_y_vec.store_aligned(res_y + i);
-                    res_z_vec.store_aligned(res_z + i);
-                    res_pot_vec.store_aligned(res_pot + i);
+                    res_store(res_ptrs, 0, i, n, res_x_vec);
+                    res_store(res_ptrs, 1, i, n, res_y_vec);
+                    res_store(res_ptrs, 2, i, n, res_z_vec);
+                    res_store(res_ptrs, 3, i, n, res_pot_vec);
                 }
             }
+        } else if constexpr (simd_enabled && NDim == 2u) {
+            tree_acc_pot_src_simd<Q>(eps2, src_ptrs, src_eps, src_size, tgt_size, p_ptrs, tgt_eps, res_ptrs);
         } else {
             // Local variables for the scalar computation.
             std::array<F, NDim> pos1, diffs;
+            const auto pm_inv_2rs_s = pm_inv_2rs();
             for (size_type i1 = 0; i1 < tgt_size; ++i1) {
                 // Load the coordinates of the current particle
                 // in the target node.
@@ -2123,19 +3445,34 @@ private:
                 if constexpr (Q == 1u || Q == 2u) {
                     m1 = p_ptrs[NDim][i1];
                 }
-                // Iterate over the particles in the src node.
-                for (size_type i2 = src_begin; i2 < src_end; ++i2) {
-                    F dist2(eps2);
+                // Load the accumulated accelerations/potentials of the current particle.
+                std::array<F, nvecs_res<Q>> a1;
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    a1[j] = res_load<F>(res_ptrs, j, i1, 1);
+                }
+                // Iterate over the source particles.
+                for (size_type i2 = 0; i2 < src_size; ++i2) {
+                    const auto h2 = tgt_eps ? pair_eps2(tgt_eps[i1], src_eps[i2]) : eps2;
+                    F dist2(compact_sk ? F(0) : h2);
                     for (std::size_t j = 0; j < NDim; ++j) {
-                        diffs[j] = m_parts[j][i2] - pos1[j];
+                        diffs[j] = src_ptrs[j][i2] - pos1[j];
+                        if (m_periodic) {
+                            diffs[j] = min_image(diffs[j]);
+                        }
                         dist2 = fma_wrap(diffs[j], diffs[j], dist2);
                     }
-                    const auto dist = std::sqrt(dist2), m2 = m_parts[NDim][i2];
+                    const auto [dist3, dist] = soft_dists<Q>(dist2, h2);
+                    const auto m2 = src_ptrs[NDim][i2];
+                    // The short-range factors in the TreePM mode.
+                    std::array<F, 2> pm_f{F(1), F(1)};
+                    if (m_pm_grid) {
+                        pm_f = pm_sr_factors(dist2, pm_inv_2rs_s);
+                    }
                     if constexpr (Q == 0u || Q == 2u) {
                         // Q == 0 or 2: accelerations are requested.
-                        const auto dist3 = dist * dist2, m_dist3 = m2 / dist3;
+                        const auto m_dist3 = m2 / dist3 * pm_f[0];
                         for (std::size_t j = 0; j < NDim; ++j) {
-                            res_ptrs[j][i1] = fma_wrap(diffs[j], m_dist3, res_ptrs[j][i1]);
+                            a1[j] = fma_wrap(diffs[j], m_dist3, a1[j]);
                         }
                     }
                     if constexpr (Q == 1u || Q == 2u) {
@@ -2143,9 +3480,13 @@ private:
                         // Establish the index of the potential in the result array:
                         // 0 if only the potentials are requested, NDim otherwise.
                         constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
-                        res_ptrs[pot_idx][i1] = fma_wrap(-m1, m2 / dist, res_ptrs[pot_idx][i1]);
+                        a1[pot_idx] = fma_wrap(-m1, m2 / dist * pm_f[1], a1[pot_idx]);
                     }
                 }
+                // Store the updated accelerations/potentials.
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res_store(res_ptrs, j, i1, 1, a1[j]);
+                }
             }
         }
     }
@@ -2154,10 +3495,9 @@ private:
     // p_ptrs pointers to the target particles' coordinates/masses, tmp_ptrs are pointers to the temporary data filled
     // in by the tree_acc_pot_bh_check() function (which will be re-used by this function), res_ptrs pointers to the
     // output arrays. Q indicates which quantities will be computed (accs, potentials, or both).
-    template <unsigned Q>
+    template <unsigned Q, typename R>
     void tree_acc_pot_bh_com(size_type src_idx, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
-                             const std::array<F *, nvecs_tmp<Q>> &tmp_ptrs,
-                             const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+                             const std::array<F *, nvecs_tmp<Q>> &tmp_ptrs, const R &res_ptrs) const
     {
         // Load locally the mass of the source node.
         const auto m_src = m_tree[src_idx].props[NDim];
@@ -2171,23 +3511,22 @@ private:
                 //
                 // Pointers to the temporary coordinate diffs and 1/dist3 values computed in the BH check.
                 const auto [tmp_x, tmp_y, tmp_z, tmp_dist3] = tmp_ptrs;
-                // Pointers to the result arrays.
-                const auto [res_x, res_y, res_z] = res_ptrs;
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
+                    const auto n = static_cast<size_type>(tgt_size - i);
                     // Compute m_src/dist**3 and load the differences.
                     const auto m_src_dist3_vec = use_fast_inv_sqrt<batch_type>
-                                                     ? m_src_vec * batch_type(tmp_dist3 + i, xsimd::aligned_mode{})
-                                                     : m_src_vec / batch_type(tmp_dist3 + i, xsimd::aligned_mode{}),
-                               xdiff = batch_type(tmp_x + i, xsimd::aligned_mode{}),
-                               ydiff = batch_type(tmp_y + i, xsimd::aligned_mode{}),
-                               zdiff = batch_type(tmp_z + i, xsimd::aligned_mode{});
+                                                     ? m_src_vec * tgt_load<batch_type>(tmp_dist3 + i, n)
+                                                     : m_src_vec / tgt_load<batch_type>(tmp_dist3 + i, n),
+                               xdiff = tgt_load<batch_type>(tmp_x + i, n),
+                               ydiff = tgt_load<batch_type>(tmp_y + i, n),
+                               zdiff = tgt_load<batch_type>(tmp_z + i, n);
                     // Compute and accumulate the accelerations.
-                    xsimd_fma(xdiff, m_src_dist3_vec, batch_type(res_x + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_x + i);
-                    xsimd_fma(ydiff, m_src_dist3_vec, batch_type(res_y + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_y + i);
-                    xsimd_fma(zdiff, m_src_dist3_vec, batch_type(res_z + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_z + i);
+                    res_store(res_ptrs, 0, i, n,
+                              xsimd_fma(xdiff, m_src_dist3_vec, res_load<batch_type>(res_ptrs, 0, i, n)));
+                    res_store(res_ptrs, 1, i, n,
+                              xsimd_fma(ydiff, m_src_dist3_vec, res_load<batch_type>(res_ptrs, 1, i, n)));
+                    res_store(res_ptrs, 2, i, n,
+                              xsimd_fma(zdiff, m_src_dist3_vec, res_load<batch_type>(res_ptrs, 2, i, n)));
                 }
             } else if constexpr (Q == 1u) {
                 // Q == 1, potentials only.
@@ -2196,17 +3535,16 @@ private:
                 const auto tmp_dist = tmp_ptrs[0];
                 // Pointer to the target masses.
                 const auto m_ptr = p_ptrs[3];
-                // Pointer to the result array.
-                const auto res = res_ptrs[0];
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
+                    const auto n = static_cast<size_type>(tgt_size - i);
                     // Compute m_src/dist.
                     const auto m_src_dist_vec = use_fast_inv_sqrt<batch_type>
-                                                    ? m_src_vec * batch_type(tmp_dist + i, xsimd::aligned_mode{})
-                                                    : m_src_vec / batch_type(tmp_dist + i, xsimd::aligned_mode{});
+                                                    ? m_src_vec * tgt_load<batch_type>(tmp_dist + i, n)
+                                                    : m_src_vec / tgt_load<batch_type>(tmp_dist + i, n);
                     // Compute and accumulate the potential.
-                    xsimd_fnma(batch_type(m_ptr + i, xsimd::aligned_mode{}), m_src_dist_vec,
-                               batch_type(res + i, xsimd::aligned_mode{}))
-                        .store_aligned(res + i);
+                    res_store(res_ptrs, 0, i, n,
+                              xsimd_fnma(tgt_load<batch_type>(m_ptr + i, n), m_src_dist_vec,
+                                         res_load<batch_type>(res_ptrs, 0, i, n)));
                 }
             } else {
                 // Q == 2, accelerations and potentials.
@@ -2215,32 +3553,33 @@ private:
                 const auto [tmp_x, tmp_y, tmp_z, tmp_dist3, tmp_dist] = tmp_ptrs;
                 // Pointer to the target masses.
                 const auto m_ptr = p_ptrs[3];
-                // Pointers to the result arrays.
-                const auto [res_x, res_y, res_z, res_pot] = res_ptrs;
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
+                    const auto n = static_cast<size_type>(tgt_size - i);
                     // Compute m_src/dist**3, m_src/dist and load the differences.
                     const auto m_src_dist3_vec = use_fast_inv_sqrt<batch_type>
-                                                     ? m_src_vec * batch_type(tmp_dist3 + i, xsimd::aligned_mode{})
-                                                     : m_src_vec / batch_type(tmp_dist3 + i, xsimd::aligned_mode{}),
+                                                     ? m_src_vec * tgt_load<batch_type>(tmp_dist3 + i, n)
+                                                     : m_src_vec / tgt_load<batch_type>(tmp_dist3 + i, n),
                                m_src_dist_vec = use_fast_inv_sqrt<batch_type>
-                                                    ? m_src_vec * batch_type(tmp_dist + i, xsimd::aligned_mode{})
-                                                    : m_src_vec / batch_type(tmp_dist + i, xsimd::aligned_mode{}),
-                               xdiff = batch_type(tmp_x + i, xsimd::aligned_mode{}),
-                               ydiff = batch_type(tmp_y + i, xsimd::aligned_mode{}),
-                               zdiff = batch_type(tmp_z + i, xsimd::aligned_mode{});
+                                                    ? m_src_vec * tgt_load<batch_type>(tmp_dist + i, n)
+                                                    : m_src_vec / tgt_load<batch_type>(tmp_dist + i, n),
+                               xdiff = tgt_load<batch_type>(tmp_x + i, n),
+                               ydiff = tgt_load<batch_type>(tmp_y + i, n),
+                               zdiff = tgt_load<batch_type>(tmp_z + i, n);
                     // Compute and accumulate the accelerations.
-                    xsimd_fma(xdiff, m_src_dist3_vec, batch_type(res_x + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_x + i);
-                    xsimd_fma(ydiff, m_src_dist3_vec, batch_type(res_y + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_y + i);
-                    xsimd_fma(zdiff, m_src_dist3_vec, batch_type(res_z + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_z + i);
+                    res_store(res_ptrs, 0, i, n,
+                              xsimd_fma(xdiff, m_src_dist3_vec, res_load<batch_type>(res_ptrs, 0, i, n)));
+                    res_store(res_ptrs, 1, i, n,
+                              xsimd_fma(ydiff, m_src_dist3_vec, res_load<batch_type>(res_ptrs, 1, i, n)));
+                    res_store(res_ptrs, 2, i, n,
+                              xsimd_fma(zdiff, m_src_dist3_vec, res_load<batch_type>(res_ptrs, 2, i, n)));
                     // Compute and accumulate the potential.
-                    xsimd_fnma(batch_type(m_ptr + i, xsimd::aligned_mode{}), m_src_dist_vec,
-                               batch_type(res_pot + i, xsimd::aligned_mode{}))
-                        .store_aligned(res_pot + i);
+                    res_store(res_ptrs, 3, i, n,
+                              xsimd_fnma(tgt_load<batch_type>(m_ptr + i, n), m_src_dist_vec,
+                                         res_load<batch_type>(res_ptrs, 3, i, n)));
                 }
             }
+        } else if constexpr (simd_enabled && NDim == 2u) {
+            tree_acc_pot_bh_com_simd<Q>(src_idx, tgt_size, p_ptrs, tmp_ptrs, res_ptrs);
         } else {
             // Init the pointer to the target masses, but only if potentials are requested.
             [[maybe_unused]] const F *m_ptr;
@@ -2252,7 +3591,8 @@ private:
                     // Q == 0 or 2: accelerations are requested.
                     const auto m_src_dist3 = m_src / tmp_ptrs[NDim][i];
                     for (std::size_t j = 0; j < NDim; ++j) {
-                        res_ptrs[j][i] = fma_wrap(tmp_ptrs[j][i], m_src_dist3, res_ptrs[j][i]);
+                        res_store(res_ptrs, j, i, 1,
+                                  fma_wrap(tmp_ptrs[j][i], m_src_dist3, res_load<F>(res_ptrs, j, i, 1)));
                     }
                 }
                 if constexpr (Q == 1u || Q == 2u) {
@@ -2263,36 +3603,444 @@ private:
                     // Establish the index of the dist values in the temp data:
                     // 0 if only the potentials are requested, NDim + 1 otherwise.
                     constexpr auto dist_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim + 1u);
-                    res_ptrs[pot_idx][i] = fma_wrap(-m_ptr[i], m_src / tmp_ptrs[dist_idx][i], res_ptrs[pot_idx][i]);
+                    res_store(res_ptrs, pot_idx, i, 1,
+                              fma_wrap(-m_ptr[i], m_src / tmp_ptrs[dist_idx][i], res_load<F>(res_ptrs, pot_idx, i, 1)));
+                }
+            }
+        }
+    }
+    // Function to compute the accelerations/potentials due to the higher-order multipole moments of a source node
+    // onto a target node. src_idx is the index, in the tree structure, of the source node, eps2 the square of the
+    // softening length, tgt_size the number of particles in the target node, p_ptrs pointers to the target particles'
+    // coordinates/masses, res_ptrs pointers to the output arrays. Q indicates which quantities will be computed
+    // (accs, potentials, or both).
+    template <unsigned Q, typename R>
+    void tree_acc_pot_bh_mp(size_type src_idx, F eps2, size_type tgt_size,
+                            const std::array<const F *, NDim + 1u> &p_ptrs, const R &res_ptrs) const
+    {
+        static_assert(MPOrder > 1u);
+        const auto &src_node = m_tree[src_idx];
+        const auto mp = m_multipoles.data() + src_idx * mp_size;
+        // The implementation, for either a scalar or a SIMD batch type.
+        auto impl = [&](auto b) {
+            using B = decltype(b);
+            constexpr bool is_batch = !std::is_same_v<B, F>;
+            constexpr auto stride = [is_batch]() {
+                if constexpr (is_batch) {
+                    return static_cast<size_type>(B::size);
+                } else {
+                    return size_type(1);
+                }
+            }();
+            // NOTE: n is the number of elements from ptr to the end of the target node (see tgt_load()).
+            auto load = [](const F *ptr, size_type n) {
+                if constexpr (is_batch) {
+                    return tgt_load<B>(ptr, n);
+                } else {
+                    ignore(n);
+                    return *ptr;
+                }
+            };
+            std::array<B, NDim> r, acc;
+            for (size_type i = 0; i < tgt_size; i += stride) {
+                const auto n = static_cast<size_type>(tgt_size - i);
+                B dist2(eps2);
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    r[j] = load(p_ptrs[j] + i, n) - B(src_node.props[j]);
+                    if (m_periodic) {
+                        r[j] = min_image(r[j]);
+                    }
+                    dist2 = gen_fma(r[j], r[j], dist2);
+                }
+                const auto inv_dist = [dist2]() {
+                    if constexpr (is_batch) {
+                        if constexpr (use_fast_inv_sqrt<B>) {
+                            return inv_sqrt(dist2);
+                        } else {
+                            return B(F(1)) / xsimd_sqrt(dist2);
+                        }
+                    } else {
+                        return F(1) / std::sqrt(dist2);
+                    }
+                }();
+                acc.fill(B(F(0)));
+                B pot(F(0));
+                mp_acc_pot<Q>(mp, r, inv_dist, inv_dist * inv_dist, acc, pot);
+                if constexpr (Q == 0u || Q == 2u) {
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        res_store(res_ptrs, j, i, n, res_load<B>(res_ptrs, j, i, n) + acc[j]);
+                    }
+                }
+                if constexpr (Q == 1u || Q == 2u) {
+                    constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                    res_store(res_ptrs, pot_idx, i, n,
+                              gen_fma(load(p_ptrs[NDim] + i, n), pot, res_load<B>(res_ptrs, pot_idx, i, n)));
+                }
+            }
+        };
+        if constexpr (simd_enabled && (NDim == 3u || NDim == 2u)) {
+            impl(xsimd::simd_type<F>(F(0)));
+        } else {
+            impl(F(0));
+        }
+    }
+    // The interaction list of a target node, as established by the tree traversal: the indices of the source
+    // nodes whose multipole expansions were used, and the ranges (in internal order) of the source particles
+    // whose interactions were computed directly. Contiguous leaf nodes are merged into a single range.
+    struct ilist_type {
+        std::vector<size_type> nodes;
+        std::vector<std::array<size_type, 2>> ranges;
+        void add_range(size_type begin, size_type end)
+        {
+            if (!ranges.empty() && ranges.back()[1] == begin) {
+                ranges.back()[1] = end;
+            } else {
+                ranges.push_back({begin, end});
+            }
+        }
+    };
+    // The cached interaction lists of all the critical nodes, stored in compressed form: the interaction list
+    // of the critical node at index i consists of the nodes in the range [node_offsets[i], node_offsets[i + 1])
+    // and of the particle ranges in the range [range_offsets[i], range_offsets[i + 1]). The lists are valid only
+    // for the value of theta2 with which they were recorded, and for the tree structure with generation tree_gen
+    // (see m_tree_gen).
+    struct ilist_cache_type {
+        F theta2 = F(0);
+        unsigned long long tree_gen = 0;
+        std::vector<size_type> node_offsets, nodes, range_offsets;
+        std::vector<std::array<size_type, 2>> ranges;
+        void clear()
+        {
+            theta2 = F(0);
+            tree_gen = 0;
+            node_offsets.clear();
+            nodes.clear();
+            range_offsets.clear();
+            ranges.clear();
+        }
+    };
+    // The bounding box of the particles of a target node: the first element contains the minimum
+    // coordinates, the second one the maximum coordinates.
+    using tgt_box_type = std::array<std::array<F, NDim>, 2>;
+    // Function to accumulate into err_ptr the upper bounds of the errors of the accelerations due to the truncation
+    // of the multipole expansion of a source node. src_idx is the index, in the tree structure, of the source node,
+    // tgt_size the number of particles in the target node, p_ptrs pointers to the coordinates/masses of the particles
+    // in the target node.
+    //
+    // The bound is (Salmon & Warren, 1994)
+    //
+    // M / (d - b)**2 * ((p + 2) - (p + 1) * b / d) * (b / d)**(p + 1),
+    //
+    // where M is the mass of the source node, d the distance of the target particle from the COM, b the radius of
+    // the sphere centred on the COM which encloses the particles of the source node, and p the order of the expansion
+    // (i.e., MPOrder, as the dipole moment with respect to the COM vanishes). The bound is infinite if the target
+    // particle lies within the sphere.
+    // NOTE: the bound does not account for the softening, and the multiplication by G is left to the caller.
+    // In periodic mode, the bound does not account for the error of the Ewald corrections (see tree_acc_pot_ewald()).
+    void tree_acc_pot_bh_err(size_type src_idx, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                             F *err_ptr) const
+    {
+        const auto &src_node = m_tree[src_idx];
+        const auto &props = src_node.props;
+        const auto b = fma_wrap(src_node.dim, std::sqrt(F(NDim)) / F(2), src_node.com_off);
+        for (size_type i = 0; i < tgt_size; ++i) {
+            F dist2(0);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                auto diff = props[j] - p_ptrs[j][i];
+                if (m_periodic) {
+                    diff = min_image(diff);
+                }
+                dist2 = fma_wrap(diff, diff, dist2);
+            }
+            const auto d = std::sqrt(dist2);
+            if (d <= b) {
+                err_ptr[i] = std::numeric_limits<F>::infinity();
+                continue;
+            }
+            const auto r = b / d;
+            auto r_pow = r;
+            for (unsigned k = 0; k < MPOrder; ++k) {
+                r_pow *= r;
+            }
+            err_ptr[i]
+                += props[NDim] / ((d - b) * (d - b)) * (F(MPOrder + 2u) - F(MPOrder + 1u) * r) * r_pow;
+        }
+    }
+    // Add to res_ptrs the Ewald corrections (see ewald.hpp) to the acceleration/potential of the target particle
+    // at index i due to a source particle of mass m. d points to the (minimum image) coordinate differences between
+    // the source and the target particle, table is the return value of ewald_table(), inv_box_size the inverse of
+    // the box size.
+    template <unsigned Q, typename R>
+    static void ewald_add(const std::vector<std::array<double, 4>> &table, F inv_box_size, const F *d, F m,
+                          size_type i, const std::array<const F *, NDim + 1u> &p_ptrs, const R &res_ptrs)
+    {
+        static_assert(NDim == 3u);
+        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+        // NOTE: the table contains the corrections at the position of the target particle with respect to the
+        // source particle, that is, at -d. As the force correction is odd, its sign flip cancels out with the
+        // one due to the attractive nature of gravity.
+        const auto c = ewald_corr(table, d, inv_box_size);
+        if constexpr (Q == 0u || Q == 2u) {
+            for (std::size_t j = 0; j < NDim; ++j) {
+                res_store(res_ptrs, j, i, 1, fma_wrap(m, c[j], res_load<F>(res_ptrs, j, i, 1)));
+            }
+        }
+        if constexpr (Q == 1u || Q == 2u) {
+            res_store(res_ptrs, pot_idx, i, 1,
+                      fma_wrap(-p_ptrs[NDim][i] * m, c[3], res_load<F>(res_ptrs, pot_idx, i, 1)));
+        }
+    }
+    // In periodic mode, add the Ewald corrections due to the source particles in the [src_begin, src_end) range
+    // to the accelerations/potentials of the particles of a target node. The other arguments are as
+    // in tree_acc_pot_leaf().
+    // NOTE: the range may contain the target particles themselves, in which case the interactions
+    // of the target particles with their own periodic images are included.
+    template <unsigned Q, typename R>
+    void tree_acc_pot_ewald_range(size_type src_begin, size_type src_end, size_type tgt_size,
+                                  const std::array<const F *, NDim + 1u> &p_ptrs, const R &res_ptrs) const
+    {
+        std::array<const F *, NDim + 1u> src_ptrs;
+        for (std::size_t j = 0; j < NDim + 1u; ++j) {
+            src_ptrs[j] = m_parts[j].data() + src_begin;
+        }
+        tree_acc_pot_ewald_src<Q>(src_ptrs, static_cast<size_type>(src_end - src_begin), tgt_size, p_ptrs,
+                                  res_ptrs);
+    }
+    // In periodic mode, add the Ewald corrections due to src_size source particles, whose coordinates/masses
+    // are pointed to by src_ptrs, to the accelerations/potentials of the particles of a target node. The other
+    // arguments are as in tree_acc_pot_leaf().
+    template <unsigned Q, typename R>
+    void tree_acc_pot_ewald_src(const std::array<const F *, NDim + 1u> &src_ptrs, size_type src_size,
+                                size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                                const R &res_ptrs) const
+    {
+        assert(use_ewald());
+        if constexpr (NDim == 3u) {
+            const auto inv_box_size = F(1) / m_box_size;
+            if constexpr (simd_enabled) {
+                // The vectorised version: the interpolation in the table is carried out
+                // over batches of target particles.
+                using batch_type = xsimd::simd_type<F>;
+                constexpr auto batch_size = batch_type::size;
+                const auto &table = ewald_table_soa<F>();
+                for (size_type i = 0; i < tgt_size; i += batch_size) {
+                    const auto n = static_cast<size_type>(tgt_size - i);
+                    // NOTE: the masked-out lanes are filled with a copy of the first target
+                    // particle (see tgt_load()), and they are discarded when storing.
+                    std::array<batch_type, NDim> pos;
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        pos[j] = tgt_load<batch_type>(p_ptrs[j] + i, n);
+                    }
+                    std::array<batch_type, 4> acc;
+                    acc.fill(batch_type(F(0)));
+                    std::array<batch_type, NDim> diffs;
+                    for (size_type k = 0; k < src_size; ++k) {
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            diffs[j] = min_image(batch_type(src_ptrs[j][k]) - pos[j]);
+                        }
+                        // NOTE: see ewald_add() for the signs.
+                        const auto c = ewald_corr_simd(table, diffs, inv_box_size);
+                        const batch_type m_src(src_ptrs[NDim][k]);
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            acc[j] = xsimd_fma(m_src, c[j], acc[j]);
+                        }
+                    }
+                    if constexpr (Q == 0u || Q == 2u) {
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            res_store(res_ptrs, j, i, n, res_load<batch_type>(res_ptrs, j, i, n) + acc[j]);
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                        res_store(res_ptrs, pot_idx, i, n,
+                                  xsimd_fnma(tgt_load<batch_type>(p_ptrs[NDim] + i, n), acc[3],
+                                             res_load<batch_type>(res_ptrs, pot_idx, i, n)));
+                    }
+                }
+            } else {
+                const auto &table = ewald_table();
+                std::array<F, NDim> diffs;
+                for (size_type i = 0; i < tgt_size; ++i) {
+                    for (size_type k = 0; k < src_size; ++k) {
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            diffs[j] = min_image(src_ptrs[j][k] - p_ptrs[j][i]);
+                        }
+                        ewald_add<Q>(table, inv_box_size, diffs.data(), src_ptrs[NDim][k], i, p_ptrs, res_ptrs);
+                    }
                 }
             }
+        } else {
+            ignore(src_ptrs, src_size, tgt_size, p_ptrs, res_ptrs);
         }
     }
+    // In periodic mode, add the Ewald corrections due to the source node at index src_idx to the
+    // accelerations/potentials of the particles of a target node. If at_com is true, the corrections are computed
+    // at the COM of the source node, consistently with the interaction of the source node as a whole
+    // (see tree_acc_pot_bh_com()): since the sum of the Newtonian interaction and of the correction
+    // is smooth across the boundaries of the periodic cell, the error of this approximation is of the same
+    // order as the error of the multipole expansion. Otherwise, the corrections are computed for each
+    // particle of the source node (see tree_acc_pot_ewald_range()). The other arguments are as
+    // in tree_acc_pot_leaf().
+    template <unsigned Q, typename R>
+    void tree_acc_pot_ewald(size_type src_idx, bool at_com, size_type tgt_size,
+                            const std::array<const F *, NDim + 1u> &p_ptrs, const R &res_ptrs) const
+    {
+        assert(use_ewald());
+        const auto &src_node = m_tree[src_idx];
+        if (!at_com) {
+            tree_acc_pot_ewald_range<Q>(src_node.begin, src_node.end, tgt_size, p_ptrs, res_ptrs);
+            return;
+        }
+        if constexpr (NDim == 3u) {
+            // The COM of the source node, treated as a single source particle.
+            const auto &props = src_node.props;
+            std::array<const F *, NDim + 1u> src_ptrs;
+            for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                src_ptrs[j] = props + j;
+            }
+            tree_acc_pot_ewald_src<Q>(src_ptrs, 1, tgt_size, p_ptrs, res_ptrs);
+            if constexpr (Q == 1u || Q == 2u) {
+                // NOTE: the second-order term of the expansion of the potential correction around the COM. The
+                // Laplacian of the potential correction is the constant 4 pi / box_size**3 (i.e., the contribution
+                // of the neutralising background), thus the isotropic part of this term has the same sign
+                // for all the source nodes, and it would accumulate over them if neglected. The anisotropic
+                // part, as well as the second-order term of the force correction (whose Laplacian vanishes),
+                // average out like the errors of the multipole expansion.
+                const auto inv_box_size = F(1) / m_box_size;
+                const auto pot_tr
+                    = F(2.0943951023931954923) * m_ewald_tr[src_idx] * inv_box_size * inv_box_size * inv_box_size;
+                constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                for (size_type i = 0; i < tgt_size; ++i) {
+                    res_store(res_ptrs, pot_idx, i, 1,
+                              fma_wrap(-p_ptrs[NDim][i], pot_tr, res_load<F>(res_ptrs, pot_idx, i, 1)));
+                }
+            }
+        }
+    }
+    // The outcome of the group-level check of the opening criterion in tree_acc_pot_box_check(): skip if the
+    // source node and its children must be skipped altogether (TreePM cutoff), fail if all the points of the
+    // target box fail the criterion, pass if they all satisfy it, none if the per-particle check is needed.
+    enum class box_check_t { skip, fail, pass, none };
+    // Group-level check of the opening criterion for the source node at index src_idx against the bounding box
+    // tgt_box of the particles of a target node (see tree_acc_pot_bh_check()). In the TreePM mode, this
+    // includes the check of the cutoff radius of the short-range interactions.
+    box_check_t tree_acc_pot_box_check(size_type src_idx, F theta, F theta2, const F *rel_ptr,
+                                       const tgt_box_type &tgt_box) const
+    {
+        const auto &src_node = m_tree[src_idx];
+        const auto props = src_node.props;
+        const auto src_crit = fma_wrap(theta, src_node.com_off, src_node.dim), src_crit2 = src_crit * src_crit;
+        const auto src_r = fma_wrap(src_node.dim, std::sqrt(F(NDim)) / F(2), src_node.com_off),
+                   src_r2 = src_r * src_r;
+        if (m_pm_grid) {
+            // In the TreePM mode, skip the source node and all its children if the sphere enclosing
+            // the source node lies beyond the cutoff radius from all the points of the box.
+            // NOTE: the minimum distance between the box and the periodic images of the COM is
+            // computed dimension by dimension. Along each dimension, the nearest image is the one
+            // returned by min_image() with respect to the centre of the box, as the box is not
+            // larger than the domain.
+            F min_dist2(0);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                const auto centre = (tgt_box[0][j] + tgt_box[1][j]) / F(2);
+                const auto d = std::max(F(0), std::abs(min_image(props[j] - centre)) - (tgt_box[1][j] - centre));
+                min_dist2 = fma_wrap(d, d, min_dist2);
+            }
+            const auto pm_dist = fma_wrap(static_cast<F>(pm_rcut), pm_rs(), src_r);
+            if (min_dist2 > pm_dist * pm_dist) {
+                return box_check_t::skip;
+            }
+        }
+        // The position of the COM used in the group-level check. In periodic mode, this is the periodic
+        // image of the COM nearest to the centre of the box, and the check is skipped if the box is too
+        // large for this image to be the nearest one for all the points of the box.
+        std::array<F, NDim> com;
+        std::copy(props, props + NDim, com.begin());
+        if (m_periodic) {
+            for (std::size_t j = 0; j < NDim; ++j) {
+                const auto centre = (tgt_box[0][j] + tgt_box[1][j]) / F(2);
+                com[j] = centre + min_image(props[j] - centre);
+                if (tgt_box[1][j] - centre + std::abs(com[j] - centre) >= m_box_size / F(2)) {
+                    return box_check_t::none;
+                }
+            }
+        }
+        // Minimum and maximum square distances of the COM from the box.
+        F min_dist2(0), max_dist2(0);
+        for (std::size_t j = 0; j < NDim; ++j) {
+            const auto d_lo = com[j] - tgt_box[0][j], d_hi = tgt_box[1][j] - com[j];
+            // NOTE: at most one of d_lo and d_hi is negative, in which case the COM
+            // lies outside the box along the current dimension.
+            const auto d_min = std::max(F(0), std::max(-d_lo, -d_hi)), d_max = std::max(std::abs(d_lo), std::abs(d_hi));
+            min_dist2 = fma_wrap(d_min, d_min, min_dist2);
+            max_dist2 = fma_wrap(d_max, d_max, max_dist2);
+        }
+        if (rel_ptr) {
+            // NOTE: the relative criterion depends on the accelerations of the target
+            // particles, we can only establish if they all lie within the sphere enclosing
+            // the source node.
+            return src_r2 >= max_dist2 ? box_check_t::fail : box_check_t::none;
+        }
+        if (src_crit2 >= theta2 * max_dist2) {
+            return box_check_t::fail;
+        }
+        return src_crit2 < theta2 * min_dist2 ? box_check_t::pass : box_check_t::none;
+    }
     // Function to check if a source node satisfies the BH criterion and, possibly, to compute the
     // accelerations/potentials due to that source node. src_idx is the index, in the tree structure, of the source
-    // node, theta2 the square of the opening angle, eps2 the square of the softening length, tgt_size the number of
-    // particles in the target node, p_ptrs pointers to the coordinates/masses of the particles in the target node,
+    // node, theta the opening angle, theta2 its square, eps2 the square of the softening length, tgt_size the number
+    // of particles in the target node, p_ptrs pointers to the coordinates/masses of the particles in the target node,
+    // tgt_eps a pointer to their softening lengths (null if per-particle softening lengths are not in use),
     // res_ptrs pointers to the output arrays. The return value is the index of the next source node in the tree
-    // traversal. Q indicates which quantities will be computed (accs, potentials, or both).
-    template <unsigned Q>
-    size_type tree_acc_pot_bh_check(size_type src_idx, F theta2, F eps2, size_type tgt_size,
-                                    const std::array<const F *, NDim + 1u> &p_ptrs,
-                                    const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+    // traversal. Q indicates which quantities will be computed (accs, potentials, or both).
+    //
+    // The BH criterion is satisfied by a target particle if dim / (dist - com_off) < theta, where dist is the distance
+    // of the particle from the COM of the source node, and dim and com_off are the dimension and the COM offset of the
+    // source node (see the tree node structure). That is, the criterion takes into account the actual extent of the
+    // particle distribution in the source node, and it becomes more conservative the farther the COM is from the
+    // centre of the distribution (Barnes, 1994). In order to avoid square roots in the check, the criterion is
+    // evaluated in the equivalent squared form (dim + theta * com_off)**2 < theta2 * dist**2.
+    //
+    // If rel_ptr is not null, the relative criterion will be used instead. rel_ptr must then point to the values
+    // alpha * |a_old| / G for the particles in the target node (see acc_pot_rel_mac_prep()), and the criterion
+    // is satisfied by a target particle if G * M / dist**2 * (dim / dist)**2 <= alpha * |a_old|, where M is the mass
+    // of the source node (Springel, 2005). That is, the error due to the truncation of the multipole expansion must
+    // be small with respect to the total acceleration of the particle. The relative criterion is evaluated in the
+    // form M * dim**2 <= rel_ptr[i] * dist**4. Additionally, the target particle must lie outside the sphere
+    // centred on the COM enclosing all the particles of the source node, as the multipole expansion would
+    // not converge otherwise.
+    //
+    // If tgt_box is not null, it must point to the bounding box of the particles of the target node (see
+    // tgt_box_type). Before the per-particle check, the criterion is then evaluated once using the minimum and
+    // maximum distances of the COM of the source node from the box: if all the points of the box fail the
+    // criterion, the source node is opened straight away, if they all satisfy it, the per-particle check is skipped.
+    // The per-particle check is run only if the box straddles the critical distance.
+    //
+    // If lb is not null, the interactions with a leaf source node which fails the criterion are evaluated in batch
+    // (see tree_acc_pot_open_leaf()).
+    //
+    // If rec is not null, the outcome of the check will be recorded in the interaction list rec. If CheckMAC
+    // is false, the source node is assumed to satisfy the opening criterion without checking it (this is used when
+    // replaying cached interaction lists).
+    //
+    // If err_ptr is not null, the bounds of the truncation errors of the accelerations are accumulated into it
+    // when the source node satisfies the criterion (see tree_acc_pot_bh_err()).
+    template <unsigned Q, bool CheckMAC = true, typename R>
+    size_type tree_acc_pot_bh_check(size_type src_idx, F theta, F theta2, F eps2, const F *rel_ptr,
+                                    const tgt_box_type *tgt_box, ilist_type *rec, leaf_batch_type *lb,
+                                    size_type tgt_size,
+                                    const std::array<const F *, NDim + 1u> &p_ptrs, const F *tgt_eps,
+                                    const R &res_ptrs, F *err_ptr) const
     {
         // Temporary vectors to store the data computed during the BH criterion check.
         // We will re-use this data later in tree_acc_pot_bh_com().
         auto &tmp_vecs = acc_pot_tmp_vecs<Q>();
         static_assert(nvecs_tmp<Q> == std::tuple_size_v<std::remove_reference_t<decltype(tmp_vecs)>>);
         std::array<F *, nvecs_tmp<Q>> tmp_ptrs;
-        // NOTE: the size of the vectors in tgt_tmp_data() might be
-        // greater than tgt_size, due to SIMD padding. Fetch the
-        // actual size.
-        const auto pdata_size = tgt_tmp_data()[0].size();
         // Prepare the temporary data.
         if constexpr (Q == 0u || Q == 2u) {
             // Q == 0 or 2: accelerations are requested.
             for (std::size_t j = 0; j < NDim + 1u; ++j) {
-                tmp_vecs[j].resize(pdata_size);
+                tmp_vecs[j].resize(tgt_size);
                 tmp_ptrs[j] = tmp_vecs[j].data();
             }
         }
@@ -2301,7 +4049,7 @@ private:
             // Establish the index of the dist values in the temp data:
             // 0 if only the potentials are requested, NDim + 1 otherwise.
             constexpr auto dist_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim + 1u);
-            tmp_vecs[dist_idx].resize(pdata_size);
+            tmp_vecs[dist_idx].resize(tgt_size);
             tmp_ptrs[dist_idx] = tmp_vecs[dist_idx].data();
         }
         // Local cache.
@@ -2310,19 +4058,65 @@ private:
         const auto n_children_src = src_node.n_children;
         // Copy locally the properties of the source node.
         const auto props = src_node.props;
-        // Copy locally the dim2 of the source node.
-        const auto src_dim2 = src_node.dim2;
+        // Compute the square of the critical distance of the source node (scaled by theta).
+        const auto src_crit = fma_wrap(theta, src_node.com_off, src_node.dim), src_crit2 = src_crit * src_crit;
+        // The quantities needed by the relative criterion: M * dim**2 and the square of the
+        // radius of the sphere enclosing the source node.
+        const auto src_mdim2 = props[NDim] * src_node.dim * src_node.dim,
+                   src_r = fma_wrap(src_node.dim, std::sqrt(F(NDim)) / F(2), src_node.com_off),
+                   src_r2 = src_r * src_r;
+        // The group-level check on the bounding box of the target node. box_fail will be set to true if
+        // all the target particles fail the opening criterion, box_pass if they all satisfy it.
+        bool box_fail = false, box_pass = false;
+        if constexpr (CheckMAC) {
+            if (tgt_box) {
+                const auto bc = tree_acc_pot_box_check(src_idx, theta, theta2, rel_ptr, *tgt_box);
+                if (bc == box_check_t::skip) {
+                    return static_cast<size_type>(src_idx + n_children_src + 1u);
+                }
+                box_fail = bc == box_check_t::fail;
+                box_pass = bc == box_check_t::pass;
+            }
+        } else {
+            ignore(tgt_box);
+        }
+        // Helper to check if the target particle(s) starting at index i fail the opening criterion.
+        // dist2 is the square of the distance(s) from the COM of the source node, either as a scalar
+        // or as a SIMD batch.
+        auto mac_fail = [src_crit2, theta2, rel_ptr, src_mdim2, src_r2, box_pass, tgt_size](const auto &dist2,
+                                                                                             size_type i) {
+            using d_type = std::remove_cv_t<std::remove_reference_t<decltype(dist2)>>;
+            if constexpr (!CheckMAC) {
+                ignore(src_crit2, theta2, rel_ptr, src_mdim2, src_r2, box_pass, tgt_size, dist2, i);
+                return false;
+            } else if (box_pass) {
+                return false;
+            } else if constexpr (std::is_same_v<d_type, F>) {
+                if (rel_ptr) {
+                    return src_mdim2 > rel_ptr[i] * dist2 * dist2 || src_r2 >= dist2;
+                }
+                return src_crit2 >= theta2 * dist2;
+            } else {
+                if (rel_ptr) {
+                    const auto w = tgt_load<d_type>(rel_ptr + i, static_cast<size_type>(tgt_size - i));
+                    return xsimd::any((d_type(src_mdim2) > w * dist2 * dist2) | (d_type(src_r2) >= dist2));
+                }
+                return xsimd::any(d_type(src_crit2) >= d_type(theta2) * dist2);
+            }
+        };
         // The flag for the BH criterion check. Initially set to true,
         // it will be set to false if at least one particle in the
         // target node fails the check.
         bool bh_flag = true;
-        if constexpr (simd_enabled && NDim == 3u) {
+        if (box_fail) {
+            // All the particles in the target node fail the check, no need to look at them one by one.
+            bh_flag = false;
+        } else if constexpr (simd_enabled && NDim == 3u) {
             // The SIMD-accelerated version.
             using batch_type = xsimd::simd_type<F>;
             constexpr auto batch_size = batch_type::size;
             // Splatted vector versions of the scalar variables.
-            const batch_type src_dim2_vec(src_dim2), theta2_vec(theta2), eps2_vec(eps2), x_com_vec(props[0]),
-                y_com_vec(props[1]), z_com_vec(props[2]);
+            const batch_type eps2_vec(eps2), x_com_vec(props[0]), y_com_vec(props[1]), z_com_vec(props[2]);
             // Pointers to the coordinates.
             const auto [x_ptr, y_ptr, z_ptr, m_ptr] = p_ptrs;
             (void)m_ptr;
@@ -2332,11 +4126,17 @@ private:
                 // Pointers to the temporary data.
                 const auto [tmp_x, tmp_y, tmp_z, tmp_dist3] = tmp_ptrs;
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    const auto diff_x = x_com_vec - batch_type(x_ptr + i, xsimd::aligned_mode{}),
-                               diff_y = y_com_vec - batch_type(y_ptr + i, xsimd::aligned_mode{}),
-                               diff_z = z_com_vec - batch_type(z_ptr + i, xsimd::aligned_mode{});
+                    const auto n = static_cast<size_type>(tgt_size - i);
+                    auto diff_x = x_com_vec - tgt_load<batch_type>(x_ptr + i, n),
+                         diff_y = y_com_vec - tgt_load<batch_type>(y_ptr + i, n),
+                         diff_z = z_com_vec - tgt_load<batch_type>(z_ptr + i, n);
+                    if (m_periodic) {
+                        diff_x = min_image(diff_x);
+                        diff_y = min_image(diff_y);
+                        diff_z = min_image(diff_z);
+                    }
                     auto dist2 = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
-                    if (xsimd::any(src_dim2_vec >= theta2_vec * dist2)) {
+                    if (mac_fail(dist2, i)) {
                         // At least one particle in the current batch fails the BH criterion
                         // check. Mark the bh_flag as false, then break out.
                         bh_flag = false;
@@ -2344,13 +4144,13 @@ private:
                     }
                     // Add the softening length.
                     dist2 += eps2_vec;
-                    diff_x.store_aligned(tmp_x + i);
-                    diff_y.store_aligned(tmp_y + i);
-                    diff_z.store_aligned(tmp_z + i);
+                    tgt_store(tmp_x + i, n, diff_x);
+                    tgt_store(tmp_y + i, n, diff_y);
+                    tgt_store(tmp_z + i, n, diff_z);
                     if constexpr (use_fast_inv_sqrt<batch_type>) {
-                        inv_sqrt_3(dist2).store_aligned(tmp_dist3 + i);
+                        tgt_store(tmp_dist3 + i, n, inv_sqrt_3(dist2));
                     } else {
-                        (xsimd_sqrt(dist2) * dist2).store_aligned(tmp_dist3 + i);
+                        tgt_store(tmp_dist3 + i, n, xsimd_sqrt(dist2) * dist2);
                     }
                 }
             } else if constexpr (Q == 1u) {
@@ -2359,11 +4159,17 @@ private:
                 // Pointer to the temporary data.
                 const auto tmp = tmp_ptrs[0];
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    const auto diff_x = x_com_vec - batch_type(x_ptr + i, xsimd::aligned_mode{}),
-                               diff_y = y_com_vec - batch_type(y_ptr + i, xsimd::aligned_mode{}),
-                               diff_z = z_com_vec - batch_type(z_ptr + i, xsimd::aligned_mode{});
+                    const auto n = static_cast<size_type>(tgt_size - i);
+                    auto diff_x = x_com_vec - tgt_load<batch_type>(x_ptr + i, n),
+                         diff_y = y_com_vec - tgt_load<batch_type>(y_ptr + i, n),
+                         diff_z = z_com_vec - tgt_load<batch_type>(z_ptr + i, n);
+                    if (m_periodic) {
+                        diff_x = min_image(diff_x);
+                        diff_y = min_image(diff_y);
+                        diff_z = min_image(diff_z);
+                    }
                     auto dist2 = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
-                    if (xsimd::any(src_dim2_vec >= theta2_vec * dist2)) {
+                    if (mac_fail(dist2, i)) {
                         // At least one particle in the current batch fails the BH criterion
                         // check. Mark the bh_flag as false, then break out.
                         bh_flag = false;
@@ -2372,9 +4178,9 @@ private:
                     // Add the softening length.
                     dist2 += eps2_vec;
                     if constexpr (use_fast_inv_sqrt<batch_type>) {
-                        inv_sqrt(dist2).store_aligned(tmp + i);
+                        tgt_store(tmp + i, n, inv_sqrt(dist2));
                     } else {
-                        xsimd_sqrt(dist2).store_aligned(tmp + i);
+                        tgt_store(tmp + i, n, xsimd_sqrt(dist2));
                     }
                 }
             } else {
@@ -2383,11 +4189,17 @@ private:
                 // Pointers to the temporary data.
                 const auto [tmp_x, tmp_y, tmp_z, tmp_dist3, tmp_dist] = tmp_ptrs;
                 for (size_type i = 0; i < tgt_size; i += batch_size) {
-                    const auto diff_x = x_com_vec - batch_type(x_ptr + i, xsimd::aligned_mode{}),
-                               diff_y = y_com_vec - batch_type(y_ptr + i, xsimd::aligned_mode{}),
-                               diff_z = z_com_vec - batch_type(z_ptr + i, xsimd::aligned_mode{});
+                    const auto n = static_cast<size_type>(tgt_size - i);
+                    auto diff_x = x_com_vec - tgt_load<batch_type>(x_ptr + i, n),
+                         diff_y = y_com_vec - tgt_load<batch_type>(y_ptr + i, n),
+                         diff_z = z_com_vec - tgt_load<batch_type>(z_ptr + i, n);
+                    if (m_periodic) {
+                        diff_x = min_image(diff_x);
+                        diff_y = min_image(diff_y);
+                        diff_z = min_image(diff_z);
+                    }
                     auto dist2 = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
-                    if (xsimd::any(src_dim2_vec >= theta2_vec * dist2)) {
+                    if (mac_fail(dist2, i)) {
                         // At least one particle in the current batch fails the BH criterion
                         // check. Mark the bh_flag as false, then break out.
                         bh_flag = false;
@@ -2395,26 +4207,31 @@ private:
                     }
                     // Add the softening length.
                     dist2 += eps2_vec;
-                    diff_x.store_aligned(tmp_x + i);
-                    diff_y.store_aligned(tmp_y + i);
-                    diff_z.store_aligned(tmp_z + i);
+                    tgt_store(tmp_x + i, n, diff_x);
+                    tgt_store(tmp_y + i, n, diff_y);
+                    tgt_store(tmp_z + i, n, diff_z);
                     if constexpr (use_fast_inv_sqrt<batch_type>) {
                         const auto inv_dist = inv_sqrt(dist2);
-                        (inv_dist * inv_dist * inv_dist).store_aligned(tmp_dist3 + i);
-                        inv_dist.store_aligned(tmp_dist + i);
+                        tgt_store(tmp_dist3 + i, n, inv_dist * inv_dist * inv_dist);
+                        tgt_store(tmp_dist + i, n, inv_dist);
                     } else {
                         const auto dist = xsimd_sqrt(dist2);
-                        (dist2 * dist).store_aligned(tmp_dist3 + i);
-                        dist.store_aligned(tmp_dist + i);
+                        tgt_store(tmp_dist3 + i, n, dist2 * dist);
+                        tgt_store(tmp_dist + i, n, dist);
                     }
                 }
             }
+        } else if constexpr (simd_enabled && NDim == 2u) {
+            bh_flag = tree_acc_pot_bh_check_simd<Q>(props, eps2, tgt_size, p_ptrs, tmp_ptrs, mac_fail);
         } else {
             // The scalar version.
             for (size_type i = 0; i < tgt_size; ++i) {
                 F dist2(0);
                 for (std::size_t j = 0; j < NDim; ++j) {
-                    const auto diff = props[j] - p_ptrs[j][i];
+                    auto diff = props[j] - p_ptrs[j][i];
+                    if (m_periodic) {
+                        diff = min_image(diff);
+                    }
                     if constexpr (Q == 0u || Q == 2u) {
                         // Store the differences for later use, if we are computing
                         // accelerations.
@@ -2422,7 +4239,7 @@ private:
                     }
                     dist2 = fma_wrap(diff, diff, dist2);
                 }
-                if (src_dim2 >= theta2 * dist2) {
+                if (mac_fail(dist2, i)) {
                     // At least one of the particles in the target
                     // node is too close to the COM. Set the flag
                     // to false and exit.
@@ -2450,7 +4267,38 @@ private:
         if (bh_flag) {
             // The source node satisfies the BH criterion for all the particles of the target node. Add the
             // interaction due to the com of the source node.
-            tree_acc_pot_bh_com<Q>(src_idx, tgt_size, p_ptrs, tmp_ptrs, res_ptrs);
+            if (compact_sk || m_pm_grid || tgt_eps) {
+                // NOTE: in the TreePM mode, the short-range factors are applied by the
+                // source particles kernel, treating the COM as a particle. The same goes for
+                // the compact-support softening kernels and for the per-particle softening
+                // lengths, the COM being softened with the largest softening length in the source node.
+                std::array<const F *, NDim + 1u> com_ptrs;
+                for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                    com_ptrs[j] = props + j;
+                }
+                tree_acc_pot_src<Q>(eps2, com_ptrs, tgt_eps ? &src_node.eps : nullptr, 1, tgt_size, p_ptrs, tgt_eps,
+                                    res_ptrs);
+            } else {
+                tree_acc_pot_bh_com<Q>(src_idx, tgt_size, p_ptrs, tmp_ptrs, res_ptrs);
+            }
+            // Add the contributions of the higher-order multipole moments, if needed.
+            if constexpr (MPOrder > 1u) {
+                // NOTE: with per-particle softening lengths, the higher-order terms are
+                // softened with the largest softening length in the source node. With the
+                // compact-support kernels, the higher-order terms are Newtonian (the
+                // accepted nodes are, as a rule, well outside the support of the kernel).
+                tree_acc_pot_bh_mp<Q>(src_idx, compact_sk ? F(0) : (tgt_eps ? src_node.eps * src_node.eps : eps2),
+                                      tgt_size, p_ptrs, res_ptrs);
+            }
+            if (err_ptr) {
+                tree_acc_pot_bh_err(src_idx, tgt_size, p_ptrs, err_ptr);
+            }
+            if (use_ewald()) {
+                tree_acc_pot_ewald<Q>(src_idx, true, tgt_size, p_ptrs, res_ptrs);
+            }
+            if (rec) {
+                rec->nodes.push_back(src_idx);
+            }
             // We can now skip all the children of the source node.
             return static_cast<size_type>(src_idx + n_children_src + 1u);
         }
@@ -2458,73 +4306,988 @@ private:
         // node, in which case we need to compute all the pairwise interactions.
         if (!n_children_src) {
             // Leaf node.
-            tree_acc_pot_leaf<Q>(eps2, src_idx, tgt_size, p_ptrs, res_ptrs);
+            tree_acc_pot_open_leaf<Q>(eps2, src_idx, lb, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+            if (use_ewald()) {
+                tree_acc_pot_ewald<Q>(src_idx, false, tgt_size, p_ptrs, res_ptrs);
+            }
+            if (rec) {
+                rec->add_range(src_node.begin, src_node.end);
+            }
         }
         // In any case, we keep traversing the tree moving to the next node in depth-first order.
         return static_cast<size_type>(src_idx + 1u);
     }
-    // Tree traversal for the computation of the accelerations/potentials. theta2 is the square of the opening angle,
-    // eps2 the square of the softening length, tgt_size the number of particles in the target node, tgt_code its code,
-    // p_ptrs are pointers to the coordinates/masses of the particles in the target node, res_ptrs pointers to the
-    // output arrays. Q indicates which quantities will be computed (accs, potentials, or both).
-    template <unsigned Q>
-    void tree_acc_pot(F theta2, F eps2, size_type tgt_size, UInt tgt_code,
-                      const std::array<const F *, NDim + 1u> &p_ptrs,
-                      const std::array<F *, nvecs_res<Q>> &res_ptrs) const
+    // Tree traversal for the computation of the accelerations/potentials. theta is the opening angle, theta2 its
+    // square, eps2 the square of the softening length, rel_ptr the data for the relative opening criterion and
+    // rec the interaction list in which the traversal will be recorded (see tree_acc_pot_bh_check()), batch_leaves
+    // a flag to signal the batched evaluation of the opened leaves (see leaf_batch_type), tgt_size the number of
+    // particles in the target node, tgt_idx the index of the target node in the tree structure, p_ptrs are pointers
+    // to the coordinates/masses of the particles in the target node, tgt_eps a pointer to their softening lengths
+    // (null if per-particle softening lengths are not in use), res_ptrs pointers to the output arrays. Q indicates
+    // which quantities will be computed (accs, potentials, or both). If err_ptr is not null, the bounds of the
+    // truncation errors of the accelerations are accumulated into it (see tree_acc_pot_bh_err()).
+    template <unsigned Q, typename R>
+    void tree_acc_pot(F theta, F theta2, F eps2, const F *rel_ptr, ilist_type *rec, bool batch_leaves,
+                      size_type tgt_size, size_type tgt_idx, const std::array<const F *, NDim + 1u> &p_ptrs,
+                      const F *tgt_eps, const R &res_ptrs, F *err_ptr) const
     {
         assert(!m_tree.empty());
-        // Tree level of the target node.
-        // NOTE: the target level is available in the tree structure, so in principle we could get
-        // it from there. However, the target node is taken from the list of critical nodes, which
-        // currently does not store the target node index. Let's keep this in mind if we change
-        // the tree building routine.
-        const auto tgt_level = tree_level<NDim>(tgt_code);
+        // Setup the batch for the opened leaves, if requested.
+        leaf_batch_type lb_storage, *lb = nullptr;
+        if (batch_leaves) {
+            auto &lb_data = leaf_batch_data();
+            for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                lb_data[j].resize(leaf_batch_max);
+                lb_storage.ptrs[j] = lb_data[j].data();
+            }
+            lb_storage.eps = nullptr;
+            if (tgt_eps) {
+                lb_data[NDim + 1u].resize(leaf_batch_max);
+                lb_storage.eps = lb_data[NDim + 1u].data();
+            }
+            lb_storage.size = 0;
+            lb = &lb_storage;
+        }
+        // Compute the bounding box of the target node, for the group-level check
+        // of the opening criterion in tree_acc_pot_bh_check().
+        assert(tgt_size > 0u);
+        tgt_box_type tgt_box;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            const auto mm = std::minmax_element(p_ptrs[j], p_ptrs[j] + tgt_size);
+            tgt_box[0][j] = *mm.first;
+            tgt_box[1][j] = *mm.second;
+        }
         // Total size of the tree.
         const auto tree_size = static_cast<size_type>(m_tree.size());
+        assert(tgt_idx < tree_size);
         // Start the iteration over the source nodes.
         for (size_type src_idx = 0; src_idx < tree_size;) {
             // Get a reference to the current source node.
             const auto &src_node = m_tree[src_idx];
-            // Extract the code of the source node.
-            const auto src_code = src_node.code;
             // Number of children of the source node.
             const auto n_children_src = src_node.n_children;
-            // Extract the level of the source node.
-            const auto src_level = src_node.level;
-            // Compute the shifted target code. This is tgt_code
-            // shifted down by the difference between tgt_level
-            // and src_level. For instance, in an octree,
-            // if the target code is 1 000 000 001 000, then tgt_level
-            // is 4, and, if src_level is 2, then the shifted code
-            // will be 1 000 000.
-            const auto s_tgt_code = static_cast<UInt>(tgt_code >> ((tgt_level - src_level) * NDim));
-            if (s_tgt_code == src_code) {
-                // The shifted target code coincides with the source code. This means
-                // that either the source node is an ancestor of the target node, or it is
-                // the target node itself. In the former cases, we just have to continue
-                // the depth-first traversal by setting ++src_idx. In the latter case,
+            // NOTE: the nodes are stored in depth-first order, hence the source node is an ancestor
+            // of the target node (or the target node itself) if and only if tgt_idx is in the
+            // [src_idx, src_idx + n_children_src] range. If src_idx > tgt_idx, the unsigned
+            // subtraction below wraps around to a value greater than n_children_src.
+            if (static_cast<size_type>(tgt_idx - src_idx) <= n_children_src) {
+                // If the source node is an ancestor of the target node, we just have to continue
+                // the depth-first traversal by setting ++src_idx. If it is the target node,
                 // we want to bump up src_idx by n_children_src + 1 in order to skip
                 // the target node and all its children. We will compute later the self
                 // interactions in the target node.
-                const auto tgt_eq_src_mask = static_cast<size_type>(-(src_code == tgt_code));
+                const auto tgt_eq_src_mask = static_cast<size_type>(-(src_idx == tgt_idx));
                 src_idx += 1u + (n_children_src & tgt_eq_src_mask);
             } else {
                 // The source node is not an ancestor of the target. We need to run the BH criterion
                 // check. The tree_acc_pot_bh_check() function will return the index of the next node
                 // in the traversal.
-                src_idx = tree_acc_pot_bh_check<Q>(src_idx, theta2, eps2, tgt_size, p_ptrs, res_ptrs);
+                src_idx = tree_acc_pot_bh_check<Q>(src_idx, theta, theta2, eps2, rel_ptr, &tgt_box, rec, lb, tgt_size,
+                                                   p_ptrs, tgt_eps, res_ptrs, err_ptr);
+            }
+        }
+
+        // Compute the interactions with the leaves still in the batch.
+        if (lb) {
+            tree_acc_pot_flush_leaves<Q>(eps2, *lb, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+        }
+
+        // Compute the self interactions within the target node.
+        tree_self_interactions<Q>(eps2, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+        if (use_ewald()) {
+            tree_acc_pot_ewald<Q>(tgt_idx, false, tgt_size, p_ptrs, res_ptrs);
+        }
+    }
+    // Compute the total accelerations/potentials on the target node at index cn_idx in the list of critical nodes,
+    // replaying the interaction list cached in m_ilist instead of traversing the tree. The other arguments
+    // are the same as in tree_acc_pot().
+    template <unsigned Q, typename R>
+    void tree_acc_pot_ilist(size_type cn_idx, F eps2, size_type tgt_size,
+                            const std::array<const F *, NDim + 1u> &p_ptrs, const R &res_ptrs, F *err_ptr) const
+    {
+        assert(cn_idx + 1u < m_ilist.node_offsets.size());
+        const auto tgt_eps = tgt_eps_ptr(cn_idx);
+        // The source nodes whose multipole expansions are used. These are known
+        // to satisfy the opening criterion, hence we can skip the check.
+        for (auto k = m_ilist.node_offsets[cn_idx]; k < m_ilist.node_offsets[cn_idx + 1u]; ++k) {
+            tree_acc_pot_bh_check<Q, false>(m_ilist.nodes[k], F(0), F(0), eps2, nullptr, nullptr, nullptr, nullptr,
+                                            tgt_size, p_ptrs, tgt_eps, res_ptrs, err_ptr);
+        }
+        // The direct interactions with the source particles.
+        for (auto k = m_ilist.range_offsets[cn_idx]; k < m_ilist.range_offsets[cn_idx + 1u]; ++k) {
+            const auto [r_begin, r_end] = m_ilist.ranges[k];
+            if constexpr (R::mixed) {
+                // NOTE: in the mixed-precision mode, the recorded ranges (which can span many leaves) are split
+                // in chunks no larger than the batches of the leaf kernel, so that the contributions are added
+                // to the compensated sums after at most leaf_batch_max terms, as in tree_acc_pot().
+                for (auto b = r_begin; b < r_end;) {
+                    const auto e
+                        = static_cast<size_type>(b + std::min(leaf_batch_max, static_cast<size_type>(r_end - b)));
+                    tree_acc_pot_range<Q>(eps2, b, e, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+                    if (use_ewald()) {
+                        tree_acc_pot_ewald_range<Q>(b, e, tgt_size, p_ptrs, res_ptrs);
+                    }
+                    b = e;
+                }
+            } else {
+                tree_acc_pot_range<Q>(eps2, r_begin, r_end, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+                if (use_ewald()) {
+                    tree_acc_pot_ewald_range<Q>(r_begin, r_end, tgt_size, p_ptrs, res_ptrs);
+                }
+            }
+        }
+        // Compute the self interactions within the target node.
+        tree_self_interactions<Q>(eps2, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+        if (use_ewald()) {
+            tree_acc_pot_ewald<Q>(m_crit_idx[cn_idx], false, tgt_size, p_ptrs, res_ptrs);
+        }
+    }
+    // Pointer to the softening lengths of the particles of the target node at index cn_idx in m_crit_nodes
+    // (null if per-particle softening lengths are not in use).
+    const F *tgt_eps_ptr(size_type cn_idx) const
+    {
+        return m_eps.empty() ? nullptr : m_eps.data() + get<1>(m_crit_nodes[cn_idx]);
+    }
+    // Compute the accelerations/potentials on the particles of a target node. out is the array of output
+    // iterators, G the grav const, cn_idx the index of the target node in m_crit_nodes. The data of the target
+    // node is read in place from m_parts, and the results are accumulated in thread-local storage,
+    // which is zeroed out. Then f(p_ptrs, res_ptrs) is invoked to accumulate the accelerations/potentials,
+    // which are finally multiplied by G and written to out.
+    //
+    // If mixed is true and F is narrower than double, f is passed pointers of type res_ptrs_type<Q, true>, and the
+    // results are accumulated as compensated sums, whose two terms are added and multiplied by G in acc_fp_type
+    // before being written to out. Otherwise, the pointers are of type res_ptrs_type<Q, false>.
+    //
+    // If out is made of plain pointers, the results are accumulated directly into (zeroed) out, skipping the
+    // thread-local storage and the final copy, and the range of out belonging to the target node is then
+    // multiplied by G in place. This requires f not to read from the range of out being written, thus the caller
+    // can disable it via the in_place flag (e.g., in the relative opening criterion the previous accelerations
+    // might alias out).
+    template <unsigned Q, typename It, typename Func>
+    void acc_pot_cnode(const std::array<It, nvecs_res<Q>> &out, F G, size_type cn_idx, bool mixed,
+                       [[maybe_unused]] bool in_place, const Func &f) const
+    {
+        const auto tgt_begin = get<1>(m_crit_nodes[cn_idx]);
+        const auto tgt_size = static_cast<size_type>(get<2>(m_crit_nodes[cn_idx]) - tgt_begin);
+        bool direct = false;
+        if constexpr (std::is_same_v<It, F *>) {
+            direct = in_place;
+        }
+        // Prepare the vectors containing the result.
+        res_ptrs_type<Q, false> res_ptrs{};
+        if (direct) {
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                res_ptrs[j] = &*(out[j] + boost::numeric_cast<it_diff_type<It>>(tgt_begin));
+                std::fill(res_ptrs[j], res_ptrs[j] + tgt_size, F(0));
+            }
+        } else {
+            auto &tmp_res = acc_pot_tmp_res<Q>();
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                // Resize and fill with zeroes.
+                tmp_res[j].resize(tgt_size);
+                std::fill(tmp_res[j].data(), tmp_res[j].data() + tgt_size, F(0));
+                res_ptrs[j] = tmp_res[j].data();
+            }
+        }
+        // Pointers to the target node data.
+        std::array<const F *, NDim + 1u> p_ptrs;
+        for (std::size_t j = 0; j < NDim + 1u; ++j) {
+            p_ptrs[j] = m_parts[j].data() + tgt_begin;
+        }
+        if constexpr (!std::is_same_v<acc_fp_type, F>) {
+            if (mixed) {
+                // Prepare the compensation terms for the mixed-precision mode.
+                res_ptrs_type<Q, true> res_ptrs_mp{};
+                auto &tmp_cmp = acc_pot_tmp_cmp<Q>();
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    res_ptrs_mp[j] = res_ptrs[j];
+                    tmp_cmp[j].resize(tgt_size);
+                    std::fill(tmp_cmp[j].data(), tmp_cmp[j].data() + tgt_size, F(0));
+                    res_ptrs_mp.cmp[j] = tmp_cmp[j].data();
+                }
+                // Do the computation.
+                f(p_ptrs, res_ptrs_mp);
+                // Write out the result, adding the two terms of the compensated sums
+                // and multiplying by G in acc_fp_type.
+                // NOTE: in the direct mode res_ptrs points into out, but each element
+                // is read before being overwritten.
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    const auto out_it = out[j] + boost::numeric_cast<it_diff_type<It>>(tgt_begin);
+                    for (size_type i = 0; i < tgt_size; ++i) {
+                        out_it[i] = static_cast<F>((acc_fp_type(res_ptrs[j][i]) + res_ptrs_mp.cmp[j][i])
+                                                   * static_cast<acc_fp_type>(G));
+                    }
+                }
+                return;
+            }
+        } else {
+            ignore(mixed);
+        }
+        // Do the computation.
+        f(p_ptrs, res_ptrs);
+        if (direct) {
+            // Multiply in place by G, if needed.
+            if (G != F(1)) {
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    std::transform(res_ptrs[j], res_ptrs[j] + tgt_size, res_ptrs[j],
+                                   [G](const F &x) { return x * G; });
+                }
+            }
+            return;
+        }
+        // Write out the result, multiplying by G if needed.
+        for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+            const auto out_it = out[j] + boost::numeric_cast<it_diff_type<It>>(tgt_begin);
+            if (G != F(1)) {
+                std::transform(res_ptrs[j], res_ptrs[j] + tgt_size, out_it, [G](const F &x) { return x * G; });
+            } else {
+                std::copy(res_ptrs[j], res_ptrs[j] + tgt_size, out_it);
+            }
+        }
+    }
+    // Add the long-range accelerations/potentials of the TreePM mode, computed by the PM solver (see pm.hpp)
+    // and multiplied by G, to the values in out. out is the array of output iterators, indexed in internal order.
+    template <unsigned Q, typename It>
+    void acc_pot_pm(const std::array<It, nvecs_res<Q>> &out, F G) const
+    {
+        simple_timer st("PM long-range accs/pots computation");
+        if constexpr (NDim == 3u) {
+            const auto np = nparts();
+            std::array<const F *, NDim + 1u> p_ptrs;
+            for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                p_ptrs[j] = m_parts[j].data();
+            }
+            std::array<std::vector<F>, nvecs_res<Q>> pm_res;
+            std::array<F *, nvecs_res<Q>> pm_ptrs;
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                pm_res[j].resize(boost::numeric_cast<decltype(pm_res[j].size())>(np));
+                pm_ptrs[j] = pm_res[j].data();
+            }
+            pm_acc_pot<Q>(static_cast<std::size_t>(m_pm_grid), m_box_size, pm_rs(), p_ptrs,
+                          static_cast<std::size_t>(np), pm_ptrs);
+            // NOTE: we will be indexing into It up to np.
+            it_diff_check<It>(np);
+            tbb::parallel_for(tbb::blocked_range(size_type(0), np), [&out, &pm_res, G](const auto &range) {
+                for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                    const auto out_it = out[j] + static_cast<it_diff_type<It>>(range.begin());
+                    for (auto i = range.begin(); i != range.end(); ++i) {
+                        out_it[static_cast<it_diff_type<It>>(i - range.begin())] += G * pm_res[j][i];
+                    }
+                }
+            });
+        } else {
+            // NOTE: the TreePM mode is available only in 3D.
+            ignore(out, G);
+            assert(false);
+        }
+    }
+    // Options for the computation of the accelerations/potentials, other than
+    // the opening angle, the grav const, the softening length and the split vector.
+    struct acc_pot_opts {
+        // Use the dual-tree traversal.
+        bool dual_tree = false;
+        // Use the relative opening criterion, based on the previous accelerations
+        // of the particles, instead of the geometrical one.
+        bool rel_mac = false;
+        // Pointers to the previous accelerations of the particles.
+        std::array<const F *, NDim> old_accs{};
+        // Number of elements available in the arrays pointed to by old_accs.
+        size_type old_accs_size = std::numeric_limits<size_type>::max();
+        // Signal if the previous accelerations are in the original order of the particles
+        // (rather than in the internal order).
+        bool old_accs_ordered = false;
+        // Cache the interaction lists of the critical nodes, and re-use them
+        // in subsequent calls with the same opening angle.
+        bool ilist_cache = false;
+        // Evaluate in batch the interactions with the opened source leaves.
+        bool batch_leaves = false;
+        // Evaluate the interactions once per pair of nodes in the dual-tree traversal.
+        bool mutual = false;
+        // Accumulate the accelerations/potentials as compensated sums (see res_ptrs_type).
+        bool mixed_precision = false;
+        // Number of particles sampled to calibrate the error-controlled evaluation (see acc_pot_err()).
+        size_type calibrate = 0;
+        // Output for the bounds of the truncation errors of the accelerations (see tree_acc_pot_bh_err()),
+        // either as a pointer or as a vector which will be resized to the number of particles.
+        F *acc_errs = nullptr;
+        std::vector<F> *acc_errs_vec = nullptr;
+        // Signal if the error bounds must be written in the original order of the particles
+        // (rather than in the internal order).
+        bool acc_errs_ordered = false;
+    };
+    // Thread-safe copy of the cached interaction lists.
+    ilist_cache_type ilist_copy() const
+    {
+        std::shared_lock lock(m_ilist_mutex);
+        return m_ilist;
+    }
+    // Invoke f(tgt_begin, tgt_end, nodes, ranges) for each critical node whose interaction list is cached (see
+    // ilist_size()). [tgt_begin, tgt_end) is the range of the particles of the critical node, nodes a vector
+    // of the indices (in nodes()) of the accepted source nodes, and ranges a vector of the ranges of the
+    // source particles whose interactions are computed directly. The particle indices are in internal order.
+    // NOTE: this is used only in the tests (see tree_test_access).
+    template <typename Func>
+    void ilist_for_each(Func &&f) const
+    {
+        std::shared_lock lock(m_ilist_mutex);
+        if (m_ilist.tree_gen != m_tree_gen || m_ilist.node_offsets.size() != m_crit_nodes.size() + 1u) {
+            return;
+        }
+        std::vector<size_type> nodes;
+        std::vector<std::array<size_type, 2>> ranges;
+        for (decltype(m_crit_nodes.size()) i = 0; i < m_crit_nodes.size(); ++i) {
+            nodes.assign(m_ilist.nodes.begin() + m_ilist.node_offsets[i],
+                         m_ilist.nodes.begin() + m_ilist.node_offsets[i + 1u]);
+            ranges.assign(m_ilist.ranges.begin() + m_ilist.range_offsets[i],
+                          m_ilist.ranges.begin() + m_ilist.range_offsets[i + 1u]);
+            f(get<1>(m_crit_nodes[i]), get<2>(m_crit_nodes[i]), std::as_const(nodes), std::as_const(ranges));
+        }
+    }
+    // Write the bounds of the truncation errors of the accelerations accumulated in err_ptr for the critical node
+    // starting at tgt_begin and containing tgt_size particles into the output of the error bounds (if requested).
+    void acc_pot_write_errs(const acc_pot_opts &opts, F G, size_type tgt_begin, size_type tgt_size,
+                            const F *err_ptr) const
+    {
+        if (!err_ptr) {
+            return;
+        }
+        const auto abs_G = std::abs(G);
+        for (size_type i = 0; i < tgt_size; ++i) {
+            const auto idx = opts.acc_errs_ordered ? m_perm[tgt_begin + i] : tgt_begin + i;
+            opts.acc_errs[idx] = abs_G * err_ptr[i];
+        }
+    }
+    // Prepare the data for the relative opening criterion for the target node whose particles start at index
+    // tgt_begin (in internal order). tgt_size is the number of particles in the node, alpha the accuracy
+    // parameter of the criterion, G the grav constant. The return value is a pointer to thread-local storage
+    // containing alpha * |a_old| / G for each particle.
+    const F *acc_pot_rel_mac_prep(const acc_pot_opts &opts, F alpha, F G, size_type tgt_begin,
+                                  size_type tgt_size) const
+    {
+        assert(opts.rel_mac);
+        auto &tmp = tgt_tmp_rel_data();
+        tmp.resize(tgt_size);
+        const auto fac = alpha / std::abs(G);
+        for (size_type i = 0; i < tgt_size; ++i) {
+            const auto idx = opts.old_accs_ordered ? m_perm[tgt_begin + i] : tgt_begin + i;
+            F acc2(0);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                acc2 = fma_wrap(opts.old_accs[j][idx], opts.old_accs[j][idx], acc2);
+            }
+            if (!std::isfinite(acc2)) {
+                throw std::domain_error("The relative opening criterion requires finite previous accelerations, but "
+                                        "the square of the norm of the previous acceleration of the particle at index "
+                                        + std::to_string(idx) + " is " + std::to_string(acc2));
+            }
+            tmp[i] = fac * std::sqrt(acc2);
+        }
+        return tmp.data();
+    }
+    // Local expansion of the gravitational field around the expansion centre of a node, used
+    // in the dual-tree traversal. The layout is: the potential (per unit of mass), the acceleration,
+    // and the NDim x NDim Jacobian of the acceleration (in row-major order).
+    // NOTE: a local expansion is the sum of the fields of many source nodes, thus it is stored
+    // (and translated down the tree) in acc_fp_type. The node-node interactions are scalar,
+    // hence this does not affect the performance appreciably.
+    static constexpr std::size_t dt_local_size = 1u + NDim + NDim * NDim;
+    using dt_local_type = std::array<acc_fp_type, dt_local_size>;
+    // Data used during the dual-tree traversal.
+    struct dt_data {
+        // Opening angle and square of the softening length.
+        F theta, eps2;
+        // Flag for the mixed-precision mode (see acc_pot_cnode()).
+        bool mixed;
+        // For each node, the coordinates of its expansion centre (i.e., the COM), the radius of
+        // the sphere centred on the COM enclosing the particles of the node and the extent
+        // of the node for the purpose of the opening criterion (i.e., dim + theta * com_off).
+        std::vector<std::array<F, NDim + 2u>> geo;
+        // For each node, a flag signalling if the node is a critical node.
+        std::vector<char> crit;
+        // The local expansions.
+        std::vector<dt_local_type> locals;
+        // For each critical node, the list of leaf source nodes whose interactions
+        // with the critical node will be computed particle by particle.
+        std::vector<std::vector<size_type>> near;
+        // Data used in the mutual mode (see dt_self_mutual()).
+        bool mutual;
+        // For each node belonging to a critical node, the index of the critical node in m_crit_nodes.
+        std::vector<size_type> owner;
+        // For each critical node (indexed as in m_crit_nodes), the list of pairs of leaves whose mutual
+        // interactions will be computed particle by particle. The first leaf of each pair belongs to
+        // the critical node.
+        std::vector<std::vector<std::array<size_type, 2>>> near_pairs;
+        // The accelerations/potentials from the pairs of leaves (in internal order).
+        // NOTE: these are sums over many pairs of leaves, thus they are stored in acc_fp_type.
+        std::array<std::vector<acc_fp_type>, NDim + 1u> near_res;
+    };
+    // Signal if the operations on the children of the target node at index idx should be run in parallel
+    // during the dual-tree traversal.
+    bool dt_par(size_type idx) const
+    {
+        // NOTE: below this number of particles, the overhead of spawning tasks
+        // is not worth it. The value is a rough guess which would benefit from tuning.
+        constexpr size_type min_par_size = 4096;
+        return m_tree[idx].end - m_tree[idx].begin > min_par_size;
+    }
+    // Invoke f on the index of each child of the node at index idx. If par is true,
+    // the invocations will be run in parallel.
+    template <typename Func>
+    void dt_for_each_child(size_type idx, bool par, const Func &f) const
+    {
+        const auto end = static_cast<size_type>(idx + m_tree[idx].n_children + 1u);
+        if (par) {
+            tbb::task_group tg;
+            for (auto c = static_cast<size_type>(idx + 1u); c < end;
+                 c = static_cast<size_type>(c + m_tree[c].n_children + 1u)) {
+                tg.run([&f, c]() { f(c); });
+            }
+            tg.wait();
+        } else {
+            for (auto c = static_cast<size_type>(idx + 1u); c < end;
+                 c = static_cast<size_type>(c + m_tree[c].n_children + 1u)) {
+                f(c);
+            }
+        }
+    }
+    // Node-node interaction in the dual-tree traversal. If the source node at index s is well separated from the
+    // target node at index t, the field generated by s will be added to the local expansion of t and true will be
+    // returned. Otherwise, false will be returned.
+    //
+    // The nodes are considered well separated if theta * dist > src_dim + theta * (src_off + tgt_r) and
+    // theta * dist > tgt_r, where dist is the distance between the COMs of s and t, src_dim and src_off the dimension
+    // and the COM offset of s, and tgt_r the radius of t. The first condition guarantees that the BH criterion
+    // (in the form used in tree_acc_pot_bh_check()) is satisfied for all the points in t, the second one ensures
+    // that the local expansion around the centre of t converges at least as fast as the multipole expansion of s.
+    // With the compact-support softening kernels, the nodes must also be far enough apart that no pair of particles
+    // is within the support of the kernel (see dt_well_separated()).
+    bool dt_m2l(dt_data &d, size_type t, size_type s) const
+    {
+        if (!dt_well_separated(d, t, s)) {
+            return false;
+        }
+        dt_m2l_add(d, t, s);
+        return true;
+    }
+    // Check the well-separatedness conditions described in dt_m2l() for the target node
+    // at index t and the source node at index s.
+    bool dt_well_separated(const dt_data &d, size_type t, size_type s) const
+    {
+        const auto &src_node = m_tree[s];
+        const auto &tgt_geo = d.geo[t];
+        F dist2(0);
+        for (std::size_t j = 0; j < NDim; ++j) {
+            const auto diff = src_node.props[j] - tgt_geo[j];
+            dist2 = fma_wrap(diff, diff, dist2);
+        }
+        const auto tgt_r = tgt_geo[NDim], src_dim = d.geo[s][NDim + 1u];
+        // NOTE: check the squared conditions, so that we don't need a square root.
+        const auto theta2_dist2 = d.theta * d.theta * dist2, crit1 = fma_wrap(d.theta, tgt_r, src_dim);
+        if constexpr (compact_sk) {
+            // NOTE: the node-node interactions are Newtonian, thus the distance between the
+            // COMs must exceed the sum of the radii of the nodes plus the largest radius
+            // of the support among the pairs of particles of the two nodes.
+            const auto min_dist = tgt_r + d.geo[s][NDim] + std::sqrt(dt_eps2(d, t, s));
+            if (!(dist2 > min_dist * min_dist)) {
+                return false;
+            }
+        }
+        return theta2_dist2 > crit1 * crit1 && theta2_dist2 > tgt_r * tgt_r;
+    }
+    // The square of the softening length for the node-node interactions between the target node at index t
+    // and the source node at index s. With per-particle softening lengths, the largest softening length in the
+    // two nodes is used (which is an upper bound for the softening lengths of all the pairs of particles).
+    F dt_eps2(const dt_data &d, size_type t, size_type s) const
+    {
+        return m_eps.empty() ? d.eps2 : pair_eps2(m_tree[t].eps, m_tree[s].eps);
+    }
+    // Add the field generated by the source node at index s to the local expansion of
+    // the target node at index t. The two nodes must be well separated.
+    void dt_m2l_add(dt_data &d, size_type t, size_type s) const
+    {
+        const auto &src_node = m_tree[s];
+        const auto &tgt_geo = d.geo[t];
+        std::array<F, NDim> diffs;
+        F dist2(0);
+        for (std::size_t j = 0; j < NDim; ++j) {
+            diffs[j] = src_node.props[j] - tgt_geo[j];
+            dist2 = fma_wrap(diffs[j], diffs[j], dist2);
+        }
+        // Accumulate the potential, the acceleration and its Jacobian.
+        // NOTE: with the Plummer kernel, the softening is accounted for consistently with the particle-node
+        // interactions. With the compact-support kernels, the nodes are outside the supports of the kernels
+        // (see dt_well_separated()), and the interaction is Newtonian.
+        const auto inv_dist = F(1) / std::sqrt(dist2 + (compact_sk ? F(0) : dt_eps2(d, t, s))),
+                   inv_dist2 = inv_dist * inv_dist, m_dist = src_node.props[NDim] * inv_dist,
+                   m_dist3 = m_dist * inv_dist2, m_dist5_3 = F(3) * m_dist3 * inv_dist2;
+        auto &loc = d.locals[t];
+        loc[0] -= m_dist;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            loc[1u + j] = fma_wrap(acc_fp_type(diffs[j]), acc_fp_type(m_dist3), loc[1u + j]);
+            for (std::size_t k = 0; k < NDim; ++k) {
+                auto &jac = loc[1u + NDim + j * NDim + k];
+                jac = fma_wrap(acc_fp_type(diffs[j] * diffs[k]), acc_fp_type(m_dist5_3), jac);
+            }
+            loc[1u + NDim + j * NDim + j] -= m_dist3;
+        }
+        if constexpr (MPOrder > 1u) {
+            // Add the contributions of the higher-order multipole moments to the potential and to the
+            // acceleration. The Jacobian is computed only from the monopole, as its contribution
+            // to the final result is already of second order.
+            std::array<F, NDim> r, acc{};
+            F pot(0);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                r[j] = -diffs[j];
+            }
+            mp_acc_pot<2>(m_multipoles.data() + s * mp_size, r, inv_dist, inv_dist2, acc, pot);
+            loc[0] += pot;
+            for (std::size_t j = 0; j < NDim; ++j) {
+                loc[1u + j] += acc[j];
+            }
+        }
+    }
+    // Translate the local expansion of the node at index p to the centre of the node at index c,
+    // and add it to the local expansion of c.
+    void dt_l2l(dt_data &d, size_type p, size_type c) const
+    {
+        const auto &p_loc = d.locals[p];
+        auto &c_loc = d.locals[c];
+        std::array<acc_fp_type, NDim> dx, jdx;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            dx[j] = acc_fp_type(d.geo[c][j]) - d.geo[p][j];
+        }
+        auto phi = p_loc[0];
+        for (std::size_t j = 0; j < NDim; ++j) {
+            jdx[j] = acc_fp_type(0);
+            for (std::size_t k = 0; k < NDim; ++k) {
+                jdx[j] = fma_wrap(p_loc[1u + NDim + j * NDim + k], dx[k], jdx[j]);
+            }
+            // NOTE: the gradient of the potential is the negated acceleration,
+            // and its Hessian is the negated Jacobian of the acceleration.
+            phi -= dx[j] * (p_loc[1u + j] + jdx[j] / acc_fp_type(2));
+        }
+        c_loc[0] += phi;
+        for (std::size_t j = 0; j < NDim; ++j) {
+            c_loc[1u + j] += p_loc[1u + j] + jdx[j];
+        }
+        for (std::size_t j = 1u + NDim; j < dt_local_size; ++j) {
+            c_loc[j] += p_loc[j];
+        }
+    }
+    // Evaluate the local expansion of the critical node at index t on its particles. tgt_size is the
+    // number of particles in the node, p_ptrs pointers to the coordinates/masses of the particles,
+    // res_ptrs pointers to the output arrays.
+    // NOTE: the expansion is evaluated in acc_fp_type, and the result is rounded
+    // to F only when it is added to the output (see res_add_acc()).
+    template <unsigned Q, typename R>
+    void dt_l2p(const dt_data &d, size_type t, size_type tgt_size, const std::array<const F *, NDim + 1u> &p_ptrs,
+                const R &res_ptrs) const
+    {
+        const auto &loc = d.locals[t];
+        const auto &geo = d.geo[t];
+        std::array<acc_fp_type, NDim> dx, jdx;
+        for (size_type i = 0; i < tgt_size; ++i) {
+            for (std::size_t j = 0; j < NDim; ++j) {
+                dx[j] = acc_fp_type(p_ptrs[j][i]) - geo[j];
+            }
+            for (std::size_t j = 0; j < NDim; ++j) {
+                jdx[j] = acc_fp_type(0);
+                for (std::size_t k = 0; k < NDim; ++k) {
+                    jdx[j] = fma_wrap(loc[1u + NDim + j * NDim + k], dx[k], jdx[j]);
+                }
+            }
+            if constexpr (Q == 0u || Q == 2u) {
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    res_add_acc(res_ptrs, j, i, loc[1u + j] + jdx[j]);
+                }
+            }
+            if constexpr (Q == 1u || Q == 2u) {
+                constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                auto phi = loc[0];
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    phi -= dx[j] * (loc[1u + j] + jdx[j] / acc_fp_type(2));
+                }
+                res_add_acc(res_ptrs, pot_idx, i, acc_fp_type(p_ptrs[NDim][i]) * phi);
+            }
+        }
+    }
+    // Compute the interactions of the source node at index s with the particles of the
+    // target node at index t. The two nodes must be disjoint.
+    void dt_interact(dt_data &d, size_type t, size_type s) const
+    {
+        if (dt_m2l(d, t, s)) {
+            // The nodes are well separated, nothing else to do.
+            return;
+        }
+        const auto &tgt_node = m_tree[t], &src_node = m_tree[s];
+        if (d.crit[t]) {
+            // The target is a critical node: we don't split it any further.
+            if (src_node.n_children) {
+                dt_for_each_child(s, false, [this, &d, t](size_type c) { dt_interact(d, t, c); });
+            } else {
+                // The source is a leaf: its interactions with the target
+                // will be computed particle by particle.
+                d.near[t].push_back(s);
+            }
+        } else if (!src_node.n_children || src_node.level > tgt_node.level) {
+            // The source is a leaf or it is smaller than the target: split the target.
+            // NOTE: the children of the target are disjoint, and each one of them is written
+            // to by a single task. Thus, it's safe to run this in parallel.
+            dt_for_each_child(t, dt_par(t), [this, &d, s](size_type c) { dt_interact(d, c, s); });
+        } else {
+            // Split the source.
+            dt_for_each_child(s, false, [this, &d, t](size_type c) { dt_interact(d, t, c); });
+        }
+    }
+    // Compute the interactions between the particles of the node at index t.
+    void dt_self(dt_data &d, size_type t) const
+    {
+        if (d.crit[t]) {
+            // The self interactions of a critical node will be computed
+            // particle by particle.
+            return;
+        }
+        dt_for_each_child(t, dt_par(t), [this, &d, t](size_type c) {
+            // Interactions within the child.
+            dt_self(d, c);
+            // Interactions between the child and its siblings.
+            dt_for_each_child(t, false, [this, &d, c](size_type c2) {
+                if (c2 != c) {
+                    dt_interact(d, c, c2);
+                }
+            });
+        });
+    }
+    // Mutual mode of the dual-tree traversal. In this mode, the interactions between two nodes are computed once
+    // for both nodes: if the nodes are well separated in both directions, the field of each node is added to the
+    // local expansion of the other one, otherwise the larger node is split, down to pairs of leaves. The
+    // interactions between the particles of the pairs of leaves are then computed once per pair of particles
+    // (see dt_near_mutual()), which halves the direct summation work and conserves the momentum exactly in the
+    // near field. The local expansions may thus belong also to nodes below the critical nodes (see dt_l2p_mutual()).
+    //
+    // Compute the mutual interactions between the disjoint nodes at indices a and b.
+    void dt_interact_mutual(dt_data &d, size_type a, size_type b) const
+    {
+        if (dt_well_separated(d, a, b) && dt_well_separated(d, b, a)) {
+            dt_m2l_add(d, a, b);
+            dt_m2l_add(d, b, a);
+            return;
+        }
+        const auto &node_a = m_tree[a], &node_b = m_tree[b];
+        if (!node_a.n_children && !node_b.n_children) {
+            d.near_pairs[d.owner[a]].push_back({a, b});
+        } else if (!node_b.n_children || (node_a.n_children && node_a.level <= node_b.level)) {
+            dt_for_each_child(a, false, [this, &d, b](size_type c) { dt_interact_mutual(d, c, b); });
+        } else {
+            dt_for_each_child(b, false, [this, &d, a](size_type c) { dt_interact_mutual(d, a, c); });
+        }
+    }
+    // Compute, in mutual mode, the interactions between the particles of the node at index t.
+    void dt_self_mutual(dt_data &d, size_type t) const
+    {
+        if (d.crit[t]) {
+            // The self interactions of a critical node will be computed
+            // particle by particle.
+            return;
+        }
+        const auto par = dt_par(t);
+        dt_for_each_child(t, par, [this, &d](size_type c) { dt_self_mutual(d, c); });
+        // The interactions between the children. Each pair of children writes into the data of both nodes of the
+        // pair, thus the pairs are processed in rounds of disjoint pairs, each of which can be run in parallel: in
+        // the round k, the child at position i is paired with the child at position i ^ k.
+        std::array<size_type, (1u << NDim)> children;
+        std::size_t n_children = 0;
+        dt_for_each_child(t, false, [&children, &n_children](size_type c) { children[n_children++] = c; });
+        for (std::size_t k = 1; k < children.size(); ++k) {
+            if (par) {
+                tbb::task_group tg;
+                for (std::size_t i = 0; i < n_children; ++i) {
+                    if (const auto i2 = i ^ k; i < i2 && i2 < n_children) {
+                        tg.run([this, &d, a = children[i], b = children[i2]]() { dt_interact_mutual(d, a, b); });
+                    }
+                }
+                tg.wait();
+            } else {
+                for (std::size_t i = 0; i < n_children; ++i) {
+                    if (const auto i2 = i ^ k; i < i2 && i2 < n_children) {
+                        dt_interact_mutual(d, children[i], children[i2]);
+                    }
+                }
+            }
+        }
+    }
+    // Compute, in mutual mode, the interactions between the pairs of leaves collected during the traversal.
+    // NOTE: the results on the second leaf of each pair, which belongs to another critical node, are first
+    // stored separately, and then accumulated into each critical node in a fixed order (that is, the order
+    // of the pairs in near_pairs), so that the results don't depend on the scheduling of the threads. The
+    // number of these results is a multiple of the number of particles, which grows as theta decreases (e.g.,
+    // about 70 times the number of particles with theta = 0.4 on a uniform distribution of 400k particles).
+    // Thus, the critical nodes are processed in chunks, so that the results on the second leaves of a chunk
+    // fit in a buffer of (about) the size of the arrays of the particles.
+    template <unsigned Q>
+    void dt_near_mutual(dt_data &d) const
+    {
+        using c_size_type = decltype(m_crit_nodes.size());
+        // The number of results on the second leaves for each critical node.
+        std::vector<size_type> pair_size(m_crit_nodes.size());
+        tbb::parallel_for(tbb::blocked_range(c_size_type(0), m_crit_nodes.size()),
+                          [this, &d, &pair_size](const auto &range) {
+                              for (auto i = range.begin(); i != range.end(); ++i) {
+                                  size_type tot_size = 0;
+                                  for (const auto &p : d.near_pairs[i]) {
+                                      const auto &node_b = m_tree[p[1]];
+                                      tot_size = static_cast<size_type>(tot_size + (node_b.end - node_b.begin));
+                                  }
+                                  pair_size[i] = tot_size;
+                              }
+                          });
+        const auto max_size = static_cast<size_type>(m_parts[0].size());
+        std::vector<size_type> pair_begin;
+        // For each result on a second leaf, the index of the critical node owning the leaf,
+        // the index of the leaf and the offset of the results in pair_res.
+        std::vector<std::array<size_type, 3>> incoming;
+        // The boundaries in incoming of the groups belonging to the same critical node.
+        std::vector<decltype(incoming.size())> groups;
+        std::array<std::vector<F>, nvecs_res<Q>> pair_res;
+        for (c_size_type c_begin = 0; c_begin < m_crit_nodes.size();) {
+            // Establish the chunk of critical nodes [c_begin, c_end), the offsets of their
+            // results on the second leaves, and the second leaves of the chunk.
+            auto c_end = c_begin;
+            size_type tot_size = 0;
+            pair_begin.clear();
+            incoming.clear();
+            while (c_end < m_crit_nodes.size() && (c_end == c_begin || tot_size + pair_size[c_end] <= max_size)) {
+                pair_begin.push_back(tot_size);
+                for (const auto &p : d.near_pairs[c_end]) {
+                    const auto b = p[1];
+                    incoming.push_back({d.owner[b], b, tot_size});
+                    tot_size = static_cast<size_type>(tot_size + (m_tree[b].end - m_tree[b].begin));
+                }
+                ++c_end;
+            }
+            // NOTE: the stable sort preserves the order of the pairs within each critical node.
+            std::stable_sort(incoming.begin(), incoming.end(),
+                             [](const auto &p1, const auto &p2) { return p1[0] < p2[0]; });
+            groups.clear();
+            for (decltype(incoming.size()) k = 0; k < incoming.size(); ++k) {
+                if (!k || incoming[k][0] != incoming[k - 1u][0]) {
+                    groups.push_back(k);
+                }
+            }
+            groups.push_back(incoming.size());
+            for (auto &v : pair_res) {
+                v.resize(tot_size);
+            }
+            tbb::parallel_for(
+                tbb::blocked_range(c_begin, c_end), [this, &d, &pair_begin, &pair_res, c_begin](const auto &range) {
+                    // The results on the first leaf of the current pair.
+                    std::array<std::vector<F>, nvecs_res<Q>> res1;
+                    for (auto i = range.begin(); i != range.end(); ++i) {
+                        auto off = pair_begin[i - c_begin];
+                        for (const auto &[a, b] : d.near_pairs[i]) {
+                            const auto &node_a = m_tree[a], &node_b = m_tree[b];
+                            const auto size_a = static_cast<size_type>(node_a.end - node_a.begin),
+                                       size_b = static_cast<size_type>(node_b.end - node_b.begin);
+                            std::array<const F *, NDim + 1u> p1_ptrs, p2_ptrs;
+                            for (std::size_t j = 0; j < NDim + 1u; ++j) {
+                                p1_ptrs[j] = m_parts[j].data() + node_a.begin;
+                                p2_ptrs[j] = m_parts[j].data() + node_b.begin;
+                            }
+                            std::array<F *, nvecs_res<Q>> res1_ptrs, res2_ptrs;
+                            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                                res1[j].assign(size_a, F(0));
+                                res1_ptrs[j] = res1[j].data();
+                                res2_ptrs[j] = pair_res[j].data() + off;
+                                std::fill(res2_ptrs[j], res2_ptrs[j] + size_b, F(0));
+                            }
+                            tree_mutual_interactions<Q>(d.eps2, size_a, p1_ptrs,
+                                                        m_eps.empty() ? nullptr : m_eps.data() + node_a.begin,
+                                                        res1_ptrs, size_b, p2_ptrs,
+                                                        m_eps.empty() ? nullptr : m_eps.data() + node_b.begin,
+                                                        res2_ptrs);
+                            // NOTE: the results on the critical node are added directly to
+                            // near_res, as each critical node is processed by a single task.
+                            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                                for (size_type k = 0; k < size_a; ++k) {
+                                    d.near_res[j][node_a.begin + k] += res1[j][k];
+                                }
+                            }
+                            off = static_cast<size_type>(off + size_b);
+                        }
+                    }
+                });
+            // Accumulate the results on the second leaves, one critical node per group.
+            tbb::parallel_for(tbb::blocked_range(decltype(groups.size())(0), groups.size() - 1u),
+                              [this, &d, &incoming, &groups, &pair_res](const auto &range) {
+                                  for (auto g = range.begin(); g != range.end(); ++g) {
+                                      for (auto k = groups[g]; k != groups[g + 1u]; ++k) {
+                                          const auto &node_b = m_tree[incoming[k][1]];
+                                          const auto off = incoming[k][2];
+                                          const auto size_b = static_cast<size_type>(node_b.end - node_b.begin);
+                                          for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                                              for (size_type k2 = 0; k2 < size_b; ++k2) {
+                                                  d.near_res[j][node_b.begin + k2] += pair_res[j][off + k2];
+                                              }
+                                          }
+                                      }
+                                  }
+                              });
+            c_begin = c_end;
+        }
+    }
+    // Evaluate, in mutual mode, the local expansions of the node at index n and of its descendants on the particles
+    // of n. off is the offset of the particles of n in the arrays pointed to by p_ptrs and res_ptrs.
+    template <unsigned Q, typename R>
+    void dt_l2p_mutual(dt_data &d, size_type n, size_type off, const std::array<const F *, NDim + 1u> &p_ptrs,
+                       const R &res_ptrs) const
+    {
+        const auto &node = m_tree[n];
+        if (!node.n_children) {
+            auto p_ptrs_n(p_ptrs);
+            for (auto &ptr : p_ptrs_n) {
+                ptr += off;
+            }
+            auto res_ptrs_n(res_ptrs);
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                res_ptrs_n[j] += off;
+                if constexpr (R::mixed) {
+                    res_ptrs_n.cmp[j] += off;
+                }
+            }
+            dt_l2p<Q>(d, n, static_cast<size_type>(node.end - node.begin), p_ptrs_n, res_ptrs_n);
+            return;
+        }
+        dt_for_each_child(n, false, [this, &d, &node, n, off, &p_ptrs, &res_ptrs](size_type c) {
+            dt_l2l(d, n, c);
+            dt_l2p_mutual<Q>(d, c, static_cast<size_type>(off + (m_tree[c].begin - node.begin)), p_ptrs, res_ptrs);
+        });
+    }
+    // Translate the local expansions down the tree starting from the node at index t and, when reaching a critical
+    // node, compute the final accelerations/potentials on its particles. out is the array of output iterators,
+    // G the grav const.
+    template <unsigned Q, typename It>
+    void dt_down(dt_data &d, const std::array<It, nvecs_res<Q>> &out, F G, size_type t) const
+    {
+        const auto &tgt_node = m_tree[t];
+        if (d.crit[t]) {
+            const auto tgt_size = static_cast<size_type>(tgt_node.end - tgt_node.begin);
+            // NOTE: the critical nodes are stored in depth-first order, thus m_crit_idx is sorted.
+            const auto cn_it = std::lower_bound(m_crit_idx.begin(), m_crit_idx.end(), t);
+            assert(cn_it != m_crit_idx.end() && *cn_it == t);
+            const auto cn_idx = static_cast<size_type>(cn_it - m_crit_idx.begin());
+            // NOTE: in the mixed-precision mode, the contributions of the near leaves are added to the
+            // compensated sums one leaf at a time (see res_ptrs_type). The results of the mutual
+            // mode and the local expansions are computed in acc_fp_type (see res_add_acc()).
+            acc_pot_cnode<Q>(
+                out, G, cn_idx, d.mixed, true,
+                [this, &d, t, &tgt_node, tgt_size, tgt_eps = tgt_eps_ptr(cn_idx)](const auto &p_ptrs,
+                                                                                   const auto &res_ptrs) {
+                    if (d.mutual) {
+                        // The interactions with the particles of the pairs of leaves.
+                        for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                            for (size_type i = 0; i < tgt_size; ++i) {
+                                res_add_acc(res_ptrs, j, i, d.near_res[j][tgt_node.begin + i]);
+                            }
+                        }
+                    } else {
+                        // The interactions with the leaf source nodes which were not well separated.
+                        for (const auto s : d.near[t]) {
+                            tree_acc_pot_leaf<Q>(d.eps2, s, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+                        }
+                    }
+                    // The self interactions.
+                    tree_self_interactions<Q>(d.eps2, tgt_size, p_ptrs, tgt_eps, res_ptrs);
+                    // The far field.
+                    if (d.mutual) {
+                        dt_l2p_mutual<Q>(d, t, 0, p_ptrs, res_ptrs);
+                    } else {
+                        dt_l2p<Q>(d, t, tgt_size, p_ptrs, res_ptrs);
+                    }
+                });
+            return;
+        }
+        dt_for_each_child(t, dt_par(t), [this, &d, &out, G, t](size_type c) {
+            dt_l2l(d, t, c);
+            dt_down<Q>(d, out, G, c);
+        });
+    }
+    // Computation of the accelerations/potentials via the dual-tree traversal. out is the array of output iterators,
+    // theta2 the square of the opening angle, G the grav constant, eps2 the square of the softening length. Q
+    // indicates which quantities will be computed (accs, potentials, or both).
+    //
+    // In the dual-tree traversal, the interactions are computed node by node: when two nodes are well separated,
+    // the field of the source node is accumulated (at second order) into a local expansion around the centre of the
+    // target node. The local expansions are then translated down the tree and evaluated on the particles of the
+    // critical nodes, together with the particle-particle interactions with the leaf nodes that were not well
+    // separated. If mutual is true, the traversal is run in mutual mode (see dt_self_mutual()). mixed is the
+    // flag for the mixed-precision mode.
+    template <unsigned Q, typename It>
+    void dt_acc_pot(const std::array<It, nvecs_res<Q>> &out, F theta2, F G, F eps2, bool mutual, bool mixed) const
+    {
+        simple_timer st("dual-tree traversal");
+        if (m_tree.empty()) {
+            return;
+        }
+        const auto tree_size = static_cast<size_type>(m_tree.size());
+        dt_data d{std::sqrt(theta2), eps2, mixed, {}, {}, {}, {}, mutual, {}, {}, {}};
+        d.geo.resize(tree_size);
+        d.crit.resize(tree_size);
+        d.locals.resize(tree_size);
+        if (!mutual) {
+            d.near.resize(tree_size);
+        }
+        // Compute the geometrical properties of the nodes.
+        // NOTE: the particles of a node are within its tight bounding box, whose centre
+        // is at a distance com_off from the COM. Hence, the sphere centred on the COM with radius
+        // com_off + sqrt(NDim) / 2 * dim encloses all the particles of the node.
+        tbb::parallel_for(tbb::blocked_range(size_type(0), tree_size), [this, &d](const auto &range) {
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                const auto &node = m_tree[i];
+                std::copy(node.props, node.props + NDim, d.geo[i].data());
+                d.geo[i][NDim] = fma_wrap(node.dim, std::sqrt(F(NDim)) / F(2), node.com_off);
+                d.geo[i][NDim + 1u] = fma_wrap(d.theta, node.com_off, node.dim);
+            }
+        });
+        // Flag the critical nodes.
+        tbb::parallel_for(
+            tbb::blocked_range(decltype(m_crit_nodes.size())(0), m_crit_nodes.size()), [this, &d](const auto &range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    d.crit[m_crit_idx[i]] = 1;
+                }
+            });
+        if (mutual) {
+            d.owner.resize(tree_size);
+            d.near_pairs.resize(m_crit_nodes.size());
+            for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+                d.near_res[j].assign(m_parts[0].size(), acc_fp_type(0));
             }
+            // Assign the nodes to the critical nodes they belong to.
+            tbb::parallel_for(tbb::blocked_range(decltype(m_crit_nodes.size())(0), m_crit_nodes.size()),
+                              [this, &d](const auto &range) {
+                                  for (auto i = range.begin(); i != range.end(); ++i) {
+                                      const auto c_idx = m_crit_idx[i];
+                                      const auto c_end = static_cast<size_type>(c_idx + m_tree[c_idx].n_children + 1u);
+                                      for (auto n = c_idx; n < c_end; ++n) {
+                                          d.owner[n] = static_cast<size_type>(i);
+                                      }
+                                  }
+                              });
+            // Compute the node-node interactions, starting from the root, and then
+            // the interactions between the pairs of leaves.
+            dt_self_mutual(d, 0);
+            dt_near_mutual<Q>(d);
+        } else {
+            // Compute the node-node interactions, starting from the root.
+            dt_self(d, 0);
         }
-
-        // Compute the self interactions within the target node.
-        tree_self_interactions<Q>(eps2, tgt_size, p_ptrs, res_ptrs);
+        // Translate the local expansions and compute the final results.
+        dt_down<Q>(d, out, G, 0);
     }
     // Top level function for the computation of the accelerations/potentials. out is the array of output iterators,
-    // theta2 the square of the opening angle, G the grav constant, eps2 the square of the softening length. Q indicates
-    // which quantities will be computed (accs, potentials, or both).
+    // theta2 the square of the opening angle, G the grav constant, eps2 the square of the softening length, opts
+    // the extra options. Q indicates which quantities will be computed (accs, potentials, or both).
     template <unsigned Q, typename It>
-    void acc_pot_impl(const std::array<It, nvecs_res<Q>> &out, F theta2, F G, F eps2,
-                      const std::vector<double> &split) const
+    void acc_pot_impl(const std::array<It, nvecs_res<Q>> &out, F theta2, F G, F eps2, const std::vector<double> &split,
+                      const acc_pot_opts &opts) const
     {
         // Validation of split, common to all codepaths.
         if (std::any_of(split.begin(), split.end(), [](const double &x) { return !std::isfinite(x); })) {
@@ -2537,127 +5300,189 @@ private:
             throw std::invalid_argument("The values in the 'split' parameter cannot all be zero");
         }
 
+        if (opts.ilist_cache) {
+            if (opts.rel_mac) {
+                throw std::invalid_argument("The caching of the interaction lists is not available when using the "
+                                            "relative opening criterion");
+            }
+            if (split.size() > 1u) {
+                throw std::invalid_argument(
+                    "The caching of the interaction lists is available only on the cpu, but the 'split' parameter "
+                    "requests the use of "
+                    + std::to_string(split.size() - 1u) + " accelerator(s)");
+            }
+        }
+
+        if (opts.calibrate) {
+            throw std::invalid_argument("The calibration is available only in the error-controlled evaluation of the "
+                                        "accelerations");
+        }
+
+        if (opts.mixed_precision) {
+            if (split.size() > 1u) {
+                throw std::invalid_argument(
+                    "The mixed-precision mode is available only on the cpu, but the 'split' parameter requests the "
+                    "use of "
+                    + std::to_string(split.size() - 1u) + " accelerator(s)");
+            }
+        }
+
+        if (opts.acc_errs) {
+            if constexpr (Q == 1u) {
+                throw std::invalid_argument("The bounds of the errors of the accelerations are not available when "
+                                            "computing only the potentials");
+            }
+            if (m_pm_grid) {
+                throw std::invalid_argument(
+                    "The bounds of the errors of the accelerations are not available in the TreePM mode");
+            }
+            if (split.size() > 1u) {
+                throw std::invalid_argument(
+                    "The bounds of the errors of the accelerations are available only on the cpu, but the 'split' "
+                    "parameter requests the use of "
+                    + std::to_string(split.size() - 1u) + " accelerator(s)");
+            }
+        }
+
+        if (m_periodic) {
+            if (split.size() > 1u) {
+                throw std::invalid_argument(
+                    "Periodic boundary conditions are supported only on the cpu, but the 'split' parameter requests "
+                    "the use of "
+                    + std::to_string(split.size() - 1u) + " accelerator(s)");
+            }
+        }
+
+        if (!m_eps.empty()) {
+            if (eps2 != F(0)) {
+                throw std::invalid_argument("A nonzero softening length cannot be specified for a tree with "
+                                            "per-particle softening lengths");
+            }
+            if (split.size() > 1u) {
+                throw std::invalid_argument(
+                    "Per-particle softening lengths are supported only on the cpu, but the 'split' parameter requests "
+                    "the use of "
+                    + std::to_string(split.size() - 1u) + " accelerator(s)");
+            }
+        }
+
+        if constexpr (compact_sk) {
+            if (split.size() > 1u) {
+                throw std::invalid_argument("The compact-support softening kernels are supported only on the cpu, but "
+                                            "the 'split' parameter requests the use of "
+                                            + std::to_string(split.size() - 1u) + " accelerator(s)");
+            }
+        }
+
+        if (opts.mutual && !opts.dual_tree) {
+            throw std::invalid_argument("The mutual evaluation of the interactions is available only in the "
+                                        "dual-tree traversal");
+        }
+
+        if (opts.dual_tree) {
+            // NOTE: all the features which are not available in the dual-tree traversal (and hence
+            // in the mutual mode, which is implemented on top of it) are rejected here.
+            if (opts.ilist_cache) {
+                throw std::invalid_argument("The caching of the interaction lists is not available in the dual-tree "
+                                            "traversal");
+            }
+            if (opts.acc_errs) {
+                throw std::invalid_argument(
+                    "The bounds of the errors of the accelerations are not available in the dual-tree traversal");
+            }
+            // NOTE: this covers also the TreePM mode, which implies periodic boundary conditions.
+            if (m_periodic) {
+                throw std::invalid_argument(
+                    "Periodic boundary conditions are not supported by the dual-tree traversal");
+            }
+            if (opts.rel_mac) {
+                throw std::invalid_argument(
+                    "The relative opening criterion is not available in the dual-tree traversal");
+            }
+            if (opts.batch_leaves) {
+                throw std::invalid_argument(
+                    "The batched evaluation of the source leaves is not available in the dual-tree traversal");
+            }
+            // The dual-tree traversal is implemented only on the cpu.
+            if (split.size() > 1u) {
+                throw std::invalid_argument(
+                    "The dual-tree traversal for the computation of accelerations/potentials is available only on "
+                    "the cpu, but the 'split' parameter requests the use of "
+                    + std::to_string(split.size() - 1u) + " accelerator(s)");
+            }
+            dt_acc_pot<Q>(out, theta2, G, eps2, opts.mutual, opts.mixed_precision);
+            return;
+        }
+
+        if (opts.rel_mac) {
+            // The relative opening criterion is implemented only on the cpu.
+            if (split.size() > 1u) {
+                throw std::invalid_argument(
+                    "The relative opening criterion for the computation of accelerations/potentials is available only "
+                    "on the cpu, but the 'split' parameter requests the use of "
+                    + std::to_string(split.size() - 1u) + " accelerator(s)");
+            }
+        }
+
+        // Setup of the interaction lists cache. If the cached lists were recorded with the same
+        // opening angle, they will be replayed, otherwise they will be recorded during the traversal.
+        // NOTE: when replaying, a shared lock is held for the whole computation, so that concurrent
+        // replays can proceed in parallel while the cache cannot be replaced. When recording, the lists
+        // are recorded into local storage without holding the lock, and the exclusive lock is taken
+        // only to publish the new cache at the end (see cpu_run below).
+        std::shared_lock<std::shared_mutex> ilist_lock;
+        bool ilist_replay = false;
+        std::vector<ilist_type> ilist_recs;
+        if (opts.ilist_cache) {
+            ilist_lock = std::shared_lock(m_ilist_mutex);
+            if (m_ilist.theta2 == theta2 && m_ilist.tree_gen == m_tree_gen
+                && m_ilist.node_offsets.size() == m_crit_nodes.size() + 1u) {
+                ilist_replay = true;
+            } else {
+                ilist_lock.unlock();
+                ilist_recs.resize(m_crit_nodes.size());
+            }
+        }
+        const bool ilist_record = opts.ilist_cache && !ilist_replay;
+
         using c_size_type = decltype(m_crit_nodes.size());
-        auto cpu_run = [this, &out, theta2, G, eps2](c_size_type c_begin, c_size_type c_end) {
+        auto cpu_run = [this, &out, theta2, G, eps2, &opts, ilist_replay, ilist_record,
+                        &ilist_recs](c_size_type c_begin, c_size_type c_end) {
             assert(c_begin <= c_end);
             assert(c_end <= m_crit_nodes.size());
 
-            // NOTE: we will be adding padding to the target node data when SIMD is active,
-            // in order to be able to use SIMD instructions on all the particles of the node.
-            // The padding data must be crafted so that it does not interfere with the useful
-            // calculations. This means that:
-            // - we will set the masses to zero so that, when computing the self interactions
-            //   in a target node, the extra accelerations/potentials due to the padding data will be zero,
-            // - for the positions, we must ensure 2 things:
-            //   - they must not overlap with any other real particle, in order to avoid singularities
-            //     when computing self-interactions in the target node, hence they must be outside the box,
-            //   - the distance of the padding particles from any point of the box must be large enough so
-            //     that they never fail the BH criterion check, which fails when node_dim >= theta * dist.
-            //     The maximum node_dim is the box size b_size, and thus we must ensure that
-            //     dist > b_size / theta for the padding particles.
-            //
-            // The strategy is that we put the padding particles at coordinates (M, M, ...), with M to
-            // be determined. The upper right corner of the box, with coordinates (b_size/2, b_size/2, ...)
-            // will be the closest point of the box to the padding particles, and the corner-particles distance
-            // will be sqrt(NDim * (M - b_size/2)**2), which simplifies to sqrt(NDim) / 2 * (2*M - b_size).
-            // Now we require this distance to be large enough to always satisfy the BH criterion (as written
-            // above), that is, sqrt(NDim) / 2 * (2*M - b_size) > b_size / theta, which yields the requirement
-            // M > b_size / (theta * sqrt(NDim)) + b_size / 2.
-            const auto M = m_box_size / (std::sqrt(theta2) * std::sqrt(F(NDim))) + m_box_size / F(2);
-            // NOTE: M is mathematically always >= m_box_size / F(2), which puts it on the top right
-            // corner of the box for theta2 == inf. To make it completely safe with respect to the requirement
-            // of avoiding singularities in the self interaction routine, we double it.
-            const auto pad_coord = M * F(2);
-            if (!std::isfinite(pad_coord)) {
-                throw std::invalid_argument(
-                    "The calculation of the SIMD padding coordinate produced the non-finite value "
-                    + std::to_string(pad_coord));
-            }
-            tbb::parallel_for(tbb::blocked_range(c_begin, c_end), [this, theta2, G, eps2, pad_coord,
-                                                                   &out](const auto &range) {
-                // Get references to the local temporary data.
-                auto &tmp_res = acc_pot_tmp_res<Q>();
-                auto &tmp_tgt = tgt_tmp_data();
+            const auto theta = std::sqrt(theta2);
+            tbb::parallel_for(tbb::blocked_range(c_begin, c_end), [this, theta, theta2, G, eps2, &out,
+                                                                   &opts, ilist_replay, ilist_record,
+                                                                   &ilist_recs](const auto &range) {
                 for (auto i = range.begin(); i != range.end(); ++i) {
-                    const auto tgt_code = get<0>(m_crit_nodes[i]);
                     const auto tgt_begin = get<1>(m_crit_nodes[i]);
                     const auto tgt_size = static_cast<size_type>(get<2>(m_crit_nodes[i]) - tgt_begin);
-                    // Size of the temporary vectors that will be used to store the target node
-                    // data and the total accelerations/potentials on its particles. If simd is not enabled, this
-                    // value will be tgt_size. Otherwise, we add extra padding at the end based on the
-                    // simd vector size.
-                    const auto pdata_size = [tgt_size]() {
-                        if constexpr (simd_enabled) {
-                            using batch_type = xsimd::simd_type<F>;
-                            constexpr auto batch_size = batch_type::size;
-                            static_assert(batch_size);
-                            // NOTE: we will need batch_size - 1 extra elements at the end of the
-                            // temp vectors, to ensure we can load/store a simd vector starting from
-                            // the last element.
-                            if ((batch_size - 1u) > (std::numeric_limits<size_type>::max() - tgt_size)) {
-                                throw std::overflow_error("The number of particles in a critical node ("
-                                                          + std::to_string(tgt_size)
-                                                          + ") is too large, and it results in an overflow condition");
+                    acc_pot_cnode<Q>(
+                        out, G, static_cast<size_type>(i), opts.mixed_precision, !opts.rel_mac,
+                        [this, theta, theta2, G, eps2, &opts, ilist_replay, ilist_record, &ilist_recs, i, tgt_begin,
+                         tgt_size](const auto &p_ptrs, const auto &res_ptrs) {
+                            // Setup the accumulation of the error bounds, if requested.
+                            F *err_ptr = nullptr;
+                            if (opts.acc_errs) {
+                                auto &tmp_err = acc_pot_tmp_err();
+                                tmp_err.assign(tgt_size, F(0));
+                                err_ptr = tmp_err.data();
                             }
-                            return static_cast<size_type>(tgt_size + (batch_size - 1u));
-                        } else {
-                            return tgt_size;
-                        }
-                    }();
-                    // Prepare the temporary vectors containing the result.
-                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
-                        // Resize and fill with zeroes (everything, including the padding data).
-                        tmp_res[j].resize(pdata_size);
-                        std::fill(tmp_res[j].data(), tmp_res[j].data() + pdata_size, F(0));
-                    }
-                    // Prepare the temporary vectors containing the target node's data.
-                    for (std::size_t j = 0; j < NDim; ++j) {
-                        tmp_tgt[j].resize(pdata_size);
-                        // From 0 to tgt_size we copy the actual node coordinates.
-                        std::copy(m_parts[j].data() + tgt_begin, m_parts[j].data() + tgt_begin + tgt_size,
-                                  tmp_tgt[j].data());
-                        // From tgt_size to pdata_size (the padding values) we insert the padding coordinate.
-                        std::fill(tmp_tgt[j].data() + tgt_size, tmp_tgt[j].data() + pdata_size, pad_coord);
-                    }
-                    // Copy the particle masses and set the padding masses to zero.
-                    tmp_tgt[NDim].resize(pdata_size);
-                    std::copy(m_parts[NDim].data() + tgt_begin, m_parts[NDim].data() + tgt_begin + tgt_size,
-                              tmp_tgt[NDim].data());
-                    std::fill(tmp_tgt[NDim].data() + tgt_size, tmp_tgt[NDim].data() + pdata_size, F(0));
-                    // Prepare arrays of pointers to the temporary data.
-                    std::array<F *, nvecs_res<Q>> res_ptrs;
-                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
-                        res_ptrs[j] = tmp_res[j].data();
-                    }
-                    std::array<const F *, NDim + 1u> p_ptrs;
-                    for (std::size_t j = 0; j < NDim + 1u; ++j) {
-                        p_ptrs[j] = tmp_tgt[j].data();
-                    }
-                    // Do the computation.
-                    tree_acc_pot<Q>(theta2, eps2, tgt_size, tgt_code, p_ptrs, res_ptrs);
-                    // Multiply by G, if needed.
-                    if (G != F(1)) {
-                        for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
-                            auto r_ptr = res_ptrs[j];
-                            if constexpr (simd_enabled) {
-                                using batch_type = xsimd::simd_type<F>;
-                                constexpr auto batch_size = batch_type::size;
-                                const batch_type Gvec(G);
-                                for (size_type k = 0; k < tgt_size; k += batch_size) {
-                                    (xsimd::load_aligned(r_ptr + k) * Gvec).store_aligned(r_ptr + k);
-                                }
-                            } else {
-                                for (size_type k = 0; k < tgt_size; ++k) {
-                                    *(r_ptr + k) *= G;
-                                }
+                            if (ilist_replay) {
+                                tree_acc_pot_ilist<Q>(static_cast<size_type>(i), eps2, tgt_size, p_ptrs, res_ptrs,
+                                                      err_ptr);
+                                acc_pot_write_errs(opts, G, tgt_begin, tgt_size, err_ptr);
+                                return;
                             }
-                        }
-                    }
-                    // Write out the result.
-                    for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
-                        std::copy(res_ptrs[j], res_ptrs[j] + tgt_size,
-                                  out[j] + boost::numeric_cast<it_diff_type<It>>(tgt_begin));
-                    }
+                            // NOTE: in the relative opening criterion, theta is used as the accuracy parameter.
+                            const auto rel_ptr
+                                = opts.rel_mac ? acc_pot_rel_mac_prep(opts, theta, G, tgt_begin, tgt_size) : nullptr;
+                            tree_acc_pot<Q>(theta, theta2, eps2, rel_ptr, ilist_record ? &ilist_recs[i] : nullptr,
+                                            opts.batch_leaves, tgt_size, m_crit_idx[i], p_ptrs,
+                                            tgt_eps_ptr(static_cast<size_type>(i)), res_ptrs, err_ptr);
+                            acc_pot_write_errs(opts, G, tgt_begin, tgt_size, err_ptr);
+                        });
                 }
 #if defined(RAKAU_WITH_SIMD_COUNTERS)
                 // For the current thread, add the thread local counters
@@ -2672,6 +5497,38 @@ private:
                 simd_rsqrt_counter_tl = 0;
 #endif
             });
+            if (ilist_record) {
+                // Store the recorded interaction lists in the cache.
+                // NOTE: when caching, the cpu always takes care of all the critical nodes.
+                assert(c_begin == 0u && c_end == m_crit_nodes.size());
+                // NOTE: build the cache in a local object first, so that m_ilist
+                // is left untouched if something goes wrong.
+                ilist_cache_type c;
+                c.node_offsets.resize(boost::numeric_cast<decltype(c.node_offsets.size())>(ilist_recs.size() + 1u));
+                c.range_offsets.resize(c.node_offsets.size());
+                for (decltype(ilist_recs.size()) i = 0; i < ilist_recs.size(); ++i) {
+                    c.node_offsets[i + 1u] = c.node_offsets[i];
+                    checked_uinc(c.node_offsets[i + 1u], boost::numeric_cast<size_type>(ilist_recs[i].nodes.size()));
+                    c.range_offsets[i + 1u] = c.range_offsets[i];
+                    checked_uinc(c.range_offsets[i + 1u],
+                                 boost::numeric_cast<size_type>(ilist_recs[i].ranges.size()));
+                }
+                c.nodes.resize(boost::numeric_cast<decltype(c.nodes.size())>(c.node_offsets.back()));
+                c.ranges.resize(boost::numeric_cast<decltype(c.ranges.size())>(c.range_offsets.back()));
+                tbb::parallel_for(tbb::blocked_range(decltype(ilist_recs.size())(0), ilist_recs.size()),
+                                  [&c, &ilist_recs](const auto &range) {
+                                      for (auto i = range.begin(); i != range.end(); ++i) {
+                                          std::copy(ilist_recs[i].nodes.begin(), ilist_recs[i].nodes.end(),
+                                                    c.nodes.data() + c.node_offsets[i]);
+                                          std::copy(ilist_recs[i].ranges.begin(), ilist_recs[i].ranges.end(),
+                                                    c.ranges.data() + c.range_offsets[i]);
+                                      }
+                                  });
+                c.theta2 = theta2;
+                c.tree_gen = m_tree_gen;
+                std::unique_lock lock(m_ilist_mutex);
+                m_ilist = std::move(c);
+            }
         };
 #if defined(RAKAU_WITH_ROCM)
         // Validation of split specific to ROCm.
@@ -2687,7 +5544,7 @@ private:
                 "Cannot split the computation of accelerations/potentials: no accelerator has been detected");
         }
 
-        if constexpr ((NDim == 3u || NDim == 2u)
+        if constexpr ((NDim == 3u || NDim == 2u) && MPOrder == 1u
                       && std::conjunction_v<
                              std::is_same<It, F *>,
                              std::disjunction<std::is_same<UInt, std::uint64_t>, std::is_same<UInt, std::uint32_t>>,
@@ -2751,7 +5608,7 @@ private:
                     "Cannot compute accelerations/potentials on an accelerator: either the "
                     "floating-point and/or integral types involved in the computation are supported only on the cpu, "
                     "or the output iterators are not pointers (this is the case when using the ordered "
-                    "acceleration/potential computation functions)");
+                    "acceleration/potential computation functions), or the multipole order is higher than 1");
             }
             cpu_run(0, m_crit_nodes.size());
         }
@@ -2767,7 +5624,7 @@ private:
                 + " were detected");
         }
 
-        if constexpr ((NDim == 3u || NDim == 2u)
+        if constexpr ((NDim == 3u || NDim == 2u) && MPOrder == 1u
                       && std::conjunction_v<
                              std::is_same<It, F *>,
                              std::disjunction<std::is_same<UInt, std::uint64_t>, std::is_same<UInt, std::uint32_t>>,
@@ -2854,7 +5711,7 @@ private:
                     "Cannot compute accelerations/potentials on an accelerator: either the "
                     "floating-point and/or integral types involved in the computation are supported only on the cpu, "
                     "or the output iterators are not pointers (this is the case when using the ordered "
-                    "acceleration/potential computation functions)");
+                    "acceleration/potential computation functions), or the multipole order is higher than 1");
             }
             cpu_run(0, m_crit_nodes.size());
         }
@@ -2865,6 +5722,11 @@ private:
         }
         cpu_run(0, m_crit_nodes.size());
 #endif
+
+        // Add the long-range part of the interactions in the TreePM mode.
+        if (m_pm_grid) {
+            acc_pot_pm<Q>(out, G);
+        }
     }
     // Small helper to check the value of the softening length and its square.
     // Used more than once, hence factored out.
@@ -2888,11 +5750,11 @@ private:
         }
     }
     // Top level dispatcher for the accs/pots functions. It will run a few checks and then invoke acc_pot_impl().
-    // out is the array of output iterators, theta the opening angle, G the grav const, eps the softening length.
-    // Q indicates which quantities will be computed (accs, potentials, or both).
+    // out is the array of output iterators, theta the opening angle, G the grav const, eps the softening length,
+    // opts the extra options. Q indicates which quantities will be computed (accs, potentials, or both).
     template <bool Ordered, unsigned Q, typename It>
     void acc_pot_dispatch(const std::array<It, nvecs_res<Q>> &out, F theta, F G, F eps,
-                          const std::vector<double> &split) const
+                          const std::vector<double> &split, const acc_pot_opts &opts) const
     {
         simple_timer st("vector accs/pots computation");
         const auto theta2 = theta * theta, eps2 = eps * eps;
@@ -2907,6 +5769,18 @@ private:
         }
         check_eps_eps2(eps, eps2);
         check_G_const(G);
+        if (opts.rel_mac && opts.old_accs_size < m_parts[0].size()) {
+            throw std::invalid_argument("The relative opening criterion requires the previous accelerations of "
+                                        + std::to_string(m_parts[0].size()) + " particles, but only "
+                                        + std::to_string(opts.old_accs_size) + " were provided");
+        }
+        // Prepare the output vector for the error bounds, if requested.
+        auto d_opts(opts);
+        if (d_opts.acc_errs_vec) {
+            d_opts.acc_errs_vec->resize(boost::numeric_cast<decltype(d_opts.acc_errs_vec->size())>(m_parts[0].size()));
+            d_opts.acc_errs = d_opts.acc_errs_vec->data();
+            d_opts.acc_errs_vec = nullptr;
+        }
         if constexpr (Ordered) {
             // Make sure we don't run into overflows when doing a permutated iteration
             // over the iterators in out.
@@ -2916,34 +5790,66 @@ private:
             for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
                 out_pits[j] = boost::make_permutation_iterator(out[j], m_perm.begin());
             }
+            // The previous accelerations and the error bounds, if provided,
+            // are in the original order as well.
+            d_opts.old_accs_ordered = true;
+            d_opts.acc_errs_ordered = true;
             // NOTE: we are checking in the acc_pot_impl() function that we can index into
             // the permuted iterators without overflows (see the use of boost::numeric_cast()).
-            acc_pot_impl<Q>(out_pits, theta2, G, eps2, split);
+            acc_pot_isa<Q, true, std::is_same_v<It, F *>>(out_pits, theta2, G, eps2, split, d_opts);
         } else {
-            acc_pot_impl<Q>(out, theta2, G, eps2, split);
+            acc_pot_isa<Q, false, std::is_same_v<It, F *>>(out, theta2, G, eps2, split, d_opts);
+        }
+    }
+    // Invoke acc_pot_impl() compiled for the instruction set selected at construction, if the tree is supported
+    // by the SIMD dispatch and PtrOut is true (that is, if the output iterators are pointers, permuted if Ordered
+    // is true). Otherwise, acc_pot_impl() is invoked directly.
+    template <unsigned Q, bool Ordered, bool PtrOut, typename Out>
+    void acc_pot_isa(const Out &out, F theta2, F G, F eps2, const std::vector<double> &split,
+                     const acc_pot_opts &opts) const
+    {
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+        if constexpr (simd_dispatch_enabled && PtrOut) {
+            switch (m_simd_isa) {
+                case simd_isa::sse2:
+                    tree_simd_access<simd_isa::sse2>::template acc_pot<Q, NDim, F, UInt, Ordered>(
+                        this, &out, theta2, G, eps2, split, &opts);
+                    break;
+                case simd_isa::avx2:
+                    tree_simd_access<simd_isa::avx2>::template acc_pot<Q, NDim, F, UInt, Ordered>(
+                        this, &out, theta2, G, eps2, split, &opts);
+                    break;
+                default:
+                    tree_simd_access<simd_isa::avx512>::template acc_pot<Q, NDim, F, UInt, Ordered>(
+                        this, &out, theta2, G, eps2, split, &opts);
+            }
+            return;
         }
+#endif
+        acc_pot_impl<Q>(out, theta2, G, eps2, split, opts);
     }
     // Helper overload for an array of vectors. It will prepare the vectors and then
     // call the other overload.
     template <bool Ordered, unsigned Q, typename Allocator>
     void acc_pot_dispatch(std::array<std::vector<F, Allocator>, nvecs_res<Q>> &out, F theta, F G, F eps,
-                          const std::vector<double> &split) const
+                          const std::vector<double> &split, const acc_pot_opts &opts) const
     {
         std::array<F *, nvecs_res<Q>> out_ptrs;
         for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
             out[j].resize(boost::numeric_cast<decltype(out[j].size())>(m_parts[0].size()));
             out_ptrs[j] = out[j].data();
         }
-        acc_pot_dispatch<Ordered, Q>(out_ptrs, theta, G, eps, split);
+        acc_pot_dispatch<Ordered, Q>(out_ptrs, theta, G, eps, split, opts);
     }
     // Helper overload for a single vector. It will prepare the vector and then
     // call the other overload. This is used for the potential-only computations.
     template <bool Ordered, unsigned Q, typename Allocator>
-    void acc_pot_dispatch(std::vector<F, Allocator> &out, F theta, F G, F eps, const std::vector<double> &split) const
+    void acc_pot_dispatch(std::vector<F, Allocator> &out, F theta, F G, F eps, const std::vector<double> &split,
+                          const acc_pot_opts &opts) const
     {
         static_assert(Q == 1u);
         out.resize(boost::numeric_cast<decltype(out.size())>(m_parts[0].size()));
-        acc_pot_dispatch<Ordered, Q>(std::array{out.data()}, theta, G, eps, split);
+        acc_pot_dispatch<Ordered, Q>(std::array{out.data()}, theta, G, eps, split, opts);
     }
     // Small helper to turn an init list into an array, in the functions for the computation
     // of the accelerations/potentials. Q indicates which quantities will be computed (accs,
@@ -2962,6 +5868,45 @@ private:
         std::copy(ilist.begin(), ilist.end(), retval.begin());
         return retval;
     }
+    // Helpers to set up the relative opening criterion in opts from the previous accelerations
+    // passed in by the user, either as an array of vectors or as an array of pointers.
+    template <typename Allocator>
+    static void parse_old_accs(acc_pot_opts &opts, const std::array<std::vector<F, Allocator>, NDim> &old_accs)
+    {
+        for (std::size_t j = 0; j < NDim; ++j) {
+            opts.old_accs[j] = old_accs[j].data();
+            opts.old_accs_size
+                = std::min(opts.old_accs_size, boost::numeric_cast<size_type>(old_accs[j].size()));
+        }
+        opts.rel_mac = true;
+    }
+    template <typename T>
+    static void parse_old_accs(acc_pot_opts &opts, const std::array<T *, NDim> &old_accs)
+    {
+        static_assert(std::is_same_v<std::remove_cv_t<T>, F>,
+                      "The previous accelerations must be passed as an array of pointers to the floating-point "
+                      "type of the tree.");
+        for (std::size_t j = 0; j < NDim; ++j) {
+            if (!old_accs[j]) {
+                throw std::invalid_argument("The pointers to the previous accelerations cannot be null");
+            }
+            opts.old_accs[j] = old_accs[j];
+        }
+        opts.rel_mac = true;
+    }
+    // Helpers to set up the output for the bounds of the truncation errors of the accelerations,
+    // either as a vector or as a pointer.
+    static void parse_acc_errs(acc_pot_opts &opts, std::vector<F> &acc_errs)
+    {
+        opts.acc_errs_vec = &acc_errs;
+    }
+    static void parse_acc_errs(acc_pot_opts &opts, F *acc_errs)
+    {
+        if (!acc_errs) {
+            throw std::invalid_argument("The pointer to the output for the error bounds cannot be null");
+        }
+        opts.acc_errs = acc_errs;
+    }
     // Helper to parse the keyword arguments for the acc/pot functions.
     template <typename... Args>
     static auto parse_accpot_kwargs(Args &&... args)
@@ -2979,25 +5924,199 @@ private:
             eps = boost::numeric_cast<F>(p(kwargs::eps));
         }
 
+        acc_pot_opts opts;
+        if constexpr (p.has(kwargs::dual_tree)) {
+            opts.dual_tree = static_cast<bool>(p(kwargs::dual_tree));
+        }
+        if constexpr (p.has(kwargs::old_accs)) {
+            parse_old_accs(opts, p(kwargs::old_accs));
+        }
+        if constexpr (p.has(kwargs::ilist_cache)) {
+            opts.ilist_cache = static_cast<bool>(p(kwargs::ilist_cache));
+        }
+        if constexpr (p.has(kwargs::batch_leaves)) {
+            opts.batch_leaves = static_cast<bool>(p(kwargs::batch_leaves));
+        }
+        if constexpr (p.has(kwargs::mutual)) {
+            opts.mutual = static_cast<bool>(p(kwargs::mutual));
+        }
+        if constexpr (p.has(kwargs::mixed_precision)) {
+            opts.mixed_precision = static_cast<bool>(p(kwargs::mixed_precision));
+        }
+        if constexpr (p.has(kwargs::calibrate)) {
+            opts.calibrate = boost::numeric_cast<size_type>(p(kwargs::calibrate));
+        }
+        if constexpr (p.has(kwargs::acc_errs)) {
+            parse_acc_errs(opts, p(kwargs::acc_errs));
+        }
+
         if constexpr (p.has(kwargs::split)) {
-            return std::tuple{G, eps, std::cref(p(kwargs::split))};
+            return std::tuple{G, eps, std::cref(p(kwargs::split)), opts};
         } else {
-            return std::tuple{G, eps, std::vector<double>{}};
+            return std::tuple{G, eps, std::vector<double>{}, opts};
+        }
+    }
+    // Error-controlled evaluation of the accelerations. Instead of an opening angle, the user specifies a target
+    // relative error err, and the computation is run with the relative opening criterion (see
+    // tree_acc_pot_bh_check()), which bounds the truncation error of each multipole expansion with respect to the
+    // total acceleration of the target particle. That is, the opening criterion adapts to the particle
+    // distribution, rather than being the same for all the source nodes. The accuracy parameter alpha of the
+    // criterion is derived from err via the error model err = rel_error_coeff * alpha**rel_error_exp. The
+    // accelerations needed by the criterion are either those supplied via the old_accs kwarg, or they are estimated
+    // with a preliminary computation using the geometrical criterion with opening angle rel_error_theta. The
+    // latter costs an additional tree traversal, which can be avoided by passing the accelerations of the
+    // previous timestep.
+    //
+    // If opts.calibrate is nonzero, the 90th percentile of the errors of the accelerations is measured against the
+    // exact accelerations of opts.calibrate particles (see acc_pot_sample_error()). If it is greater than err,
+    // alpha is rescaled according to the error model and the computation is repeated, up to rel_error_max_calib
+    // times. The exact accelerations are computed only once, at a cost of O(opts.calibrate * N) operations.
+    //
+    // NOTE: the error model is an empirical heuristic, and without calibration err is not a guaranteed bound. Its
+    // parameters are derived experimentally: for uniform and clustered (Plummer) distributions of 10000 particles,
+    // in single and double precision, and alpha in the [3E-5, 1E-2] range, the 90th percentile of the relative
+    // errors is at most about 0.14 * alpha**0.65 (the uniform distributions sit on this envelope, the Plummer ones
+    // below it). The coefficient adds a small safety margin on top of the fit. The error grows more slowly than
+    // alpha, as the criterion bounds the contribution of each source node, while the errors of the contributions
+    // partially cancel out. For the same reason, the per-node error bounds (see tree_acc_pot_bh_err())
+    // overestimate the actual errors by a factor of several hundreds, which also depends on the distribution,
+    // and they are not used to select alpha. The calibration is the way to meet err on the distributions which
+    // do not follow the model.
+    //
+    // NOTE: the relative opening criterion, and thus the error model, constrain only the errors of the
+    // accelerations. The error-controlled evaluation is thus not available when computing only the potentials.
+    // When computing both, err refers to the accelerations, and the potentials are computed with the same
+    // opening criterion, without a separate control of their errors.
+    //
+    // The features which are not compatible with the relative opening criterion (i.e., the dual-tree traversal
+    // and the caching of the interaction lists) are not available in the error-controlled evaluation.
+    static constexpr double rel_error_coeff = .15;
+    static constexpr double rel_error_exp = .65;
+    static constexpr double rel_error_theta = .8;
+    static constexpr unsigned rel_error_max_calib = 4;
+    template <bool Ordered, unsigned Q, typename It>
+    void acc_pot_err(const std::array<It, nvecs_res<Q>> &out, double err, F G, F eps,
+                     const std::vector<double> &split, acc_pot_opts opts) const
+    {
+        static_assert(Q != 1u, "The error-controlled evaluation is not available for the potentials only.");
+        simple_timer st("error-controlled accs/pots computation");
+        if (!std::isfinite(err) || err <= 0. || err >= 1.) {
+            throw std::domain_error("The target relative error must be in the (0, 1) range, but it is "
+                                    + std::to_string(err) + " instead");
+        }
+        if (opts.dual_tree) {
+            throw std::invalid_argument("The error-controlled evaluation is not available in the dual-tree traversal");
+        }
+        if (opts.ilist_cache) {
+            throw std::invalid_argument(
+                "The caching of the interaction lists is not available in the error-controlled evaluation");
+        }
+        if (split.size() > 1u) {
+            throw std::invalid_argument(
+                "The error-controlled evaluation is available only on the cpu, but the 'split' parameter requests "
+                "the use of "
+                + std::to_string(split.size() - 1u) + " accelerator(s)");
+        }
+        const auto n_calib = std::min(opts.calibrate, static_cast<size_type>(m_parts[0].size()));
+        opts.calibrate = 0;
+        // Estimate the accelerations, if they were not provided.
+        std::array<std::vector<F>, NDim> est_accs;
+        if (!opts.rel_mac) {
+            // NOTE: the error bounds are not needed for the estimate.
+            auto e_opts(opts);
+            e_opts.acc_errs = nullptr;
+            e_opts.acc_errs_vec = nullptr;
+            acc_pot_dispatch<Ordered, 0>(est_accs, static_cast<F>(rel_error_theta), G, eps, split, e_opts);
+            for (std::size_t j = 0; j < NDim; ++j) {
+                opts.old_accs[j] = est_accs[j].data();
+            }
+            opts.old_accs_size = static_cast<size_type>(m_parts[0].size());
+            opts.rel_mac = true;
+        }
+        auto alpha = boost::numeric_cast<F>(std::pow(err / rel_error_coeff, 1. / rel_error_exp));
+        if (!n_calib) {
+            acc_pot_dispatch<Ordered, Q>(out, alpha, G, eps, split, opts);
+            return;
         }
+        // The exact accelerations of the sampled particles.
+        const auto ex_accs = acc_pot_sample_exact<Ordered>(G, eps, n_calib);
+        for (unsigned k = 0;; ++k) {
+            acc_pot_dispatch<Ordered, Q>(out, alpha, G, eps, split, opts);
+            if (k == rel_error_max_calib) {
+                break;
+            }
+            const auto cur_err = acc_pot_sample_error(out, ex_accs);
+            if (cur_err <= err) {
+                break;
+            }
+            // Rescale alpha according to the error model, aiming a bit below
+            // the target in order to avoid too many iterations.
+            alpha = static_cast<F>(alpha * std::pow(err / cur_err * .9, 1. / rel_error_exp));
+        }
+    }
+    // Helper overload for an array of vectors. It will prepare the vectors and then
+    // call the other overload.
+    template <bool Ordered, unsigned Q, typename Allocator>
+    void acc_pot_err(std::array<std::vector<F, Allocator>, nvecs_res<Q>> &out, double err, F G, F eps,
+                     const std::vector<double> &split, const acc_pot_opts &opts) const
+    {
+        std::array<F *, nvecs_res<Q>> out_ptrs;
+        for (std::size_t j = 0; j < nvecs_res<Q>; ++j) {
+            out[j].resize(boost::numeric_cast<decltype(out[j].size())>(m_parts[0].size()));
+            out_ptrs[j] = out[j].data();
+        }
+        acc_pot_err<Ordered, Q>(out_ptrs, err, G, eps, split, opts);
+    }
+    // The exact accelerations of n particles, evenly spaced in the internal order (or in the original order, if
+    // Ordered is true), for the calibration of the error-controlled evaluation. The return value contains the
+    // indices of the particles and, for each of them, the components of the acceleration.
+    template <bool Ordered>
+    auto acc_pot_sample_exact(F G, F eps, size_type n) const
+    {
+        const auto size = static_cast<size_type>(m_parts[0].size());
+        std::vector<std::pair<size_type, std::array<F, NDim>>> retval(n);
+        tbb::parallel_for(tbb::blocked_range(size_type(0), n), [this, &retval, G, eps, size, n](const auto &range) {
+            for (auto k = range.begin(); k != range.end(); ++k) {
+                const auto idx = static_cast<size_type>(static_cast<double>(k) * static_cast<double>(size)
+                                                        / static_cast<double>(n));
+                retval[k] = {idx, exact_acc_pot_impl<Ordered, 0>(idx, G, eps)};
+            }
+        });
+        return retval;
+    }
+    // The 90th percentile of the relative errors of the accelerations in out (computed on the norm of the
+    // accelerations) wrt the exact accelerations ex_accs computed by acc_pot_sample_exact().
+    template <typename It, std::size_t N, typename Ex>
+    static double acc_pot_sample_error(const std::array<It, N> &out, const Ex &ex_accs)
+    {
+        std::vector<double> errs(ex_accs.size());
+        for (decltype(errs.size()) k = 0; k < errs.size(); ++k) {
+            const auto &[idx, ex] = ex_accs[k];
+            double diff2 = 0, norm2 = 0;
+            for (std::size_t j = 0; j < NDim; ++j) {
+                const auto d = static_cast<double>(*(out[j] + static_cast<it_diff_type<It>>(idx))) - ex[j];
+                diff2 += d * d;
+                norm2 += static_cast<double>(ex[j]) * ex[j];
+            }
+            errs[k] = norm2 > 0. ? std::sqrt(diff2 / norm2) : 0.;
+        }
+        const auto it = errs.begin() + static_cast<decltype(errs.size())>(errs.size() * 9u / 10u);
+        std::nth_element(errs.begin(), it, errs.end());
+        return *it;
     }
 
 public:
     template <typename Allocator, typename... KwArgs>
     void accs_u(std::array<std::vector<F, Allocator>, NDim> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 0>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 0>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void accs_u(const std::array<It, NDim> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 0>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 0>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void accs_u(std::initializer_list<It> out, F theta, KwArgs &&... args) const
@@ -3007,26 +6126,26 @@ public:
     template <typename Allocator, typename... KwArgs>
     void pots_u(std::vector<F, Allocator> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 1>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 1>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void pots_u(It out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 1>(std::array{out}, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 1>(std::array{out}, theta, G, eps, split, opts);
     }
     template <typename Allocator, typename... KwArgs>
     void accs_pots_u(std::array<std::vector<F, Allocator>, NDim + 1u> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 2>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 2>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void accs_pots_u(const std::array<It, NDim + 1u> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<false, 2>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<false, 2>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void accs_pots_u(std::initializer_list<It> out, F theta, KwArgs &&... args) const
@@ -3036,14 +6155,14 @@ public:
     template <typename Allocator, typename... KwArgs>
     void accs_o(std::array<std::vector<F, Allocator>, NDim> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 0>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 0>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void accs_o(const std::array<It, NDim> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 0>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 0>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void accs_o(std::initializer_list<It> out, F theta, KwArgs &&... args) const
@@ -3053,32 +6172,102 @@ public:
     template <typename Allocator, typename... KwArgs>
     void pots_o(std::vector<F, Allocator> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 1>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 1>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void pots_o(It out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 1>(std::array{out}, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 1>(std::array{out}, theta, G, eps, split, opts);
     }
     template <typename Allocator, typename... KwArgs>
     void accs_pots_o(std::array<std::vector<F, Allocator>, NDim + 1u> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 2>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 2>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void accs_pots_o(const std::array<It, NDim + 1u> &out, F theta, KwArgs &&... args) const
     {
-        const auto [G, eps, split] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        acc_pot_dispatch<true, 2>(out, theta, G, eps, split);
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_dispatch<true, 2>(out, theta, G, eps, split, opts);
     }
     template <typename It, typename... KwArgs>
     void accs_pots_o(std::initializer_list<It> out, F theta, KwArgs &&... args) const
     {
         accs_pots_o(acc_pot_ilist_to_array<2>(out), theta, std::forward<KwArgs>(args)...);
     }
+    // Overloads for the error-controlled evaluation (see acc_pot_err()). They are not available for the
+    // potentials only.
+    template <typename Allocator, typename... KwArgs>
+    void accs_u(std::array<std::vector<F, Allocator>, NDim> &out, rel_error err, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_err<false, 0>(out, err.value, G, eps, split, opts);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_u(const std::array<It, NDim> &out, rel_error err, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_err<false, 0>(out, err.value, G, eps, split, opts);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_u(std::initializer_list<It> out, rel_error err, KwArgs &&... args) const
+    {
+        accs_u(acc_pot_ilist_to_array<0>(out), err, std::forward<KwArgs>(args)...);
+    }
+    template <typename Allocator, typename... KwArgs>
+    void accs_pots_u(std::array<std::vector<F, Allocator>, NDim + 1u> &out, rel_error err, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_err<false, 2>(out, err.value, G, eps, split, opts);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_pots_u(const std::array<It, NDim + 1u> &out, rel_error err, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_err<false, 2>(out, err.value, G, eps, split, opts);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_pots_u(std::initializer_list<It> out, rel_error err, KwArgs &&... args) const
+    {
+        accs_pots_u(acc_pot_ilist_to_array<2>(out), err, std::forward<KwArgs>(args)...);
+    }
+    template <typename Allocator, typename... KwArgs>
+    void accs_o(std::array<std::vector<F, Allocator>, NDim> &out, rel_error err, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_err<true, 0>(out, err.value, G, eps, split, opts);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_o(const std::array<It, NDim> &out, rel_error err, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_err<true, 0>(out, err.value, G, eps, split, opts);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_o(std::initializer_list<It> out, rel_error err, KwArgs &&... args) const
+    {
+        accs_o(acc_pot_ilist_to_array<0>(out), err, std::forward<KwArgs>(args)...);
+    }
+    template <typename Allocator, typename... KwArgs>
+    void accs_pots_o(std::array<std::vector<F, Allocator>, NDim + 1u> &out, rel_error err, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_err<true, 2>(out, err.value, G, eps, split, opts);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_pots_o(const std::array<It, NDim + 1u> &out, rel_error err, KwArgs &&... args) const
+    {
+        const auto [G, eps, split, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        acc_pot_err<true, 2>(out, err.value, G, eps, split, opts);
+    }
+    template <typename It, typename... KwArgs>
+    void accs_pots_o(std::initializer_list<It> out, rel_error err, KwArgs &&... args) const
+    {
+        accs_pots_o(acc_pot_ilist_to_array<2>(out), err, std::forward<KwArgs>(args)...);
+    }
 
 private:
     template <bool Ordered, unsigned Q>
@@ -3088,34 +6277,63 @@ private:
         const auto eps2 = eps * eps;
         // Check eps.
         check_eps_eps2(eps, eps2);
+        if (!m_eps.empty() && eps2 != F(0)) {
+            throw std::invalid_argument("A nonzero softening length cannot be specified for a tree with "
+                                        "per-particle softening lengths");
+        }
         // Check G.
         check_G_const(G);
         const auto size = m_parts[0].size();
         std::array<F, nvecs_res<Q>> retval{};
         std::array<F, NDim> diffs;
+        // Establish the index of the potential in the result array:
+        // 0 if only the potentials are requested, NDim otherwise.
+        [[maybe_unused]] constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
         const auto idx = Ordered ? m_inv_perm[orig_idx] : orig_idx;
         for (size_type i = 0; i < size; ++i) {
+            for (std::size_t j = 0; j < NDim; ++j) {
+                diffs[j] = m_parts[j][i] - m_parts[j][idx];
+                if (m_periodic) {
+                    diffs[j] = min_image(diffs[j]);
+                }
+            }
+            if constexpr (NDim == 3u) {
+                if (m_periodic) {
+                    // In periodic mode, add the Ewald corrections. These include the interaction of the
+                    // particle with its own periodic images, and they are computed via the same lookup
+                    // table used in the tree traversal. Thus, the result is exact only up to the accuracy
+                    // of the interpolation in the table (see ewald.hpp).
+                    const auto c = ewald_corr(ewald_table(), diffs.data(), F(1) / m_box_size);
+                    const auto Gmi = G * m_parts[NDim][i];
+                    if constexpr (Q == 0u || Q == 2u) {
+                        for (std::size_t j = 0; j < NDim; ++j) {
+                            retval[j] = fma_wrap(Gmi, c[j], retval[j]);
+                        }
+                    }
+                    if constexpr (Q == 1u || Q == 2u) {
+                        retval[pot_idx] = fma_wrap(-Gmi * c[3], m_parts[NDim][idx], retval[pot_idx]);
+                    }
+                }
+            }
             if (i == idx) {
                 continue;
             }
-            F dist2(eps2);
+            const auto h2 = m_eps.empty() ? eps2 : pair_eps2(m_eps[i], m_eps[idx]);
+            F dist2(compact_sk ? F(0) : h2);
             for (std::size_t j = 0; j < NDim; ++j) {
-                diffs[j] = m_parts[j][i] - m_parts[j][idx];
                 dist2 = fma_wrap(diffs[j], diffs[j], dist2);
             }
-            const auto inv_dist = F(1) / std::sqrt(dist2), Gmi_dist = G * m_parts[NDim][i] * inv_dist;
+            const auto [dist3, dist] = soft_dists<Q>(dist2, h2);
             if constexpr (Q == 0u || Q == 2u) {
                 // Q == 0 or 2: accelerations are requested.
-                const auto Gmi_dist3 = inv_dist * inv_dist * Gmi_dist;
+                const auto Gmi_dist3 = G * m_parts[NDim][i] / dist3;
                 for (std::size_t j = 0; j < NDim; ++j) {
                     retval[j] = fma_wrap(diffs[j], Gmi_dist3, retval[j]);
                 }
             }
             if constexpr (Q == 1u || Q == 2u) {
                 // Q == 1 or 2: potentials are requested.
-                // Establish the index of the potential in the result array:
-                // 0 if only the potentials are requested, NDim otherwise.
-                constexpr auto pot_idx = static_cast<std::size_t>(Q == 1u ? 0u : NDim);
+                const auto Gmi_dist = G * m_parts[NDim][i] / dist;
                 retval[pot_idx] = fma_wrap(-Gmi_dist, m_parts[NDim][idx], retval[pot_idx]);
             }
         }
@@ -3126,46 +6344,46 @@ public:
     template <typename... KwArgs>
     std::array<F, NDim> exact_acc_u(size_type idx, KwArgs &&... args) const
     {
-        // NOTE: we are also parsing the split kwarg here, which is not used. I don't
-        // think it has any performance implications, and perhaps in the future
-        // we will use it.
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        // NOTE: we are also parsing the split kwarg and the extra options here, which are not used.
+        // I don't think it has any performance implications, and perhaps in the future
+        // we will use them.
+        const auto [G, eps, _, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, opts);
         return exact_acc_pot_impl<false, 0>(idx, G, eps);
     }
     template <typename... KwArgs>
     F exact_pot_u(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, opts);
         return exact_acc_pot_impl<false, 1>(idx, G, eps)[0];
     }
     template <typename... KwArgs>
     std::array<F, NDim + 1u> exact_acc_pot_u(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, opts);
         return exact_acc_pot_impl<false, 2>(idx, G, eps);
     }
     template <typename... KwArgs>
     std::array<F, NDim> exact_acc_o(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, opts);
         return exact_acc_pot_impl<true, 0>(idx, G, eps);
     }
     template <typename... KwArgs>
     F exact_pot_o(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, opts);
         return exact_acc_pot_impl<true, 1>(idx, G, eps)[0];
     }
     template <typename... KwArgs>
     std::array<F, NDim + 1u> exact_acc_pot_o(size_type idx, KwArgs &&... args) const
     {
-        const auto [G, eps, _] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
-        ignore(_);
+        const auto [G, eps, _, opts] = parse_accpot_kwargs(std::forward<KwArgs>(args)...);
+        ignore(_, opts);
         return exact_acc_pot_impl<true, 2>(idx, G, eps);
     }
 
@@ -3236,6 +6454,9 @@ private:
             m_box_size = determine_box_size(p_its_u(), nparts);
         }
 
+        // Bring the particles back into the box, if needed.
+        periodic_wrap();
+
         // Establish the new codes.
         tbb::parallel_for(tbb::blocked_range(size_type(0), nparts), [this](const auto &range) {
             std::array<UInt, NDim> tmp_dcoord;
@@ -3268,6 +6489,9 @@ private:
             for (std::size_t j = 0; j < NDim + 1u; ++j) {
                 tg.run([this, j]() { apply_isort(m_parts[j], m_last_perm); });
             }
+            if (!m_eps.empty()) {
+                tg.run([this]() { apply_isort(m_eps, m_last_perm); });
+            }
             tg.run([this]() {
                 // Apply the new indirect sorting to the original one.
                 apply_isort(m_perm, m_last_perm);
@@ -3282,6 +6506,12 @@ private:
         // before doing it.
         m_tree.clear();
         m_crit_nodes.clear();
+        m_crit_idx.clear();
+        // NOTE: the cached interaction lists refer to the old tree structure (they would not be replayed
+        // anyway, as build_tree() bumps the generation of the tree). They are not revalidated for the new
+        // positions of the particles: the revalidation must still check the opening criterion for all the
+        // accepted nodes and evaluate all the interactions again, and it is no faster than a new traversal.
+        m_ilist.clear();
         build_tree();
 
         // Re-init the views.
@@ -3337,10 +6567,48 @@ public:
     {
         return m_ncrit;
     }
+    bool periodic() const
+    {
+        return m_periodic;
+    }
+    size_type pm_grid() const
+    {
+        return m_pm_grid;
+    }
+    // The total number of sources (accepted source nodes and source particles) in the interaction lists
+    // cached by the last computation with the ilist_cache option (zero if no lists are cached).
+    size_type ilist_size() const
+    {
+        std::shared_lock lock(m_ilist_mutex);
+        auto retval = static_cast<size_type>(m_ilist.nodes.size());
+        for (const auto &[r_begin, r_end] : m_ilist.ranges) {
+            retval += static_cast<size_type>(r_end - r_begin);
+        }
+        return retval;
+    }
+    // The per-particle softening lengths, in internal (eps_parts_u()) or original (eps_parts_o()) order.
+    // The return values must not be dereferenced if per-particle softening lengths are not in use
+    // (in which case eps_parts_u() returns null).
+    const F *eps_parts_u() const
+    {
+        return m_eps.empty() ? nullptr : m_eps.data();
+    }
+    auto eps_parts_o() const
+    {
+        return boost::make_permutation_iterator(eps_parts_u(), m_inv_perm.begin());
+    }
     size_type nparts() const
     {
         return m_parts[0].size();
     }
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+    // The instruction set of the kernels used in the computation of the accelerations/potentials. This is
+    // meaningful only for the trees supported by the SIMD dispatch (see simd_dispatch_enabled).
+    simd_isa isa() const
+    {
+        return m_simd_isa;
+    }
+#endif
 
 private:
     // The size of the domain.
@@ -3353,8 +6621,18 @@ private:
     // a node is ncrit or less, then we will compute the accelerations/potentials on the
     // particles in that node in a vectorised fashion.
     size_type m_ncrit;
+    // Flag to signal the use of periodic boundary conditions. In this case, the domain
+    // is the periodic cell and the interactions are computed via Ewald summation.
+    bool m_periodic;
+    // The number of cells per dimension of the mesh in the TreePM mode (zero if the TreePM mode is
+    // disabled). In the TreePM mode, the tree computes only the short-range part of the interactions,
+    // while the long-range part is computed on the mesh via the particle-mesh method (see pm.hpp).
+    size_type m_pm_grid;
     // The particles: NDim coordinates plus masses.
     std::array<f_vector<F>, NDim + 1u> m_parts;
+    // The per-particle softening lengths (empty if the same softening length is
+    // used for all the particles). They are kept in the same order as m_parts.
+    f_vector<F> m_eps;
     // The particles' Morton codes.
     std::vector<UInt, di_aligned_allocator<UInt>> m_codes;
     // The indirect sorting vector. It establishes how to re-order the
@@ -3385,16 +6663,37 @@ private:
     tree_type m_tree;
     // The list of critical nodes.
     cnode_list_type m_crit_nodes;
+    // The indices in m_tree of the critical nodes.
+    std::vector<size_type, di_aligned_allocator<size_type>> m_crit_idx;
+    // The higher-order multipole moments of the nodes (empty if MPOrder == 1).
+    // The moments of the node at index i in m_tree are stored
+    // in the range [i * mp_size, (i + 1) * mp_size).
+    f_vector<F> m_multipoles;
+    // The traces of the quadrupole moments of the nodes, used in periodic mode
+    // (see compute_node_ewald_tr()).
+    f_vector<F> m_ewald_tr;
+    // The generation of the tree structure, bumped each time the tree is built. It is part of
+    // the key of the cached interaction lists, which store indices into m_tree.
+    unsigned long long m_tree_gen = 0;
+    // The cached interaction lists of the critical nodes (see acc_pot_impl()), protected
+    // by a mutex as they are updated by the (const) accs/pots functions.
+    mutable ilist_cache_type m_ilist;
+    mutable std::shared_mutex m_ilist_mutex;
+#if defined(RAKAU_WITH_SIMD_DISPATCH)
+    // The instruction set of the kernels used in the computation of the accelerations/potentials,
+    // selected at construction (see simd_dispatch_isa()).
+    simd_isa m_simd_isa = simd_dispatch_isa();
+#endif
 #if defined(RAKAU_WITH_ROCM)
     std::optional<rocm_state<NDim, F, UInt>> m_rocm;
 #endif
 };
 
-template <typename F>
-using quadtree = tree<2, F>;
+template <typename F, unsigned MPOrder = 1, softening_kernel SK = softening_kernel::plummer>
+using quadtree = tree<2, F, std::size_t, MPOrder, SK>;
 
-template <typename F>
-using octree = tree<3, F>;
+template <typename F, unsigned MPOrder = 1, softening_kernel SK = softening_kernel::plummer>
+using octree = tree<3, F, std::size_t, MPOrder, SK>;
 
 } // namespace rakau
 
@@ -159,6 +159,9 @@ __global__ void acc_pot_kernel(arr_wrap<F *, tree_nvecs_res<Q, NDim>> res_ptrs,
     }
     const auto p_mass = parts_ptrs.value[NDim][pidx];
 
+    // The opening angle.
+    const auto theta = sqrt(theta2);
+
     // Temporary arrays that will be used in the loop.
     F dist_vec[NDim], props[NDim + 1u];
 
@@ -182,8 +185,9 @@ __global__ void acc_pot_kernel(arr_wrap<F *, tree_nvecs_res<Q, NDim>> res_ptrs,
         }
         // Level of the source node.
         const auto src_level = src_node.level;
-        // Square of the dimension of the source node.
-        const auto src_dim2 = src_node.dim2;
+        // Square of the critical distance of the source node (scaled by theta).
+        // NOTE: see the BH criterion check in the cpu implementation for an explanation.
+        const auto src_crit = src_node.dim + theta * src_node.com_off, src_crit2 = src_crit * src_crit;
 
         // Compute the shifted particle code. This is the particle code with one extra
         // top bit and then shifted down according to the level of the source node, so that
@@ -238,7 +242,7 @@ __global__ void acc_pot_kernel(arr_wrap<F *, tree_nvecs_res<Q, NDim>> res_ptrs,
         }
 
         // Now let's run the BH/ancestor check on all the target particles in the same warp.
-        if (__all_sync(unsigned(-1), s_p_code != src_code && src_dim2 < theta2 * dist2)) {
+        if (__all_sync(unsigned(-1), s_p_code != src_code && src_crit2 < theta2 * dist2)) {
             // The source node does not contain the target particle and it satisfies the BH check.
             // We will then add the (approximated) contribution of the source node
             // to the final result.
@@ -1,5 +1,6 @@
 #include <array>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <tuple>
@@ -155,11 +156,14 @@ void rocm_state<NDim, F, UInt>::acc_pot(int p_begin, int p_end, const std::array
     // Create the output views.
     auto rt = ap2tv(out_offset, p_end - p_begin);
 
+    // The opening angle.
+    const auto theta = std::sqrt(theta2);
+
     hc::parallel_for_each(
         hc::extent<1>(p_end - p_begin).tile(__HSA_WAVEFRONT_SIZE__),
         [
             p_begin, pt = state.m_pav, codes_view = state.m_codes_view, nparts, tree_view = state.m_tree_view,
-            tree_size = state.m_tree_size, rt, theta2, G,
+            tree_size = state.m_tree_size, rt, theta, theta2, G,
             eps2
         ](hc::tiled_index<1> thread_id) [[hc]] {
             // Get the global particle index into the tree data.
@@ -208,8 +212,9 @@ void rocm_state<NDim, F, UInt>::acc_pot(int p_begin, int p_end, const std::array
                 }
                 // Level of the source node.
                 const auto src_level = src_node.level;
-                // Square of the dimension of the source node.
-                const auto src_dim2 = src_node.dim2;
+                // Square of the critical distance of the source node (scaled by theta).
+                // NOTE: see the BH criterion check in the cpu implementation for an explanation.
+                const auto src_crit = src_node.dim + theta * src_node.com_off, src_crit2 = src_crit * src_crit;
 
                 // Compute the shifted particle code. This is the particle code with one extra
                 // top bit and then shifted down according to the level of the source node, so that
@@ -263,7 +268,7 @@ void rocm_state<NDim, F, UInt>::acc_pot(int p_begin, int p_end, const std::array
                     dist_vec[j] = diff;
                 }
                 // Now let's run the BH/ancestor check on all the target particles in the same wavefront.
-                if (hc::__all(s_p_code != src_code && src_dim2 < theta2 * dist2)) {
+                if (hc::__all(s_p_code != src_code && src_crit2 < theta2 * dist2)) {
                     // The source node does not contain the target particle and it satisfies the BH check.
                     // We will then add the (approximated) contribution of the source node
                     // to the final result.
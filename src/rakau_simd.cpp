@@ -0,0 +1,106 @@
+// NOTE: this file is compiled once for each instruction set of the SIMD dispatch, with the compiler flags enabling
+// the instruction set and with RAKAU_BUILD_SIMD_ISA defined to its name in the simd_isa enum (see CMakeLists.txt).
+// Each compilation goes into a separate shared library, which exports only the explicit instantiations at the bottom.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/iterator/permutation_iterator.hpp>
+#include <boost/preprocessor/seq/elem.hpp>
+#include <boost/preprocessor/seq/for_each_product.hpp>
+
+#include <xsimd/xsimd.hpp>
+
+#include <rakau/config.hpp>
+#include <rakau/detail/simd_dispatch_fwd.hpp>
+#include <rakau/tree.hpp>
+
+#if !defined(RAKAU_WITH_SIMD_DISPATCH) || !defined(RAKAU_BUILD_SIMD_ISA)
+
+#error This file must be compiled only as part of the SIMD dispatch
+
+#endif
+
+namespace rakau
+{
+
+inline namespace detail
+{
+
+// Make sure that the compiler flags enable the instruction set this file is compiled for, and
+// no instruction set above it (e.g., via -march=native in the user-supplied flags).
+inline constexpr auto simd_build_isa = simd_isa::RAKAU_BUILD_SIMD_ISA;
+
+static_assert(simd_build_isa != simd_isa::sse2
+                  || (XSIMD_X86_INSTR_SET >= XSIMD_X86_SSE2_VERSION && XSIMD_X86_INSTR_SET < XSIMD_X86_AVX_VERSION),
+              "The SSE2 kernels must be compiled with SSE2 support enabled and AVX support disabled.");
+static_assert(simd_build_isa != simd_isa::avx2
+                  || (XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX2_VERSION && XSIMD_X86_INSTR_SET < XSIMD_X86_AVX512_VERSION),
+              "The AVX2 kernels must be compiled with AVX2 support enabled and AVX-512 support disabled.");
+static_assert(simd_build_isa != simd_isa::avx512 || XSIMD_X86_INSTR_SET >= XSIMD_X86_AVX512_VERSION,
+              "The AVX-512 kernels must be compiled with AVX-512 support enabled.");
+
+// The tree types supported by the SIMD dispatch (see tree::simd_dispatch_enabled).
+template <std::size_t NDim, typename F, typename UInt>
+using simd_tree_t = tree<NDim, F, UInt>;
+
+// The arrays of output iterators used in the computation of the accelerations/potentials, in the internal
+// order (i.e., pointers) or in the original order (i.e., pointers permuted via the tree's permutation vector).
+template <bool Ordered, unsigned Q, std::size_t NDim, typename F, typename UInt>
+using simd_out_t
+    = std::array<std::conditional_t<Ordered,
+                                    decltype(boost::make_permutation_iterator(
+                                        std::declval<F *>(),
+                                        std::declval<const simd_tree_t<NDim, F, UInt> &>().perm().begin())),
+                                    F *>,
+                 tree_nvecs_res<Q, NDim>>;
+
+template <simd_isa Isa>
+template <unsigned Q, std::size_t NDim, typename F, typename UInt, bool Ordered>
+void tree_simd_access<Isa>::acc_pot(const void *t, const void *out, F theta2, F G, F eps2,
+                                    const std::vector<double> &split, const void *opts)
+{
+    using tree_t = simd_tree_t<NDim, F, UInt>;
+    static_cast<const tree_t *>(t)->template acc_pot_impl<Q>(
+        *static_cast<const simd_out_t<Ordered, Q, NDim, F, UInt> *>(out), theta2, G, eps2, split,
+        *static_cast<const typename tree_t::acc_pot_opts *>(opts));
+}
+
+// Explicit instantiations of the templates implemented above. We are going to use Boost.Preprocessor.
+
+// Quadtrees and octrees.
+#define RAKAU_SIMD_INST_DIM_SEQUENCE (2)(3)
+
+// float and double only (there's no SIMD support for extended precision).
+#define RAKAU_SIMD_INST_FP_SEQUENCE (float)(double)
+
+// 32/64bit types for the particle codes.
+#define RAKAU_SIMD_INST_UINT_SEQUENCE (std::uint32_t)(std::uint64_t)
+
+// Computation of accelerations, potentials or both.
+#define RAKAU_SIMD_INST_Q_SEQUENCE (0)(1)(2)
+
+// Macro for the instantiation of the main function, for the output iterators in the internal or original order.
+// NDim, F, UInt and Q will be passed in as a sequence named Args (in that order).
+#define RAKAU_SIMD_EXPLICIT_INST_FUN_IMPL(Args, Ordered)                                                               \
+    template void tree_simd_access<simd_build_isa>::acc_pot<BOOST_PP_SEQ_ELEM(3, Args), BOOST_PP_SEQ_ELEM(0, Args),    \
+                                                            BOOST_PP_SEQ_ELEM(1, Args), BOOST_PP_SEQ_ELEM(2, Args),    \
+                                                            Ordered>(                                                  \
+        const void *, const void *, BOOST_PP_SEQ_ELEM(1, Args), BOOST_PP_SEQ_ELEM(1, Args),                            \
+        BOOST_PP_SEQ_ELEM(1, Args), const std::vector<double> &, const void *);
+
+#define RAKAU_SIMD_EXPLICIT_INST_FUN(r, Args)                                                                          \
+    RAKAU_SIMD_EXPLICIT_INST_FUN_IMPL(Args, false)                                                                     \
+    RAKAU_SIMD_EXPLICIT_INST_FUN_IMPL(Args, true)
+
+// Do the actual instantiation via a cartesian product over the sequences.
+// clang-format off
+BOOST_PP_SEQ_FOR_EACH_PRODUCT(RAKAU_SIMD_EXPLICIT_INST_FUN, (RAKAU_SIMD_INST_DIM_SEQUENCE)(RAKAU_SIMD_INST_FP_SEQUENCE)(RAKAU_SIMD_INST_UINT_SEQUENCE)(RAKAU_SIMD_INST_Q_SEQUENCE));
+// clang-format on
+
+} // namespace detail
+} // namespace rakau
@@ -0,0 +1,51 @@
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+
+#include <rakau/config.hpp>
+#include <rakau/detail/simd_dispatch_fwd.hpp>
+
+// NOTE: this file is compiled for the baseline instruction set (see CMakeLists.txt),
+// as it must run on all cpus.
+
+namespace rakau
+{
+
+inline namespace detail
+{
+
+simd_isa simd_dispatch_isa()
+{
+    __builtin_cpu_init();
+    // NOTE: the kernels for AVX2 are compiled with FMA support as well, the kernels for AVX-512 with the
+    // extensions introduced with the Skylake server cpus (see CMakeLists.txt).
+    auto retval = simd_isa::sse2;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        retval = simd_isa::avx2;
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd")
+            && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("avx512vl")) {
+            retval = simd_isa::avx512;
+        }
+    }
+    // Cap the instruction set with the value of the environment variable, if set.
+    if (const auto env = std::getenv("RAKAU_SIMD_ISA")) {
+        for (auto isa : {simd_isa::sse2, simd_isa::avx2, simd_isa::avx512}) {
+            if (std::strcmp(env, simd_isa_name(isa)) == 0) {
+                if (isa < retval) {
+                    retval = isa;
+                }
+                return retval;
+            }
+        }
+        throw std::invalid_argument("Invalid value for the RAKAU_SIMD_ISA environment variable: '" + std::string(env)
+                                    + "' (the valid values are 'sse2', 'avx2' and 'avx512')");
+    }
+    return retval;
+}
+
+} // namespace detail
+
+} // namespace rakau
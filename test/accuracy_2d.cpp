@@ -0,0 +1,126 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("2D accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        // NOTE: with a tiny theta, the computation degenerates into a direct summation,
+        // and it exercises the leaf and self-interaction kernels.
+        constexpr auto theta = static_cast<fp_type>(.001), bsize = static_cast<fp_type>(1);
+        auto sizes = {10u, 100u, 1000u, 2000u};
+        auto max_leaf_ns = {1u, 2u, 8u, 16u};
+        auto ncrits = {1u, 16u, 128u, 256u};
+        std::array<std::vector<fp_type>, 2> accs;
+        std::array<std::vector<fp_type>, 3> accpots;
+        std::vector<fp_type> pots;
+        fp_type tot_max_diff(0);
+        std::vector<fp_type> diffs;
+        for (auto s : sizes) {
+            auto parts = get_uniform_particles<2>(s, bsize, rng);
+            for (auto max_leaf_n : max_leaf_ns) {
+                for (auto ncrit : ncrits) {
+                    quadtree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s,
+                                        kwargs::box_size = bsize, kwargs::max_leaf_n = max_leaf_n,
+                                        kwargs::ncrit = ncrit);
+                    t.accs_o(accs, theta);
+                    t.pots_o(pots, theta);
+                    t.accs_pots_o(accpots, theta);
+                    for (auto i = 0u; i < s; ++i) {
+                        const auto eacc = t.exact_acc_pot_o(i);
+                        // NOTE: in 2D the acceleration components are often very close to zero,
+                        // thus measure their errors relative to the magnitude of the acceleration.
+                        const auto nacc = std::sqrt(eacc[0] * eacc[0] + eacc[1] * eacc[1]);
+                        for (std::size_t j = 0; j < 3u; ++j) {
+                            REQUIRE(std::isfinite(accpots[j][i]));
+                            const auto d = std::abs(eacc[j] - accpots[j][i]) / (j < 2u ? nacc : std::abs(eacc[j]));
+                            tot_max_diff = std::max(tot_max_diff, d);
+                            diffs.push_back(d);
+                        }
+                        for (std::size_t j = 0; j < 2u; ++j) {
+                            const auto d = std::abs(eacc[j] - accs[j][i]) / nacc;
+                            tot_max_diff = std::max(tot_max_diff, d);
+                            diffs.push_back(d);
+                        }
+                        const auto d = std::abs((eacc[2] - pots[i]) / eacc[2]);
+                        tot_max_diff = std::max(tot_max_diff, d);
+                        diffs.push_back(d);
+                    }
+                }
+            }
+        }
+        std::cout << "tot_max_diff=" << tot_max_diff << ", median_diff=" << median(diffs) << '\n';
+        if constexpr (std::is_same_v<fp_type, double> && std::numeric_limits<fp_type>::is_iec559) {
+            // NOTE: the bounds are derived experimentally, the maximum error being
+            // dominated by cancellation in the summation for a few particles.
+            REQUIRE(tot_max_diff < fp_type(1E-6));
+            REQUIRE(median(diffs) < fp_type(1E-13));
+        } else {
+            REQUIRE(median(diffs) < fp_type(1E-5));
+        }
+    });
+}
+
+TEST_CASE("2D median error")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1), eps = static_cast<fp_type>(.001);
+        constexpr auto s = 10000u;
+        auto parts = get_uniform_particles<2>(s, bsize, rng);
+        quadtree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s, kwargs::box_size = bsize);
+        std::array<std::vector<fp_type>, 3> accpots;
+        std::array<std::vector<fp_type>, 2> accs;
+        for (auto theta : {fp_type(.4), fp_type(.8)}) {
+            t.accs_pots_u(accpots, theta, kwargs::eps = eps);
+            // The accelerations-only computation must be consistent with the accs/pots one.
+            t.accs_u(accs, theta, kwargs::eps = eps);
+            std::vector<fp_type> acc_diff, pot_diff;
+            for (auto i = 0u; i < s; i += 10u) {
+                const auto eacc = t.exact_acc_pot_u(i, kwargs::eps = eps);
+                fp_type dacc(0), nacc(0);
+                for (std::size_t j = 0; j < 2u; ++j) {
+                    dacc += (eacc[j] - accpots[j][i]) * (eacc[j] - accpots[j][i]);
+                    nacc += eacc[j] * eacc[j];
+                    REQUIRE(std::abs(accs[j][i] - accpots[j][i]) <= std::sqrt(nacc) * fp_type(1E-4));
+                }
+                acc_diff.emplace_back(std::sqrt(dacc / nacc));
+                pot_diff.emplace_back(std::abs((eacc[2] - accpots[2][i]) / eacc[2]));
+            }
+            std::cout << "theta=" << theta << ", 2D median acc/pot errors: " << median(acc_diff) << ", "
+                      << median(pot_diff) << '\n';
+            REQUIRE(median(acc_diff) < theta * theta * fp_type(.05));
+            REQUIRE(median(pot_diff) < theta * theta * fp_type(.02));
+        }
+    });
+}
@@ -177,3 +177,50 @@ TEST_CASE("acceleration accuracy unordered")
         }
     });
 }
+
+TEST_CASE("acceleration accuracy mixed precision")
+{
+    // NOTE: the reference values are computed with a tree in double
+    // precision built from the same particles.
+    constexpr auto bsize = 1.f;
+    constexpr auto s = 10000u;
+    const auto parts = get_uniform_particles<3>(s, bsize, rng);
+    const std::vector<double> parts_d(parts.begin(), parts.end());
+    octree<float> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                    kwargs::box_size = bsize);
+    octree<double> td({parts_d.begin() + s, parts_d.begin() + 2u * s, parts_d.begin() + 3u * s, parts_d.begin()}, s,
+                      kwargs::box_size = double(bsize));
+    std::array<std::vector<float>, 3> accs, accs_mp;
+    std::array<std::vector<double>, 3> eaccs;
+    for (auto theta : {.001f, .3f}) {
+        td.accs_o(eaccs, theta);
+        t.accs_o(accs, theta);
+        t.accs_o(accs_mp, theta, kwargs::mixed_precision = true);
+        std::vector<double> diff, diff_mp;
+        for (auto i = 0u; i < s; ++i) {
+            const auto nacc = std::sqrt(eaccs[0][i] * eaccs[0][i] + eaccs[1][i] * eaccs[1][i]
+                                        + eaccs[2][i] * eaccs[2][i]);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                REQUIRE(std::isfinite(accs_mp[j][i]));
+                diff.push_back(std::abs(eaccs[j][i] - accs[j][i]) / nacc);
+                diff_mp.push_back(std::abs(eaccs[j][i] - accs_mp[j][i]) / nacc);
+            }
+        }
+        std::cout << "theta=" << theta << ", median error: " << median(diff)
+                  << ", median error in mixed precision: " << median(diff_mp) << '\n';
+        // NOTE: in mixed precision the error does not grow with the number of
+        // terms in the summation, and it stays at the level of a few ulps.
+        REQUIRE(median(diff_mp) < median(diff));
+        if constexpr (std::numeric_limits<float>::is_iec559) {
+            REQUIRE(median(diff_mp) < 6E-8);
+        }
+    }
+    // In double precision, the mixed-precision mode has no effect.
+    std::array<std::vector<double>, 3> accs_d;
+    td.accs_u(eaccs, .5);
+    td.accs_u(accs_d, .5, kwargs::mixed_precision = true);
+    REQUIRE(accs_d == eaccs);
+    td.accs_u(eaccs, .5, kwargs::dual_tree = true);
+    td.accs_u(accs_d, .5, kwargs::dual_tree = true, kwargs::mixed_precision = true);
+    REQUIRE(accs_d == eaccs);
+}
@@ -51,7 +51,7 @@ TEST_CASE("acceleration/potential accuracy ordered")
         constexpr auto theta = static_cast<fp_type>(.001), bsize = static_cast<fp_type>(1);
         auto sizes = {10u, 100u, 1000u, 2000u};
         auto max_leaf_ns = {1u, 2u, 8u, 16u};
-        auto ncrits = {1u, 16u, 128u, 256u};
+        auto ncrits = {1u, 16u, 128u, 256u, 1024u};
         std::array<std::vector<fp_type>, 4> accpots;
         fp_type tot_max_x_diff(0), tot_max_y_diff(0), tot_max_z_diff(0), tot_max_pot_diff(0);
         for (auto s : sizes) {
@@ -197,3 +197,72 @@ TEST_CASE("acceleration/potential accuracy unordered")
         }
     });
 }
+
+TEST_CASE("acceleration/potential accuracy mixed precision")
+{
+    // NOTE: the reference values are computed with a tree in double
+    // precision built from the same particles.
+    constexpr auto bsize = 1.f, theta = .4f;
+    constexpr auto s = 10000u;
+    const auto parts = get_uniform_particles<3>(s, bsize, rng);
+    const std::vector<double> parts_d(parts.begin(), parts.end());
+    octree<float> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                    kwargs::box_size = bsize);
+    octree<double> td({parts_d.begin() + s, parts_d.begin() + 2u * s, parts_d.begin() + 3u * s, parts_d.begin()}, s,
+                      kwargs::box_size = double(bsize));
+    std::array<std::vector<float>, 4> accpots, accpots_mp;
+    std::array<std::vector<double>, 4> eaccpots;
+    td.accs_pots_o(eaccpots, theta);
+    t.accs_pots_o(accpots, theta);
+    // Check the plain traversal, the recording of the interaction lists and their replay.
+    for (auto k = 0; k < 3; ++k) {
+        t.accs_pots_o(accpots_mp, theta, kwargs::mixed_precision = true, kwargs::ilist_cache = k > 0);
+        std::vector<double> acc_diff, acc_diff_mp, pot_diff, pot_diff_mp;
+        for (auto i = 0u; i < s; ++i) {
+            const auto nacc = std::sqrt(eaccpots[0][i] * eaccpots[0][i] + eaccpots[1][i] * eaccpots[1][i]
+                                        + eaccpots[2][i] * eaccpots[2][i]);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                acc_diff.push_back(std::abs(eaccpots[j][i] - accpots[j][i]) / nacc);
+                acc_diff_mp.push_back(std::abs(eaccpots[j][i] - accpots_mp[j][i]) / nacc);
+            }
+            pot_diff.push_back(std::abs((eaccpots[3][i] - accpots[3][i]) / eaccpots[3][i]));
+            pot_diff_mp.push_back(std::abs((eaccpots[3][i] - accpots_mp[3][i]) / eaccpots[3][i]));
+        }
+        std::cout << "median acc/pot errors: " << median(acc_diff) << ", " << median(pot_diff)
+                  << ", in mixed precision: " << median(acc_diff_mp) << ", " << median(pot_diff_mp) << '\n';
+        REQUIRE(median(acc_diff_mp) < median(acc_diff));
+        REQUIRE(median(pot_diff_mp) < median(pot_diff));
+        if constexpr (std::numeric_limits<float>::is_iec559) {
+            REQUIRE(median(acc_diff_mp) < 6E-8);
+            REQUIRE(median(pot_diff_mp) < 6E-8);
+        }
+    }
+    // The dual-tree traversal, with and without the mutual mode.
+    for (auto mut : {false, true}) {
+        td.accs_pots_o(eaccpots, theta, kwargs::dual_tree = true, kwargs::mutual = mut);
+        t.accs_pots_o(accpots, theta, kwargs::dual_tree = true, kwargs::mutual = mut);
+        t.accs_pots_o(accpots_mp, theta, kwargs::dual_tree = true, kwargs::mutual = mut,
+                      kwargs::mixed_precision = true);
+        std::vector<double> acc_diff, acc_diff_mp, pot_diff, pot_diff_mp;
+        for (auto i = 0u; i < s; ++i) {
+            const auto nacc = std::sqrt(eaccpots[0][i] * eaccpots[0][i] + eaccpots[1][i] * eaccpots[1][i]
+                                        + eaccpots[2][i] * eaccpots[2][i]);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                acc_diff.push_back(std::abs(eaccpots[j][i] - accpots[j][i]) / nacc);
+                acc_diff_mp.push_back(std::abs(eaccpots[j][i] - accpots_mp[j][i]) / nacc);
+            }
+            pot_diff.push_back(std::abs((eaccpots[3][i] - accpots[3][i]) / eaccpots[3][i]));
+            pot_diff_mp.push_back(std::abs((eaccpots[3][i] - accpots_mp[3][i]) / eaccpots[3][i]));
+        }
+        std::cout << "mutual=" << mut << ", dual-tree median acc/pot errors: " << median(acc_diff) << ", "
+                  << median(pot_diff) << ", in mixed precision: " << median(acc_diff_mp) << ", "
+                  << median(pot_diff_mp) << '\n';
+        // NOTE: the local expansions (and, in the mutual mode, the near-field sums) are always accumulated
+        // in double precision, thus here the errors are at the level of a few ulps also without
+        // the mixed-precision mode, and we check only the upper bound.
+        if constexpr (std::numeric_limits<float>::is_iec559) {
+            REQUIRE(median(acc_diff_mp) < 6E-8);
+            REQUIRE(median(pot_diff_mp) < 6E-8);
+        }
+    }
+}
@@ -136,3 +136,41 @@ TEST_CASE("potential accuracy unordered")
         }
     });
 }
+
+TEST_CASE("potential accuracy mixed precision")
+{
+    // NOTE: the reference values are computed with a tree in double
+    // precision built from the same particles.
+    constexpr auto bsize = 1.f;
+    constexpr auto s = 10000u;
+    const auto parts = get_uniform_particles<3>(s, bsize, rng);
+    const std::vector<double> parts_d(parts.begin(), parts.end());
+    octree<float> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                    kwargs::box_size = bsize);
+    octree<double> td({parts_d.begin() + s, parts_d.begin() + 2u * s, parts_d.begin() + 3u * s, parts_d.begin()}, s,
+                      kwargs::box_size = double(bsize));
+    std::vector<float> pots, pots_mp;
+    std::vector<double> epots;
+    for (auto theta : {.001f, .3f}) {
+        td.pots_o(epots, theta);
+        t.pots_o(pots, theta);
+        t.pots_o(pots_mp, theta, kwargs::mixed_precision = true);
+        std::vector<double> diff, diff_mp;
+        for (auto i = 0u; i < s; ++i) {
+            REQUIRE(std::isfinite(pots_mp[i]));
+            diff.push_back(std::abs((epots[i] - pots[i]) / epots[i]));
+            diff_mp.push_back(std::abs((epots[i] - pots_mp[i]) / epots[i]));
+        }
+        std::cout << "theta=" << theta << ", median error: " << median(diff)
+                  << ", median error in mixed precision: " << median(diff_mp) << '\n';
+        REQUIRE(median(diff_mp) < median(diff));
+        if constexpr (std::numeric_limits<float>::is_iec559) {
+            REQUIRE(median(diff_mp) < 6E-8);
+        }
+    }
+    // In double precision, the mixed-precision mode has no effect.
+    std::vector<double> pots_d;
+    td.pots_u(epots, .5);
+    td.pots_u(pots_d, .5, kwargs::mixed_precision = true);
+    REQUIRE(pots_d == epots);
+}
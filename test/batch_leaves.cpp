@@ -0,0 +1,96 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("batch leaves octree")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1), eps = static_cast<fp_type>(.01);
+        // NOTE: the interactions with the source particles are summed in a different order.
+        constexpr auto tol = static_cast<fp_type>(std::is_same_v<fp_type, float> ? 1E-5 : 1E-12);
+        constexpr auto s = 5000u;
+        const auto parts = get_uniform_particles<3>(s, bsize, rng);
+        // NOTE: with max_leaf_n = 1000, the leaves don't fit in the batch.
+        for (auto max_leaf_n : {1u, 8u, 16u, 1000u}) {
+            octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                              kwargs::box_size = bsize, kwargs::max_leaf_n = max_leaf_n);
+            std::array<std::vector<fp_type>, 3> accs, accs_b;
+            std::array<std::vector<fp_type>, 4> accpots, accpots_b;
+            std::vector<fp_type> pots, pots_b;
+            for (auto theta : {fp_type(.2), fp_type(.75)}) {
+                t.accs_u(accs, theta, kwargs::eps = eps);
+                t.accs_u(accs_b, theta, kwargs::eps = eps, kwargs::batch_leaves = true);
+                REQUIRE(check_close(accs_b, accs, tol));
+                t.accs_pots_o(accpots, theta, kwargs::eps = eps);
+                t.accs_pots_o(accpots_b, theta, kwargs::eps = eps, kwargs::batch_leaves = true);
+                REQUIRE(check_close(accpots_b, accpots, tol));
+                t.pots_u(pots, theta, kwargs::eps = eps);
+                t.pots_u(pots_b, theta, kwargs::eps = eps, kwargs::batch_leaves = true);
+                REQUIRE(check_close(std::array{pots_b}, std::array{pots}, tol));
+            }
+            // Combination with the interaction lists cache.
+            t.accs_u(accs, fp_type(.5), kwargs::eps = eps);
+            for (auto k = 0; k < 2; ++k) {
+                t.accs_u(accs_b, fp_type(.5), kwargs::eps = eps, kwargs::batch_leaves = true,
+                         kwargs::ilist_cache = true);
+                REQUIRE(check_close(accs_b, accs, tol));
+            }
+        }
+    });
+}
+
+TEST_CASE("batch leaves quadtree")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1);
+        constexpr auto tol = static_cast<fp_type>(std::is_same_v<fp_type, float> ? 1E-5 : 1E-12);
+        constexpr auto s = 3000u;
+        const auto parts = get_uniform_particles<2>(s, bsize, rng);
+        quadtree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s, kwargs::box_size = bsize);
+        std::array<std::vector<fp_type>, 3> accpots, accpots_b;
+        t.accs_pots_u(accpots, fp_type(.5));
+        t.accs_pots_u(accpots_b, fp_type(.5), kwargs::batch_leaves = true);
+        REQUIRE(check_close(accpots_b, accpots, tol));
+    });
+}
+
+TEST_CASE("batch leaves errors")
+{
+    constexpr auto s = 100u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::batch_leaves = true, kwargs::dual_tree = true),
+                      std::invalid_argument);
+}
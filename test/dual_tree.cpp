@@ -0,0 +1,148 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("dual-tree accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        // NOTE: with a tiny theta, the dual-tree traversal degenerates
+        // into a direct summation.
+        constexpr auto theta = static_cast<fp_type>(.001), bsize = static_cast<fp_type>(1);
+        auto sizes = {10u, 100u, 1000u, 2000u};
+        auto max_leaf_ns = {1u, 8u, 16u};
+        auto ncrits = {1u, 16u, 256u};
+        std::array<std::vector<fp_type>, 4> accpots;
+        fp_type tot_max_diff(0);
+        for (auto s : sizes) {
+            auto parts = get_uniform_particles<3>(s, bsize, rng);
+            for (auto max_leaf_n : max_leaf_ns) {
+                for (auto ncrit : ncrits) {
+                    octree<fp_type> t(
+                        {parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                        kwargs::box_size = bsize, kwargs::max_leaf_n = max_leaf_n, kwargs::ncrit = ncrit);
+                    t.accs_pots_o(accpots, theta, kwargs::dual_tree = true);
+                    for (auto i = 0u; i < s; ++i) {
+                        auto eacc = t.exact_acc_pot_o(i);
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            REQUIRE(std::isfinite(accpots[j][i]));
+                            tot_max_diff = std::max(tot_max_diff, std::abs((eacc[j] - accpots[j][i]) / eacc[j]));
+                        }
+                    }
+                }
+            }
+        }
+        std::cout << "tot_max_diff=" << tot_max_diff << '\n';
+        if constexpr (std::is_same_v<fp_type, double> && std::numeric_limits<fp_type>::is_iec559) {
+            REQUIRE(tot_max_diff < fp_type(1E-10));
+        }
+    });
+}
+
+TEST_CASE("dual-tree median error")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1), G = static_cast<fp_type>(1.5), eps = static_cast<fp_type>(.01);
+        constexpr auto s = 10000u;
+        auto parts = get_uniform_particles<3>(s, bsize, rng);
+        octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                          kwargs::box_size = bsize);
+        std::array<std::vector<fp_type>, 4> accpots, accpots_bh;
+        std::vector<fp_type> pots;
+        for (auto theta : {fp_type(.2), fp_type(.4), fp_type(.6), fp_type(.8)}) {
+            t.accs_pots_u(accpots, theta, kwargs::G = G, kwargs::eps = eps, kwargs::dual_tree = true);
+            t.accs_pots_u(accpots_bh, theta, kwargs::G = G, kwargs::eps = eps);
+            // The potentials-only computation must be consistent with the accs/pots one.
+            t.pots_u(pots, theta, kwargs::G = G, kwargs::eps = eps, kwargs::dual_tree = true);
+            std::vector<fp_type> acc_diff, pot_diff, acc_diff_bh, pot_diff_bh;
+            for (auto i = 0u; i < s; i += 10u) {
+                auto eacc = t.exact_acc_pot_u(i, kwargs::G = G, kwargs::eps = eps);
+                const auto eacc_norm = std::sqrt(eacc[0] * eacc[0] + eacc[1] * eacc[1] + eacc[2] * eacc[2]);
+                fp_type dacc(0), dacc_bh(0);
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    dacc += (eacc[j] - accpots[j][i]) * (eacc[j] - accpots[j][i]);
+                    dacc_bh += (eacc[j] - accpots_bh[j][i]) * (eacc[j] - accpots_bh[j][i]);
+                }
+                acc_diff.emplace_back(std::sqrt(dacc) / eacc_norm);
+                acc_diff_bh.emplace_back(std::sqrt(dacc_bh) / eacc_norm);
+                pot_diff.emplace_back(std::abs((eacc[3] - accpots[3][i]) / eacc[3]));
+                pot_diff_bh.emplace_back(std::abs((eacc[3] - accpots_bh[3][i]) / eacc[3]));
+                REQUIRE(std::abs((pots[i] - accpots[3][i]) / accpots[3][i]) < fp_type(1E-4));
+            }
+            const auto med_acc = median(acc_diff), med_pot = median(pot_diff);
+            std::cout << "theta=" << theta << ", dual-tree median acc/pot errors: " << med_acc << ", " << med_pot
+                      << ", BH median acc/pot errors: " << median(acc_diff_bh) << ", " << median(pot_diff_bh) << '\n';
+            // NOTE: these bounds are quite generous, they are meant to catch gross errors
+            // in the expansions.
+            REQUIRE(med_acc < fp_type(.02));
+            REQUIRE(med_pot < fp_type(.002));
+        }
+    });
+}
+
+TEST_CASE("dual-tree 2D")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1);
+        constexpr auto s = 1000u;
+        auto parts = get_uniform_particles<2>(s, bsize, rng);
+        quadtree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s, kwargs::box_size = bsize,
+                            kwargs::max_leaf_n = 4, kwargs::ncrit = 16);
+        std::array<std::vector<fp_type>, 3> accpots;
+        t.accs_pots_o(accpots, fp_type(.001), kwargs::dual_tree = true);
+        fp_type max_diff(0);
+        for (auto i = 0u; i < s; ++i) {
+            auto eacc = t.exact_acc_pot_o(i);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                max_diff = std::max(max_diff, std::abs((eacc[j] - accpots[j][i]) / eacc[j]));
+            }
+        }
+        if constexpr (std::is_same_v<fp_type, double> && std::numeric_limits<fp_type>::is_iec559) {
+            REQUIRE(max_diff < fp_type(1E-10));
+        }
+    });
+}
+
+TEST_CASE("dual-tree errors")
+{
+    octree<double> t;
+    std::array<std::vector<double>, 3> accs;
+    // Empty tree.
+    t.accs_u(accs, .5, kwargs::dual_tree = true);
+    REQUIRE(accs[0].empty());
+    // The dual-tree traversal is available only on the cpu.
+    const std::vector<double> split{1., 1.};
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::dual_tree = true, kwargs::split = split), std::invalid_argument);
+}
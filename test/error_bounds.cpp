@@ -0,0 +1,119 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+static std::mt19937 rng(0);
+
+// Check that the error bounds in errs hold for the accelerations in accs, computed
+// by the tree t. The return value is the median of the ratios between the bounds
+// and the actual errors.
+template <typename T, typename V>
+static double check_bounds(const T &t, const V &accs, const std::vector<double> &errs)
+{
+    std::vector<double> ratios;
+    for (decltype(errs.size()) i = 0; i < errs.size(); ++i) {
+        const auto eacc = t.exact_acc_u(i);
+        double dacc = 0, nacc = 0;
+        for (std::size_t j = 0; j < 3u; ++j) {
+            dacc += (eacc[j] - accs[j][i]) * (eacc[j] - accs[j][i]);
+            nacc += eacc[j] * eacc[j];
+        }
+        dacc = std::sqrt(dacc);
+        // NOTE: allow for the round-off errors.
+        REQUIRE(dacc <= errs[i] + std::sqrt(nacc) * 1E-13);
+        ratios.push_back(errs[i] / dacc);
+    }
+    return median(ratios);
+}
+
+template <typename Tree>
+static void run_bounds_test(const std::vector<double> &parts, unsigned s)
+{
+    Tree t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+           kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> accs;
+    std::array<std::vector<double>, 4> accpots;
+    std::vector<double> errs, errs2;
+    for (auto theta : {.5, .8}) {
+        t.accs_u(accs, theta, kwargs::acc_errs = errs);
+        REQUIRE(errs.size() == s);
+        const auto ratio = check_bounds(t, accs, errs);
+        std::cout << "theta=" << theta << ", median ratio between the error bounds and the errors: " << ratio
+                  << '\n';
+        // NOTE: the bounds are summed over the source nodes, while the actual errors partially
+        // cancel out, thus they are typically a few hundred times larger than the errors.
+        REQUIRE(ratio < 2000.);
+        // The bounds do not depend on the quantities being computed, nor on
+        // the batched evaluation of the leaves.
+        t.accs_pots_u(accpots, theta, kwargs::acc_errs = errs2);
+        REQUIRE(errs2 == errs);
+        t.accs_u(accs, theta, kwargs::acc_errs = errs2, kwargs::batch_leaves = true);
+        REQUIRE(errs2 == errs);
+        // Recording and replay of the interaction lists.
+        for (auto k = 0; k < 2; ++k) {
+            t.accs_u(accs, theta, kwargs::acc_errs = errs2, kwargs::ilist_cache = true);
+            REQUIRE(errs2 == errs);
+        }
+        // The ordered version, via a pointer.
+        std::vector<double> errs_o(s);
+        t.accs_o(accs, theta, kwargs::acc_errs = errs_o.data());
+        for (auto i = 0u; i < s; ++i) {
+            REQUIRE(errs_o[t.perm()[i]] == errs[i]);
+        }
+    }
+    // The bounds hold also for the accepted nodes of the relative opening criterion.
+    t.accs_u(accs, rel_error{1E-3}, kwargs::acc_errs = errs);
+    check_bounds(t, accs, errs);
+}
+
+TEST_CASE("acceleration error bounds")
+{
+    constexpr auto s = 3000u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    run_bounds_test<octree<double>>(parts, s);
+    run_bounds_test<octree<double, 2>>(parts, s);
+    run_bounds_test<octree<double, 3>>(parts, s);
+}
+
+TEST_CASE("acceleration error bounds errors")
+{
+    constexpr auto s = 100u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> accs;
+    std::vector<double> pots, errs;
+    REQUIRE_THROWS_AS(t.pots_u(pots, .5, kwargs::acc_errs = errs), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::acc_errs = errs, kwargs::dual_tree = true),
+                      std::invalid_argument);
+    const std::vector<double> split{1., 1.};
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::acc_errs = errs, kwargs::split = split), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::acc_errs = static_cast<double *>(nullptr)),
+                      std::invalid_argument);
+    // Empty tree.
+    octree<double> t0;
+    t0.accs_u(accs, .5, kwargs::acc_errs = errs);
+    REQUIRE(errs.empty());
+}
@@ -0,0 +1,232 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+// Detect if the potentials only can be computed with a target relative error.
+template <typename T, typename = void>
+struct has_pots_err : std::false_type {
+};
+
+template <typename T>
+struct has_pots_err<T, std::void_t<decltype(std::declval<const T &>().pots_u(
+                           std::declval<std::vector<double> &>(), rel_error{1E-3}))>> : std::true_type {
+};
+
+// The error-controlled evaluation constrains only the errors of the accelerations.
+static_assert(!has_pots_err<octree<double>>::value);
+
+// The 90th percentile of the relative errors of the accelerations
+// in accs, checked on one particle out of ten.
+template <typename T, typename V>
+static double acc_error_p90(const T &t, const V &accs)
+{
+    std::vector<double> errs;
+    for (decltype(accs[0].size()) i = 0; i < accs[0].size(); i += 10u) {
+        const auto eacc = t.exact_acc_u(i);
+        double dacc = 0, nacc = 0;
+        for (std::size_t j = 0; j < 3u; ++j) {
+            dacc += (eacc[j] - accs[j][i]) * (eacc[j] - accs[j][i]);
+            nacc += eacc[j] * eacc[j];
+        }
+        errs.push_back(std::sqrt(dacc / nacc));
+    }
+    std::sort(errs.begin(), errs.end());
+    return errs[errs.size() * 9u / 10u];
+}
+
+// Generate n particles with equal masses distributed according to a Plummer sphere
+// with scale radius a, truncated at radius r_max.
+template <typename F>
+static std::vector<F> get_plummer_particles(unsigned n, double a, double r_max)
+{
+    std::vector<F> retval(4u * n);
+    std::uniform_real_distribution<double> udist(0., 1.);
+    for (auto i = 0u; i < n; ++i) {
+        retval[i] = F(1) / static_cast<F>(n);
+        double r;
+        do {
+            r = a / std::sqrt(std::pow(udist(rng), -2. / 3.) - 1.);
+        } while (r > r_max);
+        const auto ct = 2. * udist(rng) - 1., st = std::sqrt(1. - ct * ct), ph = 6.283185307179586 * udist(rng);
+        retval[n + i] = static_cast<F>(r * st * std::cos(ph));
+        retval[2u * n + i] = static_cast<F>(r * st * std::sin(ph));
+        retval[3u * n + i] = static_cast<F>(r * ct);
+    }
+    return retval;
+}
+
+TEST_CASE("error control accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1);
+        constexpr auto s = 10000u;
+        const auto parts = get_uniform_particles<3>(s, bsize, rng);
+        octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                          kwargs::box_size = bsize);
+        std::array<std::vector<fp_type>, 3> accs, accs_it;
+        std::array<std::vector<fp_type>, 4> accpots;
+        for (auto &v : accs_it) {
+            v.resize(s);
+        }
+        double prev_err = 1;
+        for (auto err : {1E-2, 1E-3}) {
+            t.accs_u(accs, rel_error{err});
+            const auto p90 = acc_error_p90(t, accs);
+            std::cout << "target error=" << err << ", 90th percentile of the acc errors: " << p90 << '\n';
+            REQUIRE(p90 <= err);
+            // The error must decrease with the target.
+            REQUIRE(p90 < prev_err);
+            prev_err = p90;
+            // The other functions.
+            t.accs_u(std::array{accs_it[0].begin(), accs_it[1].begin(), accs_it[2].begin()}, rel_error{err});
+            REQUIRE(acc_error_p90(t, accs_it) <= err);
+            t.accs_u({accs_it[0].data(), accs_it[1].data(), accs_it[2].data()}, rel_error{err});
+            REQUIRE(accs_it == accs);
+            t.accs_pots_u(accpots, rel_error{err});
+            REQUIRE(acc_error_p90(t, accpots) <= err);
+            // NOTE: the errors of the potentials are not controlled, they
+            // are computed with the opening criterion of the accelerations.
+            std::vector<double> pot_errs;
+            for (auto i = 0u; i < s; i += 10u) {
+                const auto epot = t.exact_pot_u(i);
+                pot_errs.push_back(std::abs((epot - accpots[3][i]) / epot));
+            }
+            std::cout << "median of the pot errors: " << median(pot_errs) << '\n';
+            REQUIRE(median(pot_errs) <= err);
+            std::array<std::vector<fp_type>, 3> accs_o;
+            t.accs_o(accs_o, rel_error{err});
+            for (auto i = 0u; i < s; ++i) {
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    REQUIRE(accs_o[j][t.perm()[i]] == accs[j][i]);
+                }
+            }
+        }
+    });
+}
+
+TEST_CASE("error control plummer")
+{
+    // A clustered distribution, in which the accelerations span several orders of magnitude.
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto s = 10000u;
+        const auto parts = get_plummer_particles<fp_type>(s, .05, .45);
+        octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                          kwargs::box_size = fp_type(1));
+        std::array<std::vector<fp_type>, 3> accs;
+        for (auto err : {1E-2, 1E-3}) {
+            t.accs_u(accs, rel_error{err});
+            const auto p90 = acc_error_p90(t, accs);
+            std::cout << "Plummer, target error=" << err << ", 90th percentile of the acc errors: " << p90 << '\n';
+            REQUIRE(p90 <= err);
+            // The error model must not be too pessimistic either.
+            REQUIRE(p90 > err / 10);
+        }
+    });
+}
+
+TEST_CASE("error control calibration")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto s = 10000u;
+        const auto parts = get_uniform_particles<3>(s, fp_type(1), rng);
+        octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                          kwargs::box_size = fp_type(1));
+        // Overestimate the accelerations used by the opening criterion,
+        // so that the target error is missed without calibration.
+        std::array<std::vector<fp_type>, 3> old_accs, accs;
+        std::array<std::vector<fp_type>, 4> accpots;
+        t.accs_u(old_accs, fp_type(.5));
+        for (auto &v : old_accs) {
+            for (auto &a : v) {
+                a *= 100;
+            }
+        }
+        constexpr auto err = 1E-3;
+        t.accs_u(accs, rel_error{err}, kwargs::old_accs = old_accs);
+        const auto p90 = acc_error_p90(t, accs);
+        t.accs_u(accs, rel_error{err}, kwargs::old_accs = old_accs, kwargs::calibrate = 100);
+        const auto p90_c = acc_error_p90(t, accs);
+        std::cout << "90th percentile of the acc errors: " << p90 << ", with calibration: " << p90_c << '\n';
+        REQUIRE(p90 > err);
+        // NOTE: the calibration measures the error only on a sample
+        // of the particles, allow for some slack.
+        REQUIRE(p90_c < err * 1.5);
+        // In the original order. NOTE: the particles are sampled in the original order as well,
+        // thus the results may differ from those in the internal order.
+        std::array<std::vector<fp_type>, 3> old_accs_o, accs_o;
+        t.accs_o(old_accs_o, fp_type(.5));
+        for (auto &v : old_accs_o) {
+            for (auto &a : v) {
+                a *= 100;
+            }
+        }
+        t.accs_o(accs_o, rel_error{err}, kwargs::old_accs = old_accs_o, kwargs::calibrate = 100);
+        for (auto i = 0u; i < s; ++i) {
+            for (std::size_t j = 0; j < 3u; ++j) {
+                accs[j][i] = accs_o[j][t.perm()[i]];
+            }
+        }
+        REQUIRE(acc_error_p90(t, accs) < err * 1.5);
+        t.accs_pots_u(accpots, rel_error{err}, kwargs::old_accs = old_accs, kwargs::calibrate = 100);
+        REQUIRE(acc_error_p90(t, accpots) < err * 1.5);
+        // No calibration is needed on a uniform distribution with the estimated accelerations.
+        t.accs_u(accs, rel_error{err}, kwargs::calibrate = 100);
+        REQUIRE(acc_error_p90(t, accs) <= err);
+    });
+}
+
+TEST_CASE("error control errors")
+{
+    constexpr auto s = 100u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> accs;
+    for (auto err : {0., -1., 1., std::numeric_limits<double>::quiet_NaN()}) {
+        REQUIRE_THROWS_AS(t.accs_u(accs, rel_error{err}), std::domain_error);
+    }
+    REQUIRE_THROWS_AS(t.accs_u(accs, rel_error{1E-3}, kwargs::dual_tree = true), std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, rel_error{1E-3}, kwargs::ilist_cache = true), std::invalid_argument);
+    const std::vector<double> split{1., 1.};
+    REQUIRE_THROWS_AS(t.accs_u(accs, rel_error{1E-3}, kwargs::split = split), std::invalid_argument);
+    // The calibration is available only in the error-controlled evaluation.
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::calibrate = 10), std::invalid_argument);
+    // Empty tree.
+    octree<double> t0;
+    t0.accs_u(accs, rel_error{1E-3}, kwargs::calibrate = 10);
+    REQUIRE(accs[0].empty());
+}
@@ -0,0 +1,154 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <future>
+#include <initializer_list>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("ilist cache replay")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1), G = static_cast<fp_type>(1.5), eps = static_cast<fp_type>(.01);
+        // NOTE: the replayed interactions are computed in a different order
+        // wrt the tree traversal.
+        constexpr auto tol = static_cast<fp_type>(std::is_same_v<fp_type, float> ? 1E-5 : 1E-12);
+        for (auto s : {0u, 10u, 3000u}) {
+            const auto parts = get_uniform_particles<3>(s, bsize, rng);
+            octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                              kwargs::box_size = bsize, kwargs::max_leaf_n = 4, kwargs::ncrit = 32);
+            std::array<std::vector<fp_type>, 3> accs, accs_c;
+            std::array<std::vector<fp_type>, 4> accpots, accpots_c;
+            std::vector<fp_type> pots, pots_c;
+            for (auto theta : {fp_type(.4), fp_type(.8), fp_type(.4)}) {
+                t.accs_u(accs, theta, kwargs::G = G, kwargs::eps = eps);
+                t.accs_pots_o(accpots, theta, kwargs::G = G, kwargs::eps = eps);
+                t.pots_u(pots, theta, kwargs::G = G, kwargs::eps = eps);
+                // The first call records the lists (or re-records them after a change of theta),
+                // the following ones replay them.
+                for (auto k = 0; k < 2; ++k) {
+                    t.accs_u(accs_c, theta, kwargs::G = G, kwargs::eps = eps, kwargs::ilist_cache = true);
+                    REQUIRE(check_close(accs_c, accs, tol));
+                    t.accs_pots_o(accpots_c, theta, kwargs::G = G, kwargs::eps = eps, kwargs::ilist_cache = true);
+                    REQUIRE(check_close(accpots_c, accpots, tol));
+                    t.pots_u(pots_c, theta, kwargs::G = G, kwargs::eps = eps, kwargs::ilist_cache = true);
+                    REQUIRE(check_close(std::array{pots_c}, std::array{pots}, tol));
+                }
+            }
+            // The cache is kept by copies.
+            auto t2(t);
+            t2.accs_u(accs_c, fp_type(.4), kwargs::G = G, kwargs::eps = eps, kwargs::ilist_cache = true);
+            t.accs_u(accs, fp_type(.4), kwargs::G = G, kwargs::eps = eps);
+            REQUIRE(check_close(accs_c, accs, tol));
+        }
+    });
+}
+
+TEST_CASE("ilist cache update")
+{
+    constexpr auto s = 2000u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> accs, accs_c;
+    t.accs_o(accs_c, .6, kwargs::ilist_cache = true);
+    // Move the particles around: the tree structure changes, and the
+    // cached lists must be discarded.
+    std::uniform_real_distribution<double> rdist(-.1, .1);
+    t.update_particles_o([&rdist](const auto &p_its) {
+        for (std::size_t j = 0; j < 3u; ++j) {
+            for (auto i = 0u; i < s; ++i) {
+                p_its[j][i] = std::clamp(p_its[j][i] + rdist(rng), -.49, .49);
+            }
+        }
+    });
+    t.accs_o(accs_c, .6, kwargs::ilist_cache = true);
+    t.accs_o(accs, .6);
+    REQUIRE(check_close(accs_c, accs, 1E-10));
+    // Same after a clear().
+    t = octree<double>{};
+    t.accs_u(accs_c, .6, kwargs::ilist_cache = true);
+    REQUIRE(accs_c[0].empty());
+}
+
+TEST_CASE("ilist cache concurrent")
+{
+    constexpr auto s = 3000u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    const octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                           kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> accs_4, accs_6;
+    t.accs_u(accs_4, .4);
+    t.accs_u(accs_6, .6);
+    // Record the lists.
+    std::array<std::vector<double>, 3> accs_c;
+    t.accs_u(accs_c, .4, kwargs::ilist_cache = true);
+    // Concurrent replays, mixed with computations which record (and publish) new lists.
+    std::vector<std::future<std::array<std::vector<double>, 3>>> futs;
+    for (auto k = 0; k < 8; ++k) {
+        futs.push_back(std::async(std::launch::async, [&t, k]() {
+            std::array<std::vector<double>, 3> retval;
+            t.accs_u(retval, k % 4 == 3 ? .6 : .4, kwargs::ilist_cache = true);
+            return retval;
+        }));
+    }
+    for (auto k = 0; k < 8; ++k) {
+        const auto accs = futs[static_cast<decltype(futs.size())>(k)].get();
+        REQUIRE(check_close(accs, k % 4 == 3 ? accs_6 : accs_4, 1E-10));
+    }
+}
+
+TEST_CASE("ilist cache quadtree")
+{
+    constexpr auto s = 1000u;
+    const auto parts = get_uniform_particles<2>(s, 1., rng);
+    quadtree<double, 2> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s, kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> accpots, accpots_c;
+    t.accs_pots_u(accpots, .5);
+    t.accs_pots_u(accpots_c, .5, kwargs::ilist_cache = true);
+    REQUIRE(check_close(accpots_c, accpots, 1E-10));
+    t.accs_pots_u(accpots_c, .5, kwargs::ilist_cache = true);
+    REQUIRE(check_close(accpots_c, accpots, 1E-10));
+}
+
+TEST_CASE("ilist cache errors")
+{
+    constexpr auto s = 100u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> old_accs, accs;
+    t.accs_u(old_accs, .5);
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::ilist_cache = true, kwargs::dual_tree = true),
+                      std::invalid_argument);
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::ilist_cache = true, kwargs::old_accs = old_accs),
+                      std::invalid_argument);
+    const std::vector<double> split{1., 1.};
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::ilist_cache = true, kwargs::split = split), std::invalid_argument);
+}
@@ -0,0 +1,106 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <xsimd/xsimd.hpp>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("inv_sqrt")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        using batch_type = xsimd::simd_type<fp_type>;
+        if constexpr (has_fast_inv_sqrt<batch_type>) {
+            constexpr auto batch_size = batch_type::size;
+            // NOTE: cover the whole range of normal values, in which the float seed
+            // must be handled with care in the double precision implementations.
+            std::uniform_real_distribution<fp_type> edist(fp_type(std::numeric_limits<fp_type>::min_exponent),
+                                                          fp_type(std::numeric_limits<fp_type>::max_exponent - 1));
+            alignas(XSIMD_DEFAULT_ALIGNMENT) std::array<fp_type, batch_size> in, out, out3;
+            fp_type max_err(0), max_err3(0);
+            for (auto i = 0; i < 10000; ++i) {
+                for (auto &v : in) {
+                    v = std::exp2(edist(rng));
+                }
+                inv_sqrt(batch_type(in.data(), xsimd::aligned_mode{})).store_aligned(out.data());
+                inv_sqrt_3(batch_type(in.data(), xsimd::aligned_mode{})).store_aligned(out3.data());
+                for (std::size_t j = 0; j < batch_size; ++j) {
+                    const auto ex = 1 / std::sqrt(in[j]);
+                    REQUIRE(std::isfinite(out[j]));
+                    max_err = std::max(max_err, std::abs((out[j] - ex) / ex));
+                    if (std::isnormal(ex * ex * ex)) {
+                        max_err3 = std::max(max_err3, std::abs((out3[j] - ex * ex * ex) / (ex * ex * ex)));
+                    }
+                }
+            }
+            std::cout << "sizeof(F)=" << sizeof(fp_type) << ", inv_sqrt max error: " << max_err
+                      << ", inv_sqrt_3 max error: " << max_err3 << '\n';
+            // NOTE: the Newton iterations are accurate to a few ulps.
+            REQUIRE(max_err < std::numeric_limits<fp_type>::epsilon() * 8);
+            REQUIRE(max_err3 < std::numeric_limits<fp_type>::epsilon() * 16);
+        }
+    });
+}
+
+TEST_CASE("inv_sqrt accuracy")
+{
+    // The direct summation (via a tiny theta) in double precision against exact_acc().
+    constexpr auto theta = .001, bsize = 1.;
+    for (auto s : {10u, 100u, 1000u, 3000u}) {
+        const auto parts = get_uniform_particles<3>(s, bsize, rng);
+        octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                         kwargs::box_size = bsize, kwargs::max_leaf_n = 8, kwargs::ncrit = 64);
+        std::array<std::vector<double>, 3> accs;
+        std::array<std::vector<double>, 4> accpots;
+        t.accs_u(accs, theta);
+        t.accs_pots_u(accpots, theta);
+        std::vector<double> diffs;
+        double max_diff = 0;
+        for (auto i = 0u; i < s; ++i) {
+            const auto eacc = t.exact_acc_pot_u(i);
+            const auto nacc = std::sqrt(eacc[0] * eacc[0] + eacc[1] * eacc[1] + eacc[2] * eacc[2]);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                for (const auto d : {std::abs(eacc[j] - accs[j][i]) / nacc, std::abs(eacc[j] - accpots[j][i]) / nacc}) {
+                    diffs.push_back(d);
+                    max_diff = std::max(max_diff, d);
+                }
+            }
+            const auto d = std::abs((eacc[3] - accpots[3][i]) / eacc[3]);
+            diffs.push_back(d);
+            max_diff = std::max(max_diff, d);
+        }
+        std::cout << "size=" << s << ", max_diff=" << max_diff << ", median_diff=" << median(diffs) << '\n';
+        if constexpr (std::numeric_limits<double>::is_iec559) {
+            REQUIRE(max_diff < 1E-12);
+            REQUIRE(median(diffs) < 1E-14);
+        }
+    }
+}
@@ -0,0 +1,274 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <initializer_list>
+#include <iostream>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+namespace rakau
+{
+inline namespace detail
+{
+
+struct tree_test_access {
+    // Mean absolute errors of the expansion of the source node at index idx for the potential and
+    // the accelerations at the points at distance dist from its COM, in the directions dirs,
+    // with respect to the direct sum over the particles of the node.
+    template <typename Tree>
+    static std::array<double, 2> expansion_errors(const Tree &t, std::size_t idx, double dist,
+                                                  const std::vector<std::array<double, 3>> &dirs)
+    {
+        const auto &node = t.m_tree[idx];
+        std::array<double, 2> retval{};
+        for (const auto &dir : dirs) {
+            std::array<double, 3> r, acc_ex{}, acc{};
+            double pot_ex = 0, pot = 0;
+            for (std::size_t j = 0; j < 3u; ++j) {
+                r[j] = dir[j] * dist;
+            }
+            for (auto i = node.begin; i != node.end; ++i) {
+                std::array<double, 3> diff;
+                double dist2 = 0;
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    diff[j] = node.props[j] + r[j] - t.m_parts[j][i];
+                    dist2 += diff[j] * diff[j];
+                }
+                const auto m_dist = t.m_parts[3][i] / std::sqrt(dist2), m_dist3 = m_dist / dist2;
+                pot_ex -= m_dist;
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    acc_ex[j] -= diff[j] * m_dist3;
+                }
+            }
+            // The monopole.
+            const auto inv_dist = 1. / dist;
+            pot -= node.props[3] * inv_dist;
+            for (std::size_t j = 0; j < 3u; ++j) {
+                acc[j] -= node.props[3] * r[j] * inv_dist * inv_dist * inv_dist;
+            }
+            // The higher-order moments.
+            if constexpr (Tree::mp_size > 0u) {
+                Tree::template mp_acc_pot<2>(t.m_multipoles.data() + idx * Tree::mp_size, r, inv_dist,
+                                             inv_dist * inv_dist, acc, pot);
+            }
+            retval[0] += std::abs(pot - pot_ex);
+            double dacc2 = 0;
+            for (std::size_t j = 0; j < 3u; ++j) {
+                dacc2 += (acc[j] - acc_ex[j]) * (acc[j] - acc_ex[j]);
+            }
+            retval[1] += std::sqrt(dacc2);
+        }
+        for (auto &e : retval) {
+            e /= static_cast<double>(dirs.size());
+        }
+        return retval;
+    }
+};
+
+} // namespace detail
+} // namespace rakau
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+// Compute the root mean square of the relative errors on the accelerations and potentials for a tree of
+// type Tree, built from the particles in parts.
+// NOTE: with a large opening angle, the improvement brought by the octupole is small, and the
+// medians of the errors of the quadrupole and of the octupole are within the spread due
+// to the particle distribution. The root mean square is less noisy.
+template <typename Tree, typename F>
+static std::array<F, 2> rms_errors(const std::vector<F> &parts, unsigned s, F bsize, F theta, bool dual_tree)
+{
+    Tree t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+           kwargs::box_size = bsize);
+    std::array<std::vector<F>, 4> accpots;
+    t.accs_pots_u(accpots, theta, kwargs::eps = F(.01), kwargs::dual_tree = dual_tree);
+    F acc_diff(0), pot_diff(0);
+    unsigned n = 0;
+    for (auto i = 0u; i < s; i += 5u, ++n) {
+        auto eacc = t.exact_acc_pot_u(i, kwargs::eps = F(.01));
+        F dacc(0), nacc(0);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            dacc += (eacc[j] - accpots[j][i]) * (eacc[j] - accpots[j][i]);
+            nacc += eacc[j] * eacc[j];
+        }
+        acc_diff += dacc / nacc;
+        pot_diff += (eacc[3] - accpots[3][i]) * (eacc[3] - accpots[3][i]) / (eacc[3] * eacc[3]);
+    }
+    return {std::sqrt(acc_diff / F(n)), std::sqrt(pot_diff / F(n))};
+}
+
+TEST_CASE("multipole accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1);
+        constexpr auto s = 10000u;
+        const auto parts = get_uniform_particles<3>(s, bsize, rng);
+        for (auto dual_tree : {false, true}) {
+            for (auto theta : {fp_type(.4), fp_type(.8)}) {
+                const auto e1 = rms_errors<octree<fp_type>>(parts, s, bsize, theta, dual_tree);
+                const auto e2 = rms_errors<octree<fp_type, 2>>(parts, s, bsize, theta, dual_tree);
+                const auto e3 = rms_errors<octree<fp_type, 3>>(parts, s, bsize, theta, dual_tree);
+                std::cout << "theta=" << theta << ", dual_tree=" << dual_tree << ", rms acc errors: " << e1[0]
+                          << ", " << e2[0] << ", " << e3[0] << ", rms pot errors: " << e1[1] << ", " << e2[1] << ", "
+                          << e3[1] << '\n';
+                if (!dual_tree) {
+                    // NOTE: in the BH traversal, each order of the expansion must bring an improvement,
+                    // which is substantial for the small opening angle. With the large opening angle,
+                    // the particles of the accepted nodes can be almost as far from the centre of mass
+                    // as the target, and the expansions converge slowly.
+                    const auto small_theta = theta < fp_type(.5);
+                    REQUIRE(e2[0] < e1[0] / fp_type(small_theta ? 2 : 1.5));
+                    REQUIRE(e2[1] < e1[1] / fp_type(small_theta ? 2 : 1.5));
+                    REQUIRE(e3[0] < e2[0] / fp_type(small_theta ? 1.5 : 1.1));
+                    if constexpr (std::is_same_v<fp_type, double>) {
+                        // NOTE: in single precision, the octupole errors on the potential
+                        // are at the level of the round-off errors.
+                        REQUIRE(e3[1] < e2[1] / fp_type(small_theta ? 1.5 : 1));
+                    }
+                } else {
+                    // NOTE: in the dual-tree traversal, the error is dominated by the truncation
+                    // of the local expansions, and the higher-order multipoles bring little improvement.
+                    // Just check that they don't make things worse.
+                    REQUIRE(e2[0] < e1[0] * fp_type(1.01));
+                    REQUIRE(e3[0] < e1[0] * fp_type(1.01));
+                    REQUIRE(e2[1] < e1[1] * fp_type(1.01));
+                    REQUIRE(e3[1] < e1[1] * fp_type(1.01));
+                }
+            }
+        }
+    });
+}
+
+TEST_CASE("multipole expansion convergence")
+{
+    // Check the expansions of single nodes against the direct sums over their particles: the truncation
+    // error of the expansion of order P must decrease as dist**-(P+2) for the potential and as
+    // dist**-(P+3) for the accelerations, and each order must improve on the previous one.
+    constexpr auto s = 4000u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    const octree<double> t1({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                            kwargs::box_size = 1.);
+    const octree<double, 2> t2({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                               kwargs::box_size = 1.);
+    const octree<double, 3> t3({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                               kwargs::box_size = 1.);
+    std::normal_distribution<double> ndist;
+    std::vector<std::array<double, 3>> dirs(100);
+    for (auto &dir : dirs) {
+        double norm2 = 0;
+        for (auto &c : dir) {
+            c = ndist(rng);
+            norm2 += c * c;
+        }
+        for (auto &c : dir) {
+            c /= std::sqrt(norm2);
+        }
+    }
+    // Test the first child of the root node and its first child.
+    for (std::size_t idx : {1u, 2u}) {
+        const auto dim = t1.nodes()[idx].dim;
+        REQUIRE(t1.nodes()[idx].n_children > 0u);
+        std::array<std::array<double, 2>, 3> e_near, e_far;
+        e_near[0] = tree_test_access::expansion_errors(t1, idx, 8 * dim, dirs);
+        e_near[1] = tree_test_access::expansion_errors(t2, idx, 8 * dim, dirs);
+        e_near[2] = tree_test_access::expansion_errors(t3, idx, 8 * dim, dirs);
+        e_far[0] = tree_test_access::expansion_errors(t1, idx, 16 * dim, dirs);
+        e_far[1] = tree_test_access::expansion_errors(t2, idx, 16 * dim, dirs);
+        e_far[2] = tree_test_access::expansion_errors(t3, idx, 16 * dim, dirs);
+        for (std::size_t p = 0; p < 3u; ++p) {
+            std::cout << "node " << idx << ", order " << p + 1u << ", mean pot/acc errors at 8 and 16 times the node "
+                      << "size: " << e_near[p][0] << ", " << e_near[p][1] << ", " << e_far[p][0] << ", "
+                      << e_far[p][1] << '\n';
+            // NOTE: at these distances the next order of the truncation error is still visible,
+            // allow for a factor of 1.5 on the expected ratios.
+            REQUIRE(e_near[p][0] / e_far[p][0] > std::pow(2., static_cast<double>(p + 3u)) / 1.5);
+            REQUIRE(e_near[p][1] / e_far[p][1] > std::pow(2., static_cast<double>(p + 4u)) / 1.5);
+            if (p > 0u) {
+                REQUIRE(e_near[p][0] < e_near[p - 1u][0]);
+                REQUIRE(e_near[p][1] < e_near[p - 1u][1]);
+                REQUIRE(e_far[p][0] < e_far[p - 1u][0]);
+                REQUIRE(e_far[p][1] < e_far[p - 1u][1]);
+            }
+        }
+    }
+}
+
+TEST_CASE("multipole quadtree")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1), theta = static_cast<fp_type>(.6);
+        constexpr auto s = 4000u;
+        const auto parts = get_uniform_particles<2>(s, bsize, rng);
+        std::array<fp_type, 3> errs{};
+        auto compute = [&](auto t, std::size_t n) {
+            std::array<std::vector<fp_type>, 3> accpots;
+            t.accs_pots_o(accpots, theta);
+            std::vector<fp_type> diff;
+            for (auto i = 0u; i < s; i += 5u) {
+                auto eacc = t.exact_acc_pot_o(i);
+                diff.emplace_back(std::abs((eacc[0] - accpots[0][i]) / eacc[0]));
+            }
+            errs[n] = median(diff);
+        };
+        compute(quadtree<fp_type>({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s,
+                                  kwargs::box_size = bsize),
+                0);
+        compute(quadtree<fp_type, 2>({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s,
+                                     kwargs::box_size = bsize),
+                1);
+        compute(quadtree<fp_type, 3>({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s,
+                                     kwargs::box_size = bsize),
+                2);
+        std::cout << "quadtree median acc errors: " << errs[0] << ", " << errs[1] << ", " << errs[2] << '\n';
+        REQUIRE(errs[1] < errs[0]);
+        REQUIRE(errs[2] < errs[1]);
+    });
+}
+
+TEST_CASE("multipole copy/move")
+{
+    constexpr auto s = 1000u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double, 3> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                        kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> accs, accs2;
+    t.accs_o(accs, .8);
+    auto t2(t);
+    t2.accs_o(accs2, .8);
+    REQUIRE(accs == accs2);
+    auto t3(std::move(t2));
+    t3.accs_o(accs2, .8);
+    REQUIRE(accs == accs2);
+    // Check that the moments are recomputed after an update.
+    t3.update_particles_o([](const auto &) {});
+    t3.accs_o(accs2, .8);
+    for (std::size_t j = 0; j < 3u; ++j) {
+        for (auto i = 0u; i < s; ++i) {
+            REQUIRE(std::abs((accs[j][i] - accs2[j][i]) / accs[j][i]) < 1E-12);
+        }
+    }
+}
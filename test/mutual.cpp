@@ -0,0 +1,164 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("mutual accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        // NOTE: with a tiny theta, the traversal degenerates into a direct summation
+        // over the pairs of leaves.
+        constexpr auto theta = static_cast<fp_type>(.001), bsize = static_cast<fp_type>(1);
+        auto sizes = {10u, 100u, 1000u, 2000u};
+        auto max_leaf_ns = {1u, 8u, 16u};
+        auto ncrits = {1u, 16u, 256u};
+        std::array<std::vector<fp_type>, 4> accpots;
+        fp_type tot_max_diff(0), max_mom(0);
+        for (auto s : sizes) {
+            auto parts = get_uniform_particles<3>(s, bsize, rng);
+            for (auto max_leaf_n : max_leaf_ns) {
+                for (auto ncrit : ncrits) {
+                    octree<fp_type> t(
+                        {parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                        kwargs::box_size = bsize, kwargs::max_leaf_n = max_leaf_n, kwargs::ncrit = ncrit);
+                    t.accs_pots_o(accpots, theta, kwargs::dual_tree = true, kwargs::mutual = true);
+                    std::array<fp_type, 3> mom{}, mom_abs{};
+                    for (auto i = 0u; i < s; ++i) {
+                        auto eacc = t.exact_acc_pot_o(i);
+                        for (std::size_t j = 0; j < 4u; ++j) {
+                            REQUIRE(std::isfinite(accpots[j][i]));
+                            tot_max_diff = std::max(tot_max_diff, std::abs((eacc[j] - accpots[j][i]) / eacc[j]));
+                        }
+                        const auto m = *(t.p_its_o()[3] + i);
+                        for (std::size_t j = 0; j < 3u; ++j) {
+                            mom[j] += m * accpots[j][i];
+                            mom_abs[j] += std::abs(m * accpots[j][i]);
+                        }
+                    }
+                    // The total momentum change must vanish, as the interactions
+                    // are accumulated with opposite signs.
+                    for (std::size_t j = 0; j < 3u; ++j) {
+                        max_mom = std::max(max_mom, std::abs(mom[j]) / mom_abs[j]);
+                    }
+                }
+            }
+        }
+        std::cout << "tot_max_diff=" << tot_max_diff << ", max_mom=" << max_mom << '\n';
+        if constexpr (std::is_same_v<fp_type, double> && std::numeric_limits<fp_type>::is_iec559) {
+            REQUIRE(tot_max_diff < fp_type(1E-10));
+            REQUIRE(max_mom < fp_type(1E-13));
+        }
+    });
+}
+
+TEST_CASE("mutual median error")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1), G = static_cast<fp_type>(1.5), eps = static_cast<fp_type>(.01);
+        constexpr auto s = 10000u;
+        auto parts = get_uniform_particles<3>(s, bsize, rng);
+        octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                          kwargs::box_size = bsize);
+        std::array<std::vector<fp_type>, 4> accpots;
+        std::array<std::vector<fp_type>, 3> accs;
+        std::vector<fp_type> pots;
+        for (auto theta : {fp_type(.2), fp_type(.4), fp_type(.6), fp_type(.8)}) {
+            t.accs_pots_u(accpots, theta, kwargs::G = G, kwargs::eps = eps, kwargs::dual_tree = true,
+                          kwargs::mutual = true);
+            // The accs-only and potentials-only computations must be consistent with the accs/pots one.
+            t.accs_u(accs, theta, kwargs::G = G, kwargs::eps = eps, kwargs::dual_tree = true, kwargs::mutual = true);
+            t.pots_u(pots, theta, kwargs::G = G, kwargs::eps = eps, kwargs::dual_tree = true, kwargs::mutual = true);
+            std::vector<fp_type> acc_diff, pot_diff;
+            for (auto i = 0u; i < s; i += 10u) {
+                auto eacc = t.exact_acc_pot_u(i, kwargs::G = G, kwargs::eps = eps);
+                const auto eacc_norm = std::sqrt(eacc[0] * eacc[0] + eacc[1] * eacc[1] + eacc[2] * eacc[2]);
+                fp_type dacc(0);
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    dacc += (eacc[j] - accpots[j][i]) * (eacc[j] - accpots[j][i]);
+                    REQUIRE(std::abs(accs[j][i] - accpots[j][i]) <= eacc_norm * fp_type(1E-4));
+                }
+                acc_diff.emplace_back(std::sqrt(dacc) / eacc_norm);
+                pot_diff.emplace_back(std::abs((eacc[3] - accpots[3][i]) / eacc[3]));
+                REQUIRE(std::abs((pots[i] - accpots[3][i]) / accpots[3][i]) < fp_type(1E-4));
+            }
+            const auto med_acc = median(acc_diff), med_pot = median(pot_diff);
+            std::cout << "theta=" << theta << ", mutual median acc/pot errors: " << med_acc << ", " << med_pot << '\n';
+            // NOTE: the same bounds as in the dual-tree traversal.
+            REQUIRE(med_acc < fp_type(.02));
+            REQUIRE(med_pot < fp_type(.002));
+        }
+    });
+}
+
+TEST_CASE("mutual 2D")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1);
+        constexpr auto s = 1000u;
+        auto parts = get_uniform_particles<2>(s, bsize, rng);
+        quadtree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s, kwargs::box_size = bsize,
+                            kwargs::max_leaf_n = 4, kwargs::ncrit = 16);
+        std::array<std::vector<fp_type>, 3> accpots;
+        t.accs_pots_o(accpots, fp_type(.001), kwargs::dual_tree = true, kwargs::mutual = true);
+        fp_type max_diff(0);
+        for (auto i = 0u; i < s; ++i) {
+            auto eacc = t.exact_acc_pot_o(i);
+            // NOTE: in 2D the acceleration components are often very close to zero,
+            // thus measure their errors relative to the magnitude of the acceleration.
+            const auto nacc = std::sqrt(eacc[0] * eacc[0] + eacc[1] * eacc[1]);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                max_diff = std::max(max_diff, std::abs(eacc[j] - accpots[j][i]) / (j < 2u ? nacc : std::abs(eacc[j])));
+            }
+        }
+        if constexpr (std::is_same_v<fp_type, double> && std::numeric_limits<fp_type>::is_iec559) {
+            REQUIRE(max_diff < fp_type(1E-10));
+        }
+    });
+}
+
+TEST_CASE("mutual errors")
+{
+    octree<double> t;
+    std::array<std::vector<double>, 3> accs;
+    // Empty tree.
+    t.accs_u(accs, .5, kwargs::dual_tree = true, kwargs::mutual = true);
+    REQUIRE(accs[0].empty());
+    // The mutual mode is available only in the dual-tree traversal.
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::mutual = true), std::invalid_argument);
+    // Periodic boundary conditions are not supported.
+    auto parts = get_uniform_particles<3>(100u, 1., rng);
+    octree<double> tp({parts.begin() + 100u, parts.begin() + 200u, parts.begin() + 300u, parts.begin()}, 100u,
+                      kwargs::box_size = 1., kwargs::periodic = true);
+    REQUIRE_THROWS_AS(tp.accs_u(accs, .5, kwargs::dual_tree = true, kwargs::mutual = true), std::invalid_argument);
+}
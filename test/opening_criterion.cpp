@@ -0,0 +1,145 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+// Generate n particles in a box of given size, distributed in nc gaussian clusters of
+// standard deviation sigma.
+template <std::size_t D, typename F>
+static std::vector<F> get_clustered_particles(std::size_t n, std::size_t nc, F size, F sigma)
+{
+    std::vector<F> retval(n * (D + 1u));
+    std::uniform_real_distribution<F> mdist(F(0), F(1)), cdist(-size / F(4), size / F(4));
+    std::normal_distribution<F> ndist(F(0), sigma);
+    std::vector<std::array<F, D>> centres(nc);
+    for (auto &c : centres) {
+        std::generate(c.begin(), c.end(), [&cdist]() { return cdist(rng); });
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+        retval[i] = mdist(rng);
+        for (std::size_t j = 0; j < D; ++j) {
+            retval[(j + 1u) * n + i]
+                = std::clamp(centres[i % nc][j] + ndist(rng), -size / F(2) * F(.99), size / F(2) * F(.99));
+        }
+    }
+    return retval;
+}
+
+TEST_CASE("clustered accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1);
+        constexpr auto s = 10000u;
+        // NOTE: the clusters are much smaller than the box, so that the particles fill
+        // only a small fraction of the nodes in the upper levels of the tree.
+        const auto parts = get_clustered_particles<3>(s, 8, bsize, fp_type(.01));
+        octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                          kwargs::box_size = bsize);
+        std::array<std::vector<fp_type>, 4> accpots;
+        for (auto theta : {fp_type(.4), fp_type(.8)}) {
+            t.accs_pots_u(accpots, theta);
+            std::vector<fp_type> acc_diff, pot_diff;
+            for (auto i = 0u; i < s; i += 10u) {
+                const auto eacc = t.exact_acc_pot_u(i);
+                fp_type dacc(0), nacc(0);
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    dacc += (eacc[j] - accpots[j][i]) * (eacc[j] - accpots[j][i]);
+                    nacc += eacc[j] * eacc[j];
+                }
+                acc_diff.emplace_back(std::sqrt(dacc / nacc));
+                pot_diff.emplace_back(std::abs((eacc[3] - accpots[3][i]) / eacc[3]));
+            }
+            const auto max_acc = *std::max_element(acc_diff.begin(), acc_diff.end()),
+                       max_pot = *std::max_element(pot_diff.begin(), pot_diff.end());
+            const auto med_acc = median(acc_diff), med_pot = median(pot_diff);
+            std::cout << "theta=" << theta << ", clustered median acc/pot errors: " << med_acc << ", " << med_pot
+                      << ", max acc/pot errors: " << max_acc << ", " << max_pot << '\n';
+            // NOTE: the opening criterion is based on the actual extent of the particles
+            // in the nodes, thus the errors must be comparable to the errors for a uniform
+            // distribution.
+            REQUIRE(med_acc < theta * theta * fp_type(.02));
+            REQUIRE(med_pot < theta * theta * fp_type(.002));
+            REQUIRE(max_acc < theta * theta * fp_type(.2));
+        }
+    });
+}
+
+TEST_CASE("off-centre com")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1);
+        // A heavy particle in the corner of a node, and a cloud of light particles
+        // filling the rest of it, so that the COM is very close to the edge of the
+        // particle distribution. This is a known worst case for the classic BH criterion.
+        constexpr auto s = 1001u;
+        auto parts = get_uniform_particles<3>(s, bsize / fp_type(4), rng);
+        for (std::size_t j = 1; j < 4u; ++j) {
+            for (auto i = 0u; i < s; ++i) {
+                parts[j * s + i] += bsize / fp_type(8);
+            }
+            parts[j * s] = fp_type(.0001);
+        }
+        for (auto i = 1u; i < s; ++i) {
+            parts[i] /= fp_type(100);
+        }
+        parts[0] = fp_type(100);
+        // The target particles, on a line moving away from the heavy particle.
+        constexpr auto n_tgt = 50u;
+        std::vector<fp_type> all_parts((s + n_tgt) * 4u);
+        for (std::size_t j = 0; j < 4u; ++j) {
+            std::copy(parts.begin() + j * s, parts.begin() + (j + 1u) * s, all_parts.begin() + j * (s + n_tgt));
+            for (auto i = 0u; i < n_tgt; ++i) {
+                all_parts[j * (s + n_tgt) + s + i]
+                    = j ? -fp_type(.01) - fp_type(i) * fp_type(.008) : fp_type(.001);
+            }
+        }
+        constexpr auto ntot = s + n_tgt;
+        octree<fp_type> t({all_parts.begin() + ntot, all_parts.begin() + 2u * ntot, all_parts.begin() + 3u * ntot,
+                           all_parts.begin()},
+                          ntot, kwargs::box_size = bsize, kwargs::max_leaf_n = 1, kwargs::ncrit = 1);
+        std::array<std::vector<fp_type>, 3> accs;
+        for (auto theta : {fp_type(.5), fp_type(.8)}) {
+            t.accs_u(accs, theta);
+            fp_type max_diff(0);
+            for (auto i = s; i < ntot; ++i) {
+                const auto eacc = t.exact_acc_u(i);
+                fp_type dacc(0), nacc(0);
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    dacc += (eacc[j] - accs[j][i]) * (eacc[j] - accs[j][i]);
+                    nacc += eacc[j] * eacc[j];
+                }
+                max_diff = std::max(max_diff, std::sqrt(dacc / nacc));
+            }
+            std::cout << "theta=" << theta << ", off-centre com max acc error: " << max_diff << '\n';
+            REQUIRE(max_diff < theta * theta * fp_type(.1));
+        }
+    });
+}
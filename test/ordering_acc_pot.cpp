@@ -36,7 +36,7 @@ TEST_CASE("accelerations/potentials ordering")
 {
     tuple_for_each(fp_types{}, [](auto x) {
         using fp_type = decltype(x);
-        constexpr auto bsize = static_cast<fp_type>(10), theta = static_cast<fp_type>(.01);
+        constexpr auto bsize = static_cast<fp_type>(10), theta = static_cast<fp_type>(.001);
         constexpr auto s = 10000u;
         // Get random particles in a box 1/10th the size of the domain.
         auto parts = get_uniform_particles<3>(s, bsize / fp_type(10), rng);
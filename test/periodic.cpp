@@ -0,0 +1,254 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+static std::mt19937 rng(0);
+
+// Reference periodic accelerations/potentials in a box of size bsize, computed via the direct
+// summation over the nearest images and the exact Ewald corrections.
+static std::array<std::vector<double>, 4> ewald_ref(const std::vector<double> &parts, unsigned s, double bsize)
+{
+    std::array<std::vector<double>, 4> retval;
+    for (auto &v : retval) {
+        v.resize(s);
+    }
+    for (auto i = 0u; i < s; ++i) {
+        for (auto k = 0u; k < s; ++k) {
+            std::array<double, 3> d;
+            for (std::size_t j = 0; j < 3u; ++j) {
+                d[j] = parts[(j + 1u) * s + k] - parts[(j + 1u) * s + i];
+                d[j] -= bsize * std::nearbyint(d[j] / bsize);
+            }
+            const auto mk = parts[k], mi = parts[i];
+            const auto c = ewald_corr_exact({d[0] / bsize, d[1] / bsize, d[2] / bsize});
+            for (std::size_t j = 0; j < 3u; ++j) {
+                retval[j][i] += mk * c[j] / (bsize * bsize);
+            }
+            retval[3][i] -= mi * mk * c[3] / bsize;
+            if (k == i) {
+                continue;
+            }
+            const auto dist = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                retval[j][i] += mk * d[j] / (dist * dist * dist);
+            }
+            retval[3][i] -= mi * mk / dist;
+        }
+    }
+    return retval;
+}
+
+TEST_CASE("periodic lattice")
+{
+    // A cubic lattice of equal masses: by symmetry, the accelerations vanish.
+    constexpr auto n = 4u, s = n * n * n;
+    constexpr auto bsize = 2.;
+    std::vector<double> parts(4u * s);
+    for (auto i = 0u; i < s; ++i) {
+        parts[i] = 1;
+        parts[s + i] = bsize * ((i / (n * n)) + .5) / n - bsize / 2;
+        parts[2u * s + i] = bsize * ((i / n) % n + .5) / n - bsize / 2;
+        parts[3u * s + i] = bsize * (i % n + .5) / n - bsize / 2;
+    }
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = bsize, kwargs::periodic = true, kwargs::max_leaf_n = 4, kwargs::ncrit = 8);
+    REQUIRE(t.periodic());
+    std::array<std::vector<double>, 4> accpots;
+    // The magnitude of the acceleration due to the nearest neighbour.
+    const auto a_nn = 1. / ((bsize / n) * (bsize / n));
+    // NOTE: use the direct summation, as the errors of the multipole expansions do not cancel out.
+    t.accs_pots_u(accpots, .001);
+    double max_acc = 0;
+    for (auto i = 0u; i < s; ++i) {
+        max_acc = std::max(max_acc, std::sqrt(accpots[0][i] * accpots[0][i] + accpots[1][i] * accpots[1][i]
+                                              + accpots[2][i] * accpots[2][i]));
+        // All the particles are equivalent.
+        REQUIRE(std::abs((accpots[3][i] - accpots[3][0]) / accpots[3][0]) < 1E-12);
+    }
+    std::cout << "Max acc in the lattice (relative to the nearest neighbour): " << max_acc / a_nn << '\n';
+    REQUIRE(max_acc < a_nn * 1E-12);
+}
+
+TEST_CASE("periodic accuracy")
+{
+    constexpr auto s = 300u;
+    for (auto bsize : {1., 10.}) {
+        const auto parts = get_uniform_particles<3>(s, bsize, rng);
+        const auto ref = ewald_ref(parts, s, bsize);
+        octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                         kwargs::box_size = bsize, kwargs::periodic = true, kwargs::max_leaf_n = 8,
+                         kwargs::ncrit = 16);
+        std::array<std::vector<double>, 4> accpots;
+        // NOTE: the periodic potentials have zero mean, the errors
+        // are measured with respect to their root mean square.
+        double pot_rms = 0;
+        for (auto i = 0u; i < s; ++i) {
+            pot_rms += ref[3][i] * ref[3][i];
+        }
+        pot_rms = std::sqrt(pot_rms / s);
+        for (auto theta : {.001, .5}) {
+            for (auto ilc : {false, true, true}) {
+                t.accs_pots_o(accpots, theta, kwargs::ilist_cache = ilc);
+                std::vector<double> acc_errs, pot_errs;
+                for (auto i = 0u; i < s; ++i) {
+                    double dacc = 0, nacc = 0;
+                    for (std::size_t j = 0; j < 3u; ++j) {
+                        dacc += (accpots[j][i] - ref[j][i]) * (accpots[j][i] - ref[j][i]);
+                        nacc += ref[j][i] * ref[j][i];
+                    }
+                    acc_errs.push_back(std::sqrt(dacc / nacc));
+                    pot_errs.push_back(std::abs(accpots[3][i] - ref[3][i]) / pot_rms);
+                }
+                const auto acc_med = median(acc_errs), pot_med = median(pot_errs);
+                std::cout << "bsize=" << bsize << ", theta=" << theta << ", ilist_cache=" << ilc
+                          << ", median relative errors: acc=" << acc_med << ", pot=" << pot_med << '\n';
+                // NOTE: with a tiny theta, the errors are due to the interpolation in the lookup table of
+                // the Ewald corrections. The interpolation errors of the potential corrections have the
+                // same sign over most of the cell, hence they accumulate over the source particles.
+                REQUIRE(acc_med < (theta < .1 ? 1E-4 : 3E-2));
+                REQUIRE(pot_med < (theta < .1 ? 2E-3 : 2E-2));
+            }
+        }
+        // The exact computation uses the same lookup table, thus it agrees with the direct summation.
+        t.accs_pots_o(accpots, .001);
+        for (auto i = 0u; i < s; i += 10u) {
+            const auto ex = t.exact_acc_pot_o(i);
+            const auto nacc = std::sqrt(ex[0] * ex[0] + ex[1] * ex[1] + ex[2] * ex[2]);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                REQUIRE(std::abs(ex[j] - accpots[j][i]) <= nacc * 1E-12);
+            }
+            REQUIRE(std::abs(ex[3] - accpots[3][i]) <= pot_rms * 1E-12);
+        }
+    }
+}
+
+TEST_CASE("periodic wrapping")
+{
+    constexpr auto s = 200u;
+    constexpr auto bsize = 1.;
+    const auto parts = get_uniform_particles<3>(s, bsize, rng);
+    // Shift the particles by integral multiples of the box size.
+    auto shifted = parts;
+    std::uniform_int_distribution<int> sdist(-3, 3);
+    for (auto i = s; i < 4u * s; ++i) {
+        shifted[i] += sdist(rng) * bsize;
+    }
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = bsize, kwargs::periodic = true),
+        t2({shifted.begin() + s, shifted.begin() + 2u * s, shifted.begin() + 3u * s, shifted.begin()}, s,
+           kwargs::box_size = bsize, kwargs::periodic = true);
+    auto check_in_box = [bsize](const auto &tr) {
+        const auto its = tr.p_its_u();
+        for (auto i = 0u; i < tr.nparts(); ++i) {
+            for (std::size_t j = 0; j < 3u; ++j) {
+                REQUIRE(its[j][i] >= -bsize / 2);
+                REQUIRE(its[j][i] < bsize / 2);
+            }
+        }
+    };
+    check_in_box(t2);
+    std::array<std::vector<double>, 3> accs, accs2;
+    t.accs_o(accs, .5);
+    t2.accs_o(accs2, .5);
+    for (auto i = 0u; i < s; ++i) {
+        for (std::size_t j = 0; j < 3u; ++j) {
+            REQUIRE(std::abs(accs2[j][i] - accs[j][i]) < std::abs(accs[j][i]) * 1E-3 + 1E-6);
+        }
+    }
+    // Move the particles out of the box, they are wrapped back in.
+    t.update_particles_u([](const auto &its) {
+        for (auto i = 0u; i < s; ++i) {
+            its[0][i] += 1.75 * bsize;
+            its[2][i] -= .5 * bsize;
+        }
+    });
+    check_in_box(t);
+    // Copy/move semantics and clearing.
+    auto t3(t);
+    REQUIRE(t3.periodic());
+    auto t4(std::move(t3));
+    REQUIRE(t4.periodic());
+    t4.clear();
+    REQUIRE(!t4.periodic());
+}
+
+TEST_CASE("periodic origin")
+{
+    // A particle sitting on the origin of the box, in a target node smaller than a SIMD batch.
+    constexpr auto s = 3u;
+    constexpr auto bsize = 1.;
+    const std::vector<double> parts{1, 1, 1, 0, .1, 0, 0, 0, .2, 0, 0, 0};
+    const auto ref = ewald_ref(parts, s, bsize);
+    for (auto pm_grid : {0u, 16u}) {
+        octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                         kwargs::box_size = bsize, kwargs::periodic = true, kwargs::pm_grid = pm_grid);
+        octree<float> tf({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                         kwargs::box_size = bsize, kwargs::periodic = true, kwargs::pm_grid = pm_grid);
+        std::array<std::vector<double>, 4> accpots;
+        std::array<std::vector<float>, 4> accpots_f;
+        t.accs_pots_u(accpots, .5);
+        tf.accs_pots_u(accpots_f, .5);
+        for (auto i = 0u; i < s; ++i) {
+            for (std::size_t j = 0; j < 4u; ++j) {
+                REQUIRE(std::isfinite(accpots[j][i]));
+                REQUIRE(std::isfinite(accpots_f[j][i]));
+                if (!pm_grid) {
+                    REQUIRE(std::abs(accpots[j][i] - ref[j][i]) < std::abs(ref[j][i]) * 1E-3 + 1E-6);
+                    REQUIRE(std::abs(accpots_f[j][i] - ref[j][i]) < std::abs(ref[j][i]) * 1E-3 + 1E-3);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("periodic errors")
+{
+    constexpr auto s = 100u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    using Catch::Matchers::Contains;
+    REQUIRE_THROWS_WITH((octree<double>{{parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s,
+                                         parts.begin()},
+                                        s,
+                                        kwargs::periodic = true}),
+                        Contains("box size must be specified"));
+    REQUIRE_THROWS_WITH((octree<double>{{parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s,
+                                         parts.begin()},
+                                        s,
+                                        kwargs::periodic = true,
+                                        kwargs::box_size = 0.}),
+                        Contains("box size must be specified"));
+    REQUIRE_THROWS_WITH((quadtree<double>{{parts.begin() + s, parts.begin() + 2u * s, parts.begin()},
+                                          s,
+                                          kwargs::periodic = true,
+                                          kwargs::box_size = 1.}),
+                        Contains("only in 3D"));
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1., kwargs::periodic = true);
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::dual_tree = true), std::invalid_argument);
+    const std::vector<double> split{1., 1.};
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::split = split), std::invalid_argument);
+}
@@ -0,0 +1,149 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("relative mac accuracy")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1), G = static_cast<fp_type>(1.5);
+        constexpr auto s = 10000u;
+        const auto parts = get_uniform_particles<3>(s, bsize, rng);
+        octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                          kwargs::box_size = bsize);
+        // The previous accelerations, computed with the geometrical criterion.
+        std::array<std::vector<fp_type>, 3> old_accs, accs, accs_o;
+        t.accs_u(old_accs, fp_type(.5), kwargs::G = G);
+        fp_type prev_err(0);
+        for (auto alpha : {fp_type(.01), fp_type(.001), fp_type(.0001)}) {
+            t.accs_u(accs, alpha, kwargs::G = G, kwargs::old_accs = old_accs);
+            std::vector<fp_type> diffs;
+            for (auto i = 0u; i < s; i += 10u) {
+                const auto eacc = t.exact_acc_u(i, kwargs::G = G);
+                fp_type dacc(0), nacc(0);
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    dacc += (eacc[j] - accs[j][i]) * (eacc[j] - accs[j][i]);
+                    nacc += eacc[j] * eacc[j];
+                }
+                diffs.emplace_back(std::sqrt(dacc / nacc));
+            }
+            const auto err = median(diffs);
+            std::cout << "alpha=" << alpha << ", relative mac median acc error: " << err << '\n';
+            // The error must be controlled by alpha.
+            // NOTE: the error does not scale linearly with alpha, but roughly as alpha**.65 (i.e., it
+            // decreases by a factor of about 4.5 for each decade of alpha). The bound is the error model
+            // of the error-controlled evaluation (see tree::rel_error_coeff and tree::rel_error_exp).
+            REQUIRE(err < fp_type(.15) * std::pow(alpha, fp_type(.65)));
+            if (prev_err != fp_type(0)) {
+                // Check the local exponent of the scaling over the last decade of alpha.
+                const auto slope = std::log10(prev_err / err);
+                REQUIRE(slope > fp_type(.5));
+                REQUIRE(slope < fp_type(.8));
+            }
+            prev_err = err;
+            // Check the consistency of the ordered computation.
+            std::array<std::vector<fp_type>, 3> old_accs_o;
+            for (std::size_t j = 0; j < 3u; ++j) {
+                old_accs_o[j].resize(s);
+                for (auto i = 0u; i < s; ++i) {
+                    old_accs_o[j][t.perm()[i]] = old_accs[j][i];
+                }
+            }
+            t.accs_o(accs_o, alpha, kwargs::G = G, kwargs::old_accs = old_accs_o);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                for (auto i = 0u; i < s; ++i) {
+                    REQUIRE(accs_o[j][t.perm()[i]] == accs[j][i]);
+                }
+            }
+            // Check the pointer interface.
+            t.accs_u(accs_o, alpha, kwargs::G = G,
+                     kwargs::old_accs = std::array{old_accs[0].data(), old_accs[1].data(), old_accs[2].data()});
+            REQUIRE(accs_o == accs);
+        }
+        // The accelerations/potentials computation.
+        std::array<std::vector<fp_type>, 4> accpots;
+        t.accs_pots_u(accpots, fp_type(.001), kwargs::G = G, kwargs::old_accs = old_accs);
+        t.accs_u(accs, fp_type(.001), kwargs::G = G, kwargs::old_accs = old_accs);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            for (auto i = 0u; i < s; ++i) {
+                REQUIRE(std::abs((accpots[j][i] - accs[j][i]) / accs[j][i]) < fp_type(1E-4));
+            }
+        }
+    });
+}
+
+TEST_CASE("relative mac quadtree")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1);
+        constexpr auto s = 2000u;
+        const auto parts = get_uniform_particles<2>(s, bsize, rng);
+        quadtree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s, kwargs::box_size = bsize);
+        std::array<std::vector<fp_type>, 2> old_accs, accs;
+        t.accs_u(old_accs, fp_type(.5));
+        t.accs_u(accs, fp_type(.001), kwargs::old_accs = old_accs);
+        std::vector<fp_type> diffs;
+        for (auto i = 0u; i < s; ++i) {
+            const auto eacc = t.exact_acc_u(i);
+            diffs.emplace_back(std::abs((eacc[0] - accs[0][i]) / eacc[0]));
+        }
+        REQUIRE(median(diffs) < fp_type(.001));
+    });
+}
+
+TEST_CASE("relative mac errors")
+{
+    constexpr auto s = 100u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> old_accs, accs;
+    t.accs_u(old_accs, .5);
+    // Wrong number of previous accelerations.
+    auto short_accs(old_accs);
+    short_accs[1].pop_back();
+    REQUIRE_THROWS_AS(t.accs_u(accs, .01, kwargs::old_accs = short_accs), std::invalid_argument);
+    // Non-finite previous accelerations.
+    auto bad_accs(old_accs);
+    bad_accs[2][10] = std::numeric_limits<double>::infinity();
+    REQUIRE_THROWS_AS(t.accs_u(accs, .01, kwargs::old_accs = bad_accs), std::domain_error);
+    // Null pointers.
+    REQUIRE_THROWS_AS(t.accs_u(accs, .01, kwargs::old_accs = std::array<const double *, 3>{}),
+                      std::invalid_argument);
+    // Dual-tree traversal.
+    REQUIRE_THROWS_AS(t.accs_u(accs, .01, kwargs::old_accs = old_accs, kwargs::dual_tree = true),
+                      std::invalid_argument);
+    // Accelerators.
+    const std::vector<double> split{1., 1.};
+    REQUIRE_THROWS_AS(t.accs_u(accs, .01, kwargs::old_accs = old_accs, kwargs::split = split),
+                      std::invalid_argument);
+}
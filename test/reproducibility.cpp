@@ -0,0 +1,78 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <initializer_list>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include <tbb/task_arena.h>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("thread count reproducibility")
+{
+    tuple_for_each(fp_types{}, [](auto x) {
+        using fp_type = decltype(x);
+        constexpr auto bsize = static_cast<fp_type>(1), theta = static_cast<fp_type>(.5),
+                       eps = static_cast<fp_type>(.01);
+        constexpr auto s = 20000u;
+        auto parts = get_uniform_particles<3>(s, bsize, rng);
+        // Duplicate the positions of some particles, so that
+        // there are many particles with the same code.
+        for (auto i = 0u; i < s / 4u; ++i) {
+            for (auto j = 1u; j < 4u; ++j) {
+                parts[j * s + 2u * i + 1u] = parts[j * s + 2u * i];
+            }
+        }
+        // Compute the accelerations/potentials with the various codepaths,
+        // both after construction and after an update of the particles.
+        auto compute = [&]() {
+            std::vector<std::array<std::vector<fp_type>, 4>> retval(10);
+            octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                              kwargs::box_size = bsize, kwargs::ncrit = 64);
+            for (auto k = 0u; k < 2u; ++k) {
+                auto r = retval.begin() + 5 * k;
+                t.accs_pots_u(r[0], theta, kwargs::eps = eps);
+                t.accs_pots_u(r[1], theta, kwargs::eps = eps, kwargs::batch_leaves = true);
+                t.accs_pots_u(r[2], theta, kwargs::eps = eps, kwargs::dual_tree = true);
+                t.accs_pots_u(r[3], theta, kwargs::eps = eps, kwargs::dual_tree = true, kwargs::mutual = true);
+                t.accs_pots_u(r[4], theta, kwargs::eps = eps, kwargs::ilist_cache = true);
+                t.update_particles_u([&](const auto &p_its) {
+                    for (auto i = 0u; i < s; ++i) {
+                        *(p_its[0] + i) = -*(p_its[0] + i);
+                    }
+                });
+            }
+            return retval;
+        };
+        const auto ref = tbb::task_arena(1).execute(compute);
+        for (auto n_threads : {2, 3, 8}) {
+            const auto res = tbb::task_arena(n_threads).execute(compute);
+            for (decltype(res.size()) k = 0; k < res.size(); ++k) {
+                // NOTE: the results must be bitwise identical.
+                const bool equal = res[k] == ref[k];
+                REQUIRE(equal);
+            }
+        }
+    });
+}
@@ -0,0 +1,131 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <initializer_list>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+using fp_types = std::tuple<float, double>;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("simd dispatch isa selection")
+{
+    ::unsetenv("RAKAU_SIMD_ISA");
+    const auto best = simd_dispatch_isa();
+    const auto parts = get_uniform_particles<3>(100, 1.f, rng);
+    for (auto isa : {simd_isa::sse2, simd_isa::avx2, simd_isa::avx512}) {
+        ::setenv("RAKAU_SIMD_ISA", simd_isa_name(isa), 1);
+        octree<float> t({parts.begin() + 100, parts.begin() + 200, parts.begin() + 300, parts.begin()}, 100,
+                        kwargs::box_size = 1.f);
+        REQUIRE(t.isa() == std::min(isa, best));
+        // The instruction set is preserved by copies and moves.
+        ::setenv("RAKAU_SIMD_ISA", "sse2", 1);
+        auto t2(t);
+        REQUIRE(t2.isa() == std::min(isa, best));
+        auto t3(std::move(t2));
+        REQUIRE(t3.isa() == std::min(isa, best));
+        octree<float> t4;
+        REQUIRE(t4.isa() == simd_isa::sse2);
+        t4 = t3;
+        REQUIRE(t4.isa() == std::min(isa, best));
+        ::unsetenv("RAKAU_SIMD_ISA");
+    }
+    ::setenv("RAKAU_SIMD_ISA", "foo", 1);
+    REQUIRE_THROWS_AS(
+        octree<float>({parts.begin() + 100, parts.begin() + 200, parts.begin() + 300, parts.begin()}, 100),
+        std::invalid_argument);
+    ::unsetenv("RAKAU_SIMD_ISA");
+}
+
+TEST_CASE("simd dispatch kernels")
+{
+    ::unsetenv("RAKAU_SIMD_ISA");
+    const auto best = simd_dispatch_isa();
+    tuple_for_each(fp_types{}, [best](auto x) {
+        using fp_type = decltype(x);
+        using v_it = typename std::vector<fp_type>::iterator;
+        constexpr auto bsize = static_cast<fp_type>(1), G = static_cast<fp_type>(1.5), eps = static_cast<fp_type>(.01),
+                       theta = static_cast<fp_type>(.5);
+        // NOTE: the kernels for the different instruction sets process the particles
+        // in batches of different sizes, and they may use different approximations
+        // of the inverse square root.
+        constexpr auto tol = static_cast<fp_type>(std::is_same_v<fp_type, float> ? 1E-4 : 1E-12);
+        for (auto s : {10u, 3000u}) {
+            const auto parts = get_uniform_particles<3>(s, bsize, rng);
+            for (auto isa : {simd_isa::sse2, simd_isa::avx2, simd_isa::avx512}) {
+                if (isa > best) {
+                    break;
+                }
+                ::setenv("RAKAU_SIMD_ISA", simd_isa_name(isa), 1);
+                octree<fp_type> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()},
+                                  s, kwargs::box_size = bsize, kwargs::max_leaf_n = 4, kwargs::ncrit = 32);
+                quadtree<fp_type> q({parts.begin() + s, parts.begin() + 2u * s, parts.begin()}, s,
+                                    kwargs::box_size = bsize, kwargs::max_leaf_n = 4, kwargs::ncrit = 32);
+                ::unsetenv("RAKAU_SIMD_ISA");
+                REQUIRE(t.isa() == isa);
+                REQUIRE(q.isa() == isa);
+                // The outputs via vectors (i.e., pointers) use the kernels selected at construction, the outputs
+                // via the iterators of the vectors use the kernels compiled in this test.
+                std::array<std::vector<fp_type>, 3> accs, accs_ref;
+                std::array<std::vector<fp_type>, 4> accpots, accpots_ref;
+                std::array<std::vector<fp_type>, 2> qaccs, qaccs_ref;
+                std::vector<fp_type> pots;
+                std::array<std::vector<fp_type>, 1> pots_ref{std::vector<fp_type>(s)};
+                for (auto &v : accs_ref) {
+                    v.resize(s);
+                }
+                for (auto &v : accpots_ref) {
+                    v.resize(s);
+                }
+                for (auto &v : qaccs_ref) {
+                    v.resize(s);
+                }
+                t.accs_u(accs, theta, kwargs::G = G, kwargs::eps = eps);
+                t.accs_u(std::array<v_it, 3>{accs_ref[0].begin(), accs_ref[1].begin(), accs_ref[2].begin()}, theta,
+                         kwargs::G = G, kwargs::eps = eps);
+                REQUIRE(check_close(accs, accs_ref, tol));
+                t.pots_u(pots, theta, kwargs::G = G, kwargs::eps = eps);
+                t.pots_u(pots_ref[0].begin(), theta, kwargs::G = G, kwargs::eps = eps);
+                REQUIRE(check_close(std::array<std::vector<fp_type>, 1>{pots}, pots_ref, tol));
+                t.accs_pots_o(accpots, theta, kwargs::G = G, kwargs::eps = eps);
+                t.accs_pots_o(std::array<v_it, 4>{accpots_ref[0].begin(), accpots_ref[1].begin(),
+                                                  accpots_ref[2].begin(), accpots_ref[3].begin()},
+                              theta, kwargs::G = G, kwargs::eps = eps);
+                REQUIRE(check_close(accpots, accpots_ref, tol));
+                // The cached interaction lists are shared by the two paths.
+                t.accs_u(accs, theta, kwargs::G = G, kwargs::eps = eps, kwargs::ilist_cache = true);
+                REQUIRE(check_close(accs, accs_ref, tol));
+                t.accs_u(std::array<v_it, 3>{accs_ref[0].begin(), accs_ref[1].begin(), accs_ref[2].begin()}, theta,
+                         kwargs::G = G, kwargs::eps = eps, kwargs::ilist_cache = true);
+                REQUIRE(check_close(accs, accs_ref, tol));
+                q.accs_o(qaccs, theta, kwargs::G = G, kwargs::eps = eps);
+                q.accs_o(std::array<v_it, 2>{qaccs_ref[0].begin(), qaccs_ref[1].begin()}, theta, kwargs::G = G,
+                         kwargs::eps = eps);
+                REQUIRE(check_close(qaccs, qaccs_ref, tol));
+            }
+        }
+    });
+}
@@ -0,0 +1,228 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+static std::mt19937 rng(0);
+
+template <typename Tree, std::size_t NDim, typename F>
+static void run_accuracy_test(const std::vector<F> &parts, unsigned s, double eps)
+{
+    std::array<typename std::vector<F>::const_iterator, NDim + 1u> its;
+    for (std::size_t j = 0; j < NDim; ++j) {
+        its[j] = parts.begin() + (j + 1u) * s;
+    }
+    its[NDim] = parts.begin();
+    Tree t(its, s, kwargs::box_size = F(1));
+    std::array<std::vector<F>, NDim + 1u> accpots;
+    for (auto theta : {F(.001), F(.5)}) {
+        for (auto bl : {false, true}) {
+            for (auto ilc : {false, true, true}) {
+                t.accs_pots_o(accpots, theta, kwargs::eps = eps, kwargs::batch_leaves = bl,
+                              kwargs::ilist_cache = ilc);
+                std::vector<F> acc_errs, pot_errs;
+                for (auto i = 0u; i < s; i += 10u) {
+                    const auto ex = t.exact_acc_pot_o(i, kwargs::eps = eps);
+                    F dacc = 0, nacc = 0;
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        dacc += (accpots[j][i] - ex[j]) * (accpots[j][i] - ex[j]);
+                        nacc += ex[j] * ex[j];
+                    }
+                    acc_errs.push_back(std::sqrt(dacc / nacc));
+                    pot_errs.push_back(std::abs((accpots[NDim][i] - ex[NDim]) / ex[NDim]));
+                }
+                const auto acc_med = median(acc_errs), pot_med = median(pot_errs);
+                std::cout << "NDim=" << NDim << ", F=" << (std::is_same_v<F, float> ? "float" : "double")
+                          << ", theta=" << theta << ", batch_leaves=" << bl << ", ilist_cache=" << ilc
+                          << ", median relative errors: acc=" << acc_med << ", pot=" << pot_med << '\n';
+                const auto tol = theta < F(.1) ? (std::is_same_v<F, float> ? 1E-4 : 1E-10) : theta * theta * .05;
+                REQUIRE(acc_med < tol);
+                REQUIRE(pot_med < tol);
+            }
+        }
+    }
+}
+
+template <typename Tree, std::size_t NDim, typename F>
+static void run_dual_tree_test(const std::vector<F> &parts, unsigned s, double eps)
+{
+    std::array<typename std::vector<F>::const_iterator, NDim + 1u> its;
+    for (std::size_t j = 0; j < NDim; ++j) {
+        its[j] = parts.begin() + (j + 1u) * s;
+    }
+    its[NDim] = parts.begin();
+    Tree t(its, s, kwargs::box_size = F(1));
+    std::array<std::vector<F>, NDim + 1u> accpots;
+    for (auto theta : {F(.001), F(.5)}) {
+        for (auto mut : {false, true}) {
+            t.accs_pots_o(accpots, theta, kwargs::eps = eps, kwargs::dual_tree = true, kwargs::mutual = mut);
+            std::vector<F> acc_errs, pot_errs;
+            for (auto i = 0u; i < s; i += 10u) {
+                const auto ex = t.exact_acc_pot_o(i, kwargs::eps = eps);
+                F dacc = 0, nacc = 0;
+                for (std::size_t j = 0; j < NDim; ++j) {
+                    dacc += (accpots[j][i] - ex[j]) * (accpots[j][i] - ex[j]);
+                    nacc += ex[j] * ex[j];
+                }
+                acc_errs.push_back(std::sqrt(dacc / nacc));
+                pot_errs.push_back(std::abs((accpots[NDim][i] - ex[NDim]) / ex[NDim]));
+            }
+            const auto acc_med = median(acc_errs), pot_med = median(pot_errs);
+            std::cout << "NDim=" << NDim << ", F=" << (std::is_same_v<F, float> ? "float" : "double")
+                      << ", theta=" << theta << ", mutual=" << mut << ", dual-tree median relative errors: acc="
+                      << acc_med << ", pot=" << pot_med << '\n';
+            // NOTE: in 2D, the accelerations from the uniform distribution are small compared to the
+            // contributions of the single nodes, and the relative errors of the dual-tree traversal
+            // are a few times larger than in 3D (with the Plummer kernel as well).
+            const auto tol = theta < F(.1) ? (std::is_same_v<F, float> ? 1E-4 : 1E-10)
+                                           : theta * theta * (NDim == 2u ? .15 : .05);
+            REQUIRE(acc_med < tol);
+            REQUIRE(pot_med < tol);
+        }
+    }
+}
+
+TEST_CASE("softening kernels accuracy")
+{
+    constexpr auto s = 3000u;
+    // NOTE: the support radius is a few times the mean interparticle distance,
+    // so that both branches of the kernels are exercised.
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    run_accuracy_test<octree<double, 1, softening_kernel::spline>, 3>(parts, s, .05);
+    run_accuracy_test<octree<double, 1, softening_kernel::wendland_c2>, 3>(parts, s, .05);
+    run_accuracy_test<octree<double, 2, softening_kernel::spline>, 3>(parts, s, .05);
+    const auto parts_f = get_uniform_particles<3>(s, 1.f, rng);
+    run_accuracy_test<octree<float, 1, softening_kernel::spline>, 3>(parts_f, s, .05);
+    const auto parts_2d = get_uniform_particles<2>(s, 1., rng);
+    run_accuracy_test<quadtree<double, 1, softening_kernel::wendland_c2>, 2>(parts_2d, s, .05);
+}
+
+TEST_CASE("softening kernels dual tree")
+{
+    constexpr auto s = 3000u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    run_dual_tree_test<octree<double, 1, softening_kernel::spline>, 3>(parts, s, .05);
+    run_dual_tree_test<octree<double, 2, softening_kernel::wendland_c2>, 3>(parts, s, .05);
+    const auto parts_f = get_uniform_particles<3>(s, 1.f, rng);
+    run_dual_tree_test<octree<float, 1, softening_kernel::spline>, 3>(parts_f, s, .05);
+    const auto parts_2d = get_uniform_particles<2>(s, 1., rng);
+    run_dual_tree_test<quadtree<double, 1, softening_kernel::wendland_c2>, 2>(parts_2d, s, .05);
+}
+
+template <typename Tree>
+static void run_pair_test(double psi0)
+{
+    // Two particles of masses 2 and 3 along the x axis, at a distance d.
+    auto pair_accpots = [](double d, double eps) {
+        const std::vector<double> x{0., d}, y{0., 0.}, z{0., 0.}, m{2., 3.};
+        Tree t({x.begin(), y.begin(), z.begin(), m.begin()}, 2, kwargs::box_size = 4.);
+        std::array<std::vector<double>, 4> accpots;
+        t.accs_pots_o(accpots, .5, kwargs::eps = eps);
+        return accpots;
+    };
+    // Beyond the support radius, the interaction is exactly Newtonian.
+    for (auto d : {1., 1.25, 1.5}) {
+        const auto ap = pair_accpots(d, 1.);
+        REQUIRE(std::abs(ap[0][0] - 3. / (d * d)) <= 1E-15 * 3. / (d * d));
+        REQUIRE(std::abs(ap[0][1] + 2. / (d * d)) <= 1E-15 * 2. / (d * d));
+        REQUIRE(std::abs(ap[3][0] + 6. / d) <= 1E-15 * 6. / d);
+        REQUIRE(std::abs(ap[3][0] - ap[3][1]) <= 1E-15 * 6. / d);
+    }
+    // Within the support radius, the interaction is weaker than the Newtonian one, and it is
+    // continuous at the boundary of the support and between the branches of the kernel.
+    for (auto d : {.1, .3, .7, .9}) {
+        const auto ap = pair_accpots(d, 1.);
+        REQUIRE(ap[0][0] > 0.);
+        REQUIRE(ap[0][0] < 3. / (d * d));
+        REQUIRE(ap[3][0] > -6. / d);
+    }
+    for (auto d : {.5, 1.}) {
+        const auto ap1 = pair_accpots(d * (1. - 1E-9), 1.), ap2 = pair_accpots(d * (1. + 1E-9), 1.);
+        REQUIRE(std::abs(ap1[0][0] - ap2[0][0]) <= 1E-7 * std::abs(ap2[0][0]));
+        REQUIRE(std::abs(ap1[3][0] - ap2[3][0]) <= 1E-7 * std::abs(ap2[3][0]));
+    }
+    // Coincident particles: the accelerations vanish, and the potential is finite.
+    const auto ap = pair_accpots(0., .5);
+    REQUIRE(ap[0][0] == 0.);
+    REQUIRE(ap[0][1] == 0.);
+    REQUIRE(std::abs(ap[3][0] + 6. * psi0 / .5) <= 1E-14 * 6. * psi0 / .5);
+}
+
+TEST_CASE("softening kernels pair")
+{
+    run_pair_test<octree<double, 1, softening_kernel::spline>>(14. / 5.);
+    run_pair_test<octree<double, 1, softening_kernel::wendland_c2>>(3.);
+}
+
+TEST_CASE("softening kernels per-particle")
+{
+    // The compact-support kernels combine with the per-particle softening lengths.
+    constexpr auto s = 2000u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    std::vector<double> eps(s);
+    std::uniform_int_distribution<int> sdist(0, 1);
+    for (auto &e : eps) {
+        e = sdist(rng) ? .01 : .05;
+    }
+    octree<double, 1, softening_kernel::spline> t(
+        {parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+        kwargs::box_size = 1., kwargs::eps_parts = eps.begin());
+    std::ostringstream oss;
+    t.pprint(oss);
+    REQUIRE(oss.str().find("Softening kernel         : spline\n") != std::string::npos);
+    REQUIRE(std::string(softening_kernel_name(softening_kernel::plummer)) == "plummer");
+    REQUIRE(std::string(softening_kernel_name(softening_kernel::wendland_c2)) == "wendland_c2");
+    std::array<std::vector<double>, 4> accpots;
+    // NOTE: the last iteration uses the dual-tree traversal.
+    for (auto mode : {0, 1, 2}) {
+        if (mode < 2) {
+            t.accs_pots_o(accpots, .001, kwargs::batch_leaves = mode == 1);
+        } else {
+            t.accs_pots_o(accpots, .001, kwargs::dual_tree = true);
+        }
+        for (auto i = 0u; i < s; i += 10u) {
+            const auto ex = t.exact_acc_pot_o(i);
+            const auto nacc = std::sqrt(ex[0] * ex[0] + ex[1] * ex[1] + ex[2] * ex[2]);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                REQUIRE(std::abs(ex[j] - accpots[j][i]) <= nacc * 1E-10);
+            }
+            REQUIRE(std::abs(ex[3] - accpots[3][i]) <= std::abs(ex[3]) * 1E-10);
+        }
+    }
+}
+
+TEST_CASE("softening kernels errors")
+{
+    constexpr auto s = 100u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double, 1, softening_kernel::wendland_c2> t(
+        {parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+        kwargs::box_size = 1.);
+    std::array<std::vector<double>, 3> accs;
+    const std::vector<double> split{1., 1.};
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::split = split), std::invalid_argument);
+}
@@ -0,0 +1,219 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace rakau;
+using namespace rakau_test;
+
+static std::mt19937 rng(0);
+
+// Two species of particles, with softening lengths differing by a factor of 10.
+static std::vector<double> get_eps(unsigned s)
+{
+    std::vector<double> retval(s);
+    std::uniform_int_distribution<int> sdist(0, 1);
+    for (auto &e : retval) {
+        e = sdist(rng) ? .002 : .02;
+    }
+    return retval;
+}
+
+template <typename Tree, std::size_t NDim>
+static void run_accuracy_test(const std::vector<double> &parts, const std::vector<double> &eps, unsigned s)
+{
+    std::array<std::vector<double>::const_iterator, NDim + 1u> its;
+    for (std::size_t j = 0; j < NDim; ++j) {
+        its[j] = parts.begin() + (j + 1u) * s;
+    }
+    its[NDim] = parts.begin();
+    Tree t(its, s, kwargs::box_size = 1., kwargs::eps_parts = eps.begin());
+    std::array<std::vector<double>, NDim + 1u> accpots;
+    for (auto theta : {.001, .5}) {
+        for (auto bl : {false, true}) {
+            for (auto ilc : {false, true, true}) {
+                t.accs_pots_o(accpots, theta, kwargs::batch_leaves = bl, kwargs::ilist_cache = ilc);
+                std::vector<double> acc_errs, pot_errs;
+                for (auto i = 0u; i < s; i += 10u) {
+                    const auto ex = t.exact_acc_pot_o(i);
+                    double dacc = 0, nacc = 0;
+                    for (std::size_t j = 0; j < NDim; ++j) {
+                        dacc += (accpots[j][i] - ex[j]) * (accpots[j][i] - ex[j]);
+                        nacc += ex[j] * ex[j];
+                    }
+                    acc_errs.push_back(std::sqrt(dacc / nacc));
+                    pot_errs.push_back(std::abs((accpots[NDim][i] - ex[NDim]) / ex[NDim]));
+                }
+                const auto acc_med = median(acc_errs), pot_med = median(pot_errs);
+                std::cout << "NDim=" << NDim << ", theta=" << theta << ", batch_leaves=" << bl
+                          << ", ilist_cache=" << ilc << ", median relative errors: acc=" << acc_med
+                          << ", pot=" << pot_med << '\n';
+                REQUIRE(acc_med < (theta < .1 ? 1E-10 : 1E-2));
+                REQUIRE(pot_med < (theta < .1 ? 1E-10 : 1E-2));
+            }
+        }
+    }
+}
+
+TEST_CASE("per-particle softening accuracy")
+{
+    constexpr auto s = 3000u;
+    const auto eps = get_eps(s);
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    run_accuracy_test<octree<double>, 3>(parts, eps, s);
+    run_accuracy_test<octree<double, 2>, 3>(parts, eps, s);
+    const auto parts_2d = get_uniform_particles<2>(s, 1., rng);
+    run_accuracy_test<quadtree<double>, 2>(parts_2d, eps, s);
+}
+
+TEST_CASE("per-particle softening dual tree")
+{
+    constexpr auto s = 3000u;
+    const auto eps = get_eps(s);
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1., kwargs::eps_parts = eps.begin());
+    std::array<std::vector<double>, 4> accpots;
+    for (auto theta : {.001, .5}) {
+        for (auto mut : {false, true}) {
+            t.accs_pots_o(accpots, theta, kwargs::dual_tree = true, kwargs::mutual = mut);
+            std::vector<double> acc_errs, pot_errs;
+            for (auto i = 0u; i < s; i += 10u) {
+                const auto ex = t.exact_acc_pot_o(i);
+                double dacc = 0, nacc = 0;
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    dacc += (accpots[j][i] - ex[j]) * (accpots[j][i] - ex[j]);
+                    nacc += ex[j] * ex[j];
+                }
+                acc_errs.push_back(std::sqrt(dacc / nacc));
+                pot_errs.push_back(std::abs((accpots[3][i] - ex[3]) / ex[3]));
+            }
+            const auto acc_med = median(acc_errs), pot_med = median(pot_errs);
+            std::cout << "theta=" << theta << ", mutual=" << mut << ", dual-tree median relative errors: acc="
+                      << acc_med << ", pot=" << pot_med << '\n';
+            REQUIRE(acc_med < (theta < .1 ? 1E-10 : 1E-2));
+            REQUIRE(pot_med < (theta < .1 ? 1E-10 : 1E-2));
+        }
+    }
+}
+
+TEST_CASE("per-particle softening uniform")
+{
+    // With the same softening length for all the particles, the results match those
+    // of the global softening length.
+    constexpr auto s = 2000u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    const std::vector<double> eps(s, .01);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1.),
+        t_parts({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                kwargs::box_size = 1., kwargs::eps_parts = eps.data());
+    std::array<std::vector<double>, 4> accpots, accpots_parts;
+    for (auto theta : {.001, .5}) {
+        t.accs_pots_u(accpots, theta, kwargs::eps = .01);
+        t_parts.accs_pots_u(accpots_parts, theta);
+        for (auto i = 0u; i < s; ++i) {
+            double nacc = 0;
+            for (std::size_t j = 0; j < 3u; ++j) {
+                nacc += accpots[j][i] * accpots[j][i];
+            }
+            nacc = std::sqrt(nacc);
+            for (std::size_t j = 0; j < 3u; ++j) {
+                REQUIRE(std::abs(accpots_parts[j][i] - accpots[j][i]) <= nacc * 1E-12);
+            }
+            REQUIRE(std::abs(accpots_parts[3][i] - accpots[3][i]) <= std::abs(accpots[3][i]) * 1E-12);
+        }
+    }
+}
+
+TEST_CASE("per-particle softening misc")
+{
+    constexpr auto s = 500u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    const auto eps = get_eps(s);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1., kwargs::eps_parts = eps.begin(), kwargs::max_leaf_n = 4,
+                     kwargs::ncrit = 16);
+    REQUIRE(t.eps_parts_u() != nullptr);
+    REQUIRE(octree<double>{}.eps_parts_u() == nullptr);
+    auto check_eps = [&eps](const auto &tr) {
+        const auto its = tr.eps_parts_o();
+        for (auto i = 0u; i < s; ++i) {
+            REQUIRE(its[i] == eps[i]);
+        }
+    };
+    check_eps(t);
+    std::ostringstream oss;
+    t.pprint(oss);
+    REQUIRE(oss.str().find("Per-particle softening   : yes\n") != std::string::npos);
+    // The softening lengths follow the particles when the tree is updated.
+    t.update_particles_o([](const auto &its) {
+        for (auto i = 0u; i < s; ++i) {
+            its[0][i] = -its[0][i] * .9;
+            its[1][i] = its[2][i] * .9;
+        }
+    });
+    check_eps(t);
+    std::array<std::vector<double>, 3> accs;
+    t.accs_o(accs, .001);
+    for (auto i = 0u; i < s; i += 10u) {
+        const auto ex = t.exact_acc_o(i);
+        const auto nacc = std::sqrt(ex[0] * ex[0] + ex[1] * ex[1] + ex[2] * ex[2]);
+        for (std::size_t j = 0; j < 3u; ++j) {
+            REQUIRE(std::abs(ex[j] - accs[j][i]) <= nacc * 1E-6);
+        }
+    }
+    // Copy/move semantics and clearing.
+    auto t2(t);
+    check_eps(t2);
+    auto t3(std::move(t2));
+    check_eps(t3);
+    t3.clear();
+    REQUIRE(t3.eps_parts_u() == nullptr);
+}
+
+TEST_CASE("per-particle softening errors")
+{
+    constexpr auto s = 100u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    using Catch::Matchers::Contains;
+    for (auto bad : {-1., std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::infinity()}) {
+        auto eps = get_eps(s);
+        eps[42] = bad;
+        // The smallest invalid index is reported.
+        eps[77] = bad;
+        REQUIRE_THROWS_WITH((octree<double>{{parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s,
+                                             parts.begin()},
+                                            s,
+                                            kwargs::eps_parts = eps.begin()}),
+                            Contains("particle at index 42 must be finite and non-negative"));
+    }
+    const auto eps = get_eps(s);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1., kwargs::eps_parts = eps.begin());
+    std::array<std::vector<double>, 3> accs;
+    REQUIRE_THROWS_WITH(t.accs_u(accs, .5, kwargs::eps = .1), Contains("per-particle softening lengths"));
+    REQUIRE_THROWS_WITH(t.exact_acc_u(0, kwargs::eps = .1), Contains("per-particle softening lengths"));
+    const std::vector<double> split{1., 1.};
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::split = split), std::invalid_argument);
+}
@@ -11,6 +11,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
 #include <iterator>
 #include <random>
@@ -36,6 +37,30 @@ inline T median(std::vector<T> &v)
     return (v[half_size - 1u] + v[half_size]) / T(2);
 }
 
+// Check that the arrays of vectors a and b agree within a tolerance tol, relative to the
+// largest absolute value in each vector of b.
+// NOTE: a purely relative check would be too strict in single precision
+// for the components which are close to zero.
+template <typename V, typename F>
+inline bool check_close(const V &a, const V &b, F tol)
+{
+    for (std::size_t j = 0; j < a.size(); ++j) {
+        if (a[j].size() != b[j].size()) {
+            return false;
+        }
+        F max_b(0);
+        for (const auto &v : b[j]) {
+            max_b = std::max(max_b, std::abs(v));
+        }
+        for (decltype(a[j].size()) i = 0; i < a[j].size(); ++i) {
+            if (!(std::abs(a[j][i] - b[j][i]) <= tol * max_b)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 // Generate n uniformly-distributed particles in a D-dimensional box of given size, using
 // the random number engine rng.
 template <std::size_t D, typename F, typename Rng>
@@ -0,0 +1,266 @@
+// Copyright 2018 Francesco Biscani (bluescarni@gmail.com)
+//
+// This file is part of the rakau library.
+//
+// This Source Code Form is subject to the terms of the Mozilla
+// Public License v. 2.0. If a copy of the MPL was not distributed
+// with this file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <rakau/tree.hpp>
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <initializer_list>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "test_utils.hpp"
+
+namespace rakau
+{
+inline namespace detail
+{
+
+struct tree_test_access {
+    template <typename Tree, typename Func>
+    static void ilist_for_each(const Tree &t, Func &&f)
+    {
+        t.ilist_for_each(std::forward<Func>(f));
+    }
+};
+
+} // namespace detail
+} // namespace rakau
+
+using namespace rakau;
+using namespace rakau_test;
+
+static std::mt19937 rng(0);
+
+TEST_CASE("treepm accuracy")
+{
+    constexpr auto s = 3000u;
+    for (auto bsize : {1., 10.}) {
+        const auto parts = get_uniform_particles<3>(s, bsize, rng);
+        for (auto pm_grid : {16u, 32u}) {
+            octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                             kwargs::box_size = bsize, kwargs::periodic = true, kwargs::pm_grid = pm_grid);
+            REQUIRE(t.pm_grid() == pm_grid);
+            // The reference values are computed via the Ewald summation.
+            std::array<std::vector<double>, 4> ref;
+            for (auto i = 0u; i < s; i += 10u) {
+                const auto ex = t.exact_acc_pot_o(i);
+                for (std::size_t j = 0; j < 4u; ++j) {
+                    ref[j].push_back(ex[j]);
+                }
+            }
+            double pot_rms = 0;
+            for (auto p : ref[3]) {
+                pot_rms += p * p;
+            }
+            pot_rms = std::sqrt(pot_rms / static_cast<double>(ref[3].size()));
+            std::array<std::vector<double>, 4> accpots, accpots_rec;
+            for (auto theta : {.001, .5}) {
+                for (auto ilc : {false, true, true}) {
+                    t.accs_pots_o(accpots, theta, kwargs::ilist_cache = ilc);
+                    std::vector<double> acc_errs, pot_errs;
+                    for (auto i = 0u; i < s; i += 10u) {
+                        double dacc = 0, nacc = 0;
+                        for (std::size_t j = 0; j < 3u; ++j) {
+                            const auto r = ref[j][i / 10u];
+                            dacc += (accpots[j][i] - r) * (accpots[j][i] - r);
+                            nacc += r * r;
+                        }
+                        acc_errs.push_back(std::sqrt(dacc / nacc));
+                        pot_errs.push_back(std::abs(accpots[3][i] - ref[3][i / 10u]) / pot_rms);
+                    }
+                    const auto acc_med = median(acc_errs), pot_med = median(pot_errs);
+                    std::cout << "bsize=" << bsize << ", pm_grid=" << pm_grid << ", theta=" << theta
+                              << ", ilist_cache=" << ilc << ", median relative errors: acc=" << acc_med
+                              << ", pot=" << pot_med << '\n';
+                    // NOTE: with a tiny theta, the errors are due to the mesh discretisation
+                    // in the transition region of the force split.
+                    REQUIRE(acc_med < (theta < .1 ? 1E-2 : 3E-2));
+                    REQUIRE(pot_med < (theta < .1 ? 1E-2 : 3E-2));
+                    // The replay of the interaction lists gives the same results as their recording.
+                    if (ilc) {
+                        if (accpots_rec[0].empty()) {
+                            accpots_rec = accpots;
+                        } else {
+                            for (std::size_t j = 0; j < 4u; ++j) {
+                                for (auto i = 0u; i < s; ++i) {
+                                    REQUIRE(std::abs(accpots[j][i] - accpots_rec[j][i])
+                                            <= std::abs(accpots_rec[j][i]) * 1E-12 + 1E-12);
+                                }
+                            }
+                            accpots_rec[0].clear();
+                        }
+                    }
+                }
+            }
+            // The accelerations and the potentials computed separately agree with
+            // the joint computation, and G is applied also to the long-range part.
+            std::array<std::vector<double>, 3> accs;
+            std::vector<double> pots;
+            t.accs_o(accs, .5, kwargs::G = 3.);
+            t.pots_o(pots, .5, kwargs::G = 3.);
+            t.accs_pots_o(accpots, .5);
+            for (auto i = 0u; i < s; ++i) {
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    REQUIRE(std::abs(accs[j][i] - 3. * accpots[j][i]) <= std::abs(accs[j][i]) * 1E-12 + 1E-12);
+                }
+                REQUIRE(std::abs(pots[i] - 3. * accpots[3][i]) <= std::abs(pots[i]) * 1E-12 + 1E-12);
+            }
+        }
+    }
+}
+
+TEST_CASE("treepm cutoff")
+{
+    // The source nodes beyond the cutoff radius of the short-range interaction are skipped
+    // entirely, thus the interaction lists are much shorter than in the pure Ewald mode.
+    constexpr auto s = 3000u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1., kwargs::periodic = true, kwargs::max_leaf_n = 8, kwargs::ncrit = 32),
+        t_pm({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+             kwargs::box_size = 1., kwargs::periodic = true, kwargs::pm_grid = 32, kwargs::max_leaf_n = 8,
+             kwargs::ncrit = 32);
+    REQUIRE(t.ilist_size() == 0u);
+    const auto rcut = pm_rcut * pm_asmth / 32.;
+    // The two trees have the same structure. Map each particle to the leaf containing it, so that
+    // the ranges of source particles in the lists can be checked via their leaves.
+    const auto &nodes = t_pm.nodes();
+    REQUIRE(nodes.size() == t.nodes().size());
+    std::vector<std::size_t> leaf_idx(s);
+    for (std::size_t k = 0; k < nodes.size(); ++k) {
+        if (!nodes[k].n_children) {
+            std::fill(leaf_idx.begin() + nodes[k].begin, leaf_idx.begin() + nodes[k].end, k);
+        }
+    }
+    // Invoke f on each source node in the lists of a tree (the leaves for the ranges of source particles),
+    // with the number of list entries it accounts for and the cutoff distance of the node from the
+    // bounding box of the target particles, relative to rcut.
+    auto for_each_src = [&](const auto &tr, auto f) {
+        const auto its = tr.p_its_u();
+        tree_test_access::ilist_for_each(tr, [&](auto tgt_begin, auto tgt_end, const auto &src_nodes,
+                                                 const auto &src_ranges) {
+            std::array<std::array<double, 3>, 2> box;
+            for (std::size_t j = 0; j < 3u; ++j) {
+                box[0][j] = *std::min_element(its[j] + tgt_begin, its[j] + tgt_end);
+                box[1][j] = *std::max_element(its[j] + tgt_begin, its[j] + tgt_end);
+            }
+            auto rel_dist = [&](const auto &node) {
+                double min_dist2 = 0;
+                for (std::size_t j = 0; j < 3u; ++j) {
+                    const auto centre = (box[0][j] + box[1][j]) / 2;
+                    auto diff = node.props[j] - centre;
+                    diff -= std::nearbyint(diff);
+                    const auto d = std::max(0., std::abs(diff) - (box[1][j] - centre));
+                    min_dist2 += d * d;
+                }
+                const auto src_r = node.dim * std::sqrt(3.) / 2 + node.com_off;
+                return std::sqrt(min_dist2) / (rcut + src_r);
+            };
+            for (auto idx : src_nodes) {
+                f(std::size_t(1), rel_dist(nodes[idx]));
+            }
+            for (const auto &r : src_ranges) {
+                for (auto i = r[0]; i < r[1];) {
+                    const auto &leaf = nodes[leaf_idx[i]];
+                    REQUIRE(leaf.begin == i);
+                    REQUIRE(leaf.end <= r[1]);
+                    f(static_cast<std::size_t>(leaf.end - leaf.begin), rel_dist(leaf));
+                    i = leaf.end;
+                }
+            }
+        });
+    };
+    std::array<std::vector<double>, 3> accs;
+    for (auto theta : {.001, .5}) {
+        t.accs_u(accs, theta, kwargs::ilist_cache = true);
+        t_pm.accs_u(accs, theta, kwargs::ilist_cache = true);
+        REQUIRE(t_pm.ilist_size() > 0u);
+        // The opening criterion is the same in the two modes, thus the TreePM lists are bounded by the
+        // entries of the Ewald lists within the cutoff radius from their target nodes.
+        // NOTE: the bound is not attained, as the TreePM mode skips also the children of the nodes
+        // beyond the cutoff radius, whose enclosing spheres might reach within the cutoff radius.
+        std::size_t n_in = 0;
+        for_each_src(t, [&](std::size_t n, double d) { n_in += (d <= 1 + 1E-12) ? n : 0u; });
+        std::cout << "theta=" << theta << ", interaction list sizes: " << t.ilist_size() << " (Ewald), "
+                  << t_pm.ilist_size() << " (TreePM), " << n_in << " (Ewald within the cutoff)\n";
+        REQUIRE(t_pm.ilist_size() <= n_in);
+        REQUIRE(n_in < t.ilist_size());
+        // No source node in the cached lists lies beyond the cutoff radius from the
+        // particles of its target node.
+        // NOTE: the cutoff is checked on the bounding box of the target particles.
+        std::size_t n_checked = 0;
+        for_each_src(t_pm, [&](std::size_t n, double d) {
+            REQUIRE(d <= 1 + 1E-12);
+            n_checked += n;
+        });
+        REQUIRE(n_checked == t_pm.ilist_size());
+    }
+}
+
+TEST_CASE("treepm misc")
+{
+    constexpr auto s = 200u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1., kwargs::periodic = true, kwargs::pm_grid = 16);
+    std::ostringstream oss;
+    t.pprint(oss);
+    REQUIRE(oss.str().find("PM mesh size             : 16\n") != std::string::npos);
+    // Copy/move semantics and clearing.
+    auto t2(t);
+    REQUIRE(t2.pm_grid() == 16u);
+    auto t3(std::move(t2));
+    REQUIRE(t3.pm_grid() == 16u);
+    t3.clear();
+    REQUIRE(t3.pm_grid() == 0u);
+    REQUIRE(octree<double>{}.pm_grid() == 0u);
+}
+
+TEST_CASE("treepm errors")
+{
+    constexpr auto s = 100u;
+    const auto parts = get_uniform_particles<3>(s, 1., rng);
+    using Catch::Matchers::Contains;
+    REQUIRE_THROWS_WITH((octree<double>{{parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s,
+                                         parts.begin()},
+                                        s,
+                                        kwargs::box_size = 1.,
+                                        kwargs::pm_grid = 16}),
+                        Contains("requires periodic boundary conditions"));
+    for (auto pm_grid : {8u, 24u}) {
+        REQUIRE_THROWS_WITH((octree<double>{{parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s,
+                                             parts.begin()},
+                                            s,
+                                            kwargs::box_size = 1.,
+                                            kwargs::periodic = true,
+                                            kwargs::pm_grid = pm_grid}),
+                            Contains("must be a power of 2 not smaller than 16"));
+    }
+    REQUIRE_THROWS_WITH((octree<double, 2>{{parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s,
+                                            parts.begin()},
+                                           s,
+                                           kwargs::box_size = 1.,
+                                           kwargs::periodic = true,
+                                           kwargs::pm_grid = 16}),
+                        Contains("multipole order of 1"));
+    octree<double> t({parts.begin() + s, parts.begin() + 2u * s, parts.begin() + 3u * s, parts.begin()}, s,
+                     kwargs::box_size = 1., kwargs::periodic = true, kwargs::pm_grid = 16);
+    std::array<std::vector<double>, 3> accs;
+    std::vector<double> errs;
+    REQUIRE_THROWS_AS(t.accs_u(accs, .5, kwargs::acc_errs = errs), std::invalid_argument);
+}